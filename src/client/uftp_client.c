@@ -6,24 +6,69 @@
 // This client uses RUDP (Reliable UDP) and KFTP (Kirby's File Transfer Protocol) to provide this functionality. This
 // work was done as a homework assignment for a networking class.
 //
+// A transfer typed with a trailing `&` runs in the background, on an RUDP stream of its own, so the commands typed after
+// it don't wait for it to finish. Hitting Ctrl-C while a command runs in the foreground cancels it.
+//
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "../common/reliable_udp/reliable_udp.h"
+#include "../common/reliable_udp/rudp_mux.h"
 #include "../common/kftp/kftp.h"
+#include "../common/kftp/kftp_batch.h"
+#include "../common/kftp/kftp_chunked.h"
+#include "../common/kftp/kftp_command.h"
+#include "../common/kftp/kftp_dedup.h"
+#include "../common/kftp/kftp_delta.h"
+#include "../common/kftp/kftp_fingerprint.h"
+#include "../common/kftp/kftp_listing.h"
+#include "../common/kftp/kftp_merkle.h"
+#include "../common/kftp/kftp_pipeline.h"
+#include "../common/kftp/kftp_striped.h"
+#include "../common/kftp/kftp_tree.h"
 
 #define BUFSIZE 1024
 
 // Delimiters to use when extracting commands and arguments from user-supplied input
 #define DELIMITERS " \n\t\r\v\f"
 
+// Number of times a get is attempted when the downloaded file fails its integrity check
+#define MAX_GET_ATTEMPTS 3
+
 // TODO: standardize error codes between client and server
 #define PARSE_ERROR (-2)
 
+// Result of a command that the server replied had failed
+#define COMMAND_FAILED 1
+
+// File in the current directory that the fingerprints of local files are saved in, see fingerprint_local_file
+#define FINGERPRINT_INDEX_FILE ".kftp-fingerprints"
+
+// Cancels the command running in the foreground, see cancel_foreground
+RudpCancel foreground_cancel;
+
+// SIGINT handler installed while a command runs in the foreground, which cancels the command rather than the client
+void cancel_foreground(int signum) {
+    rudp_cancel(&foreground_cancel);
+    // the handler may be reset once it has run
+    signal(SIGINT, cancel_foreground);
+}
+
+
+// Fingerprints of the local files, shared with the transfers running in the background
+KftpFingerprintIndex fingerprints;
+pthread_mutex_t fingerprints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 // wrapper around perror for errors that should cause the program to terminate with a negative return code
 void fatal_error(char *msg) {
     perror(msg);
@@ -31,60 +76,103 @@ void fatal_error(char *msg) {
 }
 
 
-// Receives a RUDP response from the server, then prints out that response.
-//
-// A limitation of this function is that it will only receive one RUDP message, so the size of messages this can handle
-// is limited to the size of the message buffer.
-int handle_response(SocketInfo *sock_info, RudpReceiver *receiver) {
-    int n;
-    char buf[BUFSIZE];
+// Parses a non-negative decimal number (e.g. a byte offset), returning -1 if `token` isn't one
+long parse_size(char *token) {
+    char *end;
+    errno = 0;
+    long value = strtol(token, &end, 10);
+    if (errno != 0 || end == token || *end != 0 || value < 0)
+        return -1;
+    return value;
+}
+
 
-    n = rudp_recv(buf, BUFSIZE, sock_info, receiver);
+// Returns the ID of the next request sent to the server, so its reply can be told apart from the replies to other
+// requests. Request IDs are also used as the IDs of the streams background transfers run on, so they're never reused.
+uint32_t next_request_id(void) {
+    static uint32_t last_request_id = 0;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // background transfers parse (and retry) their commands on their own threads
+    pthread_mutex_lock(&lock);
+    uint32_t request_id = ++last_request_id;
+    pthread_mutex_unlock(&lock);
+    return request_id;
+}
+
+
+// Sends a command to the server
+int send_command(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    int n = kftp_send_command(command, socket_info, sender, receiver);
     if (n < 0) {
-        perror("ERROR in recvfrom");
+        perror("ERROR in kftp_send_command");
         return n;
     }
 
-    buf[n] = 0;
-    printf("%s\n", buf);
-    fflush(stdout);
-
     return n;
 }
 
 
-// Handles `ls` command
-int do_ls(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char* command = "ls";
-
-    // not currently implemented over KFTP, instead send using RUDP
-    // TODO: the limitation to use RUDP effectively means that the listed files must fit into a single message buffer.
-    //  should implement ls through KFTP so that larger results can be returned
-    int n = rudp_send(command, strlen(command), socket_info, sender, receiver);
+// Receives the server's reply to `request`, then prints out the message it holds (if any).
+//
+// Returns 0 if the command succeeded, COMMAND_FAILED if the server replied that it failed, and a negative int if no reply
+// could be received.
+int handle_reply(KftpCommand *request, SocketInfo *sock_info, RudpReceiver *receiver) {
+    KftpCommand reply;
+    int n = kftp_recv_reply(request, &reply, sock_info, receiver);
     if (n < 0) {
-        perror("ERROR in rudp_send");
+        perror("ERROR in kftp_recv_reply");
         return n;
     }
 
-    return handle_response(socket_info, receiver);
-}
+    if (reply.arg_count > 0) {
+        printf("%s\n", reply.args[0]);
+        fflush(stdout);
+    }
 
+    return reply.status < 0 ? COMMAND_FAILED : 0;
+}
 
-// Handles `exit` command
-int do_exit(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char* command = "exit";
 
-    // not currently implemented over KFTP, instead send using RUDP
-    int n = rudp_send(command, strlen(command), socket_info, sender, receiver);
+// Handles `ls` command, that prints the names of the files on the server matching the command's pattern (or all the
+// files if it has none), and only a page of them if one was requested
+//
+// The names are streamed back over KFTP and printed as they arrive, so listings aren't limited in size.
+int do_ls(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    uint64_t offset = 0;
+    if (command->flags & KFTP_FLAG_PAGED)
+        kftp_command_arg_uint64(command, command->arg_count - 2, &offset);
+
+    int n = send_command(command, socket_info, sender, receiver);
+    if (n == 0)
+        n = handle_reply(command, socket_info, receiver);
+    if (n != 0)
+        return n < 0 ? n : 0;
+
+    KftpListResult result;
+    n = kftp_recv_listing(stdout, &result, socket_info, receiver);
     if (n < 0) {
-        perror("ERROR in rudp_send");
+        perror("ERROR while listing files");
         return n;
     }
 
+    if (result.more)
+        printf("More files match, list them starting at offset %ld\n", (long) offset + result.count);
+    fflush(stdout);
+    return 0;
+}
+
+
+// Handles `exit` command
+int do_exit(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    int n = send_command(command, socket_info, sender, receiver);
+    if (n < 0)
+        return n;
+
     // expect a message back from the server that it is exiting gracefully
-    n = handle_response(socket_info, receiver);
+    n = handle_reply(command, socket_info, receiver);
     if (n < 0) {
-        perror("ERROR in handle_response");
+        perror("ERROR in handle_reply");
         return n;
     }
 
@@ -93,35 +181,160 @@ int do_exit(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver)
 }
 
 
-// Handles `get` command, that transfers a file from the server to the client
-int do_get(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char command[BUFSIZE] = {};
-    int n = snprintf(command, BUFSIZE, "get %s", filename);
-    if (n >= BUFSIZE || n == 0) {
-        perror("ERROR in sprintf");
-        return n;
+// Handles `get -d` command, that updates the local copy of a file using a delta sent by the server
+//
+// The file is reconstructed into a temporary file which then replaces the original, since blocks are copied from the
+// original while the new version is written.
+int recv_file_delta(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    char temp_filename[BUFSIZE] = {};
+    int n = snprintf(temp_filename, BUFSIZE, "%s%s", filename, KFTP_DELTA_TEMP_SUFFIX);
+    if (n >= BUFSIZE || n < 0) {
+        fprintf(stderr, "ERROR in recv_file_delta: filename too long\n");
+        return -1;
     }
 
-    // the initial get command (that notifies the server that it should send a file) is currently not
-    // implemented using KFTP, so instead we just send it using RUDP
-    n = rudp_send(command, strlen(command), socket_info, sender, receiver);
-    if (n < 0) {
-        perror("ERROR in rudp_send");
-        return n;
+    FILE* temp = fopen(temp_filename, "w");
+    if (temp == NULL) {
+        perror("ERROR opening temporary file to write to");
+        return -1;
+    }
+
+    // there may not be an existing copy, in which case the whole file is sent as literal data
+    FILE* basis = fopen(filename, "r");
+
+    int result = kftp_recv_file_delta(basis, temp, socket_info, sender, receiver);
+    fclose(temp);
+    if (basis != NULL)
+        fclose(basis);
+
+    if (result < 0) {
+        remove(temp_filename);
+        return result;
+    }
+
+    if (rename(temp_filename, filename) < 0) {
+        perror("ERROR replacing file with its updated copy");
+        remove(temp_filename);
+        return -1;
+    }
+
+    return result;
+}
+
+
+// Computes the fingerprint of the local copy of a file for a conditional transfer
+//
+// Fingerprints are indexed and saved in FINGERPRINT_INDEX_FILE, so a file that hasn't changed since it was last synced
+// isn't hashed again, even by a later run of the client.
+//
+// Returns 0 on success, and a negative int if there's no local copy that can be read.
+int fingerprint_local_file(char* filename, KftpFingerprint* fingerprint) {
+    pthread_mutex_lock(&fingerprints_lock);
+    int result = kftp_fingerprint_file(&fingerprints, filename, fingerprint);
+    if (fingerprints.changed && kftp_fingerprint_index_save(&fingerprints, FINGERPRINT_INDEX_FILE) < 0)
+        fprintf(stderr, "ERROR in fingerprint_local_file: could not save the fingerprint index\n");
+    pthread_mutex_unlock(&fingerprints_lock);
+    return result;
+}
+
+
+// Writes the name that the file requested by a get command is saved as to `local_name`. A ranged get is saved as
+// `<file_name>.<offset>-<length>`, so the range never overwrites a whole local copy of the file.
+void get_local_filename(KftpCommand *command, char *local_name, int size) {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    if (command->flags & KFTP_FLAG_RANGED && kftp_command_arg_uint64(command, 1, &offset) == 0
+        && kftp_command_arg_uint64(command, 2, &length) == 0)
+        snprintf(local_name, size, "%s.%llu-%llu", command->args[0], (unsigned long long) offset,
+                 (unsigned long long) length);
+    else
+        snprintf(local_name, size, "%s", command->args[0]);
+}
+
+
+// Receives the file sent by the server in response to a get command, using the transfer requested by `flags`
+//
+// Returns KFTP_NOT_MODIFIED if the transfer was conditional and the local copy is already up to date.
+int recv_file(char* filename, KftpTransferFlags *flags, SocketInfo *socket_info, RudpSender *sender,
+              RudpReceiver *receiver) {
+    if (flags->conditional) {
+        KftpFingerprint fingerprint;
+        bool has_copy = fingerprint_local_file(filename, &fingerprint) == 0;
+        int result = kftp_offer_fingerprint(has_copy ? &fingerprint : NULL, socket_info, sender, receiver);
+        if (result != KFTP_MODIFIED)
+            return result;
+    }
+
+    if (flags->delta)
+        return recv_file_delta(filename, socket_info, sender, receiver);
+    if (flags->recursive) {
+        KftpBatchResult result;
+        return kftp_recv_tree(&result, socket_info, receiver);
     }
 
     FILE* fetched_file = fopen(filename, "w");
     if (fetched_file == NULL) {
         perror("ERROR opening file to write to");
-        return n;
+        return -1;
     }
 
-    int result = kftp_recv_file(fetched_file, socket_info, receiver);
+    int result;
+    if (flags->striped)
+        result = kftp_recv_file_striped(fetched_file, socket_info, sender, receiver);
+    else if (flags->merkle)
+        result = kftp_recv_file_merkle(fetched_file, socket_info, sender, receiver);
+    else if (flags->compress || flags->sparse)
+        result = kftp_recv_file_chunked(fetched_file, socket_info, receiver);
+    else
+        result = kftp_recv_file(fetched_file, socket_info, receiver);
     fclose(fetched_file);
 
+    // don't leave a corrupted copy of the file around
+    if (result == KFTP_INTEGRITY_ERROR)
+        remove(filename);
+
+    return result;
+}
+
+
+// Handles `get` command, that transfers a file from the server to the client
+//
+// If the received file doesn't match the hash computed by the server, the file is requested again (up to
+// MAX_GET_ATTEMPTS times in total).
+int do_get(KftpCommand *command, KftpTransferFlags *flags, SocketInfo *socket_info, RudpSender *sender,
+           RudpReceiver *receiver) {
+    char filename[BUFSIZE];
+    get_local_filename(command, filename, BUFSIZE);
+    int n;
+    int result;
+    for (int attempt = 1; attempt <= MAX_GET_ATTEMPTS; attempt++) {
+        // each attempt is a separate request
+        if (attempt > 1)
+            command->request_id = next_request_id();
+
+        // the server replies before sending the file, so a file it can't send is reported instead
+        n = send_command(command, socket_info, sender, receiver);
+        if (n == 0)
+            n = handle_reply(command, socket_info, receiver);
+        if (n != 0)
+            return n < 0 ? n : 0;
+
+        result = recv_file(filename, flags, socket_info, sender, receiver);
+        if (result != KFTP_INTEGRITY_ERROR)
+            break;
+
+        fprintf(stderr, "Downloaded file does not match the server's copy (attempt %d of %d)\n", attempt,
+                MAX_GET_ATTEMPTS);
+    }
+
     if (result < 0) {
         perror("ERROR while downloading file");
-        return n;
+        return result;
+    }
+
+    if (result == KFTP_NOT_MODIFIED) {
+        printf("File not modified: %s\n", filename);
+        return 0;
     }
 
     printf("Downloaded file: %s\n", filename);
@@ -129,23 +342,21 @@ int do_get(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpRece
 }
 
 
-// Handles `put` command, that transfers a file from the client to the server
-int do_put(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char command[BUFSIZE] = {};
-    int n = snprintf(command, BUFSIZE, "put %s", filename);
-    if (n >= BUFSIZE || n == 0) {
-        perror("ERROR in sprintf");
-        return n;
+// Sends a file to the server in response to a put command, using the transfer requested by `flags`
+//
+// Returns KFTP_NOT_MODIFIED if the transfer was conditional and the server's copy is already up to date.
+int send_file(char* filename, KftpTransferFlags *flags, SocketInfo *socket_info, RudpSender *sender,
+              RudpReceiver *receiver) {
+    if (flags->conditional) {
+        KftpFingerprint fingerprint;
+        bool has_copy = fingerprint_local_file(filename, &fingerprint) == 0;
+        int result = kftp_check_fingerprint(has_copy ? &fingerprint : NULL, socket_info, sender, receiver);
+        if (result != KFTP_MODIFIED)
+            return result;
     }
 
-
-    // the initial put command (that notifies the server that it should prepare to receive a file) is currently not
-    // implemented using KFTP, so instead we just send it using RUDP
-    n = rudp_send(command, strlen(command), socket_info, sender, receiver);
-    if (n < 0) {
-        perror("ERROR in rudp_send");
-        return n;
-    }
+    if (flags->recursive)
+        return kftp_send_tree(filename, socket_info, sender, receiver);
 
     FILE* file = fopen(filename, "r");
     if (file == NULL) {
@@ -153,76 +364,353 @@ int do_put(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpRece
         return -1;
     }
 
-    int result = kftp_send_file(file, socket_info, sender, receiver);
+    int result;
+    if (flags->dedup) {
+        result = kftp_send_file_dedup(file, socket_info, sender, receiver);
+    } else if (flags->delta) {
+        result = kftp_send_file_delta(file, socket_info, sender, receiver);
+    } else if (flags->striped) {
+        result = kftp_send_file_striped(file, socket_info, sender, receiver);
+    } else if (flags->merkle) {
+        result = kftp_send_file_merkle(file, socket_info, sender, receiver);
+    } else if (flags->compress || flags->sparse) {
+        KftpChunkOptions options = {.compress=flags->compress, .sparse=flags->sparse};
+        result = kftp_send_file_chunked(file, &options, socket_info, sender, receiver);
+    } else {
+        result = kftp_send_file(file, socket_info, sender, receiver);
+    }
     fclose(file);
+    return result;
+}
+
+
+// Handles `put` command, that transfers a file from the client to the server
+//
+// The server replies once it has received the file, so the file is only reported as sent once the server has kept it.
+int do_put(KftpCommand *command, KftpTransferFlags *flags, SocketInfo *socket_info, RudpSender *sender,
+           RudpReceiver *receiver) {
+    char *filename = command->args[0];
+    int n = send_command(command, socket_info, sender, receiver);
+    if (n < 0)
+        return n;
+
+    int result = send_file(filename, flags, socket_info, sender, receiver);
 
     if (result < 0) {
         perror("ERROR while sending file");
         return result;
     }
 
-    // TODO: should we require the server to send back a message stating that the file was successfully received?
+    n = handle_reply(command, socket_info, receiver);
+    if (n != 0)
+        return n < 0 ? n : 0;
+
+    if (result == KFTP_NOT_MODIFIED) {
+        printf("File not modified: %s\n", filename);
+        return 0;
+    }
+
     printf("Sent file: %s\n", filename);
     return result;
 }
 
 
-// Handles `delete` command, that deletes a file from the server
-int do_delete(char* filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char command[BUFSIZE] = {};
-    int n = snprintf(command, BUFSIZE, "delete %s", filename);
-    if (n >= BUFSIZE || n == 0) {
-        perror("ERROR in sprintf");
-        return -1;
+// Handles `mget` command, that transfers all the files on the server matching the given patterns to the client
+int do_mget(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    int n = send_command(command, socket_info, sender, receiver);
+    if (n == 0)
+        n = handle_reply(command, socket_info, receiver);
+    if (n != 0)
+        return n < 0 ? n : 0;
+
+    KftpBatchResult result;
+    n = kftp_recv_files(&result, socket_info, receiver);
+    if (n < 0) {
+        perror("ERROR while downloading files");
+        return n;
     }
 
-    // delete is currently not implemented using KFTP, so instead we just send the command using RUDP
-    n = rudp_send(command, strlen(command), socket_info, sender, receiver);
+    printf("Downloaded %d files\n", result.received);
+    if (result.failed > 0)
+        printf("Failed to download %d files\n", result.failed);
+    return 0;
+}
+
+
+// Handles `mput` command, that transfers all the local files matching the given patterns to the server
+//
+// The patterns are expanded by the client, so only the names of the files are sent to the server (in the batch).
+//
+// The pack size is sent along with the batch, so the server doesn't need to look at KFTP_FLAG_PACK.
+int do_mput(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpFileList files = {};
+    int n = kftp_find_files(command->args, command->arg_count, &files);
     if (n < 0) {
-        perror("ERROR in rudp_send");
+        kftp_free_file_list(&files);
+        fprintf(stderr, "ERROR in do_mput: could not find files to send\n");
         return n;
     }
 
-    // we expect the server to send back a response when the file is successfully deleted
-    return handle_response(socket_info, receiver);
+    bool pack = command->flags & KFTP_FLAG_PACK;
+    n = send_command(command, socket_info, sender, receiver);
+    if (n == 0)
+        n = kftp_send_files(&files, pack ? KFTP_PACK_SIZE : KFTP_NO_PACKING, socket_info, sender, receiver);
+    int count = files.count;
+    kftp_free_file_list(&files);
+
+    if (n < 0) {
+        perror("ERROR while sending files");
+        return n;
+    }
+
+    n = handle_reply(command, socket_info, receiver);
+    if (n != 0)
+        return n < 0 ? n : 0;
+
+    printf("Sent %d files\n", count);
+    return 0;
 }
 
 
-// Executes the proper processing based on the given command.
+// Handles `delete` command, that deletes a file from the server
+int do_delete(KftpCommand *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    int n = send_command(command, socket_info, sender, receiver);
+    if (n < 0)
+        return n;
+
+    // the server replies once it's done, with a message if the file was deleted
+    n = handle_reply(command, socket_info, receiver);
+    return n < 0 ? n : 0;
+}
+
+
+// Parses the command typed by the user into `command`. Flags come before the other arguments, and the trailing numbers
+// of a ranged get or a paged ls are sent as numbers rather than strings.
 //
 // This function uses strtok which will mutate the message argument.
-int process_command(char *message, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    // TODO: unify command parsing with server implementation
-    char *first_token = strtok(message, DELIMITERS);
-    if (!first_token) return PARSE_ERROR;
+//
+// Returns 0 on success, and PARSE_ERROR if the command is invalid.
+int parse_command(char *message, KftpCommand *command) {
+    char *token = strtok(message, DELIMITERS);
+    if (!token) return PARSE_ERROR;
+
+    int opcode = kftp_command_opcode(token);
+    if (opcode < 0) return PARSE_ERROR;
+    kftp_command_init(command, opcode, next_request_id(), 0);
+    token = strtok(NULL, DELIMITERS);
+
+    // the commands of a pipeline are typed on the lines that follow it, and their number is filled in when it's sent
+    if (opcode == KFTP_OP_PIPELINE) return token ? PARSE_ERROR : 0;
+
+    // get, put, mget, and mput optionally take flags
+    bool takes_flags = opcode == KFTP_OP_GET || opcode == KFTP_OP_PUT || opcode == KFTP_OP_MGET
+                       || opcode == KFTP_OP_MPUT;
+    for (; takes_flags && token && token[0] == '-'; token = strtok(NULL, DELIMITERS)) {
+        int flag = kftp_command_flag(token);
+        if (flag == 0) return PARSE_ERROR;
+        command->flags |= flag;
+    }
+
+    char *args[KFTP_COMMAND_MAX_ARGS];
+    int arg_count = 0;
+    for (; token; token = strtok(NULL, DELIMITERS)) {
+        if (arg_count == KFTP_COMMAND_MAX_ARGS) return PARSE_ERROR;
+        args[arg_count++] = token;
+    }
 
-    char *second_token = strtok(NULL, DELIMITERS);
+    // get optionally takes a byte range after the filename, and ls optionally takes a page of the listing (the number
+    // of names to skip, and the most names to list) after its pattern
+    int numbers = 0;
+    if ((opcode == KFTP_OP_GET && arg_count == 3) || (opcode == KFTP_OP_LS && arg_count >= 2)) {
+        command->flags |= opcode == KFTP_OP_GET ? KFTP_FLAG_RANGED : KFTP_FLAG_PAGED;
+        numbers = 2;
+    }
 
-    // single arg commands
-    if (strcmp(first_token, "ls") == 0 || strcmp(first_token, "exit") == 0) {
-        // only one argument allowed
-        if (second_token) return PARSE_ERROR;
+    for (int i = 0; i < arg_count; i++) {
+        int status;
+        if (i >= arg_count - numbers) {
+            long value = parse_size(args[i]);
+            if (value < 0) return PARSE_ERROR;
+            status = kftp_command_add_uint64(command, (uint64_t) value);
+        } else {
+            status = kftp_command_add_string(command, args[i]);
+        }
+        if (status < 0) return PARSE_ERROR;
+    }
 
-        if (strcmp(first_token, "ls") == 0)
-            return do_ls(socket_info, sender, receiver);
-        else if (strcmp(first_token, "exit") == 0)
-            // does not return since do_exit terminates the process
-            do_exit(socket_info, sender, receiver);
+    // the server checks the command the same way
+    if (kftp_command_validate(command) < 0) return PARSE_ERROR;
+    return 0;
+}
+
+
+// Returns the command of a pipeline with the given request ID, or NULL if there's none. Commands are given increasing
+// request IDs as they're parsed, so they're sorted by ID.
+KftpCommand *find_pipelined(KftpCommand *commands, int count, uint32_t request_id) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (commands[middle].request_id < request_id)
+            low = middle + 1;
+        else
+            high = middle;
     }
+    return low < count && commands[low].request_id == request_id ? &commands[low] : NULL;
+}
 
-    // double arg commands
-    {
-        if (!second_token) return PARSE_ERROR;
+// Prints the outcome of a pipelined command, saving the file returned by a get. `status` is the result of receiving the
+// completion, which may have failed its integrity check.
+void report_completion(KftpCommand *command, KftpCompletion *completion, int status) {
+    KftpCommand *reply = &completion->reply;
+    char *filename = command->arg_count > 0 ? command->args[0] : "";
+    char formatted[BUFSIZE] = {0,};
+    kftp_command_format(command, formatted, BUFSIZE);
+
+    if (status == KFTP_INTEGRITY_ERROR) {
+        printf("Downloaded data does not match the server's copy: %s\n", formatted);
+    } else if (reply->status < 0) {
+        // the server's message names the command that failed
+        printf("%s\n", reply->arg_count > 0 ? reply->args[0] : formatted);
+    } else if (command->opcode == KFTP_OP_GET) {
+        char local_filename[BUFSIZE];
+        get_local_filename(command, local_filename, BUFSIZE);
+        filename = local_filename;
+        FILE *f = fopen(filename, "w");
+        if (f == NULL || fwrite(completion->data, 1, completion->data_size, f) != (size_t) completion->data_size) {
+            perror("ERROR writing downloaded file");
+            printf("Could not save file: %s\n", filename);
+        } else {
+            printf("Downloaded file: %s\n", filename);
+        }
+        if (f != NULL)
+            fclose(f);
+    } else if (command->opcode == KFTP_OP_DELETE) {
+        // the server only sends a message if there was a file to delete
+        printf(reply->arg_count > 0 ? "Deleted file: %s\n" : "Nothing to delete: %s\n", filename);
+    } else if (command->opcode == KFTP_OP_LS) {
+        // listings may complete in any order, so each one is labeled with its command
+        printf("%s:\n", formatted);
+        fwrite(completion->data, 1, completion->data_size, stdout);
+        if (reply->status == KFTP_LIST_MORE) {
+            uint64_t offset = 0;
+            if (command->flags & KFTP_FLAG_PAGED)
+                kftp_command_arg_uint64(command, command->arg_count - 2, &offset);
+            long count = 0;
+            for (int i = 0; i < completion->data_size; i++)
+                count += completion->data[i] == '\n';
+            printf("More files match, list them starting at offset %ld\n", (long) offset + count);
+        }
+    }
+    fflush(stdout);
+}
 
-        // there are no commands that take 3 arguments
-        if (strtok(NULL, DELIMITERS)) return PARSE_ERROR;
+// Sends the `count` commands of a pipeline to the server, then reports each one as soon as its completion arrives
+int run_pipeline(KftpCommand *commands, int count, SocketInfo *socket_info, RudpSender *sender,
+                 RudpReceiver *receiver) {
+    int n = kftp_send_pipeline(commands, count, next_request_id(), socket_info, sender, receiver);
+    if (n < 0)
+        return n;
+
+    // the completions are streamed back, in the order the server finished the commands
+    KftpStream stream = {.socket_info=socket_info, .receiver=receiver};
+    KftpCompletion completion;
+    for (int i = 0; i < count; i++) {
+        n = kftp_recv_completion(&stream, &completion);
+        if (n < 0 && n != KFTP_INTEGRITY_ERROR) {
+            fprintf(stderr, "ERROR in run_pipeline: received %d of %d completions\n", i, count);
+            return n;
+        }
 
-        if (strcmp(first_token, "get") == 0)
-            return do_get(second_token, socket_info, sender, receiver);
-        else if (strcmp(first_token, "put") == 0)
-            return do_put(second_token, socket_info, sender, receiver);
-        else if (strcmp(first_token, "delete") == 0)
-            return do_delete(second_token, socket_info, sender, receiver);
+        KftpCommand *command = find_pipelined(commands, count, completion.reply.request_id);
+        if (command != NULL)
+            report_completion(command, &completion, n);
+        else
+            fprintf(stderr, "ERROR in run_pipeline: completion for unknown request %u\n", completion.reply.request_id);
+        free(completion.data);
+    }
+
+    return 0;
+}
+
+
+// Handles `pipeline` command, that reads delete, ls, and get commands from the lines that follow it (up to a line
+// holding `end`), and sends them to the server without waiting for the reply to each one
+//
+// The commands are sent KFTP_PIPELINE_MAX_COMMANDS at a time. The server runs them concurrently, so their outcomes are
+// reported in the order they finish rather than the order they were typed. Commands that can't be pipelined are
+// reported and skipped.
+int do_pipeline(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpCommand *commands = malloc(KFTP_PIPELINE_MAX_COMMANDS * sizeof(KftpCommand));
+    if (commands == NULL) {
+        perror("ERROR allocating pipeline");
+        return -1;
+    }
+
+    char line[BUFSIZE];
+    char first[BUFSIZE];
+    int count = 0;
+    int status = 0;
+    bool done = false;
+    while (status >= 0 && !done) {
+        done = fgets(line, BUFSIZE, stdin) == NULL;
+        line[strcspn(line, "\r\n")] = 0;
+        if (!done && sscanf(line, "%s", first) == 1) {
+            done = strcmp(first, "end") == 0;
+
+            // strtok is used to parse the strings and is destructive
+            char line_copy[BUFSIZE] = {};
+            strcpy(line_copy, line);
+            if (done) {
+                // the pipeline is over
+            } else if (parse_command(line_copy, &commands[count]) < 0) {
+                printf("Invalid command: %s\n", line);
+            } else if (!kftp_pipeline_allows(&commands[count])) {
+                printf("Command can't be pipelined: %s\n", line);
+            } else {
+                count++;
+            }
+        }
+
+        if (count == KFTP_PIPELINE_MAX_COMMANDS || (done && count > 0)) {
+            status = run_pipeline(commands, count, socket_info, sender, receiver);
+            count = 0;
+        }
+    }
+
+    free(commands);
+    return status;
+}
+
+
+// Executes the proper processing based on the given command.
+//
+// This function uses strtok which will mutate the message argument.
+int process_command(char *message, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpCommand command;
+    if (parse_command(message, &command) < 0) return PARSE_ERROR;
+
+    KftpTransferFlags flags;
+    kftp_command_transfer_flags(&command, &flags);
+
+    switch (command.opcode) {
+        case KFTP_OP_GET:
+            return do_get(&command, &flags, socket_info, sender, receiver);
+        case KFTP_OP_PUT:
+            return do_put(&command, &flags, socket_info, sender, receiver);
+        case KFTP_OP_MGET:
+            return do_mget(&command, socket_info, sender, receiver);
+        case KFTP_OP_MPUT:
+            return do_mput(&command, socket_info, sender, receiver);
+        case KFTP_OP_DELETE:
+            return do_delete(&command, socket_info, sender, receiver);
+        case KFTP_OP_LS:
+            return do_ls(&command, socket_info, sender, receiver);
+        case KFTP_OP_EXIT:
+            // does not return since do_exit terminates the process
+            return do_exit(&command, socket_info, sender, receiver);
+        case KFTP_OP_PIPELINE:
+            return do_pipeline(socket_info, sender, receiver);
     }
 
     // unrecognized command
@@ -234,7 +722,6 @@ int process_command(char *message, SocketInfo *socket_info, RudpSender *sender,
 // messages that need to be ack'd before returning.
 int run_command(char *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
     // strtok is used to parse the strings and is destructive
-    // TODO: should implement a separate command parsing function that is shared between client and server
     char command_copy[BUFSIZE] = {};
     strcpy(command_copy, command);
 
@@ -245,6 +732,16 @@ int run_command(char *command, SocketInfo *socket_info, RudpSender *sender, Rudp
         printf("Invalid command: %s\n", command_copy);
         return 0;
     }
+    // the server is told to give up on the exchange too, so the next command starts in step with it
+    else if (result < 0 && rudp_is_cancelled(receiver->cancel)) {
+        int status = rudp_abort(socket_info, sender, receiver);
+        if (status < 0) {
+            perror("ERROR in rudp_abort");
+            return status;
+        }
+        printf("Cancelled: %s\n", command_copy);
+        return 0;
+    }
     else if (result < 0) {
         perror("ERROR in process_command");
         return result;
@@ -252,11 +749,11 @@ int run_command(char *command, SocketInfo *socket_info, RudpSender *sender, Rudp
 
 
     // acks to server can be lost, so it's possible to successfully finish a task without the server's
-    // knowledge. Here we check to make sure there are no outstanding acks before considering the command complete
-    char ack_buff[BUFSIZE] = {};
-    int status = rudp_check_acks(ack_buff, BUFSIZE, socket_info, receiver);
+    // knowledge. Here we tell the server we're done (and wait for it to confirm it has all its acks) before considering
+    // the command complete
+    int status = rudp_finish(socket_info, receiver);
     if (status < 0) {
-        perror("ERROR in rudp_check_acks");
+        perror("ERROR in rudp_finish");
         return status;
     }
 
@@ -264,6 +761,104 @@ int run_command(char *command, SocketInfo *socket_info, RudpSender *sender, Rudp
 }
 
 
+// Thread that reads the socket for as long as the client runs, so the server's probes are answered even while the
+// command in the foreground is busy (e.g. reading a large file or waiting on the user)
+void *read_socket(void *arg) {
+    rudp_mux_serve(arg);
+    fatal_error("ERROR reading socket");
+    return NULL;
+}
+
+
+// A transfer run in the background, on an RUDP stream of its own
+typedef struct {
+    char command[BUFSIZE];
+    int stream_id;
+    SocketInfo socket_info;
+    struct sockaddr_in serveraddr;  // the job's own copy, since receiving a message fills in the sender's address
+} BackgroundJob;
+
+// Thread that runs a background transfer, then closes its stream
+void *run_in_background(void *arg) {
+    BackgroundJob *job = arg;
+    job->socket_info.addr = (struct sockaddr *) &job->serveraddr;
+    RudpSender sender = {.sender_timeout=SENDER_TIMEOUT, .message_timeout=INITIAL_TIMEOUT, .stream_id=job->stream_id};
+    RudpReceiver receiver = {.stream_id=job->stream_id, .keepalive=true};
+
+    // strtok is used to parse the strings and is destructive
+    char command_copy[BUFSIZE] = {};
+    strcpy(command_copy, job->command);
+
+    int status = run_command(command_copy, &job->socket_info, &sender, &receiver);
+    printf("%s in the background: %s\n", status < 0 ? "Failed" : "Finished", job->command);
+    fflush(stdout);
+
+    rudp_mux_close(job->socket_info.mux, job->stream_id);
+    free(job);
+    return NULL;
+}
+
+// Starts running `command` in the background, on a stream of its own. Only transfers can be run in the background,
+// since the other commands are answered quickly on the control stream anyway.
+//
+// Returns 0 if the command was started (or was invalid, which is reported to the user), and a negative int on failure.
+int start_background(char *command, SocketInfo *socket_info) {
+    // strtok is used to parse the strings and is destructive
+    char command_copy[BUFSIZE] = {};
+    strcpy(command_copy, command);
+
+    KftpCommand parsed;
+    if (parse_command(command_copy, &parsed) < 0) {
+        printf("Invalid command: %s\n", command);
+        return 0;
+    }
+    if (!kftp_command_is_transfer(&parsed)) {
+        printf("Command can't be run in the background: %s\n", command);
+        return 0;
+    }
+
+    BackgroundJob *job = malloc(sizeof(BackgroundJob));
+    if (job == NULL)
+        return -1;
+    strcpy(job->command, command);
+    job->stream_id = (int) next_request_id();
+    job->socket_info = *socket_info;
+    memcpy(&job->serveraddr, socket_info->addr, sizeof(job->serveraddr));
+
+    pthread_t thread;
+    if (rudp_mux_open(socket_info->mux, job->stream_id, RUDP_STREAM_BULK) < 0) {
+        free(job);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, run_in_background, job) != 0) {
+        rudp_mux_close(socket_info->mux, job->stream_id);
+        free(job);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    printf("Running in the background: %s\n", command);
+    return 0;
+}
+
+// Removes the `&` (and any whitespace around it) that ends a command to run in the background
+//
+// Returns true if the command ended with a `&`.
+bool strip_background(char *command) {
+    int end = (int) strlen(command);
+    while (end > 0 && isspace((unsigned char) command[end - 1]))
+        end--;
+    if (end == 0 || command[end - 1] != '&')
+        return false;
+
+    end--;
+    while (end > 0 && isspace((unsigned char) command[end - 1]))
+        end--;
+    command[end] = 0;
+    return true;
+}
+
+
 int main(int argc, char **argv) {
     int sockfd, portno, n;
     socklen_t serverlen;
@@ -298,22 +893,39 @@ int main(int argc, char **argv) {
     memcpy((char *) &serveraddr.sin_addr.s_addr, (char *) server->h_addr_list[0], server->h_length);
     serveraddr.sin_port = htons(portno);
 
+    kftp_fingerprint_index_init(&fingerprints);
+    if (kftp_fingerprint_index_load(&fingerprints, FINGERPRINT_INDEX_FILE) < 0)
+        fprintf(stderr, "Could not load the fingerprint index, local files will be hashed again\n");
+
+    // commands are sent on the control stream, while background transfers get streams of their own
+    RudpMux mux;
+    rudp_mux_init(&mux, sockfd, false);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, read_socket, &mux) != 0)
+        fatal_error("ERROR starting socket reader");
+    pthread_detach(reader);
+
     serverlen = sizeof(serveraddr);
-    SocketInfo sock_info = {.sockfd=sockfd, .addr=(struct sockaddr *) &serveraddr, .addr_len=serverlen};
+    SocketInfo sock_info = {.sockfd=sockfd, .addr=(struct sockaddr *) &serveraddr, .addr_len=serverlen, .mux=&mux};
 
-    RudpSender sender = {.sender_timeout=SENDER_TIMEOUT, .message_timeout=INITIAL_TIMEOUT};
-    RudpReceiver receiver = {};
+    // a server that goes away is given up on, and the command running in the foreground can be cancelled
+    RudpSender sender = {.sender_timeout=SENDER_TIMEOUT, .message_timeout=INITIAL_TIMEOUT, .cancel=&foreground_cancel};
+    RudpReceiver receiver = {.keepalive=true, .cancel=&foreground_cancel};
 
     // client loops to remain interactive, only terminates in the case of a fatal error or exit command
     while (1) {
         // get the next command from the user
         memset(buf, 0, BUFSIZE);
         printf("Please enter one of the following messages: \n"
-               "\tget <file_name>\n"
-               "\tput <file_name>\n"
+               "\tget [-c] [-d|-z|-s|-p|-r|-u|-m] <file_name> [<offset> <length>]\n"
+               "\tput [-c] [-d|-z|-s|-p|-r|-u|-m] <file_name>\n"
+               "\tmget [-k] <pattern>...\n"
+               "\tmput [-k] <pattern>...\n"
                "\tdelete <file_name>\n"
-               "\tls\n"
+               "\tls [<pattern>] [<offset> <count>]\n"
+               "\tpipeline (followed by delete, ls, and get commands, one per line, and then end)\n"
                "\texit\n"
+               "End a get, put, mget, or mput with & to run it in the background.\n"
                "> "
         );
         // fflush() calls are needed for the end-to-end tests that monitor the stdout of the client process they run
@@ -330,8 +942,19 @@ int main(int argc, char **argv) {
                 continue;
         }
 
-        int status = run_command(buf, &sock_info, &sender, &receiver);
-        if (status < 0)
-            perror("ERROR in run_command");
+        int status;
+        if (strip_background(buf)) {
+            status = start_background(buf, &sock_info);
+            if (status < 0)
+                perror("ERROR in start_background");
+        } else {
+            // Ctrl-C only cancels the command while it runs, and quits the client at the prompt
+            foreground_cancel.cancelled = 0;
+            signal(SIGINT, cancel_foreground);
+            status = run_command(buf, &sock_info, &sender, &receiver);
+            signal(SIGINT, SIG_DFL);
+            if (status < 0)
+                perror("ERROR in run_command");
+        }
     }
 }
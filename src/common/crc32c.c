@@ -0,0 +1,115 @@
+//
+// CRC32C (Castagnoli) checksums used to detect corrupted datagrams
+//
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8
+#endif
+
+// reversed representation of the CRC32C polynomial 0x1EDC6F41
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+
+// tables[k][b] is the CRC of byte b followed by k zero bytes, which lets the software path consume 8 bytes per step
+static uint32_t tables[8][256];
+static bool hardware_supported = false;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        tables[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++)
+            tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xFF];
+    }
+
+#if defined(CRC32C_SSE42)
+    hardware_supported = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARMV8)
+    hardware_supported = true;
+#endif
+}
+
+
+static uint32_t crc32c_slice_by_8(uint32_t crc, const unsigned char* data, int data_size) {
+    while (data_size >= 8) {
+        // bytes are combined explicitly (rather than loading words) so the result doesn't depend on the host order
+        uint32_t low = crc ^ ((uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16
+                              | (uint32_t) data[3] << 24);
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF]
+              ^ tables[4][low >> 24] ^ tables[3][data[4]] ^ tables[2][data[5]] ^ tables[1][data[6]]
+              ^ tables[0][data[7]];
+        data += 8;
+        data_size -= 8;
+    }
+
+    while (data_size-- > 0)
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, int data_size) {
+    uint64_t crc64 = crc;
+    while (data_size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        data_size -= 8;
+    }
+
+    crc = (uint32_t) crc64;
+    while (data_size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#elif defined(CRC32C_ARMV8)
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, int data_size) {
+    while (data_size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        data_size -= 8;
+    }
+
+    while (data_size-- > 0)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#endif
+
+
+uint32_t crc32c_software(uint32_t crc, const char* data, int data_size) {
+    pthread_once(&init_once, crc32c_init);
+    return ~crc32c_slice_by_8(~crc, (const unsigned char*) data, data_size);
+}
+
+uint32_t crc32c(uint32_t crc, const char* data, int data_size) {
+    pthread_once(&init_once, crc32c_init);
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+    // the crc32 instructions consume words in little-endian order, which matches the order of the bytes on x86 and ARM
+    if (hardware_supported)
+        return ~crc32c_hardware(~crc, (const unsigned char*) data, data_size);
+#endif
+
+    return ~crc32c_slice_by_8(~crc, (const unsigned char*) data, data_size);
+}
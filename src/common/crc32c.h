@@ -0,0 +1,21 @@
+//
+// CRC32C (Castagnoli) checksums used to detect corrupted datagrams
+//
+// CRC32C is the CRC that SSE4.2 (and ARMv8) provide instructions for, so it can be computed at close to memory speed.
+// Hosts without those instructions fall back to a slice-by-8 table implementation that gives the same results.
+//
+
+#ifndef UDP_CRC32C_H
+#define UDP_CRC32C_H
+
+#include <stdint.h>
+
+// Computes the CRC32C of `data`, continuing from `crc`. Pass 0 as `crc` to start a new checksum, or the result of a
+// previous call to extend that checksum with more data.
+uint32_t crc32c(uint32_t crc, const char* data, int data_size);
+
+// Table based implementation used when the CPU has no CRC32C instructions. Exposed so that it can be tested on hosts
+// that do have them.
+uint32_t crc32c_software(uint32_t crc, const char* data, int data_size);
+
+#endif //UDP_CRC32C_H
@@ -0,0 +1,364 @@
+//
+// In-memory sorted index of the regular files in a directory
+//
+// The directory is read with readdir, which reports the type of each entry along with its name, so only entries whose
+// type isn't known (or symbolic links, which are indexed if they point to a regular file) need a separate stat call.
+//
+// inotify events only say which names changed, so each changed name is stat'ed again when the index is refreshed to find
+// out if it's (still) a regular file. The changes are sorted, and each one is looked up with a binary search and
+// applied to the index in place, so the index is never copied and only the names after the first change are moved. The
+// index is rebuilt from scratch if inotify drops events (once its queue overflows) or too many names changed between
+// refreshes.
+//
+
+// needed for d_type, dirfd, fstatat, strdup, and st_mtim
+#define _DEFAULT_SOURCE
+
+#include "dir_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define DIR_INDEX_INOTIFY
+#endif
+
+
+#ifdef DIR_INDEX_INOTIFY
+// changes that add or remove names, and changes to the directory itself after which it can't be watched anymore
+#define WATCHED_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define UNWATCHED_EVENTS (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)
+
+// size of the buffer inotify events are read into
+#define EVENT_BUFFER_SIZE (64 * 1024)
+#endif
+
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+static void free_names(char** names, long count) {
+    for (long i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+// Appends `name` to a list of names, growing the list as needed. The list takes ownership of `name`.
+static int append_name(char*** names, long* count, long* capacity, char* name) {
+    if (*count == *capacity) {
+        long new_capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        char** new_names = realloc(*names, new_capacity * sizeof(char*));
+        if (new_names == NULL)
+            return -1;
+        *names = new_names;
+        *capacity = new_capacity;
+    }
+    (*names)[(*count)++] = name;
+    return 0;
+}
+
+static void clear_pending(DirIndex* index) {
+    free_names(index->pending, index->pending_count);
+    index->pending = NULL;
+    index->pending_count = 0;
+    index->pending_capacity = 0;
+}
+
+static bool is_regular_file(int dir_fd, char* name) {
+    struct stat entry_stat;
+    return fstatat(dir_fd, name, &entry_stat, 0) == 0 && S_ISREG(entry_stat.st_mode);
+}
+
+static int directory_modified(char* directory, struct timespec* modified) {
+    struct stat dir_stat;
+    if (stat(directory, &dir_stat) < 0)
+        return -1;
+    *modified = dir_stat.st_mtim;
+    return 0;
+}
+
+
+#ifdef DIR_INDEX_INOTIFY
+static void stop_watching(DirIndex* index) {
+    if (index->watch_fd >= 0)
+        close(index->watch_fd);
+    index->watch_fd = -1;
+}
+
+// Reads the events queued up since the last refresh, and adds the names they affect to the pending names
+static void read_events(DirIndex* index) {
+    union {
+        struct inotify_event event;     // aligns the buffer for the events read into it
+        char bytes[EVENT_BUFFER_SIZE];
+    } buffer;
+
+    while (index->watch_fd >= 0) {
+        ssize_t n = read(index->watch_fd, buffer.bytes, sizeof(buffer.bytes));
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("ERROR in read_events");
+                stop_watching(index);
+                index->stale = true;
+            }
+            if (n == 0 || errno != EINTR)
+                break;
+            continue;
+        }
+
+        for (char* next = buffer.bytes; next < buffer.bytes + n;) {
+            struct inotify_event* event = (struct inotify_event*) next;
+            next += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                index->stale = true;
+            } else if (event->mask & UNWATCHED_EVENTS) {
+                // the index falls back to checking the directory's modification time
+                stop_watching(index);
+                index->stale = true;
+            } else if (event->len > 0 && !(event->mask & IN_ISDIR) && !index->stale) {
+                char* name = strdup(event->name);
+                if (index->pending_count == DIR_INDEX_MAX_PENDING || name == NULL
+                    || append_name(&index->pending, &index->pending_count, &index->pending_capacity, name) < 0) {
+                    free(name);
+                    index->stale = true;
+                }
+            }
+        }
+    }
+
+    // once the index is rebuilt, the pending names don't matter anymore
+    if (index->stale)
+        clear_pending(index);
+}
+#endif
+
+
+int dir_index_init(DirIndex* index, char* directory) {
+    *index = (DirIndex) {.directory=strdup(directory), .watch_fd=-1, .stale=true};
+    if (index->directory == NULL)
+        return -1;
+
+#ifdef DIR_INDEX_INOTIFY
+    // the directory is watched before it's first read, so no changes can be missed in between
+    index->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (index->watch_fd < 0 || inotify_add_watch(index->watch_fd, directory, WATCHED_EVENTS) < 0) {
+        perror("Could not watch directory, will check its modification time instead");
+        stop_watching(index);
+    }
+#endif
+    return 0;
+}
+
+void dir_index_free(DirIndex* index) {
+#ifdef DIR_INDEX_INOTIFY
+    stop_watching(index);
+#endif
+    free_names(index->names, index->count);
+    clear_pending(index);
+    free(index->directory);
+    *index = (DirIndex) {.watch_fd=-1};
+}
+
+
+// Reads the whole directory into the index
+static int rebuild(DirIndex* index) {
+    // the modification time is read first, so a change made while the directory is read causes another rebuild
+    struct timespec modified;
+    if (index->watch_fd < 0) {
+        if (directory_modified(index->directory, &modified) < 0) {
+            perror("ERROR in rebuild: could not stat directory");
+            return -1;
+        }
+        index->modified_seconds = modified.tv_sec;
+        index->modified_nanoseconds = modified.tv_nsec;
+    }
+
+    DIR* dir = opendir(index->directory);
+    if (dir == NULL) {
+        perror("ERROR in rebuild: could not open directory");
+        return -1;
+    }
+
+    char** names = NULL;
+    long count = 0;
+    long capacity = 0;
+    int status = 0;
+    struct dirent* entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        bool regular = entry->d_type == DT_REG
+                       || ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+                           && is_regular_file(dirfd(dir), entry->d_name));
+        if (!regular)
+            continue;
+
+        char* name = strdup(entry->d_name);
+        if (name == NULL || append_name(&names, &count, &capacity, name) < 0) {
+            free(name);
+            status = -1;
+        }
+    }
+    closedir(dir);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in rebuild: could not allocate index\n");
+        free_names(names, count);
+        return -1;
+    }
+
+    qsort(names, count, sizeof(char*), compare_names);
+    free_names(index->names, index->count);
+    clear_pending(index);
+    index->names = names;
+    index->count = count;
+    index->capacity = capacity;
+    index->stale = false;
+    index->stats.rebuilds++;
+    return 0;
+}
+
+// Returns the position of the first of the `count` sorted names that isn't sorted before `name`
+static long lower_bound(char** names, long count, char* name) {
+    long low = 0;
+    long high = count;
+    while (low < high) {
+        long middle = low + (high - low) / 2;
+        if (strcmp(names[middle], name) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Removes the names at `positions` (which are sorted) from the index. Only the names after the first removed one move,
+// and each of them moves once.
+static void remove_names(DirIndex* index, long* positions, long count) {
+    if (count == 0)
+        return;
+
+    long to = positions[0];
+    for (long j = 0; j < count; j++) {
+        free(index->names[positions[j]]);
+        long from = positions[j] + 1;
+        long end = j + 1 < count ? positions[j + 1] : index->count;
+        memmove(&index->names[to], &index->names[from], (end - from) * sizeof(char*));
+        to += end - from;
+    }
+    index->count -= count;
+}
+
+// Inserts the sorted `names` (none of which are in the index yet) into the index, which takes ownership of them. The
+// names are placed from the last one back, so only the names after the first insertion move, and each of them moves
+// once.
+//
+// Returns 0 on success, and a negative int if the index could not grow (in which case `names` is left untouched).
+static int insert_names(DirIndex* index, char** names, long count) {
+    if (index->count + count > index->capacity) {
+        long new_capacity = index->capacity * 2 > index->count + count ? index->capacity * 2 : index->count + count;
+        char** new_names = realloc(index->names, new_capacity * sizeof(char*));
+        if (new_names == NULL)
+            return -1;
+        index->names = new_names;
+        index->capacity = new_capacity;
+    }
+
+    // the names before `end` haven't moved yet, so they can still be searched
+    long end = index->count;
+    for (long j = count - 1; j >= 0; j--) {
+        long position = lower_bound(index->names, end, names[j]);
+        memmove(&index->names[position + j + 1], &index->names[position], (end - position) * sizeof(char*));
+        index->names[position + j] = names[j];
+        end = position;
+    }
+    index->count += count;
+    return 0;
+}
+
+// Applies the pending names to the index in place, after checking which of them are regular files. Each changed name
+// is looked up with a binary search, so the index is never copied or walked as a whole.
+static int apply_pending(DirIndex* index) {
+    if (index->pending_count == 0)
+        return 0;
+
+    long pending_count = index->pending_count;
+    char** pending = index->pending;
+    index->pending = NULL;
+    index->pending_count = 0;
+    index->pending_capacity = 0;
+
+    int dir_fd = open(index->directory, O_RDONLY | O_DIRECTORY);
+    long* removals = malloc(pending_count * sizeof(long));
+    if (dir_fd < 0 || removals == NULL) {
+        if (dir_fd >= 0)
+            close(dir_fd);
+        free(removals);
+        free_names(pending, pending_count);
+        index->stale = true;
+        return -1;
+    }
+
+    // the names to insert are moved to the front of `pending`, and the positions of the names to remove are collected,
+    // both in sorted order
+    qsort(pending, pending_count, sizeof(char*), compare_names);
+    long insert_count = 0;
+    long removal_count = 0;
+    for (long j = 0; j < pending_count; j++) {
+        // a name may have changed several times
+        if (j + 1 < pending_count && strcmp(pending[j], pending[j + 1]) == 0) {
+            free(pending[j]);
+            continue;
+        }
+
+        long position = lower_bound(index->names, index->count, pending[j]);
+        bool indexed = position < index->count && strcmp(index->names[position], pending[j]) == 0;
+        bool regular = is_regular_file(dir_fd, pending[j]);
+        if (regular && !indexed)
+            pending[insert_count++] = pending[j];
+        else
+            free(pending[j]);
+        if (indexed && !regular)
+            removals[removal_count++] = position;
+        index->stats.updates++;
+    }
+    close(dir_fd);
+
+    remove_names(index, removals, removal_count);
+    free(removals);
+    int status = insert_names(index, pending, insert_count);
+    if (status < 0) {
+        free_names(pending, insert_count);
+        index->stale = true;
+        return status;
+    }
+    free(pending);
+    return 0;
+}
+
+int dir_index_refresh(DirIndex* index) {
+#ifdef DIR_INDEX_INOTIFY
+    read_events(index);
+#endif
+
+    if (index->watch_fd < 0 && !index->stale) {
+        struct timespec modified;
+        if (directory_modified(index->directory, &modified) < 0
+            || modified.tv_sec != index->modified_seconds || modified.tv_nsec != index->modified_nanoseconds)
+            index->stale = true;
+    }
+
+    if (!index->stale && apply_pending(index) == 0)
+        return 0;
+    return rebuild(index);
+}
+
+long dir_index_lower_bound(DirIndex* index, char* name) {
+    return lower_bound(index->names, index->count, name);
+}
@@ -0,0 +1,62 @@
+//
+// In-memory sorted index of the regular files in a directory
+//
+// Reading a large directory (e.g. millions of files) takes seconds, so listings are answered from an index that is
+// built once and then kept current. On Linux, the index watches the directory with inotify and only re-checks the names
+// that changed. Elsewhere, the index is rebuilt whenever the directory's modification time changes.
+//
+
+#ifndef UDP_DIR_INDEX_H
+#define UDP_DIR_INDEX_H
+
+#include <stdbool.h>
+#include <time.h>
+
+// most changed names that are held until the next refresh, after which the index is rebuilt instead
+#define DIR_INDEX_MAX_PENDING (64 * 1024)
+
+
+// Counters that show how the index is kept current
+typedef struct {
+    unsigned long rebuilds;     // times the whole directory was read
+    unsigned long updates;      // changed names that were checked and applied to the index
+} DirIndexStats;
+
+typedef struct {
+    char* directory;
+    char** names;               // names of the regular files in the directory, sorted by strcmp
+    long count;
+    long capacity;              // number of names there's room for before `names` has to grow
+
+    int watch_fd;               // inotify descriptor watching the directory, or -1 if it isn't watched
+    char** pending;             // names that changed since the last refresh (unsorted, and possibly repeated)
+    long pending_count;
+    long pending_capacity;
+    bool stale;                 // set if the index must be rebuilt on the next refresh
+    // modification time of the directory when it was last read, if it isn't watched
+    time_t modified_seconds;
+    long modified_nanoseconds;
+
+    DirIndexStats stats;
+} DirIndex;
+
+
+// Sets up an index of `directory`, which is read on the first refresh
+//
+// Returns 0 on success, and a negative int on failure.
+int dir_index_init(DirIndex* index, char* directory);
+
+// Frees the index and stops watching its directory
+void dir_index_free(DirIndex* index);
+
+// Brings the index up to date with the directory. The names that changed since the last refresh are checked again, and
+// each one is found with a binary search and added or removed in place, which only moves the (pointers to the) names
+// sorted after it. The whole directory is only read again when the index can't tell what changed.
+//
+// Returns 0 on success, and a negative int if the directory could not be read.
+int dir_index_refresh(DirIndex* index);
+
+// Returns the position of the first name in the index that isn't sorted before `name`
+long dir_index_lower_bound(DirIndex* index, char* name);
+
+#endif //UDP_DIR_INDEX_H
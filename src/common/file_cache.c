@@ -0,0 +1,183 @@
+//
+// In-memory LRU cache of file contents
+//
+// Entries are found through a hash table keyed by path, and are kept in a list ordered by when they were last used so
+// the least recently used entries can be evicted once the cache is full. An entry is only used if the file's device,
+// inode, size, and modification time still match the version that was cached.
+//
+
+// needed for fmemopen, fileno, strdup, and st_mtim
+#define _POSIX_C_SOURCE 200809L
+
+#include "file_cache.h"
+
+#include "hash.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+static FileCacheEntry** find_slot(FileCache* cache, char* path) {
+    uint64_t hash = xxh64(path, strlen(path), 0);
+    FileCacheEntry** slot = &cache->buckets[hash % FILE_CACHE_BUCKETS];
+    while (*slot != NULL && strcmp((*slot)->path, path) != 0)
+        slot = &(*slot)->bucket_next;
+    return slot;
+}
+
+static void unlink_lru(FileCache* cache, FileCacheEntry* entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void push_newest(FileCache* cache, FileCacheEntry* entry) {
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    cache->newest = entry;
+    if (cache->oldest == NULL)
+        cache->oldest = entry;
+}
+
+// removes the entry in `slot` from the cache
+static void remove_entry(FileCache* cache, FileCacheEntry** slot) {
+    FileCacheEntry* entry = *slot;
+    *slot = entry->bucket_next;
+    unlink_lru(cache, entry);
+    cache->size -= entry->size;
+    mem_budget_release(cache->budget, entry->size);
+
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static bool is_current(FileCacheEntry* entry, struct stat* file_stat) {
+    return entry->device == file_stat->st_dev && entry->inode == file_stat->st_ino
+           && entry->size == (size_t) file_stat->st_size
+           && entry->modified.tv_sec == file_stat->st_mtim.tv_sec
+           && entry->modified.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+// Reads the contents of `f` into a new entry, evicting the least recently used entries to make room for it.
+//
+// Returns NULL if the file couldn't be read, or if the cache's budget can't cover it even once every other entry is
+// evicted.
+static FileCacheEntry* add_entry(FileCache* cache, char* path, FILE* f, struct stat* file_stat) {
+    size_t size = file_stat->st_size;
+    while (mem_budget_reserve(cache->budget, size) < 0) {
+        if (cache->oldest == NULL)
+            return NULL;
+        remove_entry(cache, find_slot(cache, cache->oldest->path));
+        cache->stats.evictions++;
+    }
+
+    FileCacheEntry* entry = calloc(1, sizeof(FileCacheEntry));
+    if (entry == NULL) {
+        mem_budget_release(cache->budget, size);
+        return NULL;
+    }
+
+    entry->path = strdup(path);
+    entry->data = malloc(size);
+    if (entry->path == NULL || entry->data == NULL || fread(entry->data, 1, size, f) != size) {
+        // the file may also have been truncated while it was being read
+        free(entry->path);
+        free(entry->data);
+        free(entry);
+        mem_budget_release(cache->budget, size);
+        return NULL;
+    }
+    entry->size = size;
+    entry->device = file_stat->st_dev;
+    entry->inode = file_stat->st_ino;
+    entry->modified = file_stat->st_mtim;
+
+    while (cache->oldest != NULL && cache->size + size > cache->capacity) {
+        remove_entry(cache, find_slot(cache, cache->oldest->path));
+        cache->stats.evictions++;
+    }
+
+    FileCacheEntry** slot = find_slot(cache, path);
+    entry->bucket_next = *slot;
+    *slot = entry;
+    push_newest(cache, entry);
+    cache->size += size;
+    return entry;
+}
+
+
+void file_cache_init(FileCache* cache, size_t capacity, size_t max_file_size) {
+    memset(cache, 0, sizeof(FileCache));
+    cache->capacity = capacity;
+    cache->max_file_size = max_file_size;
+}
+
+void file_cache_free(FileCache* cache) {
+    while (cache->oldest != NULL)
+        remove_entry(cache, find_slot(cache, cache->oldest->path));
+}
+
+FILE* file_cache_open(FileCache* cache, char* path) {
+    struct stat file_stat;
+    FileCacheEntry** slot = find_slot(cache, path);
+
+    if (*slot != NULL) {
+        if (stat(path, &file_stat) == 0 && is_current(*slot, &file_stat)) {
+            FILE* cached = fmemopen((*slot)->data, (*slot)->size, "r");
+            if (cached != NULL) {
+                cache->stats.hits++;
+                unlink_lru(cache, *slot);
+                push_newest(cache, *slot);
+                return cached;
+            }
+        }
+        remove_entry(cache, slot);
+        cache->stats.invalidations++;
+    }
+
+    cache->stats.misses++;
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    // the stat of the opened file is used so the entry describes the same version of the file that is read
+    if (fstat(fileno(f), &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0
+        || (size_t) file_stat.st_size > cache->max_file_size || (size_t) file_stat.st_size > cache->capacity)
+        return f;
+
+    FileCacheEntry* entry = add_entry(cache, path, f, &file_stat);
+    if (entry != NULL) {
+        FILE* cached = fmemopen(entry->data, entry->size, "r");
+        if (cached != NULL) {
+            fclose(f);
+            return cached;
+        }
+    }
+
+    // fall back to reading the file from disk
+    rewind(f);
+    return f;
+}
+
+void file_cache_invalidate(FileCache* cache, char* path) {
+    FileCacheEntry** slot = find_slot(cache, path);
+    if (*slot == NULL)
+        return;
+
+    remove_entry(cache, slot);
+    cache->stats.invalidations++;
+}
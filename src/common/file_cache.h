@@ -0,0 +1,77 @@
+//
+// In-memory LRU cache of file contents
+//
+// Files that are read repeatedly (e.g. a popular file that many clients get) are kept in memory so they don't need to
+// be read from disk again. Entries are checked against the file on disk whenever they're used, so a file that changed
+// since it was cached is read again instead of serving stale contents.
+//
+// The cached contents can also be charged to a memory budget shared with the rest of the program. Older entries are
+// evicted to make room in the budget, and a file the budget can't cover is read from disk instead.
+//
+
+#ifndef UDP_FILE_CACHE_H
+#define UDP_FILE_CACHE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "mem_budget.h"
+
+// number of hash buckets used to look up cached files by path
+#define FILE_CACHE_BUCKETS 256
+
+
+typedef struct FileCacheEntry {
+    char* path;
+    char* data;
+    size_t size;
+
+    // identifies the version of the file that was cached
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+
+    struct FileCacheEntry* bucket_next;     // next entry in the same hash bucket
+    struct FileCacheEntry* newer;           // neighbours in the LRU list
+    struct FileCacheEntry* older;
+} FileCacheEntry;
+
+// Counters that show how well the cache is working, e.g. to tune its capacity
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;        // entries removed to make room for other files
+    unsigned long invalidations;    // entries removed because the file changed or was removed
+} FileCacheStats;
+
+typedef struct {
+    size_t capacity;        // most bytes of file contents that are cached at a time
+    size_t max_file_size;   // larger files are never cached
+    size_t size;            // bytes of file contents currently cached
+    MemBudget* budget;      // charged for the cached contents, unless it's NULL (may be set after file_cache_init)
+    FileCacheEntry* buckets[FILE_CACHE_BUCKETS];
+    FileCacheEntry* newest;
+    FileCacheEntry* oldest;
+    FileCacheStats stats;
+} FileCache;
+
+
+void file_cache_init(FileCache* cache, size_t capacity, size_t max_file_size);
+
+// Frees all the entries in the cache
+void file_cache_free(FileCache* cache);
+
+// Opens the file at `path` for reading. If the file is cached (or can be cached), the returned stream reads from the
+// cached contents instead of from disk. The stream doesn't have a file descriptor, so callers that need one should use
+// fopen() instead.
+//
+// The stream must be closed before the cache is used again, since later calls may evict the contents it reads from.
+//
+// Returns NULL if the file could not be opened.
+FILE* file_cache_open(FileCache* cache, char* path);
+
+// Removes the file at `path` from the cache, e.g. because it's about to be overwritten
+void file_cache_invalidate(FileCache* cache, char* path);
+
+#endif //UDP_FILE_CACHE_H
@@ -0,0 +1,153 @@
+//
+// Hash functions used to identify and verify transferred data
+//
+
+#include "hash.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+
+static uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// XXH64 is defined over little-endian words, so we assemble them byte by byte to stay independent of the host order
+static uint64_t read64(const char* data) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    return (uint64_t) bytes[0]
+         | (uint64_t) bytes[1] << 8
+         | (uint64_t) bytes[2] << 16
+         | (uint64_t) bytes[3] << 24
+         | (uint64_t) bytes[4] << 32
+         | (uint64_t) bytes[5] << 40
+         | (uint64_t) bytes[6] << 48
+         | (uint64_t) bytes[7] << 56;
+}
+
+static uint32_t read32(const char* data) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    return (uint32_t) bytes[0]
+         | (uint32_t) bytes[1] << 8
+         | (uint32_t) bytes[2] << 16
+         | (uint32_t) bytes[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void xxh64_init(Xxh64State* state, uint64_t seed) {
+    state->seed = seed;
+    state->accumulators[0] = seed + PRIME64_1 + PRIME64_2;
+    state->accumulators[1] = seed + PRIME64_2;
+    state->accumulators[2] = seed;
+    state->accumulators[3] = seed - PRIME64_1;
+    state->total_size = 0;
+    state->stripe_size = 0;
+}
+
+// the bulk of the input is consumed in 32 byte stripes by four independent accumulators
+static void consume_stripe(uint64_t* accumulators, const char* stripe) {
+    accumulators[0] = xxh64_round(accumulators[0], read64(stripe));
+    accumulators[1] = xxh64_round(accumulators[1], read64(stripe + 8));
+    accumulators[2] = xxh64_round(accumulators[2], read64(stripe + 16));
+    accumulators[3] = xxh64_round(accumulators[3], read64(stripe + 24));
+}
+
+void xxh64_update(Xxh64State* state, const char* data, int data_size) {
+    const char* end = data + data_size;
+    state->total_size += data_size;
+
+    // finish off a stripe left over from the previous update first
+    if (state->stripe_size > 0) {
+        int fill = 32 - state->stripe_size;
+        if (fill > data_size)
+            fill = data_size;
+        memcpy(&state->stripe[state->stripe_size], data, fill);
+        state->stripe_size += fill;
+        data += fill;
+
+        if (state->stripe_size < 32)
+            return;
+        consume_stripe(state->accumulators, state->stripe);
+        state->stripe_size = 0;
+    }
+
+    uint64_t accumulators[4] = {
+            state->accumulators[0], state->accumulators[1], state->accumulators[2], state->accumulators[3],
+    };
+    while (data + 32 <= end) {
+        consume_stripe(accumulators, data);
+        data += 32;
+    }
+    memcpy(state->accumulators, accumulators, sizeof(accumulators));
+
+    state->stripe_size = (int) (end - data);
+    memcpy(state->stripe, data, state->stripe_size);
+}
+
+uint64_t xxh64_digest(Xxh64State* state) {
+    const uint64_t* v = state->accumulators;
+    const char* data = state->stripe;
+    const char* end = data + state->stripe_size;
+    uint64_t hash;
+
+    if (state->total_size >= 32) {
+        hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        hash = xxh64_merge_round(hash, v[0]);
+        hash = xxh64_merge_round(hash, v[1]);
+        hash = xxh64_merge_round(hash, v[2]);
+        hash = xxh64_merge_round(hash, v[3]);
+    } else {
+        hash = state->seed + PRIME64_5;
+    }
+
+    hash += state->total_size;
+
+    while (data + 8 <= end) {
+        hash ^= xxh64_round(0, read64(data));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+        data += 8;
+    }
+
+    if (data + 4 <= end) {
+        hash ^= (uint64_t) read32(data) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+    }
+
+    while (data < end) {
+        hash ^= (unsigned char) *data * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+        data++;
+    }
+
+    // final avalanche so that every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+uint64_t xxh64(const char* data, int data_size, uint64_t seed) {
+    Xxh64State state;
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, data_size);
+    return xxh64_digest(&state);
+}
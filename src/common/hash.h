@@ -0,0 +1,33 @@
+//
+// Hash functions used to identify and verify transferred data
+//
+
+#ifndef UDP_HASH_H
+#define UDP_HASH_H
+
+#include <stdint.h>
+
+// Computes the 64-bit xxHash (XXH64) of `data`.
+//
+// XXH64 is not a cryptographic hash, but it is fast and has a low enough collision rate to identify blocks of a file.
+uint64_t xxh64(const char* data, int data_size, uint64_t seed);
+
+// State for computing an XXH64 hash incrementally, over data that arrives in pieces
+typedef struct {
+    uint64_t seed;
+    uint64_t accumulators[4];
+    uint64_t total_size;
+    char stripe[32];        // input that doesn't fill up a full stripe yet
+    int stripe_size;
+} Xxh64State;
+
+// Starts a new incremental XXH64 hash
+void xxh64_init(Xxh64State* state, uint64_t seed);
+
+// Adds `data` to the hash. Hashing data in several pieces gives the same result as hashing it all at once.
+void xxh64_update(Xxh64State* state, const char* data, int data_size);
+
+// Returns the hash of all the data added so far. The state is not modified, so more data may still be added.
+uint64_t xxh64_digest(Xxh64State* state);
+
+#endif //UDP_HASH_H
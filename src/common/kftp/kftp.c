@@ -7,34 +7,78 @@
 #include "kftp.h"
 
 #include "kftp_serde.h"
+#include "../hash.h"
 #include "../reliable_udp/reliable_udp.h"
 #include "../utils.h"
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
+
+
+// Helper function that appends the trailer to the last data message if there's room left for it
+//
+// Returns the new size of the message. The size is unchanged if the trailer didn't fit and still needs to be sent.
+static int append_trailer(Xxh64State* hash_state, char* rudp_buffer, int message_size) {
+    if (MAX_DATA_SIZE - message_size < KFTP_TRAILER_SIZE)
+        return message_size;
+
+    KftpTrailer trailer = {.hash=xxh64_digest(hash_state)};
+    int serialized = serialize_kftp_trailer(&trailer, &rudp_buffer[message_size], MAX_DATA_SIZE - message_size);
+    assert(serialized == KFTP_TRAILER_SIZE);
+    return message_size + serialized;
+}
 
 
 int kftp_send_file(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    return kftp_send_file_range(read_fp, 0, LONG_MAX, to, sender, receiver);
+}
+
+
+int kftp_send_file_range(FILE* read_fp, long offset, long length, SocketInfo* to, RudpSender* sender,
+                         RudpReceiver* receiver) {
+    if (offset < 0 || length < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_range: invalid range\n");
+        return -1;
+    }
+
     // Retrieves the size of the file to determine how much data will be sent in the KFTP message
     int status = fseek(read_fp, 0, SEEK_END);
     if (status < 0) {
-        fprintf(stderr, "ERROR in kftp_send_file: error seeking to end of file\n");
+        fprintf(stderr, "ERROR in kftp_send_file_range: error seeking to end of file\n");
         return status;
     }
     long file_size = ftell(read_fp);
     if (file_size < 0) {
-        fprintf(stderr, "ERROR in kftp_send_file: error getting file size\n");
+        fprintf(stderr, "ERROR in kftp_send_file_range: error getting file size\n");
         return file_size;
     }
 
-    // Seek back to the beginning so we can read the full file contents
-    status = fseek(read_fp, 0, SEEK_SET);
+    // the range is cut off at the end of the file
+    if (offset > file_size)
+        offset = file_size;
+    if (length > file_size - offset)
+        length = file_size - offset;
+    if (length > INT_MAX) {
+        fprintf(stderr, "ERROR in kftp_send_file_range: file is too large to send\n");
+        return -1;
+    }
+
+    // Seek directly to the start of the range, so only the requested data is read
+    status = fseek(read_fp, offset, SEEK_SET);
     if (status < 0) {
-        fprintf(stderr, "ERROR in kftp_send_file: error seeking to beginning of file\n");
+        fprintf(stderr, "ERROR in kftp_send_file_range: error seeking to start of range\n");
         return status;
     }
 
-    KftpHeader header = {.data_size=file_size};
+    KftpHeader header = {.data_size=length};
+
+    // the file is hashed as it is read so that the receiver can verify it without another pass over the data
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+    bool trailer_sent = false;
 
     // max amount of data that can fit into an RUDP message
     int rudp_size_limit = MAX_DATA_SIZE;
@@ -45,30 +89,33 @@ int kftp_send_file(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiv
     // Since the first RUDP message includes the KFTP header, it has a reduced capacity for KFTP data
     int first_packet_remaining_size = rudp_size_limit - serialized;
     assert(first_packet_remaining_size >= 0);
-    size_t read_bytes = fread(&rudp_buffer[serialized], sizeof(char), first_packet_remaining_size, read_fp);
-
-    if (read_bytes != first_packet_remaining_size) {
-        // We should only not fill up the first RUDP message if the file is small enough to fit in the single message.
-        // In that case, we should have already read to EOF.
-        if(feof(read_fp) == 0) {
-            assert(file_size == read_bytes);
-        } else {
-            fprintf(stderr, "ERROR in kftp_send_file: not able to fill up first RUDP message, yet not at EOF\n");
-            return -1;
-        }
+
+    // We only don't fill up the first RUDP message if the range is small enough to fit in the single message
+    size_t first_packet_data_size = min(first_packet_remaining_size, length);
+    size_t read_bytes = fread(&rudp_buffer[serialized], sizeof(char), first_packet_data_size, read_fp);
+    if (read_bytes != first_packet_data_size) {
+        fprintf(stderr, "ERROR in kftp_send_file_range: unable to read expected number of bytes from file\n");
+        return -1;
     }
 
-    size_t remaining_bytes = file_size - read_bytes;
+    size_t remaining_bytes = length - read_bytes;
+    xxh64_update(&hash_state, &rudp_buffer[serialized], read_bytes);
 
-    status = rudp_send(rudp_buffer, serialized+read_bytes, to, sender, receiver);
+    int message_size = serialized + read_bytes;
+    if (remaining_bytes == 0) {
+        message_size = append_trailer(&hash_state, rudp_buffer, message_size);
+        trailer_sent = message_size > serialized + read_bytes;
+    }
+
+    status = rudp_send(rudp_buffer, message_size, to, sender, receiver);
     if (status < 0) {
-        fprintf(stderr, "ERROR in kftp_send_file: error in initial rudp_send\n");
+        fprintf(stderr, "ERROR in kftp_send_file_range: error in initial rudp_send\n");
         return status;
     }
 
     // send out successive file chunks until we've sent the rest of the file
     while (remaining_bytes > 0) {
-        fprintf(stderr, "Progress: %lu%%                         \r", 100 - (remaining_bytes * 100 / file_size));
+        fprintf(stderr, "Progress: %lu%%                         \r", 100 - (remaining_bytes * 100 / length));
         fflush(stderr);
 
         size_t bytes_to_read = min(rudp_size_limit, remaining_bytes);
@@ -79,27 +126,61 @@ int kftp_send_file(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiv
             // number of read bytes should only differ from the bytes we told the file to read if an error occurred or
             // if the number of bytes in the file changed since we first calculated the size, in which case we want to
             // abort anyway.
-            fprintf(stderr, "ERROR in kftp_send_file: unable to read expected number of bytes from file\n");
+            fprintf(stderr, "ERROR in kftp_send_file_range: unable to read expected number of bytes from file\n");
             return -1;
         }
 
-        status = rudp_send(rudp_buffer, read_bytes, to, sender, receiver);
+        xxh64_update(&hash_state, rudp_buffer, read_bytes);
+        remaining_bytes -= read_bytes;
+
+        message_size = read_bytes;
+        if (remaining_bytes == 0) {
+            message_size = append_trailer(&hash_state, rudp_buffer, message_size);
+            trailer_sent = message_size > read_bytes;
+        }
+
+        status = rudp_send(rudp_buffer, message_size, to, sender, receiver);
         if (status < 0) {
-            fprintf(stderr, "ERROR in kftp_send_file: error in rudp_send\n");
+            fprintf(stderr, "ERROR in kftp_send_file_range: error in rudp_send\n");
             return status;
         }
-
-        remaining_bytes -= read_bytes;
     }
 
     assert(remaining_bytes == 0);
+
+    // the last data message was too full to also hold the trailer, so it gets a message of its own
+    if (!trailer_sent) {
+        message_size = append_trailer(&hash_state, rudp_buffer, 0);
+        status = rudp_send(rudp_buffer, message_size, to, sender, receiver);
+        if (status < 0) {
+            fprintf(stderr, "ERROR in kftp_send_file_range: error sending trailer\n");
+            return status;
+        }
+    }
+
     fprintf(stderr, "Done                                  \n");
     return 0;
 }
 
 
+// Helper function that collects the bytes of the trailer, which may be split over several RUDP messages
+//
+// Returns 0 on success, and a negative int if more bytes are received than the trailer holds.
+static int collect_trailer(char* trailer_buffer, int* trailer_length, char* data, int data_size) {
+    if (*trailer_length + data_size > KFTP_TRAILER_SIZE) {
+        fprintf(stderr, "ERROR in kftp_recv_file: received unexpected data after the trailer\n");
+        return -1;
+    }
+
+    memcpy(&trailer_buffer[*trailer_length], data, data_size);
+    *trailer_length += data_size;
+    return 0;
+}
+
 int kftp_recv_file(FILE* write_fp, SocketInfo* from, RudpReceiver * receiver) {
     char rudp_buffer[MAX_PAYLOAD_SIZE] = {};
+    char trailer_buffer[KFTP_TRAILER_SIZE] = {};
+    int trailer_length = 0;
 
     int received_bytes = rudp_recv(rudp_buffer, MAX_PAYLOAD_SIZE, from, receiver);
     if (received_bytes < 0) {
@@ -115,8 +196,13 @@ int kftp_recv_file(FILE* write_fp, SocketInfo* from, RudpReceiver * receiver) {
         return -1;
     }
 
-    int received_data_bytes = received_bytes - deserialized;
-    assert(received_data_bytes > 0);
+    // the file is hashed as it is written, and the result compared to the hash in the trailer
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+
+    // the first message may also hold the end of the file and (the start of) the trailer
+    int received_data_bytes = min(received_bytes - deserialized, header.data_size);
+    assert(received_data_bytes >= 0);
     int remaining_bytes = header.data_size - received_data_bytes;
 
     // we write the file as we read it in order to scale to large files without needing increased memory
@@ -125,6 +211,12 @@ int kftp_recv_file(FILE* write_fp, SocketInfo* from, RudpReceiver * receiver) {
         fprintf(stderr, "ERROR in kftp_recv_file: error writing to file\n");
         return -1;
     }
+    xxh64_update(&hash_state, &rudp_buffer[deserialized], received_data_bytes);
+
+    int status = collect_trailer(trailer_buffer, &trailer_length, &rudp_buffer[deserialized + received_data_bytes],
+                                 received_bytes - deserialized - received_data_bytes);
+    if (status < 0)
+        return status;
 
     while(remaining_bytes > 0) {
         fprintf(stderr, "Progress: %d%%                         \r", 100 - (remaining_bytes * 100 / header.data_size));
@@ -133,19 +225,52 @@ int kftp_recv_file(FILE* write_fp, SocketInfo* from, RudpReceiver * receiver) {
         received_bytes = rudp_recv(rudp_buffer, MAX_PAYLOAD_SIZE, from, receiver);
         if (received_bytes <= 0) {
             fprintf(stderr, "ERROR in kftp_recv_file: error in rudp_recv\n");
-            return -1;
+            // e.g. the sender went away, which the caller doesn't need to tell it about
+            return received_bytes < 0 ? received_bytes : -1;
         }
 
-        written_chunk_size = fwrite(rudp_buffer, sizeof(char), received_bytes, write_fp);
-        if (written_chunk_size != received_bytes) {
+        received_data_bytes = min(received_bytes, remaining_bytes);
+        written_chunk_size = fwrite(rudp_buffer, sizeof(char), received_data_bytes, write_fp);
+        if (written_chunk_size != received_data_bytes) {
             fprintf(stderr, "ERROR in kftp_recv_file: Written chunk size (%zu) does not match received_bytes (%d)\n",
-                    written_chunk_size, received_bytes);
+                    written_chunk_size, received_data_bytes);
             return -1;
         }
-        remaining_bytes -= received_bytes;
+        xxh64_update(&hash_state, rudp_buffer, received_data_bytes);
+        remaining_bytes -= received_data_bytes;
+
+        status = collect_trailer(trailer_buffer, &trailer_length, &rudp_buffer[received_data_bytes],
+                                 received_bytes - received_data_bytes);
+        if (status < 0)
+            return status;
     }
 
     assert(remaining_bytes == 0);
+
+    while (trailer_length < KFTP_TRAILER_SIZE) {
+        received_bytes = rudp_recv(rudp_buffer, MAX_PAYLOAD_SIZE, from, receiver);
+        if (received_bytes <= 0) {
+            fprintf(stderr, "ERROR in kftp_recv_file: error receiving trailer\n");
+            return received_bytes < 0 ? received_bytes : -1;
+        }
+
+        status = collect_trailer(trailer_buffer, &trailer_length, rudp_buffer, received_bytes);
+        if (status < 0)
+            return status;
+    }
+
+    KftpTrailer trailer = {};
+    deserialized = deserialize_kftp_trailer(trailer_buffer, KFTP_TRAILER_SIZE, &trailer);
+    if (deserialized != KFTP_TRAILER_SIZE) {
+        fprintf(stderr, "ERROR in kftp_recv_file: trailer deserialization error\n");
+        return -1;
+    }
+
+    if (trailer.hash != xxh64_digest(&hash_state)) {
+        fprintf(stderr, "ERROR in kftp_recv_file: hash of received file does not match the hash of the sent file\n");
+        return KFTP_INTEGRITY_ERROR;
+    }
+
     fprintf(stderr, "Done                                  \n");
     return 0;
 }
@@ -8,12 +8,18 @@
 #define UDP_KFTP_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include "../reliable_udp/types.h"
 
 
 // size of KftpHeader in bytes
 #define KFTP_HEADER_SIZE sizeof(KftpHeader)
+// size of a serialized KftpTrailer in bytes
+#define KFTP_TRAILER_SIZE 8
+
+// Errors
+#define KFTP_INTEGRITY_ERROR (-6)   // the received data does not match the hash computed by the sender
 
 
 // TODO: using an int limits the size of a possible file to ~2GB. Should instead use a long datatype for the size
@@ -22,9 +28,16 @@ typedef struct {
     int data_size; // size of data in bytes
 } KftpHeader;
 
+// The KFTP trailer follows the data and holds the XXH64 hash (seed 0) of the data, which the receiver checks against the
+// hash of the data it received
+typedef struct {
+    uint64_t hash;
+} KftpTrailer;
+
 typedef struct {
     KftpHeader header;
     char* data;
+    KftpTrailer trailer;
 } KftpMessage;
 
 // Reads from the specified `read_fp` and sends the contents to `to` socket over RUDP. The content is read and sent as
@@ -33,10 +46,19 @@ typedef struct {
 // Returns 0 on success, and a negative int on failure.
 int kftp_send_file(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
 
-// Writes the data received from the `from` socket, over RUDP, to the file specified by `write_fp`. The content is
-// received and written as a stream.
+// Sends `length` bytes of `read_fp`, starting at `offset`, to `to` socket over RUDP. The sender seeks directly to
+// `offset`, so only the requested range is read. The range is cut off at the end of the file. The receiver receives the
+// range as if it were a whole file.
 //
 // Returns 0 on success, and a negative int on failure.
+int kftp_send_file_range(FILE* read_fp, long offset, long length, SocketInfo* to, RudpSender* sender,
+                         RudpReceiver* receiver);
+
+// Writes the data received from the `from` socket, over RUDP, to the file specified by `write_fp`. The content is
+// received and written as a stream, and hashed as it is written so that it can be checked against the trailer.
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if the written file does not match the file that was sent, and a negative
+// int on other failures.
 int kftp_recv_file(FILE* write_fp, SocketInfo* from, RudpReceiver * receiver);
 
 #endif //UDP_KFTP_H
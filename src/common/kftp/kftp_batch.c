@@ -0,0 +1,377 @@
+//
+// KFTP batch transfer implementation
+//
+// A batch is sent as:
+//  - the number of files, and the pack size (0 if files aren't packed)
+//  - for each file: the length of its name, the name, and its size (as a uint64)
+//  - for each group of files: the contents of the files, a status (0 if all of them could be read), and the XXH64 hash
+//    of the contents
+//
+// Without packing every file is a group of its own. With packing, consecutive files are grouped while their total
+// size fits in the pack size, so many small files share a single status and hash. The manifest doubles as the index of
+// each pack, since the receiver derives the groups (and the offset of each file within them) from the sizes.
+//
+
+// needed for strdup
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_batch.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <glob.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+int kftp_find_files(char** patterns, int pattern_count, KftpFileList* files) {
+    for (int i = 0; i < pattern_count; i++) {
+        glob_t matches;
+        int status = glob(patterns[i], 0, NULL, &matches);
+        if (status == GLOB_NOMATCH)
+            continue;
+        if (status != 0) {
+            fprintf(stderr, "ERROR in kftp_find_files: error expanding %s\n", patterns[i]);
+            return -1;
+        }
+
+        char** paths = realloc(files->paths, sizeof(char*) * (files->count + matches.gl_pathc));
+        if (paths == NULL) {
+            globfree(&matches);
+            return -1;
+        }
+        files->paths = paths;
+
+        for (size_t j = 0; j < matches.gl_pathc; j++) {
+            struct stat file_stat;
+            // only regular files are sent, directories would need to be walked
+            if (stat(matches.gl_pathv[j], &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+                continue;
+
+            char* path = strdup(matches.gl_pathv[j]);
+            if (path == NULL) {
+                globfree(&matches);
+                return -1;
+            }
+            files->paths[files->count++] = path;
+        }
+        globfree(&matches);
+    }
+
+    return 0;
+}
+
+
+void kftp_free_file_list(KftpFileList* files) {
+    for (int i = 0; i < files->count; i++)
+        free(files->paths[i]);
+    free(files->paths);
+    files->paths = NULL;
+    files->count = 0;
+}
+
+
+// Helper function that returns the name a file is sent under, which is the last component of its path
+static char* base_name(char* path) {
+    char* last_slash = strrchr(path, '/');
+    return last_slash == NULL ? path : last_slash + 1;
+}
+
+// Helper function that checks a received name refers to a file in the current directory
+static bool is_valid_name(char* name) {
+    return name[0] != 0 && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+
+// Helper function that returns the index after the last file of the group starting at `start`. Each group is followed
+// by a single status and hash. Without packing every file is its own group, otherwise consecutive files are grouped as
+// long as their contents fit in `pack_size` bytes. Both sides compute the groups from the manifest.
+static int group_end(uint64_t* sizes, int start, int count, int pack_size) {
+    int end = start + 1;
+    uint64_t group_size = sizes[start];
+    while (end < count && end - start < KFTP_MAX_PACK_FILES && group_size + sizes[end] <= (uint64_t) pack_size) {
+        group_size += sizes[end];
+        end++;
+    }
+    return end;
+}
+
+
+int kftp_send_file_data(char* path, uint64_t size, char* buffer, KftpStream* stream, Xxh64State* hash_state,
+                          int* file_status) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR in kftp_send_file_data: could not open %s\n", path);
+        *file_status = -1;
+    }
+
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        int chunk_size = remaining < KFTP_BATCH_BUFFER_SIZE ? (int) remaining : KFTP_BATCH_BUFFER_SIZE;
+        int n = fp == NULL ? 0 : (int) fread(buffer, sizeof(char), chunk_size, fp);
+
+        // the manifest already promised `size` bytes, so if the file shrank (or couldn't be read) zeros are sent in
+        // its place and the receiver is told to discard the file
+        if (n == 0) {
+            memset(buffer, 0, chunk_size);
+            n = chunk_size;
+            *file_status = -1;
+        }
+
+        xxh64_update(hash_state, buffer, n);
+        int status = kftp_stream_write(stream, buffer, n);
+        if (status < 0) {
+            if (fp != NULL)
+                fclose(fp);
+            return status;
+        }
+        remaining -= n;
+    }
+
+    if (fp != NULL)
+        fclose(fp);
+    return 0;
+}
+
+
+int kftp_send_files(KftpFileList* files, int pack_size, SocketInfo* to, RudpSender* sender,
+                    RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+
+    if (files->count > KFTP_BATCH_MAX_FILES) {
+        fprintf(stderr, "ERROR in kftp_send_files: too many files to send in one batch\n");
+        return -1;
+    }
+    if (pack_size < 0 || pack_size > KFTP_MAX_PACK_SIZE) {
+        fprintf(stderr, "ERROR in kftp_send_files: invalid pack size %d\n", pack_size);
+        return -1;
+    }
+
+    uint64_t* sizes = calloc(files->count > 0 ? files->count : 1, sizeof(uint64_t));
+    char* buffer = malloc(KFTP_BATCH_BUFFER_SIZE);
+    if (sizes == NULL || buffer == NULL) {
+        fprintf(stderr, "ERROR in kftp_send_files: unable to allocate buffers\n");
+        free(sizes);
+        free(buffer);
+        return -1;
+    }
+
+    int status = 0;
+    for (int i = 0; i < files->count; i++) {
+        int name_length = (int) strlen(base_name(files->paths[i]));
+        if (name_length == 0 || name_length > KFTP_MAX_NAME_LENGTH) {
+            fprintf(stderr, "ERROR in kftp_send_files: invalid file name %s\n", files->paths[i]);
+            status = -1;
+            break;
+        }
+
+        // files that can't be read any more are still listed, and failed when their contents are sent
+        struct stat file_stat;
+        sizes[i] = stat(files->paths[i], &file_stat) == 0 ? (uint64_t) file_stat.st_size : 0;
+    }
+
+    if (status == 0)
+        status = kftp_stream_write_int(&stream, files->count);
+    if (status == 0)
+        status = kftp_stream_write_int(&stream, pack_size);
+    for (int i = 0; status == 0 && i < files->count; i++) {
+        char* name = base_name(files->paths[i]);
+        status = kftp_stream_write_int(&stream, (int) strlen(name));
+        if (status == 0)
+            status = kftp_stream_write(&stream, name, (int) strlen(name));
+        if (status == 0)
+            status = kftp_stream_write_uint64(&stream, sizes[i]);
+    }
+
+    for (int start = 0; status == 0 && start < files->count;) {
+        int end = group_end(sizes, start, files->count, pack_size);
+
+        Xxh64State hash_state;
+        xxh64_init(&hash_state, 0);
+        int group_status = 0;
+        for (int i = start; status == 0 && i < end; i++)
+            status = kftp_send_file_data(files->paths[i], sizes[i], buffer, &stream, &hash_state, &group_status);
+
+        if (status == 0)
+            status = kftp_stream_write_int(&stream, group_status);
+        if (status == 0)
+            status = kftp_stream_write_hash(&stream, xxh64_digest(&hash_state));
+        start = end;
+    }
+
+    if (status == 0)
+        status = kftp_stream_flush(&stream);
+
+    free(sizes);
+    free(buffer);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_files: error sending batch\n");
+        return status;
+    }
+    return 0;
+}
+
+
+int kftp_recv_file_data(char* path, uint64_t size, char* buffer, KftpStream* stream, Xxh64State* hash_state) {
+    FILE* fp = NULL;
+    if (path != NULL && (fp = fopen(path, "w")) == NULL)
+        fprintf(stderr, "ERROR in kftp_recv_file_data: could not open %s\n", path);
+    bool written = fp != NULL;
+
+    int status = 0;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        int chunk_size = remaining < KFTP_BATCH_BUFFER_SIZE ? (int) remaining : KFTP_BATCH_BUFFER_SIZE;
+        status = kftp_stream_read(stream, buffer, chunk_size);
+        if (status < 0)
+            break;
+
+        xxh64_update(hash_state, buffer, chunk_size);
+        if (written && fwrite(buffer, sizeof(char), chunk_size, fp) != chunk_size) {
+            fprintf(stderr, "ERROR in kftp_recv_file_data: error writing %s\n", path);
+            written = false;
+        }
+        remaining -= chunk_size;
+    }
+
+    if (fp != NULL) {
+        fclose(fp);
+        // don't leave a partial copy of the file around
+        if (!written || status < 0)
+            remove(path);
+    }
+
+    if (status < 0)
+        return status;
+    return written ? 1 : 0;
+}
+
+
+// Helper function to receive a group of files (see group_end()), and check them against the group's status and hash
+//
+// Returns 0 on success (even if some files were discarded, which are counted in `result`), and a negative int if the
+// stream failed.
+static int recv_group(char** names, uint64_t* sizes, int count, char* buffer, KftpStream* stream,
+                      KftpBatchResult* result) {
+    bool written[KFTP_MAX_PACK_FILES];
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+
+    for (int i = 0; i < count; i++) {
+        bool valid_name = is_valid_name(names[i]);
+        if (!valid_name)
+            fprintf(stderr, "ERROR in recv_group: refusing to write to %s\n", names[i]);
+
+        int status = kftp_recv_file_data(valid_name ? names[i] : NULL, sizes[i], buffer, stream, &hash_state);
+        if (status < 0) {
+            // files written earlier in the group haven't been checked yet
+            for (int j = 0; j < i; j++) {
+                if (written[j])
+                    remove(names[j]);
+            }
+            return status;
+        }
+        written[i] = status == 1;
+    }
+
+    int group_status = -1;
+    uint64_t hash = 0;
+    int status = kftp_stream_read_int(stream, &group_status);
+    if (status == 0)
+        status = kftp_stream_read_hash(stream, &hash);
+
+    bool valid = status == 0 && group_status == 0 && hash == xxh64_digest(&hash_state);
+    if (status == 0 && group_status < 0)
+        fprintf(stderr, "ERROR in recv_group: sender could not read %s\n", count == 1 ? names[0] : "a packed file");
+    else if (status == 0 && !valid)
+        fprintf(stderr, "ERROR in recv_group: hash of %s does not match the sent data\n",
+                count == 1 ? names[0] : "packed files");
+
+    for (int i = 0; i < count; i++) {
+        // every file in a group that fails its check is discarded, since it isn't known which file was corrupted
+        if (written[i] && !valid)
+            remove(names[i]);
+
+        if (written[i] && valid)
+            result->received++;
+        else
+            result->failed++;
+    }
+
+    return status;
+}
+
+
+int kftp_recv_files(KftpBatchResult* result, SocketInfo* from, RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=from, .receiver=receiver};
+    *result = (KftpBatchResult) {};
+
+    int count, pack_size;
+    int status = kftp_stream_read_int(&stream, &count);
+    if (status == 0)
+        status = kftp_stream_read_int(&stream, &pack_size);
+    if (status < 0)
+        return status;
+    if (count < 0 || count > KFTP_BATCH_MAX_FILES) {
+        fprintf(stderr, "ERROR in kftp_recv_files: invalid number of files %d\n", count);
+        return -1;
+    }
+    if (pack_size < 0 || pack_size > KFTP_MAX_PACK_SIZE) {
+        fprintf(stderr, "ERROR in kftp_recv_files: invalid pack size %d\n", pack_size);
+        return -1;
+    }
+
+    char** names = calloc(count > 0 ? count : 1, sizeof(char*));
+    uint64_t* sizes = calloc(count > 0 ? count : 1, sizeof(uint64_t));
+    char* buffer = malloc(KFTP_BATCH_BUFFER_SIZE);
+    if (names == NULL || sizes == NULL || buffer == NULL) {
+        fprintf(stderr, "ERROR in kftp_recv_files: unable to allocate buffers\n");
+        status = -1;
+    }
+
+    for (int i = 0; status == 0 && i < count; i++) {
+        int name_length;
+        status = kftp_stream_read_int(&stream, &name_length);
+        if (status < 0)
+            break;
+        if (name_length <= 0 || name_length > KFTP_MAX_NAME_LENGTH) {
+            fprintf(stderr, "ERROR in kftp_recv_files: invalid name length %d\n", name_length);
+            status = -1;
+            break;
+        }
+
+        names[i] = calloc(name_length + 1, sizeof(char));
+        if (names[i] == NULL) {
+            status = -1;
+            break;
+        }
+        status = kftp_stream_read(&stream, names[i], name_length);
+        if (status == 0)
+            status = kftp_stream_read_uint64(&stream, &sizes[i]);
+    }
+
+    for (int start = 0; status == 0 && start < count;) {
+        int end = group_end(sizes, start, count, pack_size);
+        status = recv_group(&names[start], &sizes[start], end - start, buffer, &stream, result);
+        start = end;
+    }
+
+    for (int i = 0; names != NULL && i < count; i++)
+        free(names[i]);
+    free(names);
+    free(sizes);
+    free(buffer);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_files: error receiving batch\n");
+        return status;
+    }
+    return 0;
+}
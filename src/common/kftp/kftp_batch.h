@@ -0,0 +1,90 @@
+//
+// KFTP batch transfer interface
+//
+// Batch transfers send many files over a single KFTP stream. The sender first sends a manifest with the name and size of
+// every file, followed by the contents of the files back to back. Since the stream packs records into full RUDP
+// messages, small files share messages instead of each paying for their own round trips.
+//
+// Small files can also be packed together, in which case they share a single integrity check instead of each carrying
+// their own status and hash.
+//
+
+#ifndef UDP_KFTP_BATCH_H
+#define UDP_KFTP_BATCH_H
+
+#include <stdint.h>
+
+#include "kftp_stream.h"
+#include "../hash.h"
+#include "../reliable_udp/types.h"
+
+
+// longest file name (without a directory) that can be sent in a batch
+#define KFTP_MAX_NAME_LENGTH 255
+
+// most files that can be sent in a single batch
+#define KFTP_BATCH_MAX_FILES (1 << 20)
+
+// amount of file data read or written at a time
+#define KFTP_BATCH_BUFFER_SIZE (16 * 1024)
+
+// Packing groups consecutive files whose total size fits in the pack size. Files that are larger than the pack size are
+// always sent on their own.
+#define KFTP_NO_PACKING 0
+#define KFTP_PACK_SIZE (64 * 1024)          // pack size used by the client and server
+#define KFTP_MAX_PACK_SIZE (16 * 1024 * 1024)
+#define KFTP_MAX_PACK_FILES 1024            // limits the number of (empty) files in a single pack
+
+
+// Paths of the files to send in a batch
+typedef struct {
+    int count;
+    char** paths;
+} KftpFileList;
+
+// Summary of a received batch
+typedef struct {
+    int received;   // number of files written successfully
+    int failed;     // number of files that couldn't be written or failed their integrity check, and were removed
+} KftpBatchResult;
+
+
+// Expands the glob `patterns` into the regular files they match, which are added to `files`. Patterns that don't match
+// any files are ignored.
+//
+// The paths are dynamically allocated and should be freed using kftp_free_file_list().
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_find_files(char** patterns, int pattern_count, KftpFileList* files);
+
+void kftp_free_file_list(KftpFileList* files);
+
+// Sends the files in `files` as a single batch to `to`. Files are named by the last component of their path. Files are
+// packed together up to `pack_size` bytes, or sent individually if `pack_size` is KFTP_NO_PACKING.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_files(KftpFileList* files, int pack_size, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives a batch of files from `from` and writes them into the current directory. Files that fail to be written or
+// don't match the sender's hash (along with the rest of their pack) are removed and counted in `result`, without
+// failing the rest of the batch.
+//
+// Returns 0 on success, and a negative int if the batch itself could not be received.
+int kftp_recv_files(KftpBatchResult* result, SocketInfo* from, RudpReceiver* receiver);
+
+// Helper that writes `size` bytes of the file at `path` to the stream and adds them to `hash_state`, using `buffer`
+// (KFTP_BATCH_BUFFER_SIZE bytes) to read the file. If the file can't be read in full, zeros are sent in place of the
+// missing data and `file_status` is set to -1.
+//
+// Returns 0 on success (even if the file couldn't be read), and a negative int if the stream failed.
+int kftp_send_file_data(char* path, uint64_t size, char* buffer, KftpStream* stream, Xxh64State* hash_state,
+                        int* file_status);
+
+// Helper that reads `size` bytes of file data from the stream, adds them to `hash_state`, and writes them to the file at
+// `path`. The data is still read (and discarded) if `path` is NULL or the file can't be written, so that the stream
+// stays in sync.
+//
+// Returns 1 if the file was written, 0 if it wasn't, and a negative int if the stream failed.
+int kftp_recv_file_data(char* path, uint64_t size, char* buffer, KftpStream* stream, Xxh64State* hash_state);
+
+#endif //UDP_KFTP_BATCH_H
@@ -0,0 +1,500 @@
+//
+// KFTP chunked transfer implementation
+//
+// The sender reads the file into a queue of chunks that worker threads encode (compress) in parallel, while the send
+// loop writes the encoded chunks to the peer in order. Encoding therefore overlaps with waiting on acks instead of
+// adding to the time of each round trip.
+//
+// For sparse transfers, the workers ask the file system where the file's data is (SEEK_DATA/SEEK_HOLE) and queue
+// holes without reading them. Chunks of data that turn out to be all zeros are also sent as holes. Holes are hashed as
+// their offset and length, so neither side spends time on the zeros of a large sparse file.
+//
+
+// needed for SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include "kftp_chunked.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+#include "../lz4.h"
+#include "../utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SLOT_EMPTY 0        // free to be filled by a worker
+#define SLOT_ENCODING 1     // read from the file and being encoded by a worker
+#define SLOT_READY 2        // encoded and waiting to be sent
+
+
+
+typedef struct {
+    char raw[KFTP_CHUNK_SIZE];
+    char compressed[KFTP_CHUNK_SIZE];
+    int raw_size;           // for holes, the length of the hole
+    int compressed_size;    // 0 if the chunk should be sent uncompressed
+    bool hole;              // the chunk only holds zeros, which don't need to be sent
+    int state;
+} ChunkSlot;
+
+// State shared between the send loop and the workers, protected by `lock`
+typedef struct {
+    FILE* read_fp;
+    KftpChunkOptions* options;
+    ChunkSlot slots[KFTP_CHUNK_QUEUE_SIZE];
+    long next_chunk;        // index of the next chunk to be read from the file
+    long chunk_count;       // total number of chunks, only valid once `eof` is set
+    long position;          // offset in the file of the next chunk
+    long file_size;         // only used to find holes
+    long hole_end;          // end of the hole the file was last found to have at or after `position`
+    long data_end;          // end of the data following that hole, after which the file system is asked again
+    bool eof;
+    bool error;
+    bool cancelled;
+    int skip_remaining;     // number of upcoming chunks to send without attempting compression
+    int skip_length;        // number of chunks that were skipped after the last failed compression
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ChunkPipeline;
+
+
+// Decides whether compression should be attempted on the next chunk. Must be called with the lock held.
+static bool should_compress(ChunkPipeline* pipeline) {
+    if (!pipeline->options->compress)
+        return false;
+
+    if (pipeline->skip_remaining > 0) {
+        pipeline->skip_remaining--;
+        return false;
+    }
+    return true;
+}
+
+// Records the outcome of a compression attempt. Must be called with the lock held.
+static void update_compression_backoff(ChunkPipeline* pipeline, bool shrunk) {
+    if (shrunk) {
+        pipeline->skip_length = 0;
+        return;
+    }
+
+    pipeline->skip_length = pipeline->skip_length == 0 ? 1 : pipeline->skip_length * 2;
+    if (pipeline->skip_length > KFTP_COMPRESSION_MAX_SKIP)
+        pipeline->skip_length = KFTP_COMPRESSION_MAX_SKIP;
+    pipeline->skip_remaining = pipeline->skip_length;
+}
+
+// Helper function that asks the file system where the next hole and data are for sparse transfers. Must be called
+// with the lock held.
+//
+// Returns the size of the hole at the current position (0 if there's data there), or a negative int on failure.
+static long find_hole(ChunkPipeline* pipeline) {
+    if (pipeline->position < pipeline->hole_end)
+        return pipeline->hole_end - pipeline->position;
+    if (pipeline->position < pipeline->data_end)
+        return 0;
+    if (pipeline->position >= pipeline->file_size) {
+        // anything after the size the file had when the transfer started is read until the end of the file
+        pipeline->data_end = LONG_MAX;
+        return 0;
+    }
+
+#ifdef SEEK_DATA
+    int fd = fileno(pipeline->read_fp);
+    off_t data = lseek(fd, pipeline->position, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        // there's no more data, only a hole up to the end of the file
+        data = pipeline->file_size;
+    } else if (data < 0) {
+        // the file system doesn't report holes, so all of the file is treated as data
+        pipeline->data_end = LONG_MAX;
+        return 0;
+    }
+
+    off_t hole = data < pipeline->file_size ? lseek(fd, data, SEEK_HOLE) : pipeline->file_size;
+    if (hole < 0)
+        hole = pipeline->file_size;
+
+    // lseek moved the underlying file offset, so the stream needs to be repositioned (at the start of the data)
+    if (fseek(pipeline->read_fp, data, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR in find_hole: error seeking to data\n");
+        return -1;
+    }
+
+    pipeline->hole_end = data;
+    pipeline->data_end = hole;
+    return pipeline->hole_end - pipeline->position;
+#else
+    pipeline->data_end = LONG_MAX;
+    return 0;
+#endif
+}
+
+// Worker thread that repeatedly reads the next chunk of the file and encodes it
+static void* chunk_worker(void* arg) {
+    ChunkPipeline* pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        // chunks are read while holding the lock so that they are read from the file in order
+        ChunkSlot* slot = &pipeline->slots[pipeline->next_chunk % KFTP_CHUNK_QUEUE_SIZE];
+        while (!pipeline->cancelled && !pipeline->eof && slot->state != SLOT_EMPTY) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            slot = &pipeline->slots[pipeline->next_chunk % KFTP_CHUNK_QUEUE_SIZE];
+        }
+        if (pipeline->cancelled || pipeline->eof)
+            break;
+
+        if (pipeline->options->sparse) {
+            long hole_size = find_hole(pipeline);
+            if (hole_size < 0) {
+                pipeline->error = true;
+                pipeline->eof = true;
+                pthread_cond_broadcast(&pipeline->changed);
+                break;
+            }
+
+            // holes are queued without reading them from the file
+            if (hole_size > 0) {
+                slot->raw_size = hole_size < KFTP_MAX_HOLE_SIZE ? (int) hole_size : KFTP_MAX_HOLE_SIZE;
+                slot->compressed_size = 0;
+                slot->hole = true;
+                slot->state = SLOT_READY;
+                pipeline->position += slot->raw_size;
+                pipeline->next_chunk++;
+                pthread_cond_broadcast(&pipeline->changed);
+                continue;
+            }
+        }
+
+        // a chunk never extends past the data the file system reported, so holes are found at the start of a chunk
+        int chunk_size = KFTP_CHUNK_SIZE;
+        if (pipeline->data_end - pipeline->position < chunk_size)
+            chunk_size = (int) (pipeline->data_end - pipeline->position);
+
+        slot->raw_size = (int) fread(slot->raw, sizeof(char), chunk_size, pipeline->read_fp);
+        pipeline->position += slot->raw_size;
+        if (slot->raw_size < chunk_size) {
+            if (ferror(pipeline->read_fp)) {
+                fprintf(stderr, "ERROR in chunk_worker: error reading file\n");
+                pipeline->error = true;
+                pthread_cond_broadcast(&pipeline->changed);
+                break;
+            }
+            pipeline->eof = true;
+            pipeline->chunk_count = pipeline->next_chunk + (slot->raw_size > 0 ? 1 : 0);
+            if (slot->raw_size == 0) {
+                pthread_cond_broadcast(&pipeline->changed);
+                break;
+            }
+        }
+
+        pipeline->next_chunk++;
+        slot->state = SLOT_ENCODING;
+        bool sparse = pipeline->options->sparse;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        slot->hole = sparse && is_zero(slot->raw, slot->raw_size);
+
+        pthread_mutex_lock(&pipeline->lock);
+        bool compress = !slot->hole && should_compress(pipeline);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        // the compressed chunk must be strictly smaller than the original, otherwise it is sent as is
+        slot->compressed_size = compress ? lz4_compress(slot->raw, slot->raw_size, slot->compressed, slot->raw_size - 1)
+                                         : 0;
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (compress)
+            update_compression_backoff(pipeline, slot->compressed_size > 0);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+
+// Helper function that adds a hole of `size` zero bytes at `offset` to a hash. Holes are hashed as their offset and
+// length (as big-endian 64-bit ints) rather than their zeros, so a hole takes no longer to hash however large it is.
+static void hash_hole(Xxh64State* hash_state, long offset, long size) {
+    char record[16];
+    for (int i = 0; i < 8; i++) {
+        record[i] = (char) ((uint64_t) offset >> (56 - 8 * i));
+        record[8 + i] = (char) ((uint64_t) size >> (56 - 8 * i));
+    }
+    xxh64_update(hash_state, record, sizeof(record));
+}
+
+// Helper function to write out a run of zero bytes starting at `offset` as hole records, adding each one to the hash
+static int send_hole(KftpStream* stream, Xxh64State* hash_state, long offset, long hole_size) {
+    while (hole_size > 0) {
+        int record_size = hole_size < KFTP_MAX_HOLE_SIZE ? (int) hole_size : KFTP_MAX_HOLE_SIZE;
+
+        char type = KFTP_CHUNK_HOLE;
+        int status = kftp_stream_write(stream, &type, 1);
+        if (status < 0)
+            return status;
+        status = kftp_stream_write_int(stream, record_size);
+        if (status < 0)
+            return status;
+        hash_hole(hash_state, offset, record_size);
+
+        offset += record_size;
+        hole_size -= record_size;
+    }
+    return 0;
+}
+
+// Helper function to write a single encoded chunk to the stream
+static int send_chunk(KftpStream* stream, ChunkSlot* slot) {
+    char type = slot->compressed_size > 0 ? KFTP_CHUNK_LZ4 : KFTP_CHUNK_RAW;
+    int status = kftp_stream_write(stream, &type, 1);
+    if (status < 0)
+        return status;
+
+    status = kftp_stream_write_int(stream, slot->raw_size);
+    if (status < 0)
+        return status;
+
+    if (type == KFTP_CHUNK_RAW)
+        return kftp_stream_write(stream, slot->raw, slot->raw_size);
+
+    status = kftp_stream_write_int(stream, slot->compressed_size);
+    if (status < 0)
+        return status;
+    return kftp_stream_write(stream, slot->compressed, slot->compressed_size);
+}
+
+
+int kftp_send_file_chunked(FILE* read_fp, KftpChunkOptions* options, SocketInfo* to, RudpSender* sender,
+                           RudpReceiver* receiver) {
+    ChunkPipeline* pipeline = calloc(1, sizeof(ChunkPipeline));
+    if (pipeline == NULL) {
+        fprintf(stderr, "ERROR in kftp_send_file_chunked: unable to allocate chunk queue\n");
+        return -1;
+    }
+    pipeline->read_fp = read_fp;
+    pipeline->options = options;
+    pipeline->data_end = LONG_MAX;
+
+    if (options->sparse) {
+        struct stat file_stat;
+        if (fstat(fileno(read_fp), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            pipeline->file_size = file_stat.st_size;
+            pipeline->data_end = 0;
+        }
+    }
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+
+    pthread_t workers[KFTP_COMPRESSION_WORKERS];
+    int worker_count = 0;
+    for (; worker_count < KFTP_COMPRESSION_WORKERS; worker_count++) {
+        if (pthread_create(&workers[worker_count], NULL, chunk_worker, pipeline) != 0) {
+            fprintf(stderr, "ERROR in kftp_send_file_chunked: unable to start worker thread\n");
+            break;
+        }
+    }
+
+    KftpStream stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    int status = worker_count > 0 ? 0 : -1;
+    long file_size = 0;
+    long sent_size = 0;
+    long pending_hole = 0;      // consecutive holes are merged before they are sent
+    Xxh64State hash_state;      // hash of the data and holes, checked by the receiver once it has decoded all chunks
+    xxh64_init(&hash_state, 0);
+
+    for (long chunk = 0; status == 0; chunk++) {
+        ChunkSlot* slot = &pipeline->slots[chunk % KFTP_CHUNK_QUEUE_SIZE];
+
+        pthread_mutex_lock(&pipeline->lock);
+        while (slot->state != SLOT_READY && !pipeline->error && !(pipeline->eof && chunk >= pipeline->chunk_count))
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        bool done = slot->state != SLOT_READY;
+        if (done && pipeline->error)
+            status = -1;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (done)
+            break;
+
+        // the slot belongs to the send loop until it is marked as empty again
+        if (slot->hole) {
+            pending_hole += slot->raw_size;
+        } else {
+            status = send_hole(&stream, &hash_state, file_size - pending_hole, pending_hole);
+            pending_hole = 0;
+            if (status == 0)
+                status = send_chunk(&stream, slot);
+            xxh64_update(&hash_state, slot->raw, slot->raw_size);
+            sent_size += slot->compressed_size > 0 ? slot->compressed_size : slot->raw_size;
+        }
+        file_size += slot->raw_size;
+
+        pthread_mutex_lock(&pipeline->lock);
+        slot->state = SLOT_EMPTY;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->cancelled = true;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_cond_destroy(&pipeline->changed);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_chunked: error sending chunks\n");
+        return status;
+    }
+
+    status = send_hole(&stream, &hash_state, file_size - pending_hole, pending_hole);
+    if (status < 0)
+        return status;
+
+    char type = KFTP_CHUNK_END;
+    status = kftp_stream_write(&stream, &type, 1);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_uint64(&stream, (uint64_t) file_size);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_hash(&stream, xxh64_digest(&hash_state));
+    if (status < 0)
+        return status;
+
+    fprintf(stderr, "Done, sent %ld bytes of chunk data for %ld bytes of file data\n", sent_size, file_size);
+    return kftp_stream_flush(&stream);
+}
+
+
+int kftp_recv_file_chunked(FILE* write_fp, SocketInfo* from, RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=from, .receiver=receiver};
+    char raw[KFTP_CHUNK_SIZE];
+    char compressed[KFTP_CHUNK_SIZE];
+    long written = 0;
+    long pending_hole = 0;      // holes are skipped over once the data following them is written
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+
+    while (1) {
+        char type;
+        int status = kftp_stream_read(&stream, &type, 1);
+        if (status < 0)
+            return status;
+
+        if (type == KFTP_CHUNK_END) {
+            uint64_t file_size;
+            status = kftp_stream_read_uint64(&stream, &file_size);
+            if (status < 0)
+                return status;
+            uint64_t hash;
+            status = kftp_stream_read_hash(&stream, &hash);
+            if (status < 0)
+                return status;
+
+            if (file_size != (uint64_t) written) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: received %ld bytes but expected %llu\n", written,
+                        (unsigned long long) file_size);
+                return KFTP_CHUNK_CORRUPT_ERROR;
+            }
+            if (hash != xxh64_digest(&hash_state)) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: hash of received file does not match the sent file\n");
+                return KFTP_INTEGRITY_ERROR;
+            }
+
+            // a hole at the end of the file is created by extending the file to its full size
+            if (pending_hole > 0) {
+                if (fflush(write_fp) != 0 || ftruncate(fileno(write_fp), written) < 0) {
+                    fprintf(stderr, "ERROR in kftp_recv_file_chunked: error extending file over a hole\n");
+                    return -1;
+                }
+            }
+
+            fprintf(stderr, "Done                                  \n");
+            return 0;
+        }
+
+        if (type == KFTP_CHUNK_HOLE) {
+            int hole_size;
+            status = kftp_stream_read_int(&stream, &hole_size);
+            if (status < 0)
+                return status;
+            if (hole_size < 0) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: invalid hole size %d\n", hole_size);
+                return KFTP_CHUNK_CORRUPT_ERROR;
+            }
+
+            pending_hole += hole_size;
+            hash_hole(&hash_state, written, hole_size);
+            written += hole_size;
+            continue;
+        }
+
+        int raw_size;
+        status = kftp_stream_read_int(&stream, &raw_size);
+        if (status < 0)
+            return status;
+        if (raw_size < 0 || raw_size > KFTP_CHUNK_SIZE) {
+            fprintf(stderr, "ERROR in kftp_recv_file_chunked: invalid chunk size %d\n", raw_size);
+            return KFTP_CHUNK_CORRUPT_ERROR;
+        }
+
+        if (type == KFTP_CHUNK_RAW) {
+            status = kftp_stream_read(&stream, raw, raw_size);
+            if (status < 0)
+                return status;
+        }
+        else if (type == KFTP_CHUNK_LZ4) {
+            int compressed_size;
+            status = kftp_stream_read_int(&stream, &compressed_size);
+            if (status < 0)
+                return status;
+            if (compressed_size < 0 || compressed_size > KFTP_CHUNK_SIZE) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: invalid compressed size %d\n", compressed_size);
+                return KFTP_CHUNK_CORRUPT_ERROR;
+            }
+
+            status = kftp_stream_read(&stream, compressed, compressed_size);
+            if (status < 0)
+                return status;
+
+            if (lz4_decompress(compressed, compressed_size, raw, raw_size) != raw_size) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: error decompressing chunk\n");
+                return KFTP_CHUNK_CORRUPT_ERROR;
+            }
+        }
+        else {
+            fprintf(stderr, "ERROR in kftp_recv_file_chunked: unknown chunk type %d\n", type);
+            return KFTP_CHUNK_CORRUPT_ERROR;
+        }
+
+        // skipping over the hole leaves it unallocated, since nothing was written there yet
+        if (pending_hole > 0) {
+            if (fseek(write_fp, pending_hole, SEEK_CUR) < 0) {
+                fprintf(stderr, "ERROR in kftp_recv_file_chunked: error seeking past hole\n");
+                return -1;
+            }
+            pending_hole = 0;
+        }
+
+        if (fwrite(raw, sizeof(char), raw_size, write_fp) != raw_size) {
+            fprintf(stderr, "ERROR in kftp_recv_file_chunked: error writing to file\n");
+            return -1;
+        }
+        xxh64_update(&hash_state, raw, raw_size);
+        written += raw_size;
+    }
+}
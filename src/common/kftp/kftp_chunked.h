@@ -0,0 +1,61 @@
+//
+// KFTP chunked transfer interface
+//
+// Chunked transfers send a file as a sequence of self-describing chunk records rather than a single run of raw bytes.
+// This lets each chunk be encoded individually, e.g. compressed when that actually makes it smaller, or replaced by a
+// hole descriptor when it only holds zeros.
+//
+
+#ifndef UDP_KFTP_CHUNKED_H
+#define UDP_KFTP_CHUNKED_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "../reliable_udp/types.h"
+
+
+// amount of file data held by a single chunk
+#define KFTP_CHUNK_SIZE (16 * 1024)
+
+// number of threads compressing chunks ahead of the send loop, and the number of chunks they may work ahead by
+#define KFTP_COMPRESSION_WORKERS 2
+#define KFTP_CHUNK_QUEUE_SIZE 8
+
+// Once a chunk fails to shrink, compression is not attempted for the next few chunks. The number of chunks skipped
+// doubles (up to this limit) each time compression fails again, so incompressible files cost almost no CPU.
+#define KFTP_COMPRESSION_MAX_SKIP 64
+
+// largest run of zero bytes described by a single hole record
+#define KFTP_MAX_HOLE_SIZE (1 << 30)
+
+// Chunk record types
+#define KFTP_CHUNK_RAW 1    // followed by a length and that many bytes of file data
+#define KFTP_CHUNK_LZ4 2    // followed by the original length, the compressed length, and the LZ4 compressed data
+#define KFTP_CHUNK_END 3    // followed by the size of the file (64 bits) and the XXH64 hash of its data and holes
+#define KFTP_CHUNK_HOLE 4   // followed by the length of a run of zero bytes, which is not sent
+
+// Errors
+#define KFTP_CHUNK_CORRUPT_ERROR (-5)
+
+
+// Options for the sender of a chunked transfer
+typedef struct {
+    bool compress;      // compress chunks with LZ4 when that makes them smaller
+    bool sparse;        // skip over holes in the file, and send chunks of zeros as holes
+} KftpChunkOptions;
+
+
+// Reads from `read_fp` and sends the contents to `to` as a series of chunks encoded according to `options`.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_file_chunked(FILE* read_fp, KftpChunkOptions* options, SocketInfo* to, RudpSender* sender,
+                           RudpReceiver* receiver);
+
+// Receives a series of chunks from `from`, decodes them, and writes the file contents to `write_fp`. Holes are
+// recreated by seeking past them, so `write_fp` must be a newly created (or truncated) file.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_recv_file_chunked(FILE* write_fp, SocketInfo* from, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_CHUNKED_H
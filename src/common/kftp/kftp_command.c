@@ -0,0 +1,401 @@
+//
+// KFTP control message implementation
+//
+// A control message is serialized as a 12 byte header followed by its arguments:
+//  - opcode (1 byte)
+//  - number of arguments (1 byte)
+//  - flags (2 bytes)
+//  - request ID (4 bytes)
+//  - status (4 bytes)
+//  - each argument as its length (2 bytes) and then its bytes
+//
+// All numbers are big-endian.
+//
+
+#include "kftp_command.h"
+
+#include "../reliable_udp/serde.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// flags that select how a file is transferred by get and put
+#define TRANSFER_FLAGS (KFTP_FLAG_DELTA | KFTP_FLAG_COMPRESS | KFTP_FLAG_SPARSE | KFTP_FLAG_STRIPED \
+                        | KFTP_FLAG_RECURSIVE | KFTP_FLAG_CONDITIONAL | KFTP_FLAG_DEDUP | KFTP_FLAG_MERKLE)
+
+// size of a serialized 64-bit number argument
+#define UINT64_ARG_SIZE 8
+
+
+// names of the commands, indexed by opcode
+static char* command_names[] = {
+        [KFTP_OP_GET]="get", [KFTP_OP_PUT]="put", [KFTP_OP_MGET]="mget", [KFTP_OP_MPUT]="mput",
+        [KFTP_OP_DELETE]="delete", [KFTP_OP_LS]="ls", [KFTP_OP_EXIT]="exit", [KFTP_OP_REPLY]="reply",
+        [KFTP_OP_PIPELINE]="pipeline",
+};
+#define COMMAND_COUNT ((int) (sizeof(command_names) / sizeof(command_names[0])))
+
+// command line spelling of the flags that are typed as options
+static struct {
+    int flag;
+    char* option;
+} flag_options[] = {
+        {KFTP_FLAG_DELTA, "-d"}, {KFTP_FLAG_COMPRESS, "-z"}, {KFTP_FLAG_SPARSE, "-s"}, {KFTP_FLAG_STRIPED, "-p"},
+        {KFTP_FLAG_RECURSIVE, "-r"}, {KFTP_FLAG_CONDITIONAL, "-c"}, {KFTP_FLAG_DEDUP, "-u"}, {KFTP_FLAG_MERKLE, "-m"},
+        {KFTP_FLAG_PACK, "-k"},
+};
+#define FLAG_OPTION_COUNT ((int) (sizeof(flag_options) / sizeof(flag_options[0])))
+
+
+void kftp_command_init(KftpCommand* command, int opcode, uint32_t request_id, int flags) {
+    command->opcode = opcode;
+    command->request_id = request_id;
+    command->flags = flags;
+    command->status = 0;
+    command->arg_count = 0;
+    command->size = KFTP_COMMAND_HEADER_SIZE;
+}
+
+// Returns where the next argument is stored
+static char* next_arg_storage(KftpCommand* command) {
+    if (command->arg_count == 0)
+        return command->storage;
+    int last = command->arg_count - 1;
+    return command->args[last] + command->arg_lengths[last] + 1;
+}
+
+int kftp_command_add_arg(KftpCommand* command, char* data, int length) {
+    if (command->arg_count == KFTP_COMMAND_MAX_ARGS || length < 0
+        || command->size + 2 + length > KFTP_COMMAND_MAX_SIZE) {
+        fprintf(stderr, "ERROR in kftp_command_add_arg: arguments too large to send\n");
+        return -1;
+    }
+
+    char* arg = next_arg_storage(command);
+    memcpy(arg, data, length);
+    arg[length] = 0;
+    command->args[command->arg_count] = arg;
+    command->arg_lengths[command->arg_count] = length;
+    command->arg_count++;
+    command->size += 2 + length;
+    return 0;
+}
+
+int kftp_command_add_string(KftpCommand* command, char* string) {
+    return kftp_command_add_arg(command, string, (int) strlen(string));
+}
+
+int kftp_command_add_uint64(KftpCommand* command, uint64_t value) {
+    char bytes[UINT64_ARG_SIZE];
+    for (int i = 0; i < UINT64_ARG_SIZE; i++)
+        bytes[i] = (char) (value >> (8 * (UINT64_ARG_SIZE - 1 - i)));
+    return kftp_command_add_arg(command, bytes, UINT64_ARG_SIZE);
+}
+
+int kftp_command_arg_uint64(KftpCommand* command, int index, uint64_t* value) {
+    if (index < 0 || index >= command->arg_count || command->arg_lengths[index] != UINT64_ARG_SIZE)
+        return -1;
+
+    *value = 0;
+    for (int i = 0; i < UINT64_ARG_SIZE; i++)
+        *value = (*value << 8) | (unsigned char) command->args[index][i];
+    return 0;
+}
+
+
+int serialize_kftp_command(KftpCommand* command, char* buffer, int buffer_len) {
+    if (buffer_len < command->size) {
+        fprintf(stderr, "ERROR in serialize_kftp_command: buffer too small to hold command\n");
+        return -1;
+    }
+
+    int i = 0;
+    buffer[i++] = (char) command->opcode;
+    buffer[i++] = (char) command->arg_count;
+    buffer[i++] = (char) (command->flags >> 8);
+    buffer[i++] = (char) command->flags;
+
+    int serialized = serialize_int((int) command->request_id, &buffer[i], buffer_len - i);
+    if (serialized < 0) {
+        fprintf(stderr, "ERROR in serialize_kftp_command: error serializing request_id field\n");
+        return serialized;
+    }
+    i += serialized;
+
+    serialized = serialize_int(command->status, &buffer[i], buffer_len - i);
+    if (serialized < 0) {
+        fprintf(stderr, "ERROR in serialize_kftp_command: error serializing status field\n");
+        return serialized;
+    }
+    i += serialized;
+
+    for (int arg = 0; arg < command->arg_count; arg++) {
+        int length = command->arg_lengths[arg];
+        buffer[i++] = (char) (length >> 8);
+        buffer[i++] = (char) length;
+        memcpy(&buffer[i], command->args[arg], length);
+        i += length;
+    }
+
+    return i;
+}
+
+int deserialize_kftp_command(char* buffer, int buffer_len, KftpCommand* command) {
+    kftp_command_init(command, 0, 0, 0);
+    if (buffer_len < KFTP_COMMAND_HEADER_SIZE) {
+        fprintf(stderr, "ERROR in deserialize_kftp_command: buffer too small to hold command\n");
+        return -1;
+    }
+
+    int request_id;
+    deserialize_int(&buffer[4], buffer_len - 4, &request_id);
+    command->request_id = (uint32_t) request_id;
+    deserialize_int(&buffer[8], buffer_len - 8, &command->status);
+    command->opcode = (unsigned char) buffer[0];
+    command->flags = ((unsigned char) buffer[2] << 8) | (unsigned char) buffer[3];
+
+    int arg_count = (unsigned char) buffer[1];
+    int i = KFTP_COMMAND_HEADER_SIZE;
+    for (int arg = 0; arg < arg_count; arg++) {
+        if (buffer_len - i < 2) {
+            fprintf(stderr, "ERROR in deserialize_kftp_command: truncated argument length\n");
+            return -1;
+        }
+        int length = ((unsigned char) buffer[i] << 8) | (unsigned char) buffer[i + 1];
+        i += 2;
+        if (buffer_len - i < length) {
+            fprintf(stderr, "ERROR in deserialize_kftp_command: truncated argument\n");
+            return -1;
+        }
+        if (kftp_command_add_arg(command, &buffer[i], length) < 0)
+            return -1;
+        i += length;
+    }
+
+    return i;
+}
+
+
+// Checks that the last `count` arguments are numbers that fit in a long, and the others are non-empty strings
+static bool valid_args(KftpCommand* command, int count) {
+    for (int i = 0; i < command->arg_count; i++) {
+        if (i >= command->arg_count - count) {
+            uint64_t value;
+            if (kftp_command_arg_uint64(command, i, &value) < 0 || value > LONG_MAX)
+                return false;
+        } else if (command->arg_lengths[i] == 0 || strlen(command->args[i]) != command->arg_lengths[i]) {
+            // strings are used as file names and patterns, so they can't hold 0 bytes
+            return false;
+        }
+    }
+    return true;
+}
+
+int kftp_command_validate(KftpCommand* command) {
+    int flags = command->flags;
+    int allowed_flags;
+    int min_args;
+    int max_args;
+    int numbers = 0;
+
+    switch (command->opcode) {
+        case KFTP_OP_GET:
+            allowed_flags = TRANSFER_FLAGS | KFTP_FLAG_RANGED;
+            min_args = max_args = 1;
+            if (flags & KFTP_FLAG_RANGED)
+                numbers = 2;
+            break;
+        case KFTP_OP_PUT:
+            allowed_flags = TRANSFER_FLAGS;
+            min_args = max_args = 1;
+            break;
+        case KFTP_OP_MGET:
+        case KFTP_OP_MPUT:
+            allowed_flags = KFTP_FLAG_PACK;
+            min_args = 1;
+            max_args = KFTP_COMMAND_MAX_ARGS;
+            break;
+        case KFTP_OP_DELETE:
+            allowed_flags = 0;
+            min_args = max_args = 1;
+            break;
+        case KFTP_OP_LS:
+            allowed_flags = KFTP_FLAG_PAGED;
+            min_args = 0;
+            max_args = 1;
+            if (flags & KFTP_FLAG_PAGED)
+                numbers = 2;
+            break;
+        case KFTP_OP_EXIT:
+            allowed_flags = 0;
+            min_args = max_args = 0;
+            break;
+        case KFTP_OP_PIPELINE:
+            // the number of commands in the pipeline
+            allowed_flags = 0;
+            min_args = max_args = 0;
+            numbers = 1;
+            break;
+        default:
+            return -1;
+    }
+
+    if (flags & ~allowed_flags) return -1;
+    if (command->arg_count < min_args + numbers || command->arg_count > max_args + numbers) return -1;
+    if (!valid_args(command, numbers)) return -1;
+
+    bool delta = flags & KFTP_FLAG_DELTA;
+    bool compress = flags & KFTP_FLAG_COMPRESS;
+    bool sparse = flags & KFTP_FLAG_SPARSE;
+    bool striped = flags & KFTP_FLAG_STRIPED;
+    bool recursive = flags & KFTP_FLAG_RECURSIVE;
+    bool conditional = flags & KFTP_FLAG_CONDITIONAL;
+    bool dedup = flags & KFTP_FLAG_DEDUP;
+    bool merkle = flags & KFTP_FLAG_MERKLE;
+
+    // delta transfers are sent uncompressed and without holes
+    if (delta && (compress || sparse)) return -1;
+    // striped transfers send the file's raw bytes
+    if (striped && (delta || compress || sparse)) return -1;
+    // trees are sent as a single stream of plain files
+    if (recursive && (delta || compress || sparse || striped)) return -1;
+    // trees don't have a single fingerprint
+    if (recursive && conditional) return -1;
+    // deduplicated files are uploaded as chunks and downloaded as plain files
+    if (dedup && (delta || compress || sparse || striped || recursive || conditional)) return -1;
+    // Merkle-verified transfers send the file's raw bytes, block by block
+    if (merkle && (delta || compress || sparse || striped || recursive || dedup)) return -1;
+    // ranges are sent as plain transfers
+    if ((flags & KFTP_FLAG_RANGED) && (flags & TRANSFER_FLAGS)) return -1;
+
+    return 0;
+}
+
+void kftp_command_transfer_flags(KftpCommand* command, KftpTransferFlags* flags) {
+    int bits = command->flags;
+    *flags = (KftpTransferFlags) {
+            .delta=bits & KFTP_FLAG_DELTA, .compress=bits & KFTP_FLAG_COMPRESS, .sparse=bits & KFTP_FLAG_SPARSE,
+            .striped=bits & KFTP_FLAG_STRIPED, .recursive=bits & KFTP_FLAG_RECURSIVE,
+            .conditional=bits & KFTP_FLAG_CONDITIONAL, .dedup=bits & KFTP_FLAG_DEDUP, .merkle=bits & KFTP_FLAG_MERKLE,
+            .ranged=bits & KFTP_FLAG_RANGED,
+    };
+
+    uint64_t offset, length;
+    if (flags->ranged && kftp_command_arg_uint64(command, 1, &offset) == 0
+        && kftp_command_arg_uint64(command, 2, &length) == 0) {
+        flags->offset = (long) offset;
+        flags->length = (long) length;
+    }
+}
+
+
+bool kftp_command_is_transfer(KftpCommand* command) {
+    switch (command->opcode) {
+        case KFTP_OP_GET:
+        case KFTP_OP_PUT:
+        case KFTP_OP_MGET:
+        case KFTP_OP_MPUT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+int kftp_command_opcode(char* name) {
+    for (int opcode = 0; opcode < COMMAND_COUNT; opcode++) {
+        // replies are only sent by the server
+        if (command_names[opcode] != NULL && opcode != KFTP_OP_REPLY && strcmp(name, command_names[opcode]) == 0)
+            return opcode;
+    }
+    return -1;
+}
+
+int kftp_command_flag(char* option) {
+    for (int i = 0; i < FLAG_OPTION_COUNT; i++) {
+        if (strcmp(option, flag_options[i].option) == 0)
+            return flag_options[i].flag;
+    }
+    return 0;
+}
+
+void kftp_command_format(KftpCommand* command, char* buffer, int buffer_len) {
+    int opcode = command->opcode;
+    int n;
+    if (opcode > 0 && opcode < COMMAND_COUNT && command_names[opcode] != NULL)
+        n = snprintf(buffer, buffer_len, "%s", command_names[opcode]);
+    else
+        n = snprintf(buffer, buffer_len, "unknown command %d", opcode);
+
+    for (int i = 0; i < FLAG_OPTION_COUNT && n < buffer_len; i++) {
+        if (command->flags & flag_options[i].flag)
+            n += snprintf(&buffer[n], buffer_len - n, " %s", flag_options[i].option);
+    }
+
+    // ranged gets and paged listings end with two numbers, and pipelines hold the number of their commands
+    int numbers = command->flags & (KFTP_FLAG_RANGED | KFTP_FLAG_PAGED) ? 2 : opcode == KFTP_OP_PIPELINE ? 1 : 0;
+    for (int i = 0; i < command->arg_count && n < buffer_len; i++) {
+        uint64_t value;
+        if (i >= command->arg_count - numbers && kftp_command_arg_uint64(command, i, &value) == 0)
+            n += snprintf(&buffer[n], buffer_len - n, " %llu", (unsigned long long) value);
+        else
+            n += snprintf(&buffer[n], buffer_len - n, " %s", command->args[i]);
+    }
+}
+
+
+int kftp_send_command(KftpCommand* command, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int n = serialize_kftp_command(command, buffer, KFTP_COMMAND_MAX_SIZE);
+    if (n < 0)
+        return n;
+
+    n = rudp_send(buffer, n, to, sender, receiver);
+    if (n < 0)
+        fprintf(stderr, "ERROR in kftp_send_command: error sending command\n");
+    return n;
+}
+
+int kftp_recv_command(KftpCommand* command, SocketInfo* from, RudpReceiver* receiver) {
+    char buffer[MAX_PAYLOAD_SIZE];
+    int n = rudp_recv(buffer, MAX_PAYLOAD_SIZE, from, receiver);
+    if (n < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_command: error receiving command\n");
+        return n;
+    }
+
+    n = deserialize_kftp_command(buffer, n, command);
+    return n < 0 ? n : 0;
+}
+
+void kftp_command_init_reply(KftpCommand* reply, KftpCommand* request, int status, char* message) {
+    kftp_command_init(reply, KFTP_OP_REPLY, request->request_id, 0);
+    reply->status = status;
+
+    // messages are only meant to be read by the user, so a long one is cut off rather than failing the reply
+    int length = (int) strlen(message);
+    int max_length = KFTP_COMMAND_MAX_SIZE - reply->size - 2;
+    if (length > 0)
+        kftp_command_add_arg(reply, message, length < max_length ? length : max_length);
+}
+
+int kftp_send_reply(KftpCommand* request, int status, char* message, SocketInfo* to, RudpSender* sender,
+                    RudpReceiver* receiver) {
+    KftpCommand reply;
+    kftp_command_init_reply(&reply, request, status, message);
+    return kftp_send_command(&reply, to, sender, receiver);
+}
+
+int kftp_recv_reply(KftpCommand* request, KftpCommand* reply, SocketInfo* from, RudpReceiver* receiver) {
+    int status = kftp_recv_command(reply, from, receiver);
+    if (status < 0)
+        return status;
+
+    if (reply->opcode != KFTP_OP_REPLY || reply->request_id != request->request_id) {
+        fprintf(stderr, "ERROR in kftp_recv_reply: expected the reply to request %u, got opcode %d for request %u\n",
+                request->request_id, reply->opcode, reply->request_id);
+        return -1;
+    }
+    return 0;
+}
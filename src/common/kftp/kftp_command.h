@@ -0,0 +1,163 @@
+//
+// KFTP control message interface
+//
+// Commands (and the server's replies to them) are sent as compact binary control messages rather than free-text strings.
+// Each message carries an opcode, the ID of the request it belongs to, a set of flags, a status (only used by replies),
+// and a list of length-prefixed arguments. A reply carries the ID of the command it answers, so it can be matched to
+// its request even when several commands are in flight.
+//
+// The client and server share the serializer and parser, as well as the rules for which flags and arguments each
+// command takes.
+//
+
+#ifndef UDP_KFTP_COMMAND_H
+#define UDP_KFTP_COMMAND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../reliable_udp/reliable_udp.h"
+
+
+// Opcodes
+#define KFTP_OP_GET 1
+#define KFTP_OP_PUT 2
+#define KFTP_OP_MGET 3
+#define KFTP_OP_MPUT 4
+#define KFTP_OP_DELETE 5
+#define KFTP_OP_LS 6
+#define KFTP_OP_EXIT 7
+#define KFTP_OP_REPLY 8     // the server's reply to a command, with the command's request ID
+#define KFTP_OP_PIPELINE 9  // a batch of commands sent without waiting for their replies, see kftp_pipeline.h
+
+// Flags that can be set on get and put commands
+#define KFTP_FLAG_DELTA (1 << 0)        // only transfer the differences to the receiver's existing copy
+#define KFTP_FLAG_COMPRESS (1 << 1)     // compress the transferred data
+#define KFTP_FLAG_SPARSE (1 << 2)       // don't send the holes in sparse files
+#define KFTP_FLAG_STRIPED (1 << 3)      // send parts of the file in parallel over several flows
+#define KFTP_FLAG_RECURSIVE (1 << 4)    // transfer a whole directory tree
+#define KFTP_FLAG_CONDITIONAL (1 << 5)  // skip the transfer if the receiver's copy is already up to date
+#define KFTP_FLAG_DEDUP (1 << 6)        // upload into (or download from) the server's deduplicated store
+#define KFTP_FLAG_MERKLE (1 << 7)       // verify blocks as they arrive and resend only the bad ones
+// Flags that change the arguments of get and ls, whose last two arguments are then 64-bit numbers
+#define KFTP_FLAG_RANGED (1 << 8)       // get a byte range of the file (its offset and length)
+#define KFTP_FLAG_PAGED (1 << 9)        // list a page of the matching files (the number to skip, and the most to list)
+// Flags that can be set on mget and mput commands
+#define KFTP_FLAG_PACK (1 << 10)        // pack small files together so they share an integrity check
+
+// size of a serialized control message without its arguments, in bytes
+#define KFTP_COMMAND_HEADER_SIZE 12
+// a control message is sent in a single RUDP message
+#define KFTP_COMMAND_MAX_SIZE MAX_DATA_SIZE
+// most arguments a control message can hold
+#define KFTP_COMMAND_MAX_ARGS 32
+
+
+typedef struct {
+    int opcode;
+    uint32_t request_id;
+    int flags;
+    int status;                             // result of the command, only set in replies
+    int arg_count;
+    char* args[KFTP_COMMAND_MAX_ARGS];      // each argument is followed by a 0 byte, so strings can be used directly
+    int arg_lengths[KFTP_COMMAND_MAX_ARGS];
+    int size;                               // serialized size of the message, in bytes
+    char storage[KFTP_COMMAND_MAX_SIZE + KFTP_COMMAND_MAX_ARGS];    // holds the arguments
+} KftpCommand;
+
+// Transfer options requested through the flags of a get or put command
+typedef struct {
+    bool delta;
+    bool compress;
+    bool sparse;
+    bool striped;
+    bool recursive;
+    bool conditional;
+    bool dedup;
+    bool merkle;
+
+    // byte range requested by a ranged get
+    bool ranged;
+    long offset;
+    long length;
+} KftpTransferFlags;
+
+
+// Sets up an empty control message
+void kftp_command_init(KftpCommand* command, int opcode, uint32_t request_id, int flags);
+
+// Appends an argument holding `length` bytes of `data` to the message
+//
+// Returns 0 on success, and a negative int if the message can't hold another argument of that size.
+int kftp_command_add_arg(KftpCommand* command, char* data, int length);
+
+// Helpers to append string and 64-bit number arguments (numbers are sent as 8 big-endian bytes)
+int kftp_command_add_string(KftpCommand* command, char* string);
+int kftp_command_add_uint64(KftpCommand* command, uint64_t value);
+
+// Reads the 64-bit number held in argument `index`
+//
+// Returns 0 on success, and a negative int if the argument doesn't hold a number.
+int kftp_command_arg_uint64(KftpCommand* command, int index, uint64_t* value);
+
+// Serializes (converts into bytes) a control message
+//
+// Returns the number of bytes serialized on success, returns a negative int on failure
+int serialize_kftp_command(KftpCommand* command, char* buffer, int buffer_len);
+
+// Deserializes (converts from bytes) a control message. The request ID is filled in as soon as it's read, so even a
+// malformed message can be replied to.
+//
+// Returns the number of bytes deserialized on success, returns a negative int on failure
+int deserialize_kftp_command(char* buffer, int buffer_len, KftpCommand* command);
+
+// Checks that a command only has the flags and arguments its opcode takes, and that its flags can be combined
+//
+// Returns 0 if the command is valid, and a negative int otherwise.
+int kftp_command_validate(KftpCommand* command);
+
+// Decodes the transfer options of a (valid) get or put command
+void kftp_command_transfer_flags(KftpCommand* command, KftpTransferFlags* flags);
+
+// Returns true if `command` transfers files (get, put, mget, or mput), and so can be run on an RUDP stream of its own
+// alongside the commands on the control stream
+bool kftp_command_is_transfer(KftpCommand* command);
+
+// Returns the opcode of the command named `name` (e.g. "get"), or a negative int if there's no such command
+int kftp_command_opcode(char* name);
+
+// Returns the flag spelled `option` on the command line (e.g. "-d"), or 0 if there's no such flag
+int kftp_command_flag(char* option);
+
+// Writes a readable form of a command (as it would be typed at the client's prompt) into `buffer`, cutting it off if it
+// doesn't fit
+void kftp_command_format(KftpCommand* command, char* buffer, int buffer_len);
+
+// Sets up the reply to `request`, with its result `status` and a `message` for the user (which may be empty). A long
+// message is cut off so the reply fits in a single RUDP message.
+void kftp_command_init_reply(KftpCommand* reply, KftpCommand* request, int status, char* message);
+
+// Sends a control message to `to` in a single RUDP message
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_command(KftpCommand* command, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives a control message from `from`
+//
+// Returns 0 on success, and a negative int if the message could not be received or parsed (in which case the request
+// ID may still be set).
+int kftp_recv_command(KftpCommand* command, SocketInfo* from, RudpReceiver* receiver);
+
+// Sends the reply to `request`, with its result `status` and a `message` for the user (which may be empty)
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_reply(KftpCommand* request, int status, char* message, SocketInfo* to, RudpSender* sender,
+                    RudpReceiver* receiver);
+
+// Receives the reply to `request` into `reply`
+//
+// Returns 0 on success (the result of the command is held in the reply's status), and a negative int if no reply to
+// `request` could be received.
+int kftp_recv_reply(KftpCommand* request, KftpCommand* reply, SocketInfo* from, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_COMMAND_H
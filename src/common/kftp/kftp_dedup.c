@@ -0,0 +1,541 @@
+//
+// KFTP deduplicated transfer implementation
+//
+// A deduplicated upload is sent as:
+//  - sender: the number of chunks (-1 if the file couldn't be read), the size of the file (as a uint64), then the length
+//    and both hashes of each chunk
+//  - receiver: the number of chunks it is missing (-1 if it refuses the file), then the index of each missing chunk
+//  - sender: the contents of each missing chunk, in the order they were asked for
+//  - receiver: a status, which is 0 if the file was saved
+//
+// The store is laid out as:
+//  - <store>/chunks/<xx>/<id>: the contents of each chunk, named by the hex digits of its id (and spread over
+//    directories by its first two digits)
+//  - <store>/files/<name>: the recipe of each file, a text file holding the size of the file on the first line, then the
+//    id and length of each of its chunks (one per line)
+//
+
+// needed for mkdir
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_dedup.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// FastCDC masks (normalization level 2). A chunk is cut where the gear hash is zero in all of the mask's bits, and the
+// stricter mask used before the average size (and looser one after it) narrows the spread of chunk sizes.
+#define CDC_MASK_SMALL 0x0003590703530000ULL
+#define CDC_MASK_LARGE 0x0000d90003530000ULL
+
+// longest path of a chunk or recipe in the store
+#define DEDUP_PATH_LENGTH 4096
+
+// number of hex digits in the name of a chunk
+#define CHUNK_NAME_LENGTH 32
+
+
+typedef struct {
+    KftpChunkId id;
+    int length;
+    uint64_t offset;    // only used by the sender
+} DedupChunk;
+
+typedef struct {
+    int count;
+    int capacity;
+    DedupChunk* chunks;
+} DedupChunkList;
+
+
+static uint64_t gear[256];
+static bool gear_ready = false;
+
+// The gear table maps each byte to a random value. It's generated from a fixed seed (using splitmix64) so that every
+// sender cuts chunks at the same points.
+static void init_gear(void) {
+    if (gear_ready)
+        return;
+
+    uint64_t state = 0;
+    for (int i = 0; i < 256; i++) {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = true;
+}
+
+int kftp_cdc_chunk(const char* data, int data_size) {
+    if (data_size <= KFTP_CDC_MIN_SIZE)
+        return data_size;
+    init_gear();
+
+    int end = data_size < KFTP_CDC_MAX_SIZE ? data_size : KFTP_CDC_MAX_SIZE;
+    int normal_end = end < KFTP_CDC_AVG_SIZE ? end : KFTP_CDC_AVG_SIZE;
+    uint64_t hash = 0;
+    int i = KFTP_CDC_MIN_SIZE;
+
+    for (; i < normal_end; i++) {
+        hash = (hash << 1) + gear[(unsigned char) data[i]];
+        if ((hash & CDC_MASK_SMALL) == 0)
+            return i;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[(unsigned char) data[i]];
+        if ((hash & CDC_MASK_LARGE) == 0)
+            return i;
+    }
+    return end;
+}
+
+
+static KftpChunkId chunk_id(const char* data, int length) {
+    return (KftpChunkId) {.hashes={xxh64(data, length, 0), xxh64(data, length, KFTP_DEDUP_SEED)}};
+}
+
+static bool same_id(KftpChunkId* a, KftpChunkId* b) {
+    return a->hashes[0] == b->hashes[0] && a->hashes[1] == b->hashes[1];
+}
+
+static int add_chunk(DedupChunkList* list, DedupChunk* chunk) {
+    if (list->count == KFTP_DEDUP_MAX_CHUNKS) {
+        fprintf(stderr, "ERROR in add_chunk: file has too many chunks\n");
+        return -1;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        DedupChunk* chunks = realloc(list->chunks, capacity * sizeof(DedupChunk));
+        if (chunks == NULL)
+            return -1;
+        list->chunks = chunks;
+        list->capacity = capacity;
+    }
+    list->chunks[list->count++] = *chunk;
+    return 0;
+}
+
+// Splits the file into chunks, using `buffer` (KFTP_CDC_MAX_SIZE bytes) to read it
+static int split_file(FILE* read_fp, char* buffer, DedupChunkList* list, uint64_t* file_size) {
+    int filled = 0;
+    uint64_t offset = 0;
+    bool at_end = false;
+
+    while (true) {
+        if (!at_end) {
+            filled += fread(&buffer[filled], 1, KFTP_CDC_MAX_SIZE - filled, read_fp);
+            if (ferror(read_fp)) {
+                fprintf(stderr, "ERROR in split_file: error reading file\n");
+                return -1;
+            }
+            at_end = filled < KFTP_CDC_MAX_SIZE;
+        }
+        if (filled == 0)
+            break;
+
+        int length = kftp_cdc_chunk(buffer, filled);
+        DedupChunk chunk = {.id=chunk_id(buffer, length), .length=length, .offset=offset};
+        if (add_chunk(list, &chunk) < 0)
+            return -1;
+
+        offset += length;
+        filled -= length;
+        memmove(buffer, &buffer[length], filled);
+    }
+
+    *file_size = offset;
+    return 0;
+}
+
+
+int kftp_send_file_dedup(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream out_stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    KftpStream in_stream = {.socket_info=to, .receiver=receiver};
+
+    DedupChunkList list = {};
+    uint64_t file_size = 0;
+    char* buffer = malloc(KFTP_CDC_MAX_SIZE);
+    int status = buffer == NULL ? -1 : split_file(read_fp, buffer, &list, &file_size);
+
+    // the receiver is told if the file couldn't be read, so it isn't left waiting for a manifest
+    int result = kftp_stream_write_int(&out_stream, status < 0 ? -1 : list.count);
+    if (result == 0)
+        result = kftp_stream_write_uint64(&out_stream, file_size);
+    for (int i = 0; status == 0 && result == 0 && i < list.count; i++) {
+        result = kftp_stream_write_int(&out_stream, list.chunks[i].length);
+        if (result == 0)
+            result = kftp_stream_write_hash(&out_stream, list.chunks[i].id.hashes[0]);
+        if (result == 0)
+            result = kftp_stream_write_hash(&out_stream, list.chunks[i].id.hashes[1]);
+    }
+    if (result == 0)
+        result = kftp_stream_flush(&out_stream);
+
+    int missing_count = 0;
+    if (status == 0 && result == 0)
+        result = kftp_stream_read_int(&in_stream, &missing_count);
+    if (status == 0 && result == 0 && (missing_count < 0 || missing_count > list.count)) {
+        fprintf(stderr, "ERROR in kftp_send_file_dedup: receiver refused the file\n");
+        status = -1;
+    }
+
+    // all the indices are read before any chunks are sent, since RUDP only has one message in flight at a time
+    int* missing = malloc(list.count * sizeof(int) + 1);
+    if (missing == NULL)
+        status = -1;
+    for (int i = 0; status == 0 && result == 0 && i < missing_count; i++) {
+        result = kftp_stream_read_int(&in_stream, &missing[i]);
+        if (result == 0 && (missing[i] < 0 || missing[i] >= list.count)) {
+            fprintf(stderr, "ERROR in kftp_send_file_dedup: receiver asked for invalid chunk %d\n", missing[i]);
+            status = -1;
+        }
+    }
+
+    uint64_t sent_bytes = 0;
+    for (int i = 0; status == 0 && result == 0 && i < missing_count; i++) {
+        // if the file changed since it was split, the receiver will notice that the chunk doesn't match its hash
+        DedupChunk* chunk = &list.chunks[missing[i]];
+        if (fseek(read_fp, (long) chunk->offset, SEEK_SET) != 0
+            || fread(buffer, 1, chunk->length, read_fp) != (size_t) chunk->length)
+            memset(buffer, 0, chunk->length);
+        result = kftp_stream_write(&out_stream, buffer, chunk->length);
+        sent_bytes += chunk->length;
+    }
+    if (status == 0 && result == 0)
+        result = kftp_stream_flush(&out_stream);
+
+    int receiver_status = 0;
+    if (status == 0 && result == 0)
+        result = kftp_stream_read_int(&in_stream, &receiver_status);
+    if (status == 0 && result == 0 && receiver_status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_dedup: receiver failed to save the file\n");
+        status = receiver_status;
+    }
+
+    if (status == 0 && result == 0)
+        fprintf(stderr, "Done, sent %d of %d chunks (%" PRIu64 " of %" PRIu64 " bytes)\n", missing_count, list.count,
+                sent_bytes, file_size);
+    free(list.chunks);
+    free(missing);
+    free(buffer);
+    return status < 0 ? status : result;
+}
+
+
+static bool is_valid_name(char* name) {
+    return name[0] != 0 && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// creates a directory, unless it already exists
+static int make_dir(char* path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror("ERROR creating store directory");
+        return -1;
+    }
+    return 0;
+}
+
+static void chunk_name(KftpChunkId* id, char* name) {
+    snprintf(name, CHUNK_NAME_LENGTH + 1, "%016" PRIx64 "%016" PRIx64, id->hashes[0], id->hashes[1]);
+}
+
+// Fills in the path of the chunk named `name`, and creates its directory if `create` is set
+static int chunk_path(char* store_dir, char* name, bool create, char* path) {
+    int n = snprintf(path, DEDUP_PATH_LENGTH, "%s/chunks/%.2s", store_dir, name);
+    if (n < 0 || n >= DEDUP_PATH_LENGTH)
+        return -1;
+    if (create && make_dir(path) < 0)
+        return -1;
+
+    n = snprintf(path, DEDUP_PATH_LENGTH, "%s/chunks/%.2s/%s", store_dir, name, name);
+    return n < 0 || n >= DEDUP_PATH_LENGTH ? -1 : 0;
+}
+
+static int recipe_path(char* store_dir, char* name, char* path) {
+    int n = snprintf(path, DEDUP_PATH_LENGTH, "%s/files/%s", store_dir, name);
+    return n < 0 || n >= DEDUP_PATH_LENGTH ? -1 : 0;
+}
+
+// creates the store's directories, unless they already exist
+static int make_store(char* store_dir) {
+    char path[DEDUP_PATH_LENGTH];
+    if (make_dir(store_dir) < 0)
+        return -1;
+
+    int n = snprintf(path, DEDUP_PATH_LENGTH, "%s/chunks", store_dir);
+    if (n < 0 || n >= DEDUP_PATH_LENGTH || make_dir(path) < 0)
+        return -1;
+    n = snprintf(path, DEDUP_PATH_LENGTH, "%s/files", store_dir);
+    if (n < 0 || n >= DEDUP_PATH_LENGTH || make_dir(path) < 0)
+        return -1;
+    return 0;
+}
+
+// Writes `data` to `path` through a temporary file, so a partially written file is never left in the store
+static int write_atomically(char* path, char* data, size_t size) {
+    char temp_path[DEDUP_PATH_LENGTH];
+    int n = snprintf(temp_path, DEDUP_PATH_LENGTH, "%s.tmp", path);
+    if (n < 0 || n >= DEDUP_PATH_LENGTH)
+        return -1;
+
+    FILE* f = fopen(temp_path, "w");
+    if (f == NULL)
+        return -1;
+    bool written = fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0 || !written || rename(temp_path, path) < 0) {
+        remove(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_recipe(char* store_dir, char* name, uint64_t file_size, DedupChunkList* list) {
+    char path[DEDUP_PATH_LENGTH];
+    if (recipe_path(store_dir, name, path) < 0)
+        return -1;
+
+    // each line holds a chunk name, a space, a length of at most 5 digits, and a newline
+    size_t max_size = 32 + (size_t) list->count * (CHUNK_NAME_LENGTH + 8);
+    char* recipe = malloc(max_size);
+    if (recipe == NULL)
+        return -1;
+
+    size_t size = snprintf(recipe, max_size, "%" PRIu64 "\n", file_size);
+    for (int i = 0; i < list->count; i++) {
+        char name_hex[CHUNK_NAME_LENGTH + 1];
+        chunk_name(&list->chunks[i].id, name_hex);
+        size += snprintf(&recipe[size], max_size - size, "%s %d\n", name_hex, list->chunks[i].length);
+    }
+
+    int result = write_atomically(path, recipe, size);
+    free(recipe);
+    return result;
+}
+
+// chunks being sorted by compare_indices, since qsort doesn't pass a context to the comparison function
+static DedupChunk* sorted_chunks;
+
+static int compare_indices(const void* a, const void* b) {
+    KftpChunkId* id_a = &sorted_chunks[*(const int*) a].id;
+    KftpChunkId* id_b = &sorted_chunks[*(const int*) b].id;
+    for (int i = 0; i < 2; i++) {
+        if (id_a->hashes[i] != id_b->hashes[i])
+            return id_a->hashes[i] < id_b->hashes[i] ? -1 : 1;
+    }
+    return *(const int*) a - *(const int*) b;
+}
+
+// Finds the chunks that aren't in the store yet. Chunks that appear several times in the file are only asked for once.
+//
+// Returns the number of missing chunks, whose indices are written to `missing`.
+static int find_missing(char* store_dir, DedupChunkList* list, int* missing) {
+    int* order = malloc(list->count * sizeof(int) + 1);
+    if (order == NULL)
+        return -1;
+    for (int i = 0; i < list->count; i++)
+        order[i] = i;
+    sorted_chunks = list->chunks;
+    qsort(order, list->count, sizeof(int), compare_indices);
+
+    int missing_count = 0;
+    for (int i = 0; i < list->count; i++) {
+        DedupChunk* chunk = &list->chunks[order[i]];
+        if (i > 0 && same_id(&chunk->id, &list->chunks[order[i - 1]].id))
+            continue;
+
+        char name[CHUNK_NAME_LENGTH + 1];
+        char path[DEDUP_PATH_LENGTH];
+        chunk_name(&chunk->id, name);
+        if (chunk_path(store_dir, name, false, path) < 0 || access(path, F_OK) < 0)
+            missing[missing_count++] = order[i];
+    }
+
+    free(order);
+    return missing_count;
+}
+
+// Reads the manifest sent by the sender into `list`, checking that the chunks add up to the size of the file
+static int recv_manifest(KftpStream* stream, DedupChunkList* list, uint64_t* file_size, bool* valid) {
+    int count;
+    int result = kftp_stream_read_int(stream, &count);
+    if (result == 0)
+        result = kftp_stream_read_uint64(stream, file_size);
+    if (result < 0)
+        return result;
+    if (count < 0) {
+        fprintf(stderr, "ERROR in recv_manifest: sender couldn't read the file\n");
+        return -1;
+    }
+    if (count > KFTP_DEDUP_MAX_CHUNKS) {
+        fprintf(stderr, "ERROR in recv_manifest: file has too many chunks\n");
+        return -1;
+    }
+
+    uint64_t total_size = 0;
+    *valid = true;
+    for (int i = 0; i < count; i++) {
+        DedupChunk chunk = {};
+        result = kftp_stream_read_int(stream, &chunk.length);
+        if (result == 0)
+            result = kftp_stream_read_hash(stream, &chunk.id.hashes[0]);
+        if (result == 0)
+            result = kftp_stream_read_hash(stream, &chunk.id.hashes[1]);
+        if (result == 0)
+            result = add_chunk(list, &chunk);
+        if (result < 0)
+            return result;
+
+        if (chunk.length <= 0 || chunk.length > KFTP_CDC_MAX_SIZE)
+            *valid = false;
+        total_size += chunk.length;
+    }
+
+    if (total_size != *file_size)
+        *valid = false;
+    return 0;
+}
+
+int kftp_recv_file_dedup(char* name, char* store_dir, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream in_stream = {.socket_info=from, .receiver=receiver};
+    KftpStream out_stream = {.socket_info=from, .sender=sender, .receiver=receiver};
+
+    DedupChunkList list = {};
+    uint64_t file_size;
+    bool valid;
+    int result = recv_manifest(&in_stream, &list, &file_size, &valid);
+    if (result < 0) {
+        free(list.chunks);
+        return result;
+    }
+
+    if (!valid)
+        fprintf(stderr, "ERROR in kftp_recv_file_dedup: invalid manifest\n");
+    if (!is_valid_name(name)) {
+        fprintf(stderr, "ERROR in kftp_recv_file_dedup: invalid file name %s\n", name);
+        valid = false;
+    }
+
+    int* missing = malloc(list.count * sizeof(int) + 1);
+    char* buffer = malloc(KFTP_CDC_MAX_SIZE);
+    int missing_count = -1;
+    if (valid && missing != NULL && buffer != NULL && make_store(store_dir) == 0)
+        missing_count = find_missing(store_dir, &list, missing);
+
+    result = kftp_stream_write_int(&out_stream, missing_count);
+    for (int i = 0; result == 0 && i < missing_count; i++)
+        result = kftp_stream_write_int(&out_stream, missing[i]);
+    if (result == 0)
+        result = kftp_stream_flush(&out_stream);
+
+    // the rest of the chunks are still received after a failure, so the stream stays in sync
+    int status = missing_count < 0 ? -1 : 0;
+    for (int i = 0; result == 0 && i < missing_count; i++) {
+        DedupChunk* chunk = &list.chunks[missing[i]];
+        result = kftp_stream_read(&in_stream, buffer, chunk->length);
+        if (result < 0 || status < 0)
+            continue;
+
+        KftpChunkId id = chunk_id(buffer, chunk->length);
+        if (!same_id(&id, &chunk->id)) {
+            fprintf(stderr, "ERROR in kftp_recv_file_dedup: chunk %d does not match its hash\n", missing[i]);
+            status = KFTP_INTEGRITY_ERROR;
+            continue;
+        }
+
+        char chunk_name_hex[CHUNK_NAME_LENGTH + 1];
+        char path[DEDUP_PATH_LENGTH];
+        chunk_name(&chunk->id, chunk_name_hex);
+        if (chunk_path(store_dir, chunk_name_hex, true, path) < 0 || write_atomically(path, buffer, chunk->length) < 0) {
+            fprintf(stderr, "ERROR in kftp_recv_file_dedup: unable to store chunk %d\n", missing[i]);
+            status = -1;
+        }
+    }
+
+    if (result == 0 && status == 0 && write_recipe(store_dir, name, file_size, &list) < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_file_dedup: unable to save recipe\n");
+        status = -1;
+    }
+
+    if (result == 0 && missing_count >= 0) {
+        result = kftp_stream_write_int(&out_stream, status);
+        if (result == 0)
+            result = kftp_stream_flush(&out_stream);
+    }
+
+    if (result == 0 && status == 0)
+        fprintf(stderr, "Done, received %d of %d chunks\n", missing_count, list.count);
+    free(list.chunks);
+    free(missing);
+    free(buffer);
+    return result < 0 ? result : status;
+}
+
+
+// Appends the contents of the chunk named `name` to `write_fp`, checking that it has the expected length
+static int copy_chunk(char* store_dir, char* name, int length, char* buffer, FILE* write_fp) {
+    char path[DEDUP_PATH_LENGTH];
+    if (chunk_path(store_dir, name, false, path) < 0)
+        return -1;
+
+    FILE* chunk = fopen(path, "r");
+    if (chunk == NULL)
+        return -1;
+    bool complete = fread(buffer, 1, length, chunk) == (size_t) length && fgetc(chunk) == EOF;
+    fclose(chunk);
+
+    if (!complete || fwrite(buffer, 1, length, write_fp) != (size_t) length)
+        return -1;
+    return 0;
+}
+
+FILE* kftp_dedup_open(char* name, char* store_dir) {
+    char path[DEDUP_PATH_LENGTH];
+    if (!is_valid_name(name) || recipe_path(store_dir, name, path) < 0)
+        return NULL;
+
+    FILE* recipe = fopen(path, "r");
+    if (recipe == NULL)
+        return NULL;
+
+    FILE* assembled = tmpfile();
+    char* buffer = malloc(KFTP_CDC_MAX_SIZE);
+    uint64_t file_size;
+    int status = assembled != NULL && buffer != NULL && fscanf(recipe, "%" SCNu64, &file_size) == 1 ? 0 : -1;
+
+    char chunk_name_hex[CHUNK_NAME_LENGTH + 1];
+    int length;
+    uint64_t assembled_size = 0;
+    while (status == 0 && fscanf(recipe, "%32s %d", chunk_name_hex, &length) == 2) {
+        if (strlen(chunk_name_hex) != CHUNK_NAME_LENGTH || strspn(chunk_name_hex, "0123456789abcdef") != CHUNK_NAME_LENGTH
+            || length <= 0 || length > KFTP_CDC_MAX_SIZE) {
+            status = -1;
+            break;
+        }
+        status = copy_chunk(store_dir, chunk_name_hex, length, buffer, assembled);
+        assembled_size += length;
+    }
+    fclose(recipe);
+    free(buffer);
+
+    if (status < 0 || assembled_size != file_size || fflush(assembled) != 0) {
+        fprintf(stderr, "ERROR in kftp_dedup_open: unable to reassemble %s from the store\n", name);
+        if (assembled != NULL)
+            fclose(assembled);
+        return NULL;
+    }
+
+    rewind(assembled);
+    return assembled;
+}
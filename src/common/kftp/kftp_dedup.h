@@ -0,0 +1,63 @@
+//
+// KFTP deduplicated transfer interface
+//
+// Deduplicated transfers upload a file into a content-addressed store on the receiver. The sender splits the file into
+// content-defined chunks (using FastCDC) and first sends only the hashes of the chunks. The receiver replies with the
+// chunks it doesn't have yet, so only new data is sent. Since chunk boundaries depend on the content rather than on
+// offsets, an insertion or deletion only changes the chunks around it, and the rest are still found in the store.
+//
+// The store keeps each distinct chunk once, and each file as a recipe listing its chunks, so near-duplicate files (e.g.
+// versioned builds) take up little extra disk space.
+//
+
+#ifndef UDP_KFTP_DEDUP_H
+#define UDP_KFTP_DEDUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../reliable_udp/types.h"
+
+
+// Chunk sizes, in bytes. Chunks are cut at content-defined points between the min and max size, and are normalized
+// around the average size.
+#define KFTP_CDC_MIN_SIZE (2 * 1024)
+#define KFTP_CDC_AVG_SIZE (8 * 1024)
+#define KFTP_CDC_MAX_SIZE (64 * 1024)
+
+// most chunks that a single file can be split into
+#define KFTP_DEDUP_MAX_CHUNKS (1 << 24)
+
+// seed of the second XXH64 hash that makes up a chunk's (128-bit) identifier
+#define KFTP_DEDUP_SEED 0x6b667470646564ULL
+
+
+// Identifies a chunk by its contents: the XXH64 hashes of the chunk with seeds 0 and KFTP_DEDUP_SEED
+typedef struct {
+    uint64_t hashes[2];
+} KftpChunkId;
+
+
+// Returns the length of the first chunk of `data`, using the FastCDC gear hash. At most KFTP_CDC_MAX_SIZE bytes of
+// `data` are used, and `data_size` is returned if it's no larger than KFTP_CDC_MIN_SIZE.
+int kftp_cdc_chunk(const char* data, int data_size);
+
+// Splits the file read from `read_fp` into chunks and uploads the chunks that the receiver at `to` doesn't have yet.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_file_dedup(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives a deduplicated upload from `from`, adding the new chunks to the store at `store_dir` and saving the file's
+// recipe under `name`. `name` may not contain a directory.
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if a received chunk doesn't match its hash, and a negative int on other
+// failures.
+int kftp_recv_file_dedup(char* name, char* store_dir, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver);
+
+// Reassembles the file saved under `name` in the store at `store_dir` into a temporary file, which is removed once it
+// is closed.
+//
+// Returns NULL if the file is not in the store or could not be reassembled.
+FILE* kftp_dedup_open(char* name, char* store_dir);
+
+#endif //UDP_KFTP_DEDUP_H
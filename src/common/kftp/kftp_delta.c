@@ -0,0 +1,552 @@
+//
+// KFTP delta transfer implementation
+//
+// Delta transfers follow the rsync algorithm: the receiver sends signatures for each block of its existing copy of a
+// file, and the sender replies with a stream of literal data and references to blocks the receiver already has.
+//
+
+#include "kftp_delta.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// size of the sliding window buffer the sender scans for matching blocks, must hold at least two blocks
+#define DELTA_WINDOW_SIZE (4 * KFTP_DELTA_MAX_BLOCK_SIZE)
+
+// size of the buffer used to copy literal data and blocks into the reconstructed file
+#define DELTA_COPY_BUFFER_SIZE 4096
+
+#define EMPTY_SLOT (-1)
+
+
+void rolling_checksum_init(RollingChecksum* checksum, const char* data, int length) {
+    checksum->a = 0;
+    checksum->b = 0;
+    checksum->length = length;
+
+    for (int i = 0; i < length; i++) {
+        checksum->a += (unsigned char) data[i];
+        checksum->b += checksum->a;
+    }
+}
+
+// Slides the window forward by one byte, removing `out` from the front and appending `in` to the back
+void rolling_checksum_roll(RollingChecksum* checksum, char out, char in) {
+    checksum->a += (unsigned char) in - (unsigned char) out;
+    checksum->b += checksum->a - (uint32_t) checksum->length * (unsigned char) out;
+}
+
+uint32_t rolling_checksum_digest(RollingChecksum* checksum) {
+    return (checksum->b << 16) | (checksum->a & 0xFFFF);
+}
+
+
+// Picks a block size of roughly sqrt(file_size), which balances the size of the signatures against the amount of
+// literal data sent for each changed region
+int kftp_delta_block_size(long file_size) {
+    long block_size = KFTP_DELTA_MIN_BLOCK_SIZE;
+    while (block_size * block_size < file_size && block_size < KFTP_DELTA_MAX_BLOCK_SIZE)
+        block_size *= 2;
+
+    return (int) block_size;
+}
+
+
+// Helper function that computes and sends the signature of every full block in `basis_fp`. The trailing partial block
+// (if any) is not included since it can only ever match at the very end of the file.
+static int send_signatures(FILE* basis_fp, KftpStream* stream, KftpSignatures* signatures) {
+    long basis_size = 0;
+    if (basis_fp != NULL) {
+        if (fseek(basis_fp, 0, SEEK_END) < 0 || (basis_size = ftell(basis_fp)) < 0
+            || fseek(basis_fp, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "ERROR in send_signatures: error getting size of basis file\n");
+            return -1;
+        }
+    }
+
+    signatures->block_size = kftp_delta_block_size(basis_size);
+    long block_count = basis_size / signatures->block_size;
+    signatures->block_count = block_count < KFTP_DELTA_MAX_BLOCK_COUNT ? (int) block_count : KFTP_DELTA_MAX_BLOCK_COUNT;
+
+    int status = kftp_stream_write_int(stream, signatures->block_size);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_int(stream, signatures->block_count);
+    if (status < 0)
+        return status;
+
+    char* block = malloc(signatures->block_size);
+    if (block == NULL) {
+        fprintf(stderr, "ERROR in send_signatures: unable to allocate block buffer\n");
+        return -1;
+    }
+
+    for (int i = 0; i < signatures->block_count; i++) {
+        if (fread(block, sizeof(char), signatures->block_size, basis_fp) != signatures->block_size) {
+            fprintf(stderr, "ERROR in send_signatures: unable to read block %d of basis file\n", i);
+            status = -1;
+            break;
+        }
+
+        RollingChecksum checksum;
+        rolling_checksum_init(&checksum, block, signatures->block_size);
+
+        status = kftp_stream_write_int(stream, (int) rolling_checksum_digest(&checksum));
+        if (status < 0)
+            break;
+        status = kftp_stream_write_hash(stream, xxh64(block, signatures->block_size, 0));
+        if (status < 0)
+            break;
+    }
+
+    free(block);
+    if (status < 0)
+        return status;
+
+    return kftp_stream_flush(stream);
+}
+
+
+// Helper function that receives the signatures sent by send_signatures(). The blocks array is dynamically allocated
+// and must be freed by the caller.
+static int recv_signatures(KftpStream* stream, KftpSignatures* signatures) {
+    int status = kftp_stream_read_int(stream, &signatures->block_size);
+    if (status < 0)
+        return status;
+    status = kftp_stream_read_int(stream, &signatures->block_count);
+    if (status < 0)
+        return status;
+
+    if (signatures->block_size < KFTP_DELTA_MIN_BLOCK_SIZE || signatures->block_size > KFTP_DELTA_MAX_BLOCK_SIZE
+        || signatures->block_count < 0 || signatures->block_count > KFTP_DELTA_MAX_BLOCK_COUNT) {
+        fprintf(stderr, "ERROR in recv_signatures: invalid signature header\n");
+        return KFTP_DELTA_CORRUPT_ERROR;
+    }
+
+    signatures->blocks = malloc(sizeof(KftpBlockSignature) * (signatures->block_count + 1));
+    if (signatures->blocks == NULL) {
+        fprintf(stderr, "ERROR in recv_signatures: unable to allocate %d signatures\n", signatures->block_count);
+        return -1;
+    }
+
+    for (int i = 0; i < signatures->block_count; i++) {
+        int weak;
+        status = kftp_stream_read_int(stream, &weak);
+        if (status < 0)
+            return status;
+        signatures->blocks[i].weak = (uint32_t) weak;
+
+        status = kftp_stream_read_hash(stream, &signatures->blocks[i].strong);
+        if (status < 0)
+            return status;
+    }
+
+    return 0;
+}
+
+
+// Open addressing hash table from weak checksums to block indices, used by the sender to look up candidate blocks
+typedef struct {
+    int* slots;
+    int mask;
+} SignatureTable;
+
+static int build_signature_table(KftpSignatures* signatures, SignatureTable* table) {
+    int capacity = 16;
+    while (capacity < signatures->block_count * 2)
+        capacity *= 2;
+
+    table->mask = capacity - 1;
+    table->slots = malloc(sizeof(int) * capacity);
+    if (table->slots == NULL)
+        return -1;
+
+    for (int i = 0; i < capacity; i++)
+        table->slots[i] = EMPTY_SLOT;
+
+    for (int i = 0; i < signatures->block_count; i++) {
+        int slot = signatures->blocks[i].weak & table->mask;
+        while (table->slots[slot] != EMPTY_SLOT)
+            slot = (slot + 1) & table->mask;
+        table->slots[slot] = i;
+    }
+
+    return 0;
+}
+
+// Returns the index of a block matching `data`, or a negative int if there is none. The strong hash is only computed
+// once a block with a matching weak checksum is found.
+static int find_block(SignatureTable* table, KftpSignatures* signatures, uint32_t weak, const char* data) {
+    bool strong_computed = false;
+    uint64_t strong = 0;
+
+    for (int slot = weak & table->mask; table->slots[slot] != EMPTY_SLOT; slot = (slot + 1) & table->mask) {
+        KftpBlockSignature* candidate = &signatures->blocks[table->slots[slot]];
+        if (candidate->weak != weak)
+            continue;
+
+        if (!strong_computed) {
+            strong = xxh64(data, signatures->block_size, 0);
+            strong_computed = true;
+        }
+        if (candidate->strong == strong)
+            return table->slots[slot];
+    }
+
+    return -1;
+}
+
+
+// Run of consecutive blocks that has been matched but not yet sent, consecutive matches are merged into a single record
+typedef struct {
+    int first_block;
+    int block_count;
+} PendingCopy;
+
+static int flush_copy(KftpStream* stream, PendingCopy* copy) {
+    if (copy->block_count == 0)
+        return 0;
+
+    char type = KFTP_DELTA_COPY;
+    int status = kftp_stream_write(stream, &type, 1);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_int(stream, copy->first_block);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_int(stream, copy->block_count);
+    if (status < 0)
+        return status;
+
+    copy->block_count = 0;
+    return 0;
+}
+
+static int send_literal(KftpStream* stream, PendingCopy* copy, char* data, int data_size) {
+    if (data_size == 0)
+        return 0;
+
+    // any matched blocks come before this literal data in the file
+    int status = flush_copy(stream, copy);
+    if (status < 0)
+        return status;
+
+    char type = KFTP_DELTA_LITERAL;
+    status = kftp_stream_write(stream, &type, 1);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_int(stream, data_size);
+    if (status < 0)
+        return status;
+
+    return kftp_stream_write(stream, data, data_size);
+}
+
+static int add_copy(KftpStream* stream, PendingCopy* copy, int block) {
+    if (copy->block_count > 0 && copy->first_block + copy->block_count == block) {
+        copy->block_count++;
+        return 0;
+    }
+
+    int status = flush_copy(stream, copy);
+    if (status < 0)
+        return status;
+
+    copy->first_block = block;
+    copy->block_count = 1;
+    return 0;
+}
+
+
+// Helper function that scans `read_fp` for blocks matching the signatures and sends the resulting delta records
+static int send_delta(FILE* read_fp, KftpStream* stream, KftpSignatures* signatures, SignatureTable* table) {
+    int block_size = signatures->block_size;
+    char* window = malloc(DELTA_WINDOW_SIZE);
+    if (window == NULL) {
+        fprintf(stderr, "ERROR in send_delta: unable to allocate window buffer\n");
+        return -1;
+    }
+
+    int status = 0;
+    int window_length = 0;      // number of valid bytes in the window buffer
+    int position = 0;           // start of the block currently being checked
+    int literal_start = 0;      // start of the unmatched data that has not been sent yet
+    bool eof = false;
+    bool have_checksum = false;
+    RollingChecksum checksum;
+    PendingCopy copy = {};
+
+    long file_size = 0;
+    long literal_bytes = 0;
+    Xxh64State hash_state;      // hash of the whole file, checked by the receiver once it has rebuilt the file
+    xxh64_init(&hash_state, 0);
+    long matched_blocks = 0;
+
+    while (1) {
+        // refill the window when there isn't a full block left to slide over
+        if (window_length - position <= block_size && !eof) {
+            status = send_literal(stream, &copy, &window[literal_start], position - literal_start);
+            if (status < 0)
+                break;
+            literal_bytes += position - literal_start;
+
+            memmove(window, &window[position], window_length - position);
+            window_length -= position;
+            position = 0;
+            literal_start = 0;
+
+            size_t read_bytes = fread(&window[window_length], sizeof(char), DELTA_WINDOW_SIZE - window_length, read_fp);
+            if (read_bytes < DELTA_WINDOW_SIZE - window_length) {
+                if (ferror(read_fp)) {
+                    fprintf(stderr, "ERROR in send_delta: error reading file\n");
+                    status = -1;
+                    break;
+                }
+                eof = true;
+            }
+            xxh64_update(&hash_state, &window[window_length], (int) read_bytes);
+            window_length += read_bytes;
+            file_size += read_bytes;
+        }
+
+        if (window_length - position < block_size)
+            break;
+
+        if (!have_checksum) {
+            rolling_checksum_init(&checksum, &window[position], block_size);
+            have_checksum = true;
+        }
+
+        int block = signatures->block_count > 0
+                ? find_block(table, signatures, rolling_checksum_digest(&checksum), &window[position])
+                : -1;
+        if (block >= 0) {
+            status = send_literal(stream, &copy, &window[literal_start], position - literal_start);
+            if (status < 0)
+                break;
+            literal_bytes += position - literal_start;
+
+            status = add_copy(stream, &copy, block);
+            if (status < 0)
+                break;
+            matched_blocks++;
+
+            position += block_size;
+            literal_start = position;
+            have_checksum = false;
+            continue;
+        }
+
+        if (window_length - position > block_size)
+            rolling_checksum_roll(&checksum, window[position], window[position + block_size]);
+        else
+            have_checksum = false;
+        position++;
+
+        if (position - literal_start >= KFTP_DELTA_MAX_LITERAL) {
+            status = send_literal(stream, &copy, &window[literal_start], position - literal_start);
+            if (status < 0)
+                break;
+            literal_bytes += position - literal_start;
+            literal_start = position;
+        }
+    }
+
+    // whatever is left at the end of the file is too short to match a block
+    if (status == 0) {
+        status = send_literal(stream, &copy, &window[literal_start], window_length - literal_start);
+        literal_bytes += window_length - literal_start;
+    }
+    if (status == 0)
+        status = flush_copy(stream, &copy);
+
+    free(window);
+    if (status < 0)
+        return status;
+
+    char type = KFTP_DELTA_END;
+    status = kftp_stream_write(stream, &type, 1);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_uint64(stream, (uint64_t) file_size);
+    if (status < 0)
+        return status;
+    status = kftp_stream_write_hash(stream, xxh64_digest(&hash_state));
+    if (status < 0)
+        return status;
+
+    fprintf(stderr, "Delta: %ld literal bytes, %ld matched blocks of %d bytes\n", literal_bytes, matched_blocks,
+            block_size);
+    return kftp_stream_flush(stream);
+}
+
+
+int kftp_send_file_delta(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    // signatures and the delta travel in opposite directions, so each needs its own stream
+    KftpStream signature_stream = {.socket_info=to, .receiver=receiver};
+    KftpStream delta_stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    KftpSignatures signatures = {};
+    SignatureTable table = {};
+
+    int status = recv_signatures(&signature_stream, &signatures);
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_delta: error receiving signatures\n");
+        goto cleanup;
+    }
+
+    status = build_signature_table(&signatures, &table);
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_delta: unable to build signature table\n");
+        goto cleanup;
+    }
+
+    status = send_delta(read_fp, &delta_stream, &signatures, &table);
+    if (status < 0)
+        fprintf(stderr, "ERROR in kftp_send_file_delta: error sending delta\n");
+
+cleanup:
+    free(signatures.blocks);
+    free(table.slots);
+    return status;
+}
+
+
+// Helper function that copies `size` bytes from the stream to `write_fp`, adding them to the hash of the rebuilt file
+static int recv_literal(KftpStream* stream, FILE* write_fp, Xxh64State* hash_state, int size) {
+    char buffer[DELTA_COPY_BUFFER_SIZE];
+
+    while (size > 0) {
+        int chunk_size = size < DELTA_COPY_BUFFER_SIZE ? size : DELTA_COPY_BUFFER_SIZE;
+        int status = kftp_stream_read(stream, buffer, chunk_size);
+        if (status < 0)
+            return status;
+
+        if (fwrite(buffer, sizeof(char), chunk_size, write_fp) != chunk_size) {
+            fprintf(stderr, "ERROR in recv_literal: error writing to file\n");
+            return -1;
+        }
+        xxh64_update(hash_state, buffer, chunk_size);
+        size -= chunk_size;
+    }
+
+    return 0;
+}
+
+// Helper function that copies blocks from `basis_fp` to `write_fp`, adding them to the hash of the rebuilt file
+static int copy_blocks(FILE* basis_fp, FILE* write_fp, Xxh64State* hash_state, KftpSignatures* signatures,
+                       int first_block, int block_count) {
+    if (first_block < 0 || block_count < 0 || block_count > signatures->block_count - first_block) {
+        fprintf(stderr, "ERROR in copy_blocks: reference to unknown blocks %d-%d\n", first_block,
+                first_block + block_count);
+        return KFTP_DELTA_CORRUPT_ERROR;
+    }
+
+    if (fseek(basis_fp, (long) first_block * signatures->block_size, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR in copy_blocks: error seeking in basis file\n");
+        return -1;
+    }
+
+    char buffer[DELTA_COPY_BUFFER_SIZE];
+    long remaining = (long) block_count * signatures->block_size;
+    while (remaining > 0) {
+        int chunk_size = remaining < DELTA_COPY_BUFFER_SIZE ? (int) remaining : DELTA_COPY_BUFFER_SIZE;
+        if (fread(buffer, sizeof(char), chunk_size, basis_fp) != chunk_size) {
+            fprintf(stderr, "ERROR in copy_blocks: error reading basis file\n");
+            return -1;
+        }
+        if (fwrite(buffer, sizeof(char), chunk_size, write_fp) != chunk_size) {
+            fprintf(stderr, "ERROR in copy_blocks: error writing to file\n");
+            return -1;
+        }
+        xxh64_update(hash_state, buffer, chunk_size);
+        remaining -= chunk_size;
+    }
+
+    return 0;
+}
+
+
+int kftp_recv_file_delta(FILE* basis_fp, FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream signature_stream = {.socket_info=from, .sender=sender, .receiver=receiver};
+    KftpStream stream = {.socket_info=from, .receiver=receiver};
+    KftpSignatures signatures = {};
+
+    int status = send_signatures(basis_fp, &signature_stream, &signatures);
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_file_delta: error sending signatures\n");
+        return status;
+    }
+
+    // blocks are matched by their hashes, so a collision would silently corrupt the file if the result wasn't verified
+    long written = 0;
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+    while (1) {
+        char type;
+        status = kftp_stream_read(&stream, &type, 1);
+        if (status < 0)
+            return status;
+
+        if (type == KFTP_DELTA_LITERAL) {
+            int size;
+            status = kftp_stream_read_int(&stream, &size);
+            if (status < 0)
+                return status;
+            if (size < 0) {
+                fprintf(stderr, "ERROR in kftp_recv_file_delta: invalid literal size %d\n", size);
+                return KFTP_DELTA_CORRUPT_ERROR;
+            }
+
+            status = recv_literal(&stream, write_fp, &hash_state, size);
+            if (status < 0)
+                return status;
+            written += size;
+        }
+        else if (type == KFTP_DELTA_COPY) {
+            int first_block, block_count;
+            status = kftp_stream_read_int(&stream, &first_block);
+            if (status < 0)
+                return status;
+            status = kftp_stream_read_int(&stream, &block_count);
+            if (status < 0)
+                return status;
+
+            status = copy_blocks(basis_fp, write_fp, &hash_state, &signatures, first_block, block_count);
+            if (status < 0)
+                return status;
+            written += (long) block_count * signatures.block_size;
+        }
+        else if (type == KFTP_DELTA_END) {
+            uint64_t file_size;
+            status = kftp_stream_read_uint64(&stream, &file_size);
+            if (status < 0)
+                return status;
+            uint64_t hash;
+            status = kftp_stream_read_hash(&stream, &hash);
+            if (status < 0)
+                return status;
+
+            if (file_size != (uint64_t) written) {
+                fprintf(stderr, "ERROR in kftp_recv_file_delta: reconstructed %ld bytes but expected %llu\n", written,
+                        (unsigned long long) file_size);
+                return KFTP_DELTA_CORRUPT_ERROR;
+            }
+            if (hash != xxh64_digest(&hash_state)) {
+                fprintf(stderr, "ERROR in kftp_recv_file_delta: hash of rebuilt file does not match the sent file\n");
+                return KFTP_INTEGRITY_ERROR;
+            }
+
+            fprintf(stderr, "Done                                  \n");
+            return 0;
+        }
+        else {
+            fprintf(stderr, "ERROR in kftp_recv_file_delta: unknown record type %d\n", type);
+            return KFTP_DELTA_CORRUPT_ERROR;
+        }
+    }
+}
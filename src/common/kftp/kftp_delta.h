@@ -0,0 +1,82 @@
+//
+// KFTP delta transfer interface
+//
+// Delta transfers follow the rsync algorithm: the receiver sends signatures (a weak rolling checksum and a strong hash)
+// for each block of its existing copy of a file, and the sender replies with a stream of literal data and references
+// to blocks the receiver already has. The amount of data sent therefore scales with the size of the change rather
+// than the size of the file.
+//
+
+#ifndef UDP_KFTP_DELTA_H
+#define UDP_KFTP_DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../reliable_udp/types.h"
+
+
+// Bounds on the block size used for signatures. The block size is picked based on the size of the receiver's copy.
+#define KFTP_DELTA_MIN_BLOCK_SIZE 512
+#define KFTP_DELTA_MAX_BLOCK_SIZE (64 * 1024)
+
+// Most blocks signatures are sent for, which covers a basis of up to 1 TiB at the largest block size. The rest of a
+// larger basis is never matched, so it's sent as literal data.
+#define KFTP_DELTA_MAX_BLOCK_COUNT (1 << 24)
+
+// Largest literal record the sender will emit, longer runs of unmatched data are split over several records
+#define KFTP_DELTA_MAX_LITERAL (32 * 1024)
+
+// Suffix of the temporary file a delta is reconstructed into before it replaces the original file
+#define KFTP_DELTA_TEMP_SUFFIX ".kftp-delta"
+
+// Record types that make up a delta stream
+#define KFTP_DELTA_LITERAL 1    // followed by a length and that many bytes of data
+#define KFTP_DELTA_COPY 2       // followed by the index of the first block to copy and the number of blocks to copy
+#define KFTP_DELTA_END 3        // followed by the size and XXH64 hash of the reconstructed file
+
+// Errors
+#define KFTP_DELTA_CORRUPT_ERROR (-4)
+
+
+// Rolling checksum (as used by rsync) that can be updated in constant time when the window slides by one byte
+typedef struct {
+    uint32_t a;     // sum of the bytes in the window
+    uint32_t b;     // sum of the prefix sums of the window
+    int length;     // size of the window
+} RollingChecksum;
+
+typedef struct {
+    uint32_t weak;      // digest of the rolling checksum
+    uint64_t strong;    // xxh64 of the block
+} KftpBlockSignature;
+
+typedef struct {
+    int block_size;
+    int block_count;
+    KftpBlockSignature* blocks;
+} KftpSignatures;
+
+
+// Reads block signatures from the peer and then sends the contents of `read_fp` as a delta against them
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_file_delta(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Sends block signatures of `basis_fp` to the peer, then receives a delta and writes the reconstructed file to
+// `write_fp`. `basis_fp` may be NULL if there is no existing copy of the file, in which case the full file is sent.
+//
+// `write_fp` must not refer to the same file as `basis_fp` since blocks are copied from the basis while writing.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_recv_file_delta(FILE* basis_fp, FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver);
+
+
+// Remaining methods intended primarily for internal use
+void rolling_checksum_init(RollingChecksum* checksum, const char* data, int length);
+void rolling_checksum_roll(RollingChecksum* checksum, char out, char in);
+uint32_t rolling_checksum_digest(RollingChecksum* checksum);
+
+int kftp_delta_block_size(long file_size);
+
+#endif //UDP_KFTP_DELTA_H
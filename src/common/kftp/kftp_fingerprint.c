@@ -0,0 +1,284 @@
+//
+// KFTP conditional transfer implementation
+//
+// The receiver's offer is sent as:
+//  - 1 if the receiver has a copy of the file (0 otherwise)
+//  - if it has a copy: the size (as a uint64) and XXH64 hash of the copy
+//
+// The sender then replies with KFTP_MODIFIED or KFTP_NOT_MODIFIED.
+//
+// A saved index holds a line for each fingerprint: the device, inode, size, modification time (seconds and nanoseconds),
+// and hash (in hex) of the file, followed by its path.
+//
+
+// needed for fileno, strdup, getline, and st_mtim
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_fingerprint.h"
+
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+// amount of the file read at a time while hashing it
+#define FINGERPRINT_BUFFER_SIZE (64 * 1024)
+
+
+static KftpFingerprintEntry** find_slot(KftpFingerprintIndex* index, char* path) {
+    uint64_t hash = xxh64(path, strlen(path), 0);
+    KftpFingerprintEntry** slot = &index->buckets[hash % KFTP_FINGERPRINT_BUCKETS];
+    while (*slot != NULL && strcmp((*slot)->path, path) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+static bool is_current(KftpFingerprintEntry* entry, struct stat* file_stat) {
+    return entry->device == file_stat->st_dev && entry->inode == file_stat->st_ino
+           && entry->fingerprint.size == (uint64_t) file_stat->st_size
+           && entry->modified.tv_sec == file_stat->st_mtim.tv_sec
+           && entry->modified.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+static int hash_file(FILE* f, KftpFingerprint* fingerprint) {
+    char* buffer = malloc(FINGERPRINT_BUFFER_SIZE);
+    if (buffer == NULL)
+        return -1;
+
+    Xxh64State state;
+    xxh64_init(&state, 0);
+    uint64_t size = 0;
+    size_t n;
+    while ((n = fread(buffer, 1, FINGERPRINT_BUFFER_SIZE, f)) > 0) {
+        xxh64_update(&state, buffer, (int) n);
+        size += n;
+    }
+    free(buffer);
+
+    if (ferror(f))
+        return -1;
+
+    fingerprint->size = size;
+    fingerprint->hash = xxh64_digest(&state);
+    return 0;
+}
+
+// Adds a fingerprint to the index, replacing any older fingerprint of the same file
+static void index_fingerprint(KftpFingerprintIndex* index, char* path, struct stat* file_stat,
+                              KftpFingerprint* fingerprint) {
+    KftpFingerprintEntry** slot = find_slot(index, path);
+    KftpFingerprintEntry* entry = *slot;
+    if (entry == NULL) {
+        if (index->count == KFTP_FINGERPRINT_INDEX_SIZE) {
+            kftp_fingerprint_index_free(index);
+            slot = find_slot(index, path);
+        }
+
+        entry = calloc(1, sizeof(KftpFingerprintEntry));
+        if (entry == NULL)
+            return;
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            free(entry);
+            return;
+        }
+        *slot = entry;
+        index->count++;
+    }
+
+    entry->fingerprint = *fingerprint;
+    entry->device = file_stat->st_dev;
+    entry->inode = file_stat->st_ino;
+    entry->modified = file_stat->st_mtim;
+    index->changed = true;
+}
+
+
+void kftp_fingerprint_index_init(KftpFingerprintIndex* index) {
+    memset(index, 0, sizeof(KftpFingerprintIndex));
+}
+
+void kftp_fingerprint_index_free(KftpFingerprintIndex* index) {
+    for (int i = 0; i < KFTP_FINGERPRINT_BUCKETS; i++) {
+        while (index->buckets[i] != NULL) {
+            KftpFingerprintEntry* entry = index->buckets[i];
+            index->buckets[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    index->count = 0;
+}
+
+// Helper function that adds the fingerprint saved on `line` to the index
+//
+// Returns 0 on success, and a negative int if the line is invalid.
+static int load_entry(KftpFingerprintIndex* index, char* line) {
+    unsigned long long device, inode, size, hash;
+    long long seconds;
+    long nanoseconds;
+    int path_start = 0;
+    if (sscanf(line, "%llu %llu %llu %lld %ld %llx %n", &device, &inode, &size, &seconds, &nanoseconds, &hash,
+               &path_start) != 6 || path_start == 0)
+        return -1;
+
+    char* path = &line[path_start];
+    path[strcspn(path, "\n")] = 0;
+    if (path[0] == 0)
+        return -1;
+
+    // the index only needs the parts of the file's stat that identify its version
+    struct stat file_stat = {.st_dev=(dev_t) device, .st_ino=(ino_t) inode, .st_size=(off_t) size};
+    file_stat.st_mtim.tv_sec = (time_t) seconds;
+    file_stat.st_mtim.tv_nsec = nanoseconds;
+    KftpFingerprint fingerprint = {.size=size, .hash=hash};
+    index_fingerprint(index, path, &file_stat, &fingerprint);
+    return 0;
+}
+
+int kftp_fingerprint_index_load(KftpFingerprintIndex* index, char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    char* line = NULL;
+    size_t line_size = 0;
+    int result = 0;
+    while (result == 0 && index->count < KFTP_FINGERPRINT_INDEX_SIZE && getline(&line, &line_size, f) >= 0)
+        result = load_entry(index, line);
+    if (result == 0 && ferror(f))
+        result = -1;
+    free(line);
+    fclose(f);
+
+    if (result < 0) {
+        fprintf(stderr, "ERROR in kftp_fingerprint_index_load: invalid fingerprint index %s\n", filename);
+        kftp_fingerprint_index_free(index);
+    }
+    index->changed = false;
+    return result;
+}
+
+int kftp_fingerprint_index_save(KftpFingerprintIndex* index, char* filename) {
+    char temp_filename[4096];
+    int n = snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+    if (n < 0 || n >= sizeof(temp_filename))
+        return -1;
+
+    FILE* f = fopen(temp_filename, "w");
+    if (f == NULL)
+        return -1;
+
+    for (int i = 0; i < KFTP_FINGERPRINT_BUCKETS; i++) {
+        for (KftpFingerprintEntry* entry = index->buckets[i]; entry != NULL; entry = entry->next) {
+            // a path that spans lines can't be saved, so its file is hashed again by the next program to load the index
+            if (strchr(entry->path, '\n') != NULL)
+                continue;
+            fprintf(f, "%llu %llu %llu %lld %ld %llx %s\n", (unsigned long long) entry->device,
+                    (unsigned long long) entry->inode, (unsigned long long) entry->fingerprint.size,
+                    (long long) entry->modified.tv_sec, (long) entry->modified.tv_nsec,
+                    (unsigned long long) entry->fingerprint.hash, entry->path);
+        }
+    }
+
+    bool failed = ferror(f) != 0;
+    failed = fclose(f) != 0 || failed;
+    if (failed || rename(temp_filename, filename) < 0) {
+        fprintf(stderr, "ERROR in kftp_fingerprint_index_save: error writing fingerprint index %s\n", filename);
+        remove(temp_filename);
+        return -1;
+    }
+    index->changed = false;
+    return 0;
+}
+
+int kftp_fingerprint_file(KftpFingerprintIndex* index, char* path, KftpFingerprint* fingerprint) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    // the stat of the opened file is used so the index describes the same version of the file that is hashed
+    struct stat file_stat;
+    if (fstat(fileno(f), &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        fclose(f);
+        return -1;
+    }
+
+    if (index != NULL) {
+        KftpFingerprintEntry* entry = *find_slot(index, path);
+        if (entry != NULL && is_current(entry, &file_stat)) {
+            index->hits++;
+            *fingerprint = entry->fingerprint;
+            fclose(f);
+            return 0;
+        }
+        index->misses++;
+    }
+
+    int result = hash_file(f, fingerprint);
+    fclose(f);
+    if (result < 0) {
+        fprintf(stderr, "ERROR in kftp_fingerprint_file: error reading file\n");
+        return result;
+    }
+
+    // a file that changed while it was hashed will have a different size or modification time the next time around
+    if (index != NULL && fingerprint->size == (uint64_t) file_stat.st_size)
+        index_fingerprint(index, path, &file_stat, fingerprint);
+    return 0;
+}
+
+int kftp_offer_fingerprint(KftpFingerprint* fingerprint, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream out_stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    KftpStream in_stream = {.socket_info=to, .receiver=receiver};
+
+    int result = kftp_stream_write_int(&out_stream, fingerprint != NULL);
+    if (result == 0 && fingerprint != NULL)
+        result = kftp_stream_write_uint64(&out_stream, fingerprint->size);
+    if (result == 0 && fingerprint != NULL)
+        result = kftp_stream_write_hash(&out_stream, fingerprint->hash);
+    if (result == 0)
+        result = kftp_stream_flush(&out_stream);
+    if (result < 0)
+        return result;
+
+    int reply;
+    result = kftp_stream_read_int(&in_stream, &reply);
+    if (result < 0)
+        return result;
+    if (reply != KFTP_MODIFIED && reply != KFTP_NOT_MODIFIED) {
+        fprintf(stderr, "ERROR in kftp_offer_fingerprint: invalid reply %d\n", reply);
+        return -1;
+    }
+    return reply;
+}
+
+int kftp_check_fingerprint(KftpFingerprint* fingerprint, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream in_stream = {.socket_info=from, .receiver=receiver};
+    KftpStream out_stream = {.socket_info=from, .sender=sender, .receiver=receiver};
+
+    int has_copy;
+    KftpFingerprint offered = {};
+    int result = kftp_stream_read_int(&in_stream, &has_copy);
+    if (result == 0 && has_copy)
+        result = kftp_stream_read_uint64(&in_stream, &offered.size);
+    if (result == 0 && has_copy)
+        result = kftp_stream_read_hash(&in_stream, &offered.hash);
+    if (result < 0)
+        return result;
+
+    int reply = KFTP_MODIFIED;
+    if (has_copy && fingerprint != NULL && offered.size == fingerprint->size && offered.hash == fingerprint->hash)
+        reply = KFTP_NOT_MODIFIED;
+
+    result = kftp_stream_write_int(&out_stream, reply);
+    if (result == 0)
+        result = kftp_stream_flush(&out_stream);
+    return result < 0 ? result : reply;
+}
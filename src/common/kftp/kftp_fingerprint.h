@@ -0,0 +1,97 @@
+//
+// KFTP conditional transfer interface
+//
+// Before a conditional transfer, the receiver sends the fingerprint of its copy of the file (if it has one) to the
+// sender. If the sender's copy has the same fingerprint, it replies that the file is not modified and the transfer is
+// skipped, so syncing an unchanged file only takes a single round trip.
+//
+// Fingerprints are made of the size and XXH64 hash of a file. Hashing a large file is expensive, so an index can be used
+// to remember the fingerprints of files that haven't changed (i.e. that still have the same size and modification
+// time) since they were last hashed. An index can be saved to a file and loaded again, so it outlives the program.
+//
+
+#ifndef UDP_KFTP_FINGERPRINT_H
+#define UDP_KFTP_FINGERPRINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "../reliable_udp/types.h"
+
+
+// number of hash buckets used to look up indexed fingerprints by path
+#define KFTP_FINGERPRINT_BUCKETS 256
+
+// most fingerprints that are indexed at a time. The index is cleared when it is full.
+#define KFTP_FINGERPRINT_INDEX_SIZE 4096
+
+// Replies to a fingerprint
+#define KFTP_MODIFIED 0         // the sender's copy differs, so the file follows
+#define KFTP_NOT_MODIFIED 1     // the receiver's copy is up to date, so nothing follows
+
+
+typedef struct {
+    uint64_t size;
+    uint64_t hash;  // XXH64 hash (seed 0) of the contents of the file
+} KftpFingerprint;
+
+typedef struct KftpFingerprintEntry {
+    char* path;
+    KftpFingerprint fingerprint;
+
+    // identifies the version of the file that was hashed
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+
+    struct KftpFingerprintEntry* next;     // next entry in the same hash bucket
+} KftpFingerprintEntry;
+
+typedef struct {
+    KftpFingerprintEntry* buckets[KFTP_FINGERPRINT_BUCKETS];
+    int count;
+    bool changed;           // set when a fingerprint is indexed, and cleared when the index is loaded or saved
+    unsigned long hits;     // fingerprints that didn't need to be computed again
+    unsigned long misses;
+} KftpFingerprintIndex;
+
+
+void kftp_fingerprint_index_init(KftpFingerprintIndex* index);
+
+// Frees all the entries in the index
+void kftp_fingerprint_index_free(KftpFingerprintIndex* index);
+
+// Adds the fingerprints saved in `filename` by kftp_fingerprint_index_save() to the index. Saved fingerprints are checked
+// against the file they were computed for like any other, so ones that have gone stale since are never used.
+//
+// Returns 0 on success (or if there's no such file yet), and a negative int if the file could not be read, in which case
+// the index is left empty.
+int kftp_fingerprint_index_load(KftpFingerprintIndex* index, char* filename);
+
+// Saves the fingerprints in the index to `filename`. The file is replaced all at once, so it never holds half an index.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_fingerprint_index_save(KftpFingerprintIndex* index, char* filename);
+
+// Computes the fingerprint of the regular file at `path`. If `index` isn't NULL, the fingerprint is taken from the index
+// when the file hasn't changed since it was indexed, and the index is updated otherwise.
+//
+// Returns 0 on success, and a negative int if the file could not be read.
+int kftp_fingerprint_file(KftpFingerprintIndex* index, char* path, KftpFingerprint* fingerprint);
+
+// Sends the fingerprint of the receiver's copy of a file to `to`, or that there is no copy if `fingerprint` is NULL, and
+// receives the sender's reply.
+//
+// Returns KFTP_MODIFIED if the file will be sent, KFTP_NOT_MODIFIED if it won't, and a negative int on failure.
+int kftp_offer_fingerprint(KftpFingerprint* fingerprint, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives the fingerprint of the receiver's copy of a file from `from`, and replies whether it matches `fingerprint`,
+// the fingerprint of the sender's copy. `fingerprint` may be NULL if the sender couldn't fingerprint its copy, in which
+// case the file is always treated as modified.
+//
+// Returns KFTP_MODIFIED if the file should be sent, KFTP_NOT_MODIFIED if it shouldn't, and a negative int on failure.
+int kftp_check_fingerprint(KftpFingerprint* fingerprint, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_FINGERPRINT_H
@@ -0,0 +1,164 @@
+//
+// KFTP directory listing implementation
+//
+// A listing is sent as the length and bytes of each name, followed by a length of 0 (names are never empty) and the
+// status of the listing.
+//
+// Names are listed from a sorted index of the directory. Only names starting with the literal part of the pattern (the
+// part before its first wildcard) can match, and those are next to each other in the index, so listing them takes time
+// proportional to the number of names with that prefix rather than the size of the directory.
+//
+
+// needed for strndup
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_listing.h"
+
+#include "kftp_stream.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+// characters that make a pattern more than a literal name
+#define GLOB_CHARACTERS "*?[\\"
+
+
+void kftp_list_filter_init(KftpListFilter* filter, char* pattern, long offset, long limit) {
+    *filter = (KftpListFilter) {.pattern=pattern, .prefix_length=-1, .offset=offset, .limit=limit};
+    if (pattern == NULL)
+        return;
+
+    // a pattern like "log-*" only checks a prefix, which doesn't need the full glob matching of fnmatch
+    size_t length = strlen(pattern);
+    if (length > 0 && pattern[length - 1] == '*' && strcspn(pattern, GLOB_CHARACTERS) == length - 1)
+        filter->prefix_length = (int) length - 1;
+}
+
+bool kftp_list_matches(KftpListFilter* filter, char* name) {
+    if (filter->pattern == NULL)
+        return true;
+    if (filter->prefix_length >= 0)
+        return strncmp(name, filter->pattern, filter->prefix_length) == 0;
+    return fnmatch(filter->pattern, name, 0) == 0;
+}
+
+
+int kftp_list_names(DirIndex* index, KftpListFilter* filter, KftpListVisitor visit, void* context) {
+    char* prefix = strndup(filter->pattern != NULL ? filter->pattern : "",
+                           filter->pattern != NULL ? strcspn(filter->pattern, GLOB_CHARACTERS) : 0);
+    if (prefix == NULL || dir_index_refresh(index) < 0) {
+        fprintf(stderr, "ERROR in kftp_list_names: could not read directory\n");
+        free(prefix);
+        return -1;
+    }
+
+    // without other wildcards, every name with the prefix matches, so the skipped names don't need to be looked at
+    bool prefix_only = filter->pattern == NULL || filter->prefix_length >= 0;
+    size_t prefix_length = strlen(prefix);
+    long position = dir_index_lower_bound(index, prefix);
+    if (prefix_only)
+        position = filter->offset < index->count - position ? position + filter->offset : index->count;
+
+    long skipped = 0;
+    long visited = 0;
+    int status = KFTP_LIST_DONE;
+    for (; position < index->count; position++) {
+        char* name = index->names[position];
+        if (strncmp(name, prefix, prefix_length) != 0)
+            break;
+        if (!prefix_only && !kftp_list_matches(filter, name))
+            continue;
+        if (!prefix_only && skipped < filter->offset) {
+            skipped++;
+            continue;
+        }
+        if (filter->limit != KFTP_LIST_UNLIMITED && visited == filter->limit) {
+            status = KFTP_LIST_MORE;
+            break;
+        }
+
+        int visit_status = visit(name, context);
+        if (visit_status < 0) {
+            status = visit_status;
+            break;
+        }
+        visited++;
+    }
+
+    free(prefix);
+    return status;
+}
+
+
+// Stream a listing is sent over, and the status of its writes
+typedef struct {
+    KftpStream stream;
+    int status;
+} ListingStream;
+
+static int write_name(char* name, void* context) {
+    ListingStream* listing = context;
+    int length = (int) strlen(name);
+    listing->status = kftp_stream_write_int(&listing->stream, length);
+    if (listing->status == 0)
+        listing->status = kftp_stream_write(&listing->stream, name, length);
+    return listing->status;
+}
+
+int kftp_send_listing(DirIndex* index, KftpListFilter* filter, SocketInfo* to, RudpSender* sender,
+                      RudpReceiver* receiver) {
+    ListingStream listing = {.stream={.socket_info=to, .sender=sender, .receiver=receiver}};
+
+    // the receiver is still sent the end of the listing if the directory can't be read, so it isn't left waiting for
+    // names
+    int list_status = kftp_list_names(index, filter, write_name, &listing);
+
+    int status = listing.status;
+    if (status == 0)
+        status = kftp_stream_write_int(&listing.stream, 0);
+    if (status == 0)
+        status = kftp_stream_write_int(&listing.stream, list_status);
+    if (status == 0)
+        status = kftp_stream_flush(&listing.stream);
+    return status;
+}
+
+
+int kftp_recv_listing(FILE* out, KftpListResult* result, SocketInfo* from, RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=from, .receiver=receiver};
+    char name[KFTP_LIST_MAX_NAME_LENGTH + 1];
+    *result = (KftpListResult) {};
+
+    while (true) {
+        int length;
+        int status = kftp_stream_read_int(&stream, &length);
+        if (status < 0)
+            return status;
+        if (length == 0)
+            break;
+        if (length < 0 || length > KFTP_LIST_MAX_NAME_LENGTH) {
+            fprintf(stderr, "ERROR in kftp_recv_listing: invalid name length %d\n", length);
+            return -1;
+        }
+
+        status = kftp_stream_read(&stream, name, length);
+        if (status < 0)
+            return status;
+        name[length] = 0;
+        fprintf(out, "%s\n", name);
+        result->count++;
+    }
+
+    int list_status;
+    int status = kftp_stream_read_int(&stream, &list_status);
+    if (status < 0)
+        return status;
+    if (list_status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_listing: sender could not read the directory\n");
+        return list_status;
+    }
+
+    result->more = list_status == KFTP_LIST_MORE;
+    return 0;
+}
@@ -0,0 +1,76 @@
+//
+// KFTP directory listing interface
+//
+// Listings are streamed over a single KFTP stream, so there's no limit on the number of files that can be listed. The
+// sender lists the names from a sorted index of the directory, filters them (by a glob pattern) and pages through them,
+// so the receiver is only sent the names it asked for.
+//
+
+#ifndef UDP_KFTP_LISTING_H
+#define UDP_KFTP_LISTING_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../dir_index.h"
+#include "../reliable_udp/types.h"
+
+
+// limit used to list every matching file
+#define KFTP_LIST_UNLIMITED (-1)
+
+// longest file name that can be listed
+#define KFTP_LIST_MAX_NAME_LENGTH 255
+
+// Status sent at the end of a listing. Other statuses are negative if the directory could not be read.
+#define KFTP_LIST_DONE 0    // every matching name was sent
+#define KFTP_LIST_MORE 1    // the listing stopped at the limit, and more names match
+
+
+// Selects the names sent in a listing
+typedef struct {
+    char* pattern;          // glob pattern the names must match, or NULL to list every file
+    int prefix_length;      // length of the prefix if the pattern is just a prefix followed by '*', -1 otherwise
+    long offset;            // number of matching names to skip
+    long limit;             // most names to send, or KFTP_LIST_UNLIMITED
+} KftpListFilter;
+
+// Summary of a received listing
+typedef struct {
+    long count;             // number of names received
+    bool more;              // set if more names match past the ones received
+} KftpListResult;
+
+
+// Sets up `filter` to select the names matching `pattern` (or every name if it's NULL), skipping the first `offset`
+// matches and selecting at most `limit` of the rest
+void kftp_list_filter_init(KftpListFilter* filter, char* pattern, long offset, long limit);
+
+// Returns true if `name` matches the filter's pattern. Prefix patterns (e.g. "log-*") are matched without fnmatch.
+bool kftp_list_matches(KftpListFilter* filter, char* name);
+
+// Called with each name selected for a listing. Returning a negative int stops the listing.
+typedef int (*KftpListVisitor)(char* name, void* context);
+
+// Refreshes `index`, then calls `visit` (with `context`) on the names of the regular files in its directory that are
+// selected by `filter`, in sorted order
+//
+// Returns the status of the listing (KFTP_LIST_DONE or KFTP_LIST_MORE), or a negative int if the directory could not be
+// read or `visit` failed.
+int kftp_list_names(DirIndex* index, KftpListFilter* filter, KftpListVisitor visit, void* context);
+
+// Refreshes `index`, then sends the names of the regular files in its directory that are selected by `filter` to `to`,
+// in sorted order
+//
+// Returns 0 on success (even if the directory could not be read, which the receiver is told about), and a negative int
+// if the stream failed.
+int kftp_send_listing(DirIndex* index, KftpListFilter* filter, SocketInfo* to, RudpSender* sender,
+                      RudpReceiver* receiver);
+
+// Receives a listing from `from`, writing each name to `out` (followed by a newline) as soon as it arrives
+//
+// Returns 0 on success, and a negative int if the listing could not be received or the sender could not read the
+// directory.
+int kftp_recv_listing(FILE* out, KftpListResult* result, SocketInfo* from, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_LISTING_H
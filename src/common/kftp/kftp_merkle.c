@@ -0,0 +1,376 @@
+//
+// KFTP Merkle-verified transfer implementation
+//
+// A Merkle-verified transfer is sent as:
+//  - sender: the block size (-1 if the file couldn't be read), the size of the file (as a uint64), the root of the
+//    Merkle tree, the hash of each block (the leaves of the tree), then the contents of every block
+//  - receiver: the number of blocks that failed their check (-1 if it refuses the file), then the index of each one
+//  - sender: the contents of each bad block, in the order they were asked for, after which the receiver again replies
+//    with the blocks that are still bad. This is repeated until no blocks are bad, or KFTP_MERKLE_MAX_REPAIRS repairs
+//    were made.
+//
+// The leaves are the XXH64 hashes (seed 0) of the blocks, and each parent is the XXH64 hash (seed 1) of its two
+// children. A node without a sibling is moved up to the next level as is.
+//
+
+// needed for pread and pwrite
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_merkle.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// seed of the hash combining two nodes of the tree, so that a parent can't be mistaken for a block
+#define MERKLE_NODE_SEED 1
+
+
+// Range of blocks hashed by a single thread
+typedef struct {
+    int fd;
+    uint64_t file_size;
+    int block_size;
+    uint64_t* leaves;
+    int first;
+    int count;
+    int status;
+} MerkleHashJob;
+
+
+int kftp_merkle_block_size(uint64_t file_size) {
+    uint64_t block_size = KFTP_MERKLE_BLOCK_SIZE;
+    while (block_size < KFTP_MERKLE_MAX_BLOCK_SIZE && (file_size + block_size - 1) / block_size > KFTP_MERKLE_MAX_BLOCKS)
+        block_size *= 2;
+    return (int) block_size;
+}
+
+static int block_count(uint64_t file_size, int block_size) {
+    return (int) ((file_size + block_size - 1) / block_size);
+}
+
+static int block_length(uint64_t file_size, int block_size, int index) {
+    uint64_t offset = (uint64_t) index * block_size;
+    return file_size - offset < (uint64_t) block_size ? (int) (file_size - offset) : block_size;
+}
+
+// Thread that hashes a contiguous range of blocks
+static void* hash_job(void* arg) {
+    MerkleHashJob* job = arg;
+    char* buffer = malloc(job->block_size);
+    job->status = buffer == NULL ? -1 : 0;
+
+    for (int i = job->first; job->status == 0 && i < job->first + job->count; i++) {
+        int length = block_length(job->file_size, job->block_size, i);
+        if (pread(job->fd, buffer, length, (off_t) i * job->block_size) != length) {
+            fprintf(stderr, "ERROR in hash_job: error reading file\n");
+            job->status = -1;
+            break;
+        }
+        job->leaves[i] = xxh64(buffer, length, 0);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+int kftp_merkle_hash_blocks(int fd, uint64_t file_size, int block_size, uint64_t* leaves) {
+    int count = block_count(file_size, block_size);
+    int per_thread = (count + KFTP_MERKLE_THREADS - 1) / KFTP_MERKLE_THREADS;
+    MerkleHashJob jobs[KFTP_MERKLE_THREADS];
+    pthread_t threads[KFTP_MERKLE_THREADS];
+    int started = 0;
+    int status = 0;
+
+    for (int first = 0; first < count; first += per_thread) {
+        MerkleHashJob* job = &jobs[started];
+        *job = (MerkleHashJob) {.fd=fd, .file_size=file_size, .block_size=block_size, .leaves=leaves, .first=first,
+                                .count=count - first < per_thread ? count - first : per_thread};
+        if (pthread_create(&threads[started], NULL, hash_job, job) != 0) {
+            fprintf(stderr, "ERROR in kftp_merkle_hash_blocks: could not start hashing thread\n");
+            status = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].status < 0)
+            status = jobs[i].status;
+    }
+    return status;
+}
+
+uint64_t kftp_merkle_root(uint64_t* leaves, int count) {
+    if (count == 0)
+        return xxh64(NULL, 0, 0);
+
+    uint64_t* level = malloc(count * sizeof(uint64_t));
+    if (level == NULL)
+        return 0;
+    memcpy(level, leaves, count * sizeof(uint64_t));
+
+    // each level is built in place over the one below it
+    while (count > 1) {
+        int parents = 0;
+        for (int i = 0; i < count; i += 2) {
+            if (i + 1 == count) {
+                level[parents++] = level[i];
+            } else {
+                uint64_t children[2] = {level[i], level[i + 1]};
+                level[parents++] = xxh64((char*) children, sizeof(children), MERKLE_NODE_SEED);
+            }
+        }
+        count = parents;
+    }
+
+    uint64_t root = level[0];
+    free(level);
+    return root;
+}
+
+int kftp_merkle_verify(int fd, uint64_t root) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        perror("ERROR in kftp_merkle_verify");
+        return -1;
+    }
+
+    uint64_t file_size = file_stat.st_size;
+    int block_size = kftp_merkle_block_size(file_size);
+    int count = block_count(file_size, block_size);
+    uint64_t* leaves = malloc(count * sizeof(uint64_t) + 1);
+    if (leaves == NULL)
+        return -1;
+
+    int status = kftp_merkle_hash_blocks(fd, file_size, block_size, leaves);
+    if (status == 0 && kftp_merkle_root(leaves, count) != root)
+        status = KFTP_INTEGRITY_ERROR;
+
+    free(leaves);
+    return status;
+}
+
+
+// Sends the blocks whose indices are listed in `blocks`, reading them with `buffer` (block_size bytes)
+static int send_blocks(KftpStream* stream, int fd, uint64_t file_size, int block_size, int* blocks, int count,
+                       char* buffer) {
+    for (int i = 0; i < count; i++) {
+        int length = block_length(file_size, block_size, blocks[i]);
+
+        // if the file changed since it was hashed, the receiver will notice that the block doesn't match its hash
+        if (pread(fd, buffer, length, (off_t) blocks[i] * block_size) != length)
+            memset(buffer, 0, length);
+        int result = kftp_stream_write(stream, buffer, length);
+        if (result < 0)
+            return result;
+    }
+    return kftp_stream_flush(stream);
+}
+
+int kftp_send_file_merkle(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream out_stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    KftpStream in_stream = {.socket_info=to, .receiver=receiver};
+
+    int fd = fileno(read_fp);
+    struct stat file_stat;
+    int status = fd < 0 || fstat(fd, &file_stat) < 0 ? -1 : 0;
+    uint64_t file_size = status == 0 ? file_stat.st_size : 0;
+    int block_size = kftp_merkle_block_size(file_size);
+    int count = block_count(file_size, block_size);
+
+    // blocks[] first lists every block, then the blocks the receiver asks for again
+    uint64_t* leaves = malloc(count * sizeof(uint64_t) + 1);
+    int* blocks = malloc(count * sizeof(int) + 1);
+    char* buffer = malloc(block_size);
+    if (leaves == NULL || blocks == NULL || buffer == NULL)
+        status = -1;
+    if (status == 0)
+        status = kftp_merkle_hash_blocks(fd, file_size, block_size, leaves);
+    if (status < 0)
+        fprintf(stderr, "ERROR in kftp_send_file_merkle: could not hash file\n");
+
+    // the receiver is told if the file couldn't be read, so it isn't left waiting for the tree
+    int result = kftp_stream_write_int(&out_stream, status < 0 ? -1 : block_size);
+    if (result == 0)
+        result = kftp_stream_write_uint64(&out_stream, file_size);
+    if (result == 0 && status == 0)
+        result = kftp_stream_write_hash(&out_stream, kftp_merkle_root(leaves, count));
+    for (int i = 0; status == 0 && result == 0 && i < count; i++)
+        result = kftp_stream_write_hash(&out_stream, leaves[i]);
+    if (status < 0 && result == 0)
+        result = kftp_stream_flush(&out_stream);
+
+    for (int i = 0; i < count && blocks != NULL; i++)
+        blocks[i] = i;
+    int bad_count = count;
+    int repairs = 0;
+    while (status == 0 && result == 0) {
+        result = send_blocks(&out_stream, fd, file_size, block_size, blocks, bad_count, buffer);
+
+        // all the indices are read before any blocks are sent again, since RUDP only has one message in flight at a time
+        if (result == 0)
+            result = kftp_stream_read_int(&in_stream, &bad_count);
+        if (result == 0 && (bad_count < 0 || bad_count > count)) {
+            fprintf(stderr, "ERROR in kftp_send_file_merkle: receiver refused the file\n");
+            status = -1;
+        }
+        for (int i = 0; status == 0 && result == 0 && i < bad_count; i++) {
+            result = kftp_stream_read_int(&in_stream, &blocks[i]);
+            if (result == 0 && (blocks[i] < 0 || blocks[i] >= count)) {
+                fprintf(stderr, "ERROR in kftp_send_file_merkle: receiver asked for invalid block %d\n", blocks[i]);
+                status = -1;
+            }
+        }
+
+        if (status < 0 || result < 0 || bad_count == 0)
+            break;
+        if (repairs == KFTP_MERKLE_MAX_REPAIRS) {
+            fprintf(stderr, "ERROR in kftp_send_file_merkle: %d blocks still bad after %d repairs\n", bad_count,
+                    repairs);
+            status = KFTP_INTEGRITY_ERROR;
+            break;
+        }
+        fprintf(stderr, "Resending %d bad blocks\n", bad_count);
+        repairs++;
+    }
+
+    free(leaves);
+    free(blocks);
+    free(buffer);
+    return status < 0 ? status : result;
+}
+
+
+// Reads and drops `size` bytes of blocks, so the sender isn't left waiting for the receiver to take them
+static int skip_blocks(KftpStream* stream, uint64_t size) {
+    char buffer[BUFSIZ];
+    while (size > 0) {
+        int length = size < sizeof(buffer) ? (int) size : (int) sizeof(buffer);
+        int result = kftp_stream_read(stream, buffer, length);
+        if (result < 0)
+            return result;
+        size -= length;
+    }
+    return 0;
+}
+
+// Receives the blocks listed in `blocks`, writing the ones that match their leaf and moving the indices of the others
+// to the front of `blocks`. If a block can't be written, `write_failed` is set and the rest of the blocks are still
+// received (but not written), so the receiver can reply to the sender.
+//
+// Returns the number of bad blocks, or a negative int on failure.
+static int recv_blocks(KftpStream* stream, int fd, uint64_t file_size, int block_size, uint64_t* leaves, int* blocks,
+                       int count, char* buffer, bool* write_failed) {
+    int bad_count = 0;
+    for (int i = 0; i < count; i++) {
+        int length = block_length(file_size, block_size, blocks[i]);
+        int result = kftp_stream_read(stream, buffer, length);
+        if (result < 0)
+            return result;
+
+        if (*write_failed)
+            continue;
+        if (xxh64(buffer, length, 0) != leaves[blocks[i]]) {
+            blocks[bad_count++] = blocks[i];
+        } else if (pwrite(fd, buffer, length, (off_t) blocks[i] * block_size) != length) {
+            fprintf(stderr, "ERROR in recv_blocks: error writing to file\n");
+            *write_failed = true;
+        }
+    }
+    return bad_count;
+}
+
+int kftp_recv_file_merkle(FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream in_stream = {.socket_info=from, .receiver=receiver};
+    KftpStream out_stream = {.socket_info=from, .sender=sender, .receiver=receiver};
+
+    int block_size = 0;
+    uint64_t file_size = 0;
+    int result = kftp_stream_read_int(&in_stream, &block_size);
+    if (result == 0)
+        result = kftp_stream_read_uint64(&in_stream, &file_size);
+    if (result < 0)
+        return result;
+    if (block_size < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_file_merkle: sender could not read the file\n");
+        return -1;
+    }
+    if (block_size != kftp_merkle_block_size(file_size)) {
+        // without the right block size the rest of the transfer can't be parsed, so it is abandoned
+        fprintf(stderr, "ERROR in kftp_recv_file_merkle: unexpected block size %d\n", block_size);
+        return -1;
+    }
+
+    int count = block_count(file_size, block_size);
+    uint64_t root = 0;
+    uint64_t* leaves = malloc(count * sizeof(uint64_t) + 1);
+    int* blocks = malloc(count * sizeof(int) + 1);
+    char* buffer = malloc(block_size);
+    int status = leaves == NULL || blocks == NULL || buffer == NULL ? -1 : 0;
+
+    result = kftp_stream_read_hash(&in_stream, &root);
+    for (int i = 0; result == 0 && i < count; i++) {
+        uint64_t leaf = 0;
+        result = kftp_stream_read_hash(&in_stream, &leaf);
+        if (status == 0)
+            leaves[i] = leaf;
+    }
+    if (status == 0 && result == 0 && kftp_merkle_root(leaves, count) != root) {
+        fprintf(stderr, "ERROR in kftp_recv_file_merkle: block hashes don't match the root\n");
+        status = KFTP_INTEGRITY_ERROR;
+    }
+
+    int fd = fileno(write_fp);
+    for (int i = 0; status == 0 && i < count; i++)
+        blocks[i] = i;
+    int bad_count = count;
+    for (int repairs = 0; result == 0; repairs++) {
+        if (status < 0) {
+            result = skip_blocks(&in_stream, file_size);
+        } else {
+            bool write_failed = false;
+            bad_count = recv_blocks(&in_stream, fd, file_size, block_size, leaves, blocks, bad_count, buffer,
+                                    &write_failed);
+            if (bad_count < 0)
+                status = result = bad_count;
+            else if (write_failed)
+                status = -1;  // the sender is told the file was refused, rather than left waiting for a reply
+        }
+        if (result < 0)
+            break;
+
+        result = kftp_stream_write_int(&out_stream, status < 0 ? -1 : bad_count);
+        for (int i = 0; status == 0 && result == 0 && i < bad_count; i++)
+            result = kftp_stream_write_int(&out_stream, blocks[i]);
+        if (result == 0)
+            result = kftp_stream_flush(&out_stream);
+
+        if (status < 0 || bad_count == 0)
+            break;
+        if (repairs == KFTP_MERKLE_MAX_REPAIRS) {
+            fprintf(stderr, "ERROR in kftp_recv_file_merkle: %d blocks still bad after %d repairs\n", bad_count,
+                    repairs);
+            status = KFTP_INTEGRITY_ERROR;
+            break;
+        }
+        fprintf(stderr, "Re-requesting %d bad blocks\n", bad_count);
+    }
+
+    if (status == 0 && result == 0)
+        fprintf(stderr, "Merkle root: %016" PRIx64 "\n", root);
+    free(leaves);
+    free(blocks);
+    free(buffer);
+    return status < 0 ? status : result;
+}
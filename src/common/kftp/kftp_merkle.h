@@ -0,0 +1,64 @@
+//
+// KFTP Merkle-verified transfer interface
+//
+// Merkle-verified transfers split a file into fixed-size blocks and hash each block (in parallel, over several threads).
+// The block hashes are the leaves of a Merkle tree, whose root identifies the whole file. The sender sends the root and
+// the leaves before the blocks, so the receiver can verify each block as it lands instead of only finding out at the
+// end that some part of the file is corrupt. Blocks that fail their check are re-requested, and only those blocks are
+// sent again.
+//
+// Since the leaves can be hashed in parallel, a file can also be checked against a stored root without a full serial
+// rehash.
+//
+
+#ifndef UDP_KFTP_MERKLE_H
+#define UDP_KFTP_MERKLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../reliable_udp/types.h"
+
+
+// Blocks are at least this large, and grow (by powers of two) so that a file never has more than KFTP_MERKLE_MAX_BLOCKS
+#define KFTP_MERKLE_BLOCK_SIZE (64 * 1024)
+#define KFTP_MERKLE_MAX_BLOCK_SIZE (1 << 30)
+#define KFTP_MERKLE_MAX_BLOCKS (1 << 20)
+
+// number of threads that hash the blocks of a file
+#define KFTP_MERKLE_THREADS 4
+
+// number of times bad blocks are sent again before the transfer fails
+#define KFTP_MERKLE_MAX_REPAIRS 3
+
+
+// Returns the block size used for a file of `file_size` bytes
+int kftp_merkle_block_size(uint64_t file_size);
+
+// Hashes each `block_size` block of the file open as `fd` (of `file_size` bytes) into `leaves`, using
+// KFTP_MERKLE_THREADS threads.
+//
+// Returns 0 on success, and a negative int if the file could not be read.
+int kftp_merkle_hash_blocks(int fd, uint64_t file_size, int block_size, uint64_t* leaves);
+
+// Returns the root of the Merkle tree with the `count` given leaves
+uint64_t kftp_merkle_root(uint64_t* leaves, int count);
+
+// Checks the file open as `fd` against the Merkle `root` it had when it was sent or received.
+//
+// Returns 0 if the file matches, KFTP_INTEGRITY_ERROR if it doesn't, and another negative int on failure.
+int kftp_merkle_verify(int fd, uint64_t root);
+
+// Reads from the specified `read_fp` and sends its blocks to `to`, along with the Merkle tree used to verify them.
+// Blocks that the receiver reports as bad are sent again.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_file_merkle(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives the blocks sent by `from` into `write_fp`, verifying each one as it lands and re-requesting the bad ones.
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if some blocks were still bad after KFTP_MERKLE_MAX_REPAIRS repairs, and
+// another negative int on failure.
+int kftp_recv_file_merkle(FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_MERKLE_H
@@ -0,0 +1,263 @@
+//
+// KFTP pipeline implementation
+//
+// A pipeline is sent as:
+//  - the pipeline command, a control message holding the number of commands. It starts the first RUDP message of the
+//    pipeline, so the receiver reads it like any other command.
+//  - each command as its serialized size, followed by the serialized command
+//
+// Each completion is sent back as the serialized size of the reply, the reply, and the size of the data returned by the
+// command (0 if there's none). Any data follows, along with its XXH64 hash.
+//
+
+#include "kftp_pipeline.h"
+
+#include "kftp.h"
+#include "../hash.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// State shared by the threads running the commands of a pipeline
+typedef struct {
+    KftpCommand* commands;
+    int count;
+    int next;                       // index of the next command to run
+    pthread_mutex_t next_lock;
+
+    KftpPipelineHandler handler;
+    void* context;
+
+    // completions are written by whichever thread finished the command, and none are written once a write fails
+    KftpStream stream;
+    int status;
+    pthread_mutex_t stream_lock;
+} PipelineRun;
+
+
+bool kftp_pipeline_allows(KftpCommand* command) {
+    switch (command->opcode) {
+        case KFTP_OP_DELETE:
+        case KFTP_OP_LS:
+            return true;
+        case KFTP_OP_GET:
+            // the file is returned in the completion, so it can't be sent with any of the other transfers
+            return (command->flags & ~KFTP_FLAG_RANGED) == 0;
+        default:
+            return false;
+    }
+}
+
+
+// Writes a control message to the stream, preceded by its size
+static int write_command(KftpStream* stream, KftpCommand* command) {
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int size = serialize_kftp_command(command, buffer, KFTP_COMMAND_MAX_SIZE);
+    if (size < 0)
+        return size;
+
+    int status = kftp_stream_write_int(stream, size);
+    if (status == 0)
+        status = kftp_stream_write(stream, buffer, size);
+    return status;
+}
+
+// Reads a control message written by write_command into `buffer`, returning its size or a negative int on failure
+static int read_command(KftpStream* stream, char* buffer) {
+    int size;
+    int status = kftp_stream_read_int(stream, &size);
+    if (status < 0)
+        return status;
+    if (size < KFTP_COMMAND_HEADER_SIZE || size > KFTP_COMMAND_MAX_SIZE) {
+        fprintf(stderr, "ERROR in read_command: invalid command size %d\n", size);
+        return -1;
+    }
+
+    status = kftp_stream_read(stream, buffer, size);
+    return status < 0 ? status : size;
+}
+
+
+int kftp_send_pipeline(KftpCommand* commands, int count, uint32_t request_id, SocketInfo* to, RudpSender* sender,
+                       RudpReceiver* receiver) {
+    KftpCommand header;
+    kftp_command_init(&header, KFTP_OP_PIPELINE, request_id, 0);
+    kftp_command_add_uint64(&header, count);
+
+    // the header isn't preceded by its size, since the receiver parses it as a single command
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int status = serialize_kftp_command(&header, buffer, KFTP_COMMAND_MAX_SIZE);
+    KftpStream stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+    if (status >= 0)
+        status = kftp_stream_write(&stream, buffer, status);
+
+    for (int i = 0; status == 0 && i < count; i++)
+        status = write_command(&stream, &commands[i]);
+    if (status == 0)
+        status = kftp_stream_flush(&stream);
+
+    if (status < 0)
+        fprintf(stderr, "ERROR in kftp_send_pipeline: could not send commands\n");
+    return status;
+}
+
+
+int kftp_recv_pipeline(KftpCommand* header, char* received, int received_size, KftpCommand** commands,
+                       SocketInfo* from, RudpReceiver* receiver) {
+    uint64_t count;
+    if (kftp_command_arg_uint64(header, 0, &count) < 0 || count == 0 || count > KFTP_PIPELINE_MAX_COMMANDS
+        || received_size < 0 || received_size > MAX_PAYLOAD_SIZE) {
+        fprintf(stderr, "ERROR in kftp_recv_pipeline: invalid pipeline\n");
+        return -1;
+    }
+
+    KftpStream stream = {.socket_info=from, .receiver=receiver, .length=received_size};
+    memcpy(stream.buffer, received, received_size);
+
+    *commands = malloc(count * sizeof(KftpCommand));
+    if (*commands == NULL) {
+        fprintf(stderr, "ERROR in kftp_recv_pipeline: could not allocate commands\n");
+        return -1;
+    }
+
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    for (int i = 0; i < (int) count; i++) {
+        int size = read_command(&stream, buffer);
+        if (size < 0) {
+            fprintf(stderr, "ERROR in kftp_recv_pipeline: could not receive command %d of %d\n", i + 1, (int) count);
+            free(*commands);
+            *commands = NULL;
+            return size;
+        }
+
+        // the command is still run, so the sender is told it's invalid
+        if (deserialize_kftp_command(buffer, size, &(*commands)[i]) < 0)
+            (*commands)[i].opcode = 0;
+    }
+
+    return (int) count;
+}
+
+
+static int write_completion(KftpStream* stream, KftpCompletion* completion) {
+    int status = write_command(stream, &completion->reply);
+    if (status == 0)
+        status = kftp_stream_write_int(stream, completion->data_size);
+    if (status == 0 && completion->data_size > 0) {
+        status = kftp_stream_write(stream, completion->data, completion->data_size);
+        if (status == 0)
+            status = kftp_stream_write_hash(stream, xxh64(completion->data, completion->data_size, 0));
+    }
+    return status;
+}
+
+// Thread that runs commands of the pipeline until there are none left
+static void* pipeline_worker(void* arg) {
+    PipelineRun* run = arg;
+
+    while (true) {
+        pthread_mutex_lock(&run->next_lock);
+        int i = run->next < run->count ? run->next++ : -1;
+        pthread_mutex_unlock(&run->next_lock);
+        if (i < 0)
+            break;
+
+        // the handler only needs to fill in the reply if the command failed or has a message
+        KftpCompletion completion = {.data=NULL};
+        kftp_command_init_reply(&completion.reply, &run->commands[i], 0, "");
+        run->handler(&run->commands[i], &completion, run->context);
+
+        pthread_mutex_lock(&run->stream_lock);
+        if (run->status == 0)
+            run->status = write_completion(&run->stream, &completion);
+        pthread_mutex_unlock(&run->stream_lock);
+        free(completion.data);
+    }
+
+    return NULL;
+}
+
+int kftp_run_pipeline(KftpCommand* commands, int count, KftpPipelineHandler handler, void* context, SocketInfo* to,
+                      RudpSender* sender, RudpReceiver* receiver) {
+    PipelineRun run = {.commands=commands, .count=count, .handler=handler, .context=context,
+                       .stream={.socket_info=to, .sender=sender, .receiver=receiver}};
+    pthread_mutex_init(&run.next_lock, NULL);
+    pthread_mutex_init(&run.stream_lock, NULL);
+
+    pthread_t threads[KFTP_PIPELINE_THREADS];
+    int started = 0;
+    while (started < KFTP_PIPELINE_THREADS && started < count
+           && pthread_create(&threads[started], NULL, pipeline_worker, &run) == 0)
+        started++;
+
+    // without any threads, the commands are run one after another instead
+    if (started == 0) {
+        fprintf(stderr, "ERROR in kftp_run_pipeline: could not start threads, running commands in order\n");
+        pipeline_worker(&run);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&run.next_lock);
+    pthread_mutex_destroy(&run.stream_lock);
+
+    if (run.status == 0)
+        run.status = kftp_stream_flush(&run.stream);
+    if (run.status < 0)
+        fprintf(stderr, "ERROR in kftp_run_pipeline: could not send completions\n");
+    return run.status;
+}
+
+
+int kftp_recv_completion(KftpStream* stream, KftpCompletion* completion) {
+    completion->data = NULL;
+    completion->data_size = 0;
+
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int size = read_command(stream, buffer);
+    if (size < 0)
+        return size;
+    if (deserialize_kftp_command(buffer, size, &completion->reply) < 0 || completion->reply.opcode != KFTP_OP_REPLY) {
+        fprintf(stderr, "ERROR in kftp_recv_completion: invalid reply\n");
+        return -1;
+    }
+
+    int data_size;
+    int status = kftp_stream_read_int(stream, &data_size);
+    if (status < 0)
+        return status;
+    if (data_size < 0 || data_size > KFTP_PIPELINE_MAX_DATA_SIZE) {
+        fprintf(stderr, "ERROR in kftp_recv_completion: invalid data size %d\n", data_size);
+        return -1;
+    }
+    if (data_size == 0)
+        return 0;
+
+    char* data = malloc(data_size);
+    if (data == NULL) {
+        fprintf(stderr, "ERROR in kftp_recv_completion: could not allocate data\n");
+        return -1;
+    }
+
+    uint64_t hash;
+    status = kftp_stream_read(stream, data, data_size);
+    if (status == 0)
+        status = kftp_stream_read_hash(stream, &hash);
+    if (status < 0) {
+        free(data);
+        return status;
+    }
+
+    // the data has been read in full, so the next completion can still be received
+    if (xxh64(data, data_size, 0) != hash) {
+        free(data);
+        return KFTP_INTEGRITY_ERROR;
+    }
+
+    completion->data = data;
+    completion->data_size = data_size;
+    return 0;
+}
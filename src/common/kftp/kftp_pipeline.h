@@ -0,0 +1,79 @@
+//
+// KFTP pipeline interface
+//
+// A pipeline sends many small commands (delete, ls, and plain or ranged get) without waiting for the reply to each one.
+// RUDP only has a single message in flight, so commands sent one at a time cost a round trip each. Instead, the commands
+// of a pipeline are packed together on a single KFTP stream, so each RUDP message carries dozens of them.
+//
+// The receiver runs the commands concurrently and streams back a completion for each one as soon as it's done, so
+// completions arrive in the order the commands finish and are matched to their commands by request ID. A completion
+// holds the command's reply along with any data it returns (the contents of a file, or the names in a listing), so a
+// pipelined get or ls doesn't need a transfer of its own.
+//
+
+#ifndef UDP_KFTP_PIPELINE_H
+#define UDP_KFTP_PIPELINE_H
+
+#include <stdbool.h>
+
+#include "kftp_command.h"
+#include "kftp_stream.h"
+
+
+// most commands sent in a single pipeline
+#define KFTP_PIPELINE_MAX_COMMANDS 1024
+// most data a single completion can carry, so pipelined gets are limited to small files (or ranges)
+#define KFTP_PIPELINE_MAX_DATA_SIZE (1024 * 1024)
+// most names a pipelined ls returns, which is then replied to with KFTP_LIST_MORE if more names match
+#define KFTP_PIPELINE_MAX_NAMES 4096
+// number of threads the commands of a pipeline are run on
+#define KFTP_PIPELINE_THREADS 4
+
+
+// Result of a pipelined command
+typedef struct {
+    KftpCommand reply;      // reply to the command, with its request ID
+    char* data;             // data returned by the command (allocated with malloc), or NULL
+    int data_size;
+} KftpCompletion;
+
+// Runs a single command of a pipeline, filling in its completion. Called from several threads at once.
+typedef void (*KftpPipelineHandler)(KftpCommand* command, KftpCompletion* completion, void* context);
+
+
+// Returns true if `command` can be sent in a pipeline: delete, ls, and get without transfer flags (a ranged get is
+// allowed)
+bool kftp_pipeline_allows(KftpCommand* command);
+
+// Sends the `count` commands of a pipeline to `to`, preceded by a pipeline command with `request_id`
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_pipeline(KftpCommand* commands, int count, uint32_t request_id, SocketInfo* to, RudpSender* sender,
+                       RudpReceiver* receiver);
+
+// Receives the commands of the pipeline started by `header`. The start of the pipeline arrives in the same RUDP message
+// as its header, so the `received_size` bytes that followed the header in that message are passed in as `received`.
+//
+// A command that can't be parsed is returned with an opcode of 0 (and as much of its request ID as could be read), so it
+// can still be replied to.
+//
+// Returns the number of commands (stored in `commands`, which should be freed with free) on success, and a negative int
+// on failure.
+int kftp_recv_pipeline(KftpCommand* header, char* received, int received_size, KftpCommand** commands,
+                       SocketInfo* from, RudpReceiver* receiver);
+
+// Runs the `count` commands of a pipeline with `handler` on KFTP_PIPELINE_THREADS threads, sending each completion to
+// `to` as soon as its command is done
+//
+// Returns 0 on success, and a negative int if the completions could not be sent.
+int kftp_run_pipeline(KftpCommand* commands, int count, KftpPipelineHandler handler, void* context, SocketInfo* to,
+                      RudpSender* sender, RudpReceiver* receiver);
+
+// Receives the next completion of a pipeline from `stream` (which should be set up to read from the receiver of the
+// pipeline, and kept for all its completions)
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if the completion's data was corrupted (in which case the reply is still
+// set and the next completion can still be received), and a negative int on failure.
+int kftp_recv_completion(KftpStream* stream, KftpCompletion* completion);
+
+#endif //UDP_KFTP_PIPELINE_H
@@ -1,5 +1,5 @@
 //
-// Provides serialize and deserialize functions for KFTP headers
+// Provides serialize and deserialize functions for KFTP headers and trailers
 //
 // We currently don't need to serialize or deserialize KFTP messages since the message only adds the data which is sent
 // incrementally over multiple RUDP messages.
@@ -48,3 +48,58 @@ int deserialize_kftp_header(char* buffer, int buffer_len, KftpHeader * header) {
 
     return i;
 }
+
+int serialize_kftp_trailer(KftpTrailer* trailer, char* buffer, int buffer_len) {
+    if (buffer_len < KFTP_TRAILER_SIZE) {
+        fprintf(stderr, "ERROR in serialize_kftp_trailer: buffer too small to hold trailer\n");
+        return -1;
+    }
+
+    // the 64-bit hash is serialized as two big-endian ints, most significant half first
+    int i = 0;
+    int serialized;
+
+    serialized = serialize_int((int) (trailer->hash >> 32), &buffer[i], buffer_len - i);
+    if (serialized < 0) {
+        fprintf(stderr, "ERROR in serialize_kftp_trailer: error serializing hash field\n");
+        return serialized;
+    }
+    i += serialized;
+
+    serialized = serialize_int((int) (trailer->hash & 0xFFFFFFFF), &buffer[i], buffer_len - i);
+    if (serialized < 0) {
+        fprintf(stderr, "ERROR in serialize_kftp_trailer: error serializing hash field\n");
+        return serialized;
+    }
+    i += serialized;
+
+    return i;
+}
+
+int deserialize_kftp_trailer(char* buffer, int buffer_len, KftpTrailer* trailer) {
+    if (buffer_len < KFTP_TRAILER_SIZE) {
+        fprintf(stderr, "ERROR in deserialize_kftp_trailer: buffer too small to hold trailer\n");
+        return -1;
+    }
+
+    int i = 0;
+    int high, low;
+    int deserialized;
+
+    deserialized = deserialize_int(&buffer[i], buffer_len - i, &high);
+    if (deserialized < 0) {
+        fprintf(stderr, "ERROR in deserialize_kftp_trailer: error deserializing hash field\n");
+        return -1;
+    }
+    i += deserialized;
+
+    deserialized = deserialize_int(&buffer[i], buffer_len - i, &low);
+    if (deserialized < 0) {
+        fprintf(stderr, "ERROR in deserialize_kftp_trailer: error deserializing hash field\n");
+        return -1;
+    }
+    i += deserialized;
+
+    trailer->hash = ((uint64_t) (uint32_t) high << 32) | (uint32_t) low;
+    return i;
+}
@@ -1,5 +1,5 @@
 //
-// Provides serialize and deserialize functions for KFTP headers
+// Provides serialize and deserialize functions for KFTP headers and trailers
 //
 // We currently don't need to serialize or deserialize KFTP messages since the message only adds the data which is sent
 // incrementally over multiple RUDP messages.
@@ -20,4 +20,14 @@ int serialize_kftp_header(KftpHeader* header, char* buffer, int buffer_len);
 // Returns the number of bytes deserialized on success, returns a negative int on failure
 int deserialize_kftp_header(char* buffer, int buffer_len, KftpHeader* header);
 
+// Serializes (converts into bytes) a KftpTrailer
+//
+// Returns the number of bytes serialized on success, returns a negative int on failure
+int serialize_kftp_trailer(KftpTrailer* trailer, char* buffer, int buffer_len);
+
+// Deserializes (converts from bytes) a KftpTrailer
+//
+// Returns the number of bytes deserialized on success, returns a negative int on failure
+int deserialize_kftp_trailer(char* buffer, int buffer_len, KftpTrailer* trailer);
+
 #endif //UDP_KFTP_SERDE_H
@@ -0,0 +1,126 @@
+//
+// KFTP stream implementation
+//
+// A KFTP stream presents the sequence of RUDP messages exchanged with a peer as a continuous byte stream.
+//
+
+#include "kftp_stream.h"
+
+#include "../reliable_udp/serde.h"
+#include "../utils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+int kftp_stream_flush(KftpStream* stream) {
+    if (stream->length == 0)
+        return 0;
+
+    int status = rudp_send(stream->buffer, stream->length, stream->socket_info, stream->sender, stream->receiver);
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_stream_flush: error in rudp_send\n");
+        return status;
+    }
+
+    stream->length = 0;
+    return 0;
+}
+
+
+int kftp_stream_write(KftpStream* stream, char* data, int data_size) {
+    int written = 0;
+
+    while (written < data_size) {
+        int chunk_size = min(data_size - written, MAX_DATA_SIZE - stream->length);
+        memcpy(&stream->buffer[stream->length], &data[written], chunk_size);
+        stream->length += chunk_size;
+        written += chunk_size;
+
+        // only full messages are sent here, the remainder waits for more data or an explicit flush
+        if (stream->length == MAX_DATA_SIZE) {
+            int status = kftp_stream_flush(stream);
+            if (status < 0)
+                return status;
+        }
+    }
+
+    return 0;
+}
+
+
+int kftp_stream_read(KftpStream* stream, char* buffer, int size) {
+    int read = 0;
+
+    while (read < size) {
+        if (stream->position == stream->length) {
+            int received_bytes = rudp_recv(stream->buffer, MAX_PAYLOAD_SIZE, stream->socket_info, stream->receiver);
+            if (received_bytes <= 0) {
+                fprintf(stderr, "ERROR in kftp_stream_read: error in rudp_recv\n");
+                return -1;
+            }
+            stream->length = received_bytes;
+            stream->position = 0;
+        }
+
+        int chunk_size = min(size - read, stream->length - stream->position);
+        memcpy(&buffer[read], &stream->buffer[stream->position], chunk_size);
+        stream->position += chunk_size;
+        read += chunk_size;
+    }
+
+    return 0;
+}
+
+
+int kftp_stream_write_int(KftpStream* stream, int value) {
+    char buffer[4];
+    int serialized = serialize_int(value, buffer, sizeof(buffer));
+    if (serialized < 0)
+        return serialized;
+
+    return kftp_stream_write(stream, buffer, serialized);
+}
+
+
+int kftp_stream_read_int(KftpStream* stream, int* value) {
+    char buffer[4];
+    int status = kftp_stream_read(stream, buffer, sizeof(buffer));
+    if (status < 0)
+        return status;
+
+    status = deserialize_int(buffer, sizeof(buffer), value);
+    return status < 0 ? status : 0;
+}
+
+
+int kftp_stream_write_uint64(KftpStream* stream, uint64_t value) {
+    int status = kftp_stream_write_int(stream, (int) (value >> 32));
+    if (status < 0)
+        return status;
+    return kftp_stream_write_int(stream, (int) (value & 0xFFFFFFFF));
+}
+
+
+int kftp_stream_read_uint64(KftpStream* stream, uint64_t* value) {
+    int high, low;
+    int status = kftp_stream_read_int(stream, &high);
+    if (status < 0)
+        return status;
+    status = kftp_stream_read_int(stream, &low);
+    if (status < 0)
+        return status;
+
+    *value = ((uint64_t) (uint32_t) high << 32) | (uint32_t) low;
+    return 0;
+}
+
+
+int kftp_stream_write_hash(KftpStream* stream, uint64_t hash) {
+    return kftp_stream_write_uint64(stream, hash);
+}
+
+
+int kftp_stream_read_hash(KftpStream* stream, uint64_t* hash) {
+    return kftp_stream_read_uint64(stream, hash);
+}
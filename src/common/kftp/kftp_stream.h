@@ -0,0 +1,55 @@
+//
+// KFTP stream interface
+//
+// A KFTP stream presents the sequence of RUDP messages exchanged with a peer as a continuous byte stream. Writes are
+// buffered until a full RUDP message can be sent, so small records are packed together instead of each paying for a
+// separate (stop-and-wait) RUDP message.
+//
+
+#ifndef UDP_KFTP_STREAM_H
+#define UDP_KFTP_STREAM_H
+
+#include <stdint.h>
+
+#include "../reliable_udp/reliable_udp.h"
+
+
+// Holds the state of a stream in a single direction. A stream should either be written to or read from, not both.
+typedef struct {
+    SocketInfo* socket_info;
+    RudpSender* sender;         // only needed for writing
+    RudpReceiver* receiver;
+    char buffer[MAX_PAYLOAD_SIZE];
+    int length;                 // number of bytes currently held in the buffer
+    int position;               // index of the next byte to read from the buffer
+} KftpStream;
+
+
+// Appends `data` to the stream, sending out a RUDP message each time a full message worth of data is buffered
+//
+// Returns 0 on success, and a negative int on failure
+int kftp_stream_write(KftpStream* stream, char* data, int data_size);
+
+// Sends out any data still buffered in the stream. Must be called once the last write has been made.
+//
+// Returns 0 on success, and a negative int on failure
+int kftp_stream_flush(KftpStream* stream);
+
+// Reads exactly `size` bytes from the stream, receiving additional RUDP messages as needed
+//
+// Returns 0 on success, and a negative int on failure
+int kftp_stream_read(KftpStream* stream, char* buffer, int size);
+
+// Helpers to write and read big-endian ints to and from a stream
+int kftp_stream_write_int(KftpStream* stream, int value);
+int kftp_stream_read_int(KftpStream* stream, int* value);
+
+// Helpers to write and read 64-bit values (e.g. file offsets) to and from a stream, as two big-endian ints
+int kftp_stream_write_uint64(KftpStream* stream, uint64_t value);
+int kftp_stream_read_uint64(KftpStream* stream, uint64_t* value);
+
+// Helpers to write and read 64-bit hashes to and from a stream
+int kftp_stream_write_hash(KftpStream* stream, uint64_t hash);
+int kftp_stream_read_hash(KftpStream* stream, uint64_t* hash);
+
+#endif //UDP_KFTP_STREAM_H
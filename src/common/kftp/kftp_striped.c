@@ -0,0 +1,330 @@
+//
+// KFTP striped transfer implementation
+//
+// Each stripe is transferred by its own thread using its own socket, RudpSender and RudpReceiver, so stripes don't
+// share any state other than the file. The file is accessed with pread and pwrite, which don't use (or move) a shared
+// file offset.
+//
+
+// needed for pread and pwrite
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_striped.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+#include "../reliable_udp/reliable_udp.h"
+
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// State of a single stripe, shared between the thread transferring it and the thread that started the transfer
+typedef struct {
+    int sockfd;
+    struct sockaddr_in addr;    // address of the peer's socket for this stripe
+    RudpSender sender;          // only needed for sending
+    int fd;                     // file the stripe is read from or written to
+    char* buffer;               // KFTP_STRIPE_BUFFER_SIZE bytes
+    long offset;                // set by the sender in advance, and learned by the receiver from the stripe itself
+    long length;
+    int status;
+} KftpStripe;
+
+
+// Thread that sends a single stripe of the file
+static void* send_stripe(void* arg) {
+    KftpStripe* stripe = arg;
+    SocketInfo socket_info = {.sockfd=stripe->sockfd, .addr=(struct sockaddr*) &stripe->addr,
+                              .addr_len=sizeof(stripe->addr)};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .sender=&stripe->sender, .receiver=&receiver};
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+
+    int status = kftp_stream_write_uint64(&stream, stripe->offset);
+    if (status == 0)
+        status = kftp_stream_write_uint64(&stream, stripe->length);
+
+    long sent = 0;
+    while (status == 0 && sent < stripe->length) {
+        size_t size = stripe->length - sent < KFTP_STRIPE_BUFFER_SIZE ? stripe->length - sent : KFTP_STRIPE_BUFFER_SIZE;
+        ssize_t n = pread(stripe->fd, stripe->buffer, size, stripe->offset + sent);
+        if (n <= 0) {
+            fprintf(stderr, "ERROR in send_stripe: error reading file\n");
+            status = -1;
+            break;
+        }
+
+        xxh64_update(&hash_state, stripe->buffer, (int) n);
+        status = kftp_stream_write(&stream, stripe->buffer, (int) n);
+        sent += n;
+    }
+
+    if (status == 0)
+        status = kftp_stream_write_hash(&stream, xxh64_digest(&hash_state));
+    if (status == 0)
+        status = kftp_stream_flush(&stream);
+
+    stripe->status = status;
+    return NULL;
+}
+
+
+// Thread that receives a single stripe and writes it into place in the file
+static void* recv_stripe(void* arg) {
+    KftpStripe* stripe = arg;
+    SocketInfo socket_info = {.sockfd=stripe->sockfd, .addr=(struct sockaddr*) &stripe->addr,
+                              .addr_len=sizeof(stripe->addr)};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .receiver=&receiver};
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+
+    uint64_t offset, length;
+    int status = kftp_stream_read_uint64(&stream, &offset);
+    if (status == 0)
+        status = kftp_stream_read_uint64(&stream, &length);
+    if (status == 0 && (offset > LONG_MAX || length > LONG_MAX - offset)) {
+        fprintf(stderr, "ERROR in recv_stripe: invalid stripe range\n");
+        status = -1;
+    }
+
+    long received = 0;
+    while (status == 0 && received < length) {
+        int size = length - received < KFTP_STRIPE_BUFFER_SIZE ? (int) (length - received) : KFTP_STRIPE_BUFFER_SIZE;
+        status = kftp_stream_read(&stream, stripe->buffer, size);
+        if (status < 0)
+            break;
+
+        xxh64_update(&hash_state, stripe->buffer, size);
+        if (pwrite(stripe->fd, stripe->buffer, size, (off_t) offset + received) != size) {
+            fprintf(stderr, "ERROR in recv_stripe: error writing file\n");
+            status = -1;
+            break;
+        }
+        received += size;
+    }
+
+    uint64_t hash;
+    if (status == 0)
+        status = kftp_stream_read_hash(&stream, &hash);
+    if (status == 0 && hash != xxh64_digest(&hash_state)) {
+        fprintf(stderr, "ERROR in recv_stripe: hash of received stripe does not match the sent stripe\n");
+        status = KFTP_INTEGRITY_ERROR;
+    }
+
+    if (status == 0) {
+        stripe->offset = (long) offset;
+        stripe->length = (long) length;
+
+        // the ack for the last message can be lost, in which case the sender keeps resending it until it's acked
+        char ack_buffer[MAX_PAYLOAD_SIZE];
+        rudp_check_acks(ack_buffer, MAX_PAYLOAD_SIZE, &socket_info, &receiver);
+    }
+
+    stripe->status = status;
+    return NULL;
+}
+
+
+// Helper function to open a socket to receive a stripe on, bound to a port chosen by the OS
+//
+// Returns the socket on success, and a negative int on failure
+static int open_stripe_socket(int* port) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return sockfd;
+
+    struct sockaddr_in addr = {.sin_family=AF_INET, .sin_addr.s_addr=htonl(INADDR_ANY), .sin_port=0};
+    socklen_t addr_len = sizeof(addr);
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+        || getsockname(sockfd, (struct sockaddr*) &addr, &addr_len) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    *port = ntohs(addr.sin_port);
+    return sockfd;
+}
+
+
+int kftp_send_file_striped(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream in_stream = {.socket_info=to, .receiver=receiver};
+    KftpStream out_stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+
+    int stripe_count;
+    int status = kftp_stream_read_int(&in_stream, &stripe_count);
+    if (status < 0)
+        return status;
+    if (stripe_count < 1 || stripe_count > KFTP_MAX_STRIPES) {
+        fprintf(stderr, "ERROR in kftp_send_file_striped: receiver asked for %d stripes\n", stripe_count);
+        stripe_count = 0;
+        status = -1;
+    }
+
+    KftpStripe stripes[KFTP_MAX_STRIPES];
+    for (int i = 0; i < stripe_count; i++) {
+        int port;
+        status = kftp_stream_read_int(&in_stream, &port);
+        if (status < 0)
+            return status;
+
+        // the stripes are sent to the same host as the rest of the transfer, just to different ports
+        stripes[i] = (KftpStripe) {.sockfd=-1, .fd=fileno(read_fp), .status=-1};
+        memcpy(&stripes[i].addr, to->addr, sizeof(stripes[i].addr));
+        stripes[i].addr.sin_port = htons(port);
+        stripes[i].sender = (RudpSender) {.message_timeout=sender->message_timeout,
+                                          .sender_timeout=sender->sender_timeout};
+        // the stripes together are held to the limits of the transfer
+        memcpy(stripes[i].sender.rate_limits, sender->rate_limits, sizeof(sender->rate_limits));
+    }
+
+    struct stat file_stat;
+    long file_size = 0;
+    if (status == 0 && fstat(fileno(read_fp), &file_stat) < 0) {
+        fprintf(stderr, "ERROR in kftp_send_file_striped: unable to get size of file\n");
+        status = -1;
+    }
+    else if (status == 0) {
+        file_size = file_stat.st_size;
+    }
+
+    pthread_t threads[KFTP_MAX_STRIPES];
+    int started = 0;
+    for (; status == 0 && started < stripe_count; started++) {
+        KftpStripe* stripe = &stripes[started];
+        stripe->offset = file_size * started / stripe_count;
+        stripe->length = file_size * (started + 1) / stripe_count - stripe->offset;
+        stripe->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        stripe->buffer = malloc(KFTP_STRIPE_BUFFER_SIZE);
+        if (stripe->sockfd < 0 || stripe->buffer == NULL
+            || pthread_create(&threads[started], NULL, send_stripe, stripe) != 0) {
+            fprintf(stderr, "ERROR in kftp_send_file_striped: unable to start stripe %d\n", started);
+            status = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (stripes[i].status < 0) {
+            fprintf(stderr, "ERROR in kftp_send_file_striped: error sending stripe %d\n", i);
+            status = stripes[i].status;
+        }
+    }
+    for (int i = 0; i < stripe_count && i <= started; i++) {
+        if (stripes[i].sockfd >= 0)
+            close(stripes[i].sockfd);
+        free(stripes[i].buffer);
+    }
+
+    // the receiver only knows the transfer is over (or has failed) once it gets this result
+    int result = kftp_stream_write_int(&out_stream, status < 0 ? -1 : 0);
+    if (result == 0)
+        result = kftp_stream_write_uint64(&out_stream, (uint64_t) file_size);
+    if (result == 0)
+        result = kftp_stream_flush(&out_stream);
+
+    if (status == 0 && result == 0)
+        fprintf(stderr, "Done, sent %ld bytes over %d stripes\n", file_size, stripe_count);
+    return status < 0 ? status : result;
+}
+
+
+int kftp_recv_file_striped(FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream in_stream = {.socket_info=from, .receiver=receiver};
+    KftpStream out_stream = {.socket_info=from, .sender=sender, .receiver=receiver};
+    KftpStripe stripes[KFTP_STRIPE_COUNT];
+    int ports[KFTP_STRIPE_COUNT];
+
+    int opened = 0;
+    for (; opened < KFTP_STRIPE_COUNT; opened++) {
+        KftpStripe* stripe = &stripes[opened];
+        *stripe = (KftpStripe) {.fd=fileno(write_fp), .status=-1};
+        stripe->buffer = malloc(KFTP_STRIPE_BUFFER_SIZE);
+        stripe->sockfd = open_stripe_socket(&ports[opened]);
+        if (stripe->sockfd < 0 || stripe->buffer == NULL) {
+            fprintf(stderr, "ERROR in kftp_recv_file_striped: unable to open stripe %d\n", opened);
+            if (stripe->sockfd >= 0)
+                close(stripe->sockfd);
+            free(stripe->buffer);
+            break;
+        }
+    }
+
+    // the threads can be started ahead of announcing the ports, they just wait for the first message of their stripe
+    pthread_t threads[KFTP_STRIPE_COUNT];
+    int started = 0;
+    if (opened == KFTP_STRIPE_COUNT) {
+        for (; started < KFTP_STRIPE_COUNT; started++) {
+            if (pthread_create(&threads[started], NULL, recv_stripe, &stripes[started]) != 0) {
+                fprintf(stderr, "ERROR in kftp_recv_file_striped: unable to start stripe %d\n", started);
+                break;
+            }
+        }
+    }
+
+    // if not every stripe could be started, no stripes are asked for, which the sender reports as a failed transfer
+    int stripe_count = started == KFTP_STRIPE_COUNT ? KFTP_STRIPE_COUNT : 0;
+    int status = kftp_stream_write_int(&out_stream, stripe_count);
+    for (int i = 0; status == 0 && i < stripe_count; i++)
+        status = kftp_stream_write_int(&out_stream, ports[i]);
+    if (status == 0)
+        status = kftp_stream_flush(&out_stream);
+
+    int sender_status = -1;
+    uint64_t file_size = 0;
+    if (status == 0)
+        status = kftp_stream_read_int(&in_stream, &sender_status);
+    if (status == 0)
+        status = kftp_stream_read_uint64(&in_stream, &file_size);
+    if (status == 0 && sender_status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_file_striped: sender failed to send the file\n");
+        status = -1;
+    }
+
+    // stripes that were never (fully) sent would otherwise wait forever for their next message
+    if (status < 0) {
+        for (int i = 0; i < started; i++)
+            pthread_cancel(threads[i]);
+    }
+
+    long received = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (status == 0 && stripes[i].status < 0)
+            status = stripes[i].status;
+        received += stripes[i].length;
+    }
+    for (int i = 0; i < opened; i++) {
+        close(stripes[i].sockfd);
+        free(stripes[i].buffer);
+    }
+
+    if (status < 0)
+        return status;
+
+    if (received != file_size) {
+        fprintf(stderr, "ERROR in kftp_recv_file_striped: received %ld bytes but expected %lu\n", received,
+                (unsigned long) file_size);
+        return -1;
+    }
+
+    // empty stripes at the end of the file (e.g. for an empty file) are never written to
+    if (fflush(write_fp) != 0 || ftruncate(fileno(write_fp), (off_t) file_size) < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_file_striped: error setting size of file\n");
+        return -1;
+    }
+
+    fprintf(stderr, "Done                                  \n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+//
+// KFTP striped transfer interface
+//
+// Striped transfers split a file into byte ranges (stripes) that are sent concurrently, each by its own thread over its
+// own RUDP flow (a separate pair of sockets). Since every RUDP flow is stop-and-wait, running several flows side by side
+// keeps several messages in flight at once and spreads the work over multiple cores.
+//
+// The receiver opens a socket per stripe and announces their ports over the existing connection. The sender then sends
+// each stripe (its offset, length, data, and the XXH64 hash of the data) to one of those ports, and reports over the
+// existing connection once every stripe has been delivered.
+//
+
+#ifndef UDP_KFTP_STRIPED_H
+#define UDP_KFTP_STRIPED_H
+
+#include <stdio.h>
+
+#include "../reliable_udp/types.h"
+
+
+// number of stripes the receiver asks for, and the most stripes a sender will accept
+#define KFTP_STRIPE_COUNT 4
+#define KFTP_MAX_STRIPES 16
+
+// amount of file data read or written at a time by each stripe's thread
+#define KFTP_STRIPE_BUFFER_SIZE (64 * 1024)
+
+
+// Reads from `read_fp` and sends the contents as stripes to the ports announced by the receiver at `to`.
+//
+// Returns 0 on success, and a negative int on failure.
+int kftp_send_file_striped(FILE* read_fp, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Opens a socket per stripe, announces them to the sender at `from`, and writes each received stripe into place in
+// `write_fp`.
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if a stripe doesn't match the sender's hash, and another negative int on
+// failure.
+int kftp_recv_file_striped(FILE* write_fp, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_STRIPED_H
@@ -0,0 +1,377 @@
+//
+// KFTP tree transfer implementation
+//
+// Each entry is described by its path (relative to the parent of the tree's root), its permission bits, and its
+// modification time (seconds and nanoseconds). Directory modes and times are only applied once the whole tree has been
+// received, since writing the directory's contents would update its modification time (and a read-only directory
+// couldn't be filled in).
+//
+
+// needed for lstat, strdup and utimensat
+#define _POSIX_C_SOURCE 200809L
+
+#include "kftp_tree.h"
+
+#include "kftp.h"
+#include "kftp_stream.h"
+#include "../hash.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+// Attributes of a received directory, applied once the tree is complete
+typedef struct {
+    char* path;
+    int mode;
+    struct timespec mtime;
+} DirAttributes;
+
+
+// Helper function to write the type, path, mode and modification time that start each entry
+static int write_entry(KftpStream* stream, char type, char* path, struct stat* entry_stat) {
+    int status = kftp_stream_write(stream, &type, 1);
+    if (status == 0)
+        status = kftp_stream_write_int(stream, (int) strlen(path));
+    if (status == 0)
+        status = kftp_stream_write(stream, path, (int) strlen(path));
+    if (status == 0)
+        status = kftp_stream_write_int(stream, (int) (entry_stat->st_mode & 07777));
+    if (status == 0)
+        status = kftp_stream_write_uint64(stream, (uint64_t) entry_stat->st_mtim.tv_sec);
+    if (status == 0)
+        status = kftp_stream_write_int(stream, (int) entry_stat->st_mtim.tv_nsec);
+    return status;
+}
+
+
+// Helper function to join a directory and the name of one of its entries. The result is dynamically allocated.
+static char* join_path(char* directory, char* name) {
+    size_t length = strlen(directory) + strlen(name) + 2;
+    char* path = malloc(length);
+    if (path != NULL)
+        snprintf(path, length, "%s/%s", directory, name);
+    return path;
+}
+
+
+// Helper function that sends the entry at `local_path` (under the name `path`), and everything below it
+//
+// Entries that can't be read are skipped, so this only fails if the stream fails.
+static int send_entry(char* local_path, char* path, int depth, char* buffer, KftpStream* stream) {
+    struct stat entry_stat;
+    if (lstat(local_path, &entry_stat) < 0) {
+        fprintf(stderr, "ERROR in send_entry: could not stat %s, skipping\n", local_path);
+        return 0;
+    }
+    if (strlen(path) > KFTP_MAX_PATH_LENGTH) {
+        fprintf(stderr, "ERROR in send_entry: path of %s is too long, skipping\n", local_path);
+        return 0;
+    }
+
+    if (S_ISREG(entry_stat.st_mode)) {
+        uint64_t size = (uint64_t) entry_stat.st_size;
+        int status = write_entry(stream, KFTP_TREE_FILE, path, &entry_stat);
+        if (status == 0)
+            status = kftp_stream_write_uint64(stream, size);
+
+        Xxh64State hash_state;
+        xxh64_init(&hash_state, 0);
+        int file_status = 0;
+        if (status == 0)
+            status = kftp_send_file_data(local_path, size, buffer, stream, &hash_state, &file_status);
+        if (status == 0)
+            status = kftp_stream_write_int(stream, file_status);
+        if (status == 0)
+            status = kftp_stream_write_hash(stream, xxh64_digest(&hash_state));
+        return status;
+    }
+
+    if (!S_ISDIR(entry_stat.st_mode))
+        return 0;
+    if (depth >= KFTP_MAX_TREE_DEPTH) {
+        fprintf(stderr, "ERROR in send_entry: %s is nested too deeply, skipping\n", local_path);
+        return 0;
+    }
+
+    int status = write_entry(stream, KFTP_TREE_DIR, path, &entry_stat);
+    if (status < 0)
+        return status;
+
+    // the directory itself is still sent if its contents can't be listed
+    DIR* dir = opendir(local_path);
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR in send_entry: could not open directory %s\n", local_path);
+        return 0;
+    }
+
+    struct dirent* entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char* child_local_path = join_path(local_path, entry->d_name);
+        char* child_path = join_path(path, entry->d_name);
+        if (child_local_path == NULL || child_path == NULL)
+            status = -1;
+        else
+            status = send_entry(child_local_path, child_path, depth + 1, buffer, stream);
+        free(child_local_path);
+        free(child_path);
+    }
+    closedir(dir);
+
+    return status;
+}
+
+
+int kftp_send_tree(char* root, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=to, .sender=sender, .receiver=receiver};
+
+    char* root_path = strdup(root);
+    char* buffer = malloc(KFTP_BATCH_BUFFER_SIZE);
+    if (root_path == NULL || buffer == NULL) {
+        fprintf(stderr, "ERROR in kftp_send_tree: unable to allocate buffers\n");
+        free(root_path);
+        free(buffer);
+        return -1;
+    }
+
+    // the tree is sent under the last component of the root, ignoring any trailing slashes
+    size_t length = strlen(root_path);
+    while (length > 1 && root_path[length - 1] == '/')
+        root_path[--length] = 0;
+    char* last_slash = strrchr(root_path, '/');
+    char* name = last_slash == NULL ? root_path : last_slash + 1;
+
+    int root_status = 0;
+    struct stat root_stat;
+    if (name[0] == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "ERROR in kftp_send_tree: %s can't be sent as a tree\n", root);
+        root_status = KFTP_TREE_ROOT_ERROR;
+    }
+    else if (lstat(root_path, &root_stat) < 0 || !(S_ISDIR(root_stat.st_mode) || S_ISREG(root_stat.st_mode))) {
+        fprintf(stderr, "ERROR in kftp_send_tree: %s is not a directory or regular file\n", root);
+        root_status = KFTP_TREE_ROOT_ERROR;
+    }
+
+    int status = 0;
+    if (root_status == 0)
+        status = send_entry(root_path, name, 0, buffer, &stream);
+
+    // the receiver always expects the end of the tree, even if the root couldn't be sent
+    char type = KFTP_TREE_END;
+    if (status == 0)
+        status = kftp_stream_write(&stream, &type, 1);
+    if (status == 0)
+        status = kftp_stream_write_int(&stream, root_status);
+    if (status == 0)
+        status = kftp_stream_flush(&stream);
+
+    free(root_path);
+    free(buffer);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_send_tree: error sending tree\n");
+        return status;
+    }
+    return root_status;
+}
+
+
+// Helper function that checks a received path stays within the current directory
+static bool is_valid_path(char* path) {
+    if (path[0] == 0 || path[0] == '/')
+        return false;
+
+    // every component must be a plain name, so the path can't climb out of the current directory
+    char* component = path;
+    while (1) {
+        char* end = strchr(component, '/');
+        size_t component_length = end == NULL ? strlen(component) : (size_t) (end - component);
+        if (component_length == 0 || (component_length == 1 && component[0] == '.')
+            || (component_length == 2 && component[0] == '.' && component[1] == '.'))
+            return false;
+        if (end == NULL)
+            return true;
+        component = end + 1;
+    }
+}
+
+
+// Helper function to set the mode and modification time of a received entry
+static void apply_attributes(char* path, int mode, struct timespec* mtime) {
+    struct timespec times[2] = {{.tv_nsec=UTIME_OMIT}, *mtime};
+    if (chmod(path, (mode_t) mode) < 0 || utimensat(AT_FDCWD, path, times, 0) < 0)
+        fprintf(stderr, "ERROR in apply_attributes: could not set attributes of %s\n", path);
+}
+
+
+// Helper function to read the path, mode and modification time that start each entry
+//
+// The path is dynamically allocated.
+static int read_entry(KftpStream* stream, char** path, int* mode, struct timespec* mtime) {
+    int path_length;
+    int status = kftp_stream_read_int(stream, &path_length);
+    if (status < 0)
+        return status;
+    if (path_length <= 0 || path_length > KFTP_MAX_PATH_LENGTH) {
+        fprintf(stderr, "ERROR in read_entry: invalid path length %d\n", path_length);
+        return -1;
+    }
+
+    *path = calloc(path_length + 1, sizeof(char));
+    if (*path == NULL)
+        return -1;
+
+    uint64_t seconds = 0;
+    int nanoseconds = 0;
+    status = kftp_stream_read(stream, *path, path_length);
+    if (status == 0)
+        status = kftp_stream_read_int(stream, mode);
+    if (status == 0)
+        status = kftp_stream_read_uint64(stream, &seconds);
+    if (status == 0)
+        status = kftp_stream_read_int(stream, &nanoseconds);
+
+    *mode &= 07777;
+    *mtime = (struct timespec) {.tv_sec=(time_t) seconds, .tv_nsec=nanoseconds};
+    if (status == 0 && (nanoseconds < 0 || nanoseconds >= 1000000000)) {
+        fprintf(stderr, "ERROR in read_entry: invalid modification time\n");
+        status = -1;
+    }
+    return status;
+}
+
+
+// Helper function to receive a file entry (after its path, mode and modification time)
+//
+// Returns 0 on success (even if the file was discarded, which is counted in `result`), and a negative int if the
+// stream failed.
+static int recv_file_entry(char* path, int mode, struct timespec* mtime, char* buffer, KftpStream* stream,
+                           KftpBatchResult* result) {
+    uint64_t size;
+    int status = kftp_stream_read_uint64(stream, &size);
+    if (status < 0)
+        return status;
+
+    bool valid_path = is_valid_path(path);
+    if (!valid_path)
+        fprintf(stderr, "ERROR in recv_file_entry: refusing to write to %s\n", path);
+
+    Xxh64State hash_state;
+    xxh64_init(&hash_state, 0);
+    int written = kftp_recv_file_data(valid_path ? path : NULL, size, buffer, stream, &hash_state);
+    if (written < 0)
+        return written;
+
+    int file_status = -1;
+    uint64_t hash = 0;
+    status = kftp_stream_read_int(stream, &file_status);
+    if (status == 0)
+        status = kftp_stream_read_hash(stream, &hash);
+
+    bool valid = status == 0 && file_status == 0 && hash == xxh64_digest(&hash_state);
+    if (status == 0 && file_status < 0)
+        fprintf(stderr, "ERROR in recv_file_entry: sender could not read %s\n", path);
+    else if (status == 0 && !valid)
+        fprintf(stderr, "ERROR in recv_file_entry: hash of %s does not match the sent file\n", path);
+
+    if (written && valid) {
+        apply_attributes(path, mode, mtime);
+        result->received++;
+    } else {
+        // don't leave a corrupted copy of the file around
+        if (written)
+            remove(path);
+        result->failed++;
+    }
+
+    return status;
+}
+
+
+int kftp_recv_tree(KftpBatchResult* result, SocketInfo* from, RudpReceiver* receiver) {
+    KftpStream stream = {.socket_info=from, .receiver=receiver};
+    *result = (KftpBatchResult) {};
+
+    char* buffer = malloc(KFTP_BATCH_BUFFER_SIZE);
+    DirAttributes* dirs = NULL;
+    int dir_count = 0;
+    int status = buffer == NULL ? -1 : 0;
+    int root_status = -1;
+
+    while (status == 0) {
+        char type;
+        status = kftp_stream_read(&stream, &type, 1);
+        if (status < 0)
+            break;
+
+        if (type == KFTP_TREE_END) {
+            status = kftp_stream_read_int(&stream, &root_status);
+            break;
+        }
+        if (type != KFTP_TREE_DIR && type != KFTP_TREE_FILE) {
+            fprintf(stderr, "ERROR in kftp_recv_tree: unknown record type %d\n", type);
+            status = -1;
+            break;
+        }
+
+        char* path = NULL;
+        int mode;
+        struct timespec mtime;
+        status = read_entry(&stream, &path, &mode, &mtime);
+
+        if (status == 0 && type == KFTP_TREE_FILE) {
+            status = recv_file_entry(path, mode, &mtime, buffer, &stream, result);
+            free(path);
+        }
+        else if (status == 0 && !is_valid_path(path)) {
+            fprintf(stderr, "ERROR in kftp_recv_tree: refusing to create %s\n", path);
+            free(path);
+        }
+        else if (status == 0) {
+            // the directory is created writable so it can be filled in, its mode is applied at the end
+            if (mkdir(path, 0700) < 0 && errno != EEXIST)
+                fprintf(stderr, "ERROR in kftp_recv_tree: could not create directory %s\n", path);
+
+            DirAttributes* resized = realloc(dirs, sizeof(DirAttributes) * (dir_count + 1));
+            if (resized == NULL) {
+                free(path);
+                status = -1;
+                break;
+            }
+            dirs = resized;
+            dirs[dir_count++] = (DirAttributes) {.path=path, .mode=mode, .mtime=mtime};
+        }
+        else {
+            free(path);
+        }
+    }
+
+    // directories are finished from the bottom up, so setting a directory's attributes doesn't affect its parent's
+    for (int i = dir_count - 1; i >= 0; i--) {
+        if (status == 0)
+            apply_attributes(dirs[i].path, dirs[i].mode, &dirs[i].mtime);
+        free(dirs[i].path);
+    }
+    free(dirs);
+    free(buffer);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_tree: error receiving tree\n");
+        return status;
+    }
+    if (root_status < 0) {
+        fprintf(stderr, "ERROR in kftp_recv_tree: sender could not send the tree\n");
+        return KFTP_TREE_ROOT_ERROR;
+    }
+    return result->failed > 0 ? KFTP_INTEGRITY_ERROR : 0;
+}
@@ -0,0 +1,46 @@
+//
+// KFTP tree transfer interface
+//
+// Tree transfers send a whole directory tree over a single KFTP stream. The sender walks the tree depth first and sends
+// a record for each entry as soon as it finds it, so walking the tree overlaps with sending the files found so far.
+// Directories are always sent before their contents, so the receiver can create each directory before it's needed.
+//
+
+#ifndef UDP_KFTP_TREE_H
+#define UDP_KFTP_TREE_H
+
+#include "kftp_batch.h"
+#include "../reliable_udp/types.h"
+
+
+// longest path (relative to the parent of the tree's root) that can be sent
+#define KFTP_MAX_PATH_LENGTH 4096
+
+// deepest level of nested directories that is sent
+#define KFTP_MAX_TREE_DEPTH 64
+
+// Tree record types
+#define KFTP_TREE_DIR 1     // followed by the path, mode, and modification time of a directory
+#define KFTP_TREE_FILE 2    // followed by the path, mode, modification time, and size of a file, then its contents,
+                            // a status (0 if the whole file could be read), and the XXH64 hash of the contents
+#define KFTP_TREE_END 3     // followed by a status, which is negative if the root of the tree couldn't be sent
+
+// Errors
+#define KFTP_TREE_ROOT_ERROR (-7)   // the root of the tree couldn't be sent, which the receiver has been told about
+
+
+// Walks the tree rooted at `root` and sends its directories and regular files to `to`. Other types of files (e.g.
+// symbolic links) are skipped. The tree is sent under the last component of `root`, and `root` may also be a single
+// regular file.
+//
+// Returns 0 on success, KFTP_TREE_ROOT_ERROR if `root` couldn't be sent, and another negative int on failure.
+int kftp_send_tree(char* root, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
+
+// Receives a tree from `from` and recreates it in the current directory, including the mode and modification time of
+// each entry. Files that fail to be written or don't match the sender's hash are removed and counted in `result`.
+//
+// Returns 0 on success, KFTP_INTEGRITY_ERROR if any files failed, KFTP_TREE_ROOT_ERROR if the sender couldn't send the
+// tree, and another negative int if the tree itself could not be received.
+int kftp_recv_tree(KftpBatchResult* result, SocketInfo* from, RudpReceiver* receiver);
+
+#endif //UDP_KFTP_TREE_H
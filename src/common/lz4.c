@@ -0,0 +1,192 @@
+//
+// LZ4 block compression
+//
+// Implements the LZ4 block format. A block is a series of sequences, each made up of a token, a run of literal bytes,
+// and a match (an offset back into the already decoded data and a length) to copy. The last sequence only has literals.
+//
+
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5         // the last 5 bytes of a block are always literals
+#define MATCH_FIND_LIMIT 12     // a match can't start within the last 12 bytes of a block
+#define MAX_OFFSET 65535
+
+#define HASH_LOG 12
+
+// the search step grows the longer no match is found, so incompressible data is skipped over quickly
+#define SKIP_TRIGGER 6
+
+
+static uint32_t read32(const char* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static int hash32(uint32_t sequence) {
+    return (int) ((sequence * 2654435761U) >> (32 - HASH_LOG));
+}
+
+// Helper function that writes the extra bytes of a length that doesn't fit into the 4 bits of a token
+static char* write_length(char* op, char* op_end, int length) {
+    while (length >= 255) {
+        if (op >= op_end)
+            return NULL;
+        *op++ = (char) 255;
+        length -= 255;
+    }
+    if (op >= op_end)
+        return NULL;
+    *op++ = (char) length;
+    return op;
+}
+
+// Helper function that writes a sequence of literals followed by a match. A `match_length` of 0 writes the final,
+// literal only, sequence.
+static char* write_sequence(char* op, char* op_end, const char* literals, int literal_length, int offset,
+                            int match_length) {
+    if (op >= op_end)
+        return NULL;
+
+    char* token = op++;
+    *token = (char) ((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15 && (op = write_length(op, op_end, literal_length - 15)) == NULL)
+        return NULL;
+
+    if (op + literal_length > op_end)
+        return NULL;
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length == 0)
+        return op;
+
+    if (op + 2 > op_end)
+        return NULL;
+    *op++ = (char) (offset & 0xFF);
+    *op++ = (char) (offset >> 8);
+
+    int extra_length = match_length - MIN_MATCH;
+    *token |= (char) (extra_length >= 15 ? 15 : extra_length);
+    if (extra_length >= 15 && (op = write_length(op, op_end, extra_length - 15)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+int lz4_compress(const char* src, int src_size, char* dst, int dst_capacity) {
+    char* op = dst;
+    char* op_end = dst + dst_capacity;
+    int anchor = 0;     // start of the literals that haven't been written yet
+
+    if (src_size >= MATCH_FIND_LIMIT + 1) {
+        // table of the most recent position each hashed 4 byte sequence was seen at, offset by one so 0 means unseen
+        int table[1 << HASH_LOG] = {0,};
+        int match_find_limit = src_size - MATCH_FIND_LIMIT;
+        int match_limit = src_size - LAST_LITERALS;
+        int ip = 0;
+
+        while (1) {
+            int ref = 0;
+            int attempts = 1 << SKIP_TRIGGER;
+            int found = 0;
+            while (ip < match_find_limit) {
+                int h = hash32(read32(&src[ip]));
+                ref = table[h] - 1;
+                table[h] = ip + 1;
+                if (ref >= 0 && ip - ref <= MAX_OFFSET && read32(&src[ref]) == read32(&src[ip])) {
+                    found = 1;
+                    break;
+                }
+                ip += attempts++ >> SKIP_TRIGGER;
+            }
+            if (!found)
+                break;
+
+            // a match may start before the position we found it at
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+
+            int match_length = MIN_MATCH;
+            while (ip + match_length < match_limit && src[ip + match_length] == src[ref + match_length])
+                match_length++;
+
+            op = write_sequence(op, op_end, &src[anchor], ip - anchor, ip - ref, match_length);
+            if (op == NULL)
+                return 0;
+
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    op = write_sequence(op, op_end, &src[anchor], src_size - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+
+    return (int) (op - dst);
+}
+
+// Helper function that reads the extra bytes of a length, returning a negative int if the input runs out
+static int read_length(const char** ip, const char* ip_end, int length) {
+    unsigned char byte;
+    do {
+        if (*ip >= ip_end)
+            return -1;
+        byte = (unsigned char) *(*ip)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int lz4_decompress(const char* src, int src_size, char* dst, int dst_capacity) {
+    const char* ip = src;
+    const char* ip_end = src + src_size;
+    char* op = dst;
+    char* op_end = dst + dst_capacity;
+
+    while (ip < ip_end) {
+        unsigned char token = (unsigned char) *ip++;
+
+        int literal_length = token >> 4;
+        if (literal_length == 15 && (literal_length = read_length(&ip, ip_end, literal_length)) < 0)
+            return -1;
+        if (literal_length > ip_end - ip || literal_length > op_end - op)
+            return -1;
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // the last sequence ends after its literals
+        if (ip == ip_end)
+            break;
+
+        if (ip_end - ip < 2)
+            return -1;
+        int offset = (unsigned char) ip[0] | (unsigned char) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+
+        int match_length = token & 0xF;
+        if (match_length == 15 && (match_length = read_length(&ip, ip_end, match_length)) < 0)
+            return -1;
+        match_length += MIN_MATCH;
+        if (match_length > op_end - op)
+            return -1;
+
+        // matches may overlap the data they produce (e.g. runs of a single byte), so copy byte by byte
+        const char* match = op - offset;
+        for (int i = 0; i < match_length; i++)
+            op[i] = match[i];
+        op += match_length;
+    }
+
+    return (int) (op - dst);
+}
@@ -0,0 +1,22 @@
+//
+// LZ4 block compression
+//
+// Implements the LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md), which favours speed
+// over compression ratio. Blocks produced here can be decoded by any LZ4 implementation and vice versa.
+//
+
+#ifndef UDP_LZ4_H
+#define UDP_LZ4_H
+
+// Compresses `src` into `dst`.
+//
+// Returns the compressed size on success, or 0 if the compressed data would not fit into `dst_capacity` bytes. Passing
+// a capacity smaller than `src_size` therefore doubles as a check that the data actually shrinks.
+int lz4_compress(const char* src, int src_size, char* dst, int dst_capacity);
+
+// Decompresses `src` into `dst`.
+//
+// Returns the decompressed size on success, and a negative int if the data is malformed or does not fit into `dst`.
+int lz4_decompress(const char* src, int src_size, char* dst, int dst_capacity);
+
+#endif //UDP_LZ4_H
@@ -0,0 +1,86 @@
+//
+// Memory budget implementation
+//
+
+#include "mem_budget.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+void mem_budget_init(MemBudget* budget, size_t limit) {
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->limit = limit;
+    budget->used = 0;
+    budget->peak = 0;
+    budget->refused = 0;
+}
+
+
+void mem_budget_free(MemBudget* budget) {
+    pthread_mutex_destroy(&budget->lock);
+}
+
+
+// Helper function that adds `size` bytes to the memory in use, while holding the lock
+static void add_used(MemBudget* budget, size_t size) {
+    budget->used += size;
+    if (budget->used > budget->peak)
+        budget->peak = budget->used;
+}
+
+int mem_budget_reserve(MemBudget* budget, size_t size) {
+    if (budget == NULL)
+        return 0;
+
+    pthread_mutex_lock(&budget->lock);
+    bool fits = budget->limit == MEM_BUDGET_UNLIMITED
+                || (budget->used <= budget->limit && size <= budget->limit - budget->used);
+    if (fits)
+        add_used(budget, size);
+    else
+        budget->refused++;
+    pthread_mutex_unlock(&budget->lock);
+
+    return fits ? 0 : -1;
+}
+
+
+void mem_budget_charge(MemBudget* budget, size_t size) {
+    if (budget == NULL)
+        return;
+
+    pthread_mutex_lock(&budget->lock);
+    add_used(budget, size);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+
+void mem_budget_release(MemBudget* budget, size_t size) {
+    if (budget == NULL)
+        return;
+
+    pthread_mutex_lock(&budget->lock);
+    if (size > budget->used) {
+        fprintf(stderr, "ERROR in mem_budget_release: releasing %zu bytes, but only %zu are in use\n", size,
+                budget->used);
+        size = budget->used;
+    }
+    budget->used -= size;
+    pthread_mutex_unlock(&budget->lock);
+}
+
+
+size_t mem_budget_available(MemBudget* budget) {
+    if (budget == NULL)
+        return SIZE_MAX;
+
+    pthread_mutex_lock(&budget->lock);
+    size_t available = SIZE_MAX;
+    if (budget->limit != MEM_BUDGET_UNLIMITED)
+        available = budget->used < budget->limit ? budget->limit - budget->used : 0;
+    pthread_mutex_unlock(&budget->lock);
+
+    return available;
+}
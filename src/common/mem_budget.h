@@ -0,0 +1,51 @@
+//
+// Memory budget shared by the parts of a program that hold on to memory
+//
+// A budget doesn't allocate anything itself: it keeps count of the bytes that buffers and caches have charged to it, so
+// that together they stay under a limit however many clients there are. Memory that can be done without (e.g. a file
+// that could be read from disk instead of cached, or a message the peer will resend) is reserved, and isn't used if the
+// budget can't cover it. Memory that's needed regardless is charged even past the limit, so it still counts against
+// what's left for everything else.
+//
+// Budgets are shared between threads, and a NULL budget stands for no budget at all.
+//
+
+#ifndef UDP_MEM_BUDGET_H
+#define UDP_MEM_BUDGET_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// limit of a budget that never refuses a reservation
+#define MEM_BUDGET_UNLIMITED 0
+
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t limit;               // in bytes, or MEM_BUDGET_UNLIMITED
+    size_t used;                // bytes charged to the budget and not released yet
+    size_t peak;                // most bytes ever charged at once
+    unsigned long refused;      // reservations that didn't fit in the budget
+} MemBudget;
+
+
+// Sets up a budget of `limit` bytes (MEM_BUDGET_UNLIMITED for no limit)
+void mem_budget_init(MemBudget* budget, size_t limit);
+
+void mem_budget_free(MemBudget* budget);
+
+// Reserves `size` bytes if they fit in what's left of the budget
+//
+// Returns 0 on success, and a negative int if the memory shouldn't be used.
+int mem_budget_reserve(MemBudget* budget, size_t size);
+
+// Charges `size` bytes to the budget even if they don't fit in it, for memory that's used regardless
+void mem_budget_charge(MemBudget* budget, size_t size);
+
+// Gives back `size` bytes that were reserved or charged
+void mem_budget_release(MemBudget* budget, size_t size);
+
+// Returns the bytes left in the budget, or SIZE_MAX if it has no limit
+size_t mem_budget_available(MemBudget* budget);
+
+#endif //UDP_MEM_BUDGET_H
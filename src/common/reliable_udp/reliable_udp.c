@@ -14,36 +14,217 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "rudp_mux.h"
+#include "rudp_rate.h"
 #include "serde.h"
 #include "types.h"
 #include "../utils.h"
 
 
+// size of the data of an abort: its number, followed by the last ack of its sender and the last message its receiver
+// received
+#define ABORT_DATA_SIZE 12
+
+
 // Helper function that determines if a received message is within the old ack window and therefore should be sent an
 // ack. This helps ensure that acks can be resent at a future time if they are lost on the way to the receiver.
 bool in_old_ack_window(RudpMessage* received_message, RudpReceiver* receiver) {
     // TODO: we treat 0 as a special value here to indicate the type of message. Should instead modify the header
     //  struct to include an indication of if the message is a seq or ack
-    return received_message->header.seq_num != 0
+    // negative sequence numbers are reserved for the messages that finish an exchange, and are never acked
+    return received_message->header.seq_num > 0
         && 0 <= (receiver->last_received - received_message->header.seq_num)
         && (receiver->last_received - received_message->header.seq_num) < ACK_WINDOW;
 }
 
 
-// Helper function to send an ack for the `received_message` to the `from` socket.
+// Helper function that checks if `message` belongs to the stream `stream_id`. Messages that could not be delivered to
+// their own stream end up on the control stream, and are ignored there.
+bool on_stream(RudpMessage* message, int stream_id) {
+    return message->header.stream_id == stream_id;
+}
+
+
+// Helper function to send a message without data (an ack, FIN, or FIN-ACK) on stream `stream_id` to the `to` socket,
+// advertising a receive window of `window` bytes.
 //
-// Acks are not reliably delivered, so we can simply fire and forget the ack.
-int ack(RudpMessage* received_message, SocketInfo* from) {
-    RudpMessage ack_message = {.header = (RudpHeader) {.ack_num=received_message->header.seq_num, .data_size=0}};
+// These messages are not reliably delivered, so we can simply fire and forget them.
+int send_control_message(int seq_num, int ack_num, int stream_id, int window, SocketInfo* to) {
+    RudpMessage message = {.header = (RudpHeader) {.seq_num=seq_num, .ack_num=ack_num, .data_size=0,
+                                                   .stream_id=stream_id, .window=window}};
 
     char wire_data[MAX_PAYLOAD_SIZE] = {0,};
-    int wire_data_len = serialize(&ack_message, wire_data, MAX_PAYLOAD_SIZE);
+    int wire_data_len = serialize(&message, wire_data, MAX_PAYLOAD_SIZE);
     if (wire_data_len < 0) {
-        fprintf(stderr, "ERROR in ack: Error serializing ack message\n");
+        fprintf(stderr, "ERROR in send_control_message: Error serializing message\n");
         return wire_data_len;
     }
 
-    return sendto(from->sockfd, wire_data, wire_data_len, 0, from->addr, from->addr_len);
+    return sendto(to->sockfd, wire_data, wire_data_len, 0, to->addr, to->addr_len);
+}
+
+// Helper function that returns the receive window of a receiver: the data it has room for beyond the messages it has
+// taken. A stream sharing its socket has room for as many messages as its queue has free slots, while a receiver with a
+// socket of its own takes the next message straight off the socket.
+int receive_window(SocketInfo* from, RudpReceiver* receiver) {
+    if (from->mux != NULL)
+        return rudp_mux_free_space(from->mux, receiver->stream_id);
+    return SOCKET_RECEIVE_WINDOW;
+}
+
+// Helper function to send an ack for the `received_message` to the `from` socket, advertising the receiver's window
+int ack(RudpMessage* received_message, SocketInfo* from, RudpReceiver* receiver) {
+    int window = receive_window(from, receiver);
+    receiver->window_closed = window < MAX_DATA_SIZE;
+    return send_control_message(EMPTY_ACK_NUM, received_message->header.seq_num, received_message->header.stream_id,
+                                window, from);
+}
+
+// Helper function that checks if `message` is a window update: an ack for the last message the sender sent, which
+// the receiver sends again once it has made room for the next message
+bool is_window_update(RudpMessage* message, RudpSender* sender) {
+    return message->header.seq_num == EMPTY_ACK_NUM && message->header.ack_num > 0
+        && message->header.ack_num == sender->last_ack;
+}
+
+// Helper function that answers the message in `buffer` if it's a keepalive probe, sending the answer to `to`
+//
+// Returns true if the message was a probe
+bool answer_probe(char* buffer, int size, SocketInfo* to) {
+    RudpMessage probe = {};
+    if (deserialize(buffer, size, &probe) < 0)
+        return false;
+    free(probe.data);
+    if (probe.header.seq_num != PROBE_SEQ_NUM)
+        return false;
+
+    if (send_control_message(PROBE_ACK_SEQ_NUM, EMPTY_ACK_NUM, probe.header.stream_id, 0, to) < 0)
+        fprintf(stderr, "ERROR in answer_probe: error sending probe ack\n");
+    return true;
+}
+
+// Helper function that applies `message` if it's an abort of the exchange by the peer on the receiver's stream, and
+// answers it with an ABORT-ACK sent to `from`. The receiver catches up with the peer's sender, and so does `sender`
+// (unless it's NULL, which only a thread that isn't sending can pass) with the peer's receiver. A resent abort is only
+// answered.
+//
+// Returns true if the message was an abort, in which case the receiver's `aborted` flag is set unless the abort had
+// already been applied.
+bool handle_abort(RudpMessage* message, SocketInfo* from, RudpSender* sender, RudpReceiver* receiver) {
+    int number, peer_last_ack, peer_last_received;
+    if (message->header.seq_num != ABORT_SEQ_NUM || !on_stream(message, receiver->stream_id)
+        || message->header.data_size != ABORT_DATA_SIZE
+        || deserialize_int(message->data, ABORT_DATA_SIZE, &number) < 0
+        || deserialize_int(&message->data[4], ABORT_DATA_SIZE - 4, &peer_last_ack) < 0
+        || deserialize_int(&message->data[8], ABORT_DATA_SIZE - 8, &peer_last_received) < 0)
+        return false;
+
+    if (number != receiver->last_abort) {
+        // whatever the peer sent that wasn't acked is dropped, and whatever it received counts as acked, so the next
+        // message on either side is the first of the next exchange
+        receiver->last_received = peer_last_ack;
+        if (sender != NULL)
+            sender->last_ack = peer_last_received;
+        receiver->last_abort = number;
+        receiver->aborted = true;
+    }
+    if (send_control_message(ABORT_ACK_SEQ_NUM, number, receiver->stream_id, 0, from) < 0)
+        fprintf(stderr, "ERROR in handle_abort: error sending ABORT-ACK\n");
+    return true;
+}
+
+// Helper function that waits up to `timeout` milliseconds (forever if it's negative) for the next message on stream
+// `stream_id`, reading it into `buffer`. If the socket is shared between several streams, messages are read through
+// its mux so that the messages of other streams are kept for them. Keepalive probes are answered (by the mux if there
+// is one) and never returned.
+//
+// Returns the number of bytes received, 0 if no message arrived in time, and a negative int on failure
+int receive_message(char* buffer, int buffer_size, int stream_id, SocketInfo* from, int timeout) {
+    if (from->mux != NULL)
+        return rudp_mux_recv(from->mux, stream_id, buffer, buffer_size, from, timeout);
+
+    struct timeval start;
+    struct timeval current_time;
+    gettimeofday(&start, NULL);
+
+    while (true) {
+        if (timeout >= 0) {
+            gettimeofday(&current_time, NULL);
+            int remaining = timeout - elapsed_time(&start, &current_time);
+            struct pollfd poll_fds[1];
+            poll_fds[0] = (struct pollfd) {.fd=from->sockfd, .events=POLLIN};
+            int status = poll(poll_fds, 1, remaining > 0 ? remaining : 0);
+            if (status <= 0)
+                return status;
+        }
+
+        int n = recvfrom(from->sockfd, buffer, buffer_size, 0, from->addr, &from->addr_len);
+        if (n <= 0 || !answer_probe(buffer, n, from))
+            return n;
+    }
+}
+
+
+// Helper function that returns how long (in milliseconds) a peer can be silent before it's probed, given the smoothed
+// round trip time `srtt` to it (in microseconds, 0 if it isn't known yet)
+int probe_interval(int srtt) {
+    return max(KEEPALIVE_MIN_INTERVAL, KEEPALIVE_RTTS * (srtt / 1000));
+}
+
+// Helper function that returns how long (in milliseconds) a peer can be silent before it's given up on, given the
+// smoothed round trip time `srtt` to it (in microseconds, 0 if it isn't known yet)
+int dead_peer_timeout(int srtt) {
+    return max(DEAD_PEER_MIN_TIMEOUT, DEAD_PEER_RTTS * (srtt / 1000));
+}
+
+// Helper function that folds a round trip time `sample` (in microseconds) into the smoothed round trip time `srtt`
+void update_srtt(int* srtt, long sample) {
+    // a measured round trip time is never 0, which stands for one that isn't known
+    if (sample < 1)
+        sample = 1;
+    *srtt = *srtt == 0 ? (int) sample : (int) ((7L * *srtt + sample) / 8);
+}
+
+void rudp_cancel(RudpCancel* cancel) {
+    cancel->cancelled = 1;
+}
+
+bool rudp_is_cancelled(RudpCancel* cancel) {
+    return cancel != NULL && cancel->cancelled;
+}
+
+
+// Helper function that holds back a message of `data_size` bytes while the receiver's window doesn't have room for it.
+// Waits up to one message timeout for a window update, after which the message is sent anyway: the update may have
+// been lost, and the message then asks for the window again.
+void wait_for_window(int data_size, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    struct timeval start;
+    struct timeval current_time;
+    gettimeofday(&start, NULL);
+    current_time = start;
+
+    while (sender->window < data_size && !receiver->aborted
+           && elapsed_time(&start, &current_time) < sender->message_timeout) {
+        char buffer[MAX_PAYLOAD_SIZE] = {0,};
+        int n = receive_message(buffer, MAX_PAYLOAD_SIZE, sender->stream_id, to,
+                                sender->message_timeout - elapsed_time(&start, &current_time));
+        if (n == 0)
+            return;
+
+        RudpMessage received_message = {};
+        if (n > 0 && deserialize(buffer, MAX_PAYLOAD_SIZE, &received_message) >= 0) {
+            // once the receiver aborts the exchange, the message is given up on rather than sent
+            if (on_stream(&received_message, sender->stream_id)
+                && !handle_abort(&received_message, to, sender, receiver)) {
+                if (is_window_update(&received_message, sender))
+                    sender->window = received_message.header.window;
+                else if (in_old_ack_window(&received_message, receiver) && ack(&received_message, to, receiver) < 0)
+                    fprintf(stderr, "ERROR in wait_for_window: error in ack\n");
+            }
+            free(received_message.data);
+        }
+        gettimeofday(&current_time, NULL);
+    }
 }
 
 
@@ -53,7 +234,8 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
     if(data_size > MAX_DATA_SIZE || data_size < 0)
         return PAYLOAD_TOO_LARGE_ERROR;
 
-    RudpHeader header = {.seq_num = sender->last_ack + 1, .ack_num = EMPTY_ACK_NUM, data_size = data_size};
+    RudpHeader header = {.seq_num = sender->last_ack + 1, .ack_num = EMPTY_ACK_NUM, .data_size = data_size,
+                         .stream_id = sender->stream_id};
     RudpMessage message = {.header = header, .data = data};
 
     // we estimate the size of the serialized data to proactively avoid potential buffer overflows from serialization
@@ -70,7 +252,12 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
     if(wire_data_len > MAX_PAYLOAD_SIZE || wire_data_len < 0)
         return PAYLOAD_TOO_LARGE_ERROR;
 
+    // the message is only sent once the receiver has room for it
+    if (sender->window_known && sender->window < data_size)
+        wait_for_window(data_size, to, sender, receiver);
+
     bool acked = false;
+    int attempts = 0;
 
     // we keep track of the start and current times so we can eventually timeout the sender if a single RUDP message
     // isn't ever ack'd
@@ -81,9 +268,9 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
         fprintf(stderr, "ERROR in rudp_send_chunk: error getting sender start time\n");
         return status;
     }
-
-    struct pollfd poll_fds[1];
-    poll_fds[0] = (struct pollfd) {.fd=to->sockfd, .events=POLLIN};
+    // time the message was first sent, and the last time the receiver was heard from (while sending this message)
+    struct timeval first_sent = sender_start;
+    struct timeval heard = sender_start;
 
     // Keep retrying to send the message until either an ack is received or the sender times out
     while(!acked) {
@@ -95,31 +282,44 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
 
         if(elapsed_time(&sender_start, &current_time) > sender->sender_timeout)
             return SENDER_TIMEOUT_ERROR;
-
+        if (rudp_is_cancelled(sender->cancel))
+            return CANCELLED_ERROR;
+        if (receiver->aborted)
+            return ABORTED_ERROR;
+        // until the round trip time is known, there's no telling how long the receiver can take to answer
+        if (sender->srtt > 0 && elapsed_time(&heard, &current_time) > dead_peer_timeout(sender->srtt))
+            return PEER_DEAD_ERROR;
+
+        // the first attempt was paced by rudp_send before the message could be sent, but resent messages take their
+        // share of the rate limits too
+        if (attempts > 0 && rudp_rate_wait(sender, wire_data_len) < 0)
+            fprintf(stderr, "ERROR in rudp_send_chunk: error waiting on rate limits\n");
+        attempts++;
+
+        if (attempts == 1)
+            gettimeofday(&first_sent, NULL);
         status = sendto(to->sockfd, wire_data, wire_data_len, 0, to->addr, to->addr_len);
         if (status < 0) {
             fprintf(stderr, "ERROR in rudp_send_chunk: error in sendto\n");
             continue;
         }
+        // the receiver may be too busy to take the message, but it still answers a probe if it's alive
+        if (sender->srtt > 0 && elapsed_time(&heard, &current_time) >= probe_interval(sender->srtt)
+            && send_control_message(PROBE_SEQ_NUM, EMPTY_ACK_NUM, sender->stream_id, 0, to) < 0)
+            fprintf(stderr, "ERROR in rudp_send_chunk: error sending probe\n");
 
         // TODO: replace with adaptive timeout based on average RTTs
         // If a response isn't received within the expected RTT, we try sending the message again
-        status = poll(poll_fds, 1, sender->message_timeout);
-        if (status < 0) {
-            fprintf(stderr, "ERROR in rudp_send_chunk: error polling socket\n");
+        char buffer[MAX_PAYLOAD_SIZE] = {0,};
+        int n = receive_message(buffer, MAX_PAYLOAD_SIZE, sender->stream_id, to, sender->message_timeout);
+        if (n < 0) {
+            fprintf(stderr, "ERROR in rudp_send_chunk: error receiving message\n");
             continue;
         }
-        else if (status == 0)
+        else if (n == 0)
             // timed out, retry
             continue;
         else {
-            char buffer[MAX_PAYLOAD_SIZE] = {0,};
-            int n = recvfrom(to->sockfd, buffer, MAX_PAYLOAD_SIZE, 0, to->addr, &to->addr_len);
-            if (n < 0) {
-                fprintf(stderr, "ERROR in rudp_send_chunk: error in recvfrom\n");
-                continue;
-            }
-
             RudpMessage received_message = {};
             // TODO: ensure any memory allocated by deserialization is freed
             int deserialized = deserialize(buffer, MAX_PAYLOAD_SIZE, &received_message);
@@ -128,16 +328,41 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
                 fprintf(stderr, "Deserialization error %d in rudp_send_chunk, ignoring message\n", deserialized);
                 continue;
             }
+            if (!on_stream(&received_message, sender->stream_id)) {
+                free(received_message.data);
+                continue;
+            }
+            gettimeofday(&heard, NULL);
+
+            // the receiver gave up on the exchange, so the message won't be acked
+            if (handle_abort(&received_message, to, sender, receiver)) {
+                free(received_message.data);
+                continue;
+            }
 
             if (received_message.header.ack_num == sender->last_ack + 1) {
                 sender->last_ack++;
                 acked = true;
+                sender->window_known = true;
+                sender->window = received_message.header.window;
+                // the ack of a resent message could be for any of its copies, so only first attempts are timed
+                if (attempts == 1)
+                    update_srtt(&sender->srtt, elapsed_time_us(&first_sent, &heard));
+
+                // a FIN also acks the message it follows, and its sender is waiting to hear that we're done too
+                if (received_message.header.seq_num == FIN_SEQ_NUM
+                    && send_control_message(FIN_ACK_SEQ_NUM, EMPTY_ACK_NUM, sender->stream_id, 0, to) < 0)
+                    fprintf(stderr, "ERROR in rudp_send_chunk: error sending FIN-ACK\n");
+            }
+            // the receiver has made room (it drops messages it has no room for), and the message is resent right away
+            else if (is_window_update(&received_message, sender)) {
+                sender->window = received_message.header.window;
             }
             // if a previously sent ack is lost, the receiver could be stuck re-sending their message and never process
             // the one we just sent. To handle this situation, we also need to be able to respond with acks to previous
             // incoming messages
             else if (in_old_ack_window(&received_message, receiver)) {
-                status = ack(&received_message, to);
+                status = ack(&received_message, to, receiver);
                 if (status < 0) {
                     fprintf(stderr, "ERROR in rudp_send_chunk: error in ack\n");
                     continue;
@@ -153,6 +378,9 @@ int rudp_send_chunk(char* data, int data_size, SocketInfo* to, RudpSender* sende
 // TODO: we only use RUDP to send a single message at a time, should we really support sending multiple chunks?
 // Sends data in chunks through several RUDP messages
 int rudp_send(char* data, int data_size, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver) {
+    if (receiver->aborted)
+        return ABORTED_ERROR;
+
     int num_chunks = (data_size / (MAX_DATA_SIZE+1)) + 1;
     if (num_chunks < 1) {
         fprintf(stderr, "ERROR in rudp_send: invalid number of chunks to send\n");
@@ -162,7 +390,16 @@ int rudp_send(char* data, int data_size, SocketInfo* to, RudpSender* sender, Rud
     int bytes_sent = 0;
     for (int i = 0; i < num_chunks; i++) {
         int chunk_size = min(data_size - bytes_sent, MAX_DATA_SIZE);
-        int status = rudp_send_chunk(&data[bytes_sent], chunk_size, to, sender, receiver);
+
+        // the message is paced before it waits for its turn, so it doesn't hold up the other streams while it's held back
+        int status = rudp_rate_wait(sender, chunk_size + HEADER_SIZE);
+        // a stream sharing its socket with others waits for its turn to send
+        if (status == 0 && to->mux != NULL)
+            status = rudp_mux_acquire(to->mux, sender->stream_id, chunk_size);
+        if (status == 0)
+            status = rudp_send_chunk(&data[bytes_sent], chunk_size, to, sender, receiver);
+        if (to->mux != NULL)
+            rudp_mux_release(to->mux, sender->stream_id);
         if (status < 0) {
             fprintf(stderr, "ERROR in rudp_send: error sending chunk\n");
             return status;
@@ -180,18 +417,32 @@ int rudp_send(char* data, int data_size, SocketInfo* to, RudpSender* sender, Rud
 int rudp_handle_received_message(RudpMessage* received_message, char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* receiver) {
     int ret_code = 0;
 
+    if (!on_stream(received_message, receiver->stream_id))
+        goto dealloc;
+
     if (received_message->header.data_size > buffer_size) {
         fprintf(stderr, "ERROR in rudp_handle_received_message: Received message's payload too large for buffer\n");
         ret_code = -1;
         goto dealloc;
     }
 
+    // The sender is done with the exchange. We're waiting on a new message rather than an ack, so we can confirm that
+    // it can move on.
+    if (received_message->header.seq_num == FIN_SEQ_NUM) {
+        int status = send_control_message(FIN_ACK_SEQ_NUM, EMPTY_ACK_NUM, received_message->header.stream_id, 0, from);
+        if (status < 0) {
+            fprintf(stderr, "ERROR in rudp_handle_received_message: error sending FIN-ACK\n");
+            ret_code = status;
+        }
+        goto dealloc;
+    }
+
     // To cover the case where an ack for a previous message has been sent that the receiver hasn't received, we
     // simply reply with an ACK for any message that has a sequence number within the ACK_WINDOW preceding our last
     // received sequence number
     if (received_message->header.seq_num == receiver->last_received + 1
         || in_old_ack_window(received_message, receiver)) {
-        int status = ack(received_message, from);
+        int status = ack(received_message, from, receiver);
         if (status < 0) {
             fprintf(stderr, "ERROR in rudp_handle_received_message: error in ack\n");
             ret_code = status;
@@ -215,13 +466,64 @@ dealloc:
 }
 
 int rudp_recv(char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* receiver) {
-    // TODO: should include a receiver timeout like the sender timeout
+    if (receiver->aborted)
+        return ABORTED_ERROR;
+
+    // the last ack told the sender there was no room for its next message, so it's told once there is
+    if (receiver->window_closed) {
+        int window = receive_window(from, receiver);
+        receiver->window_closed = window < MAX_DATA_SIZE;
+        if (!receiver->window_closed
+            && send_control_message(EMPTY_ACK_NUM, receiver->last_received, receiver->stream_id, window, from) < 0)
+            fprintf(stderr, "ERROR in rudp_recv: error sending window update\n");
+    }
+
+    // a receiver that can stop waiting polls the socket in short waits, so it can check on its deadline, cancellation,
+    // and sender in between
+    bool can_stop = receiver->receive_timeout > 0 || receiver->keepalive || receiver->cancel != NULL;
+    struct timeval start;
+    struct timeval current_time;
+    gettimeofday(&start, NULL);
+    struct timeval heard = start;           // last time the sender was heard from
+    struct timeval probed = start;          // last time the sender was probed
+    int unanswered_probes = 0;
+
     while (1) {
-        int n = recvfrom(from->sockfd, buffer, buffer_size, 0, from->addr, &from->addr_len);
+        int timeout = -1;
+        if (can_stop) {
+            gettimeofday(&current_time, NULL);
+            if (rudp_is_cancelled(receiver->cancel))
+                return CANCELLED_ERROR;
+            int elapsed = elapsed_time(&start, &current_time);
+            if (receiver->receive_timeout > 0 && elapsed >= receiver->receive_timeout)
+                return RECEIVER_TIMEOUT_ERROR;
+
+            if (receiver->keepalive) {
+                int interval = probe_interval(receiver->srtt);
+                int silence = elapsed_time(&heard, &current_time);
+                if (silence >= dead_peer_timeout(receiver->srtt))
+                    return PEER_DEAD_ERROR;
+                if (silence >= interval && elapsed_time(&probed, &current_time) >= interval) {
+                    if (send_control_message(PROBE_SEQ_NUM, EMPTY_ACK_NUM, receiver->stream_id, 0, from) < 0)
+                        fprintf(stderr, "ERROR in rudp_recv: error sending probe\n");
+                    probed = current_time;
+                    unanswered_probes++;
+                }
+            }
+
+            timeout = INITIAL_TIMEOUT;
+            if (receiver->receive_timeout > 0)
+                timeout = min(timeout, receiver->receive_timeout - elapsed);
+        }
+
+        int n = receive_message(buffer, buffer_size, receiver->stream_id, from, timeout);
         if (n < 0) {
-            fprintf(stderr, "ERROR in rudp_recv: error in recvfrom\n");
+            fprintf(stderr, "ERROR in rudp_recv: error receiving message\n");
             continue;
         }
+        else if (n == 0 && can_stop)
+            // timed out, check on the sender
+            continue;
 
         RudpMessage received_message = {};
         int deserialized = deserialize(buffer, buffer_size, &received_message);
@@ -230,6 +532,27 @@ int rudp_recv(char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* rec
             continue;
         }
 
+        if (can_stop && on_stream(&received_message, receiver->stream_id))
+            gettimeofday(&heard, NULL);
+        if (received_message.header.seq_num == PROBE_ACK_SEQ_NUM) {
+            if (on_stream(&received_message, receiver->stream_id)) {
+                // like resent messages, probes that had to be sent again aren't timed
+                if (unanswered_probes == 1)
+                    update_srtt(&receiver->srtt, elapsed_time_us(&probed, &heard));
+                unanswered_probes = 0;
+            }
+            free(received_message.data);
+            continue;
+        }
+
+        // the sender gave up on the exchange, so the message we're waiting on won't come
+        if (handle_abort(&received_message, from, NULL, receiver)) {
+            free(received_message.data);
+            if (receiver->aborted)
+                return ABORTED_ERROR;
+            continue;
+        }
+
         // Beyond this point, memory should have been allocated by the deserialize() function. It needs to be freed.
         // This is currently taken care of in rudp_handle_received_message().
 
@@ -254,12 +577,12 @@ int rudp_handle_received_ack(RudpMessage* received_message, SocketInfo* from, Ru
     int ret_code = 0;
 
     // we only care about when we need to send acks, will drop any other messages
-    if (!in_old_ack_window(received_message, receiver)) {
+    if (!on_stream(received_message, receiver->stream_id) || !in_old_ack_window(received_message, receiver)) {
         fprintf(stderr, "Received message not in ack window, dropping\n");
         goto dealloc;
     }
 
-    int status = ack(received_message, from);
+    int status = ack(received_message, from, receiver);
     ret_code = status;
     if (status < 0) {
         fprintf(stderr, "ERROR in rudp_handle_received_ack: error in ack\n");
@@ -277,26 +600,17 @@ int rudp_check_acks(char* buffer, int buffer_size, SocketInfo* from, RudpReceive
     bool handled_ack = true;
     int handled_acks = 0;
 
-    struct pollfd poll_fds[1];
-    poll_fds[0] = (struct pollfd) {.fd=from->sockfd, .events=POLLIN};
-
     while (handled_ack) {
         // TODO: replace with adaptive timeout
-        int status = poll(poll_fds, 1, INITIAL_TIMEOUT);
-        if (status < 0) {
-            fprintf(stderr, "ERROR in rudp_check_acks: error in poll\n");
-            return status;
+        int n = receive_message(buffer, buffer_size, receiver->stream_id, from, INITIAL_TIMEOUT);
+        if (n < 0) {
+            fprintf(stderr, "ERROR in rudp_check_acks: error receiving message\n");
+            return n;
         }
-        else if (status == 0)
+        else if (n == 0)
             // timed out, no acks
             break;
 
-        int n = recvfrom(from->sockfd, buffer, buffer_size, 0, from->addr, &from->addr_len);
-        if (n < 0) {
-            fprintf(stderr, "ERROR in rudp_check_acks: error in recvfrom\n");
-            continue;
-        }
-
         RudpMessage received_message = {};
         int deserialized = deserialize(buffer, buffer_size, &received_message);
         if (deserialized < 0) {
@@ -307,10 +621,116 @@ int rudp_check_acks(char* buffer, int buffer_size, SocketInfo* from, RudpReceive
         // Beyond this point, memory should have been allocated by the deserialize() function. It needs to be freed.
         // This is currently taken care of in rudp_handle_received_ack().
 
-        status = rudp_handle_received_ack(&received_message, from, receiver);
+        int status = rudp_handle_received_ack(&received_message, from, receiver);
         handled_ack = status > 0;
         if (handled_ack)
             handled_acks++;
     }
     return handled_acks;
 }
+
+
+int rudp_finish(SocketInfo* peer, RudpReceiver* receiver) {
+    // the FIN acks the last message received, so it also takes the place of that message's ack if it was lost
+    int status = send_control_message(FIN_SEQ_NUM, receiver->last_received, receiver->stream_id,
+                                      receive_window(peer, receiver), peer);
+    if (status < 0) {
+        fprintf(stderr, "ERROR in rudp_finish: error sending FIN\n");
+        return status;
+    }
+
+    while (true) {
+        // TODO: replace with adaptive timeout
+        char buffer[MAX_PAYLOAD_SIZE] = {0,};
+        int n = receive_message(buffer, MAX_PAYLOAD_SIZE, receiver->stream_id, peer, INITIAL_TIMEOUT);
+        if (n < 0) {
+            fprintf(stderr, "ERROR in rudp_finish: error receiving message\n");
+            return n;
+        }
+        else if (n == 0)
+            // the peer isn't resending anything, so it has all its acks even if the FIN-ACK was lost
+            return 0;
+
+        RudpMessage received_message = {};
+        int deserialized = deserialize(buffer, MAX_PAYLOAD_SIZE, &received_message);
+        if (deserialized < 0) {
+            fprintf(stderr, "Deserialization error %d in rudp_finish, ignoring message\n", deserialized);
+            continue;
+        }
+        free(received_message.data);
+        if (!on_stream(&received_message, receiver->stream_id))
+            continue;
+
+        if (received_message.header.seq_num == FIN_ACK_SEQ_NUM)
+            return 0;
+
+        // the peer resent a message, so both its ack and the FIN were lost
+        if (in_old_ack_window(&received_message, receiver)) {
+            if (ack(&received_message, peer, receiver) < 0
+                || send_control_message(FIN_SEQ_NUM, receiver->last_received, receiver->stream_id,
+                                        receive_window(peer, receiver), peer) < 0)
+                fprintf(stderr, "ERROR in rudp_finish: error resending ack\n");
+        }
+    }
+}
+
+
+int rudp_abort(SocketInfo* peer, RudpSender* sender, RudpReceiver* receiver) {
+    int number = ++sender->aborts;
+    char data[ABORT_DATA_SIZE];
+    serialize_int(number, data, ABORT_DATA_SIZE);
+    serialize_int(sender->last_ack, &data[4], ABORT_DATA_SIZE - 4);
+    serialize_int(receiver->last_received, &data[8], ABORT_DATA_SIZE - 8);
+    RudpMessage abort = {.header = (RudpHeader) {.seq_num=ABORT_SEQ_NUM, .ack_num=EMPTY_ACK_NUM,
+                                                 .data_size=ABORT_DATA_SIZE, .stream_id=sender->stream_id},
+                         .data = data};
+    char wire_data[MAX_PAYLOAD_SIZE] = {0,};
+    int wire_data_len = serialize(&abort, wire_data, MAX_PAYLOAD_SIZE);
+    if (wire_data_len < 0) {
+        fprintf(stderr, "ERROR in rudp_abort: error serializing abort\n");
+        return wire_data_len;
+    }
+
+    // a peer that's busy may take a while to get to the abort, but it keeps answering probes in the meantime
+    struct timeval current_time;
+    gettimeofday(&current_time, NULL);
+    struct timeval heard = current_time;
+    struct timeval probed = current_time;
+    while (true) {
+        gettimeofday(&current_time, NULL);
+        int silence = elapsed_time(&heard, &current_time);
+        if (silence >= dead_peer_timeout(sender->srtt)) {
+            fprintf(stderr, "ERROR in rudp_abort: peer stopped answering\n");
+            return PEER_DEAD_ERROR;
+        }
+
+        if (sendto(peer->sockfd, wire_data, wire_data_len, 0, peer->addr, peer->addr_len) < 0)
+            fprintf(stderr, "ERROR in rudp_abort: error in sendto\n");
+        int interval = probe_interval(sender->srtt);
+        if (silence >= interval && elapsed_time(&probed, &current_time) >= interval) {
+            if (send_control_message(PROBE_SEQ_NUM, EMPTY_ACK_NUM, sender->stream_id, 0, peer) < 0)
+                fprintf(stderr, "ERROR in rudp_abort: error sending probe\n");
+            probed = current_time;
+        }
+
+        // the peer may still be sending the aborted exchange until it sees the abort, and none of it is acked
+        char buffer[MAX_PAYLOAD_SIZE] = {0,};
+        struct timeval sent = current_time;
+        gettimeofday(&current_time, NULL);
+        while (elapsed_time(&sent, &current_time) < sender->message_timeout) {
+            int n = receive_message(buffer, MAX_PAYLOAD_SIZE, sender->stream_id, peer,
+                                    sender->message_timeout - elapsed_time(&sent, &current_time));
+            gettimeofday(&current_time, NULL);
+            RudpMessage received_message = {};
+            if (n <= 0 || deserialize(buffer, MAX_PAYLOAD_SIZE, &received_message) < 0)
+                continue;
+            free(received_message.data);
+            if (!on_stream(&received_message, sender->stream_id))
+                continue;
+
+            heard = current_time;
+            if (received_message.header.seq_num == ABORT_ACK_SEQ_NUM && received_message.header.ack_num == number)
+                return 0;
+        }
+    }
+}
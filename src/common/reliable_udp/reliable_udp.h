@@ -22,6 +22,34 @@
 #define INITIAL_TIMEOUT 220     // in milliseconds, timeout until a message will be resent
 #define SENDER_TIMEOUT 5000     // in milliseconds, timeout until a message is considered impossible to deliver
 
+// Sequence numbers of the messages that finish an exchange (the sequence numbers of data messages start at 1). A FIN
+// carries an ack for the last message its sender received, and is answered with a FIN-ACK.
+#define FIN_SEQ_NUM (-1)
+#define FIN_ACK_SEQ_NUM (-2)
+
+// Sequence numbers of keepalive probes and their answers. A probe is answered as soon as its peer reads the socket, even
+// if no thread is waiting on the probe's stream, so a peer that's alive but busy keeps answering them.
+#define PROBE_SEQ_NUM (-3)
+#define PROBE_ACK_SEQ_NUM (-4)
+
+// Sequence numbers of the messages that abort an exchange and their answers. An abort carries its number and where its
+// sender is in the exchange (see rudp_abort), and is answered once its peer has caught up.
+#define ABORT_SEQ_NUM (-5)
+#define ABORT_ACK_SEQ_NUM (-6)
+
+// Once the round trip time to a peer is known, the peer is given up on after it has been silent for DEAD_PEER_RTTS
+// round trips (but at least DEAD_PEER_MIN_TIMEOUT, so a busy peer on a fast network isn't mistaken for a dead one)
+#define DEAD_PEER_RTTS 16
+#define DEAD_PEER_MIN_TIMEOUT 2000  // in milliseconds
+// A silent peer is probed every KEEPALIVE_RTTS round trips, but no more often than every KEEPALIVE_MIN_INTERVAL. A sender
+// resends its message every message timeout until it's acked, so a sender is only probed once it has stopped resending.
+#define KEEPALIVE_RTTS 4
+#define KEEPALIVE_MIN_INTERVAL (4 * INITIAL_TIMEOUT)    // in milliseconds
+
+// in bytes, receive window advertised by a receiver with a socket of its own, which takes each message straight off the
+// socket (streams sharing a socket advertise the free space in their queues instead)
+#define SOCKET_RECEIVE_WINDOW MAX_DATA_SIZE
+
 // if a receiver sees a message with a sequence number <= its last received sequence number, it will still send an
 // ack if the difference is within the ack window
 #define ACK_WINDOW 100
@@ -29,12 +57,19 @@
 
 // Sends data as a (reliable) UDP message
 //
+// Once the round trip time to the receiver is known, a receiver that stops answering (including the keepalive probes
+// sent along with the resent messages) is given up on after a few round trips rather than after the sender timeout.
+//
 // Returns a 0 on success, and a negative int on failure
 int rudp_send(char* data, int data_size, SocketInfo* to, RudpSender* sender, RudpReceiver* receiver);
 
 // Receives a single (reliable) UDP message
 //
-// Returns the number of received bytes (of data) on success, and a negative int on failure
+// Waits forever unless the receiver has a receive timeout, keepalive, or a way to be cancelled. With keepalive, the
+// sender is probed whenever it has been silent for a while, and is given up on once it stops answering.
+//
+// Returns the number of received bytes (of data) on success, and a negative int on failure (RECEIVER_TIMEOUT_ERROR,
+// PEER_DEAD_ERROR, or CANCELLED_ERROR if it stopped waiting)
 int rudp_recv(char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* receiver);
 
 // Listens a little longer for messages and sends acks if applicable, will discard other messages
@@ -42,4 +77,28 @@ int rudp_recv(char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* rec
 // Returns the number of messages that were ack'd on success, or a negative int on failure
 int rudp_check_acks(char* buffer, int buffer_size, SocketInfo* from, RudpReceiver* receiver);
 
+// Finishes an exchange once the last message from `peer` has been received, so the peer isn't left resending a message
+// whose ack was lost. A FIN (which acks that message again) is sent, and the peer answers with a FIN-ACK, which is
+// waited for. Messages the peer resends in the meantime are acked, and the FIN is sent again with them. If nothing
+// arrives for INITIAL_TIMEOUT (e.g. the peer doesn't answer FINs), the exchange is taken to be finished.
+//
+// Returns 0 on success, and a negative int on failure
+int rudp_finish(SocketInfo* peer, RudpReceiver* receiver);
+
+// Makes the senders and receivers using `cancel` give up on what they're waiting for, returning CANCELLED_ERROR.
+// Waiting receivers notice within INITIAL_TIMEOUT. Only sets a flag, so it can be called from a signal handler.
+void rudp_cancel(RudpCancel* cancel);
+
+// Returns true if `cancel` has been cancelled (a NULL one never is)
+bool rudp_is_cancelled(RudpCancel* cancel);
+
+// Aborts the exchange with `peer` (e.g. once it was cancelled), so that the peer stops sending or waiting on it too.
+// The peer's rudp_send and rudp_recv fail with ABORTED_ERROR, and keep failing until it clears its receiver's
+// `aborted` flag, while its sequence numbers catch up with ours so the next exchange starts in step. Waits for the peer
+// to confirm the abort, resending it every message timeout, and gives up once the peer stops answering. Doesn't check
+// the sender's or receiver's cancel.
+//
+// Returns 0 on success, and a negative int if the peer never confirmed the abort.
+int rudp_abort(SocketInfo* peer, RudpSender* sender, RudpReceiver* receiver);
+
 #endif //UDP_RELIABLE_UDP_H
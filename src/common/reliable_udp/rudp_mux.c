@@ -0,0 +1,510 @@
+//
+// RUDP stream multiplexing implementation
+//
+// All the state of a mux is guarded by its lock. A thread waiting on a message becomes the reader if no other thread is
+// reading the socket: it reads a single message without holding the lock, queues it for its stream, and wakes up the
+// other threads so the message's stream can take it and another thread can take over reading.
+//
+
+// needed for clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include "rudp_mux.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "serde.h"
+
+
+static void schedule(RudpMux* mux);
+
+
+// Helper function that finds the open stream `stream_id`, returning NULL if it isn't open
+static RudpStream* find_stream(RudpMux* mux, int stream_id) {
+    for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+        if (mux->streams[i].open && mux->streams[i].id == stream_id)
+            return &mux->streams[i];
+    }
+    return NULL;
+}
+
+
+// Helper function that checks if the stream `stream_id` was closed recently
+static bool was_closed(RudpMux* mux, int stream_id) {
+    int remembered = mux->closed_count < RUDP_MUX_CLOSED_HISTORY ? mux->closed_count : RUDP_MUX_CLOSED_HISTORY;
+    for (int i = 0; i < remembered; i++) {
+        if (mux->closed[i] == stream_id)
+            return true;
+    }
+    return false;
+}
+
+
+// Helper function that opens a stream while holding the lock, returning NULL if it can't be opened
+static RudpStream* open_stream(RudpMux* mux, int stream_id, int class) {
+    if (find_stream(mux, stream_id) != NULL || was_closed(mux, stream_id))
+        return NULL;
+
+    for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+        RudpStream* stream = &mux->streams[i];
+        if (stream->open)
+            continue;
+
+        *stream = (RudpStream) {.id=stream_id, .open=true, .class=class, .weight=1};
+        return stream;
+    }
+    return NULL;
+}
+
+
+// Helper function that drops the messages queued for a stream, while holding the lock
+static void drop_queue(RudpMux* mux, RudpStream* stream) {
+    for (int i = 0; i < stream->queued; i++)
+        mem_budget_release(mux->budget, stream->queue[(stream->queue_start + i) % RUDP_MUX_QUEUE_SIZE].size);
+    stream->queue_start = 0;
+    stream->queued = 0;
+}
+
+
+void rudp_mux_init(RudpMux* mux, int sockfd, bool accepts) {
+    memset(mux, 0, sizeof(*mux));
+    mux->sockfd = sockfd;
+    mux->accepts = accepts;
+    mux->streams[0] = (RudpStream) {.id=RUDP_CONTROL_STREAM, .open=true, .class=RUDP_STREAM_CONTROL, .weight=1};
+    pthread_mutex_init(&mux->lock, NULL);
+    pthread_cond_init(&mux->changed, NULL);
+}
+
+
+void rudp_mux_free(RudpMux* mux) {
+    for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+        if (mux->streams[i].open)
+            drop_queue(mux, &mux->streams[i]);
+    }
+    pthread_mutex_destroy(&mux->lock);
+    pthread_cond_destroy(&mux->changed);
+}
+
+
+int rudp_mux_open(RudpMux* mux, int stream_id, int class) {
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = open_stream(mux, stream_id, class);
+    pthread_mutex_unlock(&mux->lock);
+
+    if (stream == NULL) {
+        fprintf(stderr, "ERROR in rudp_mux_open: could not open stream %d\n", stream_id);
+        return -1;
+    }
+    return 0;
+}
+
+
+void rudp_mux_close(RudpMux* mux, int stream_id) {
+    if (stream_id == RUDP_CONTROL_STREAM)
+        return;
+
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    if (stream != NULL) {
+        stream->open = false;
+        drop_queue(mux, stream);
+        mux->closed[mux->closed_count % RUDP_MUX_CLOSED_HISTORY] = stream_id;
+        mux->closed_count++;
+        if (stream->sending) {
+            mux->bulk_sending--;
+            schedule(mux);
+        }
+        pthread_cond_broadcast(&mux->changed);
+    }
+    pthread_mutex_unlock(&mux->lock);
+}
+
+
+// Helper function that checks that a message can be deserialized, including its checksum
+static bool is_intact(RudpDatagram* datagram) {
+    RudpMessage message = {};
+    if (deserialize(datagram->data, datagram->size, &message) < 0)
+        return false;
+    free(message.data);
+    return true;
+}
+
+
+// Helper function that queues a message for a stream, dropping it if the stream's queue is full or the mux's budget
+// can't cover it
+static void enqueue(RudpMux* mux, RudpStream* stream, RudpDatagram* datagram) {
+    if (stream->queued == RUDP_MUX_QUEUE_SIZE)
+        return;
+    if (stream->class == RUDP_STREAM_CONTROL)
+        mem_budget_charge(mux->budget, datagram->size);
+    else if (mem_budget_reserve(mux->budget, datagram->size) < 0)
+        return;
+    stream->queue[(stream->queue_start + stream->queued) % RUDP_MUX_QUEUE_SIZE] = *datagram;
+    stream->queued++;
+}
+
+// Helper function that answers a keepalive probe, sending the answer back to where the probe came from
+static void answer_probe(RudpMux* mux, RudpDatagram* datagram, int stream_id) {
+    RudpMessage answer = {.header = (RudpHeader) {.seq_num=PROBE_ACK_SEQ_NUM, .ack_num=EMPTY_ACK_NUM,
+                                                  .stream_id=stream_id}};
+    char wire_data[HEADER_SIZE];
+    int wire_data_len = serialize(&answer, wire_data, sizeof(wire_data));
+    if (wire_data_len < 0
+        || sendto(mux->sockfd, wire_data, wire_data_len, 0, (struct sockaddr*) &datagram->addr, datagram->addr_len) < 0)
+        fprintf(stderr, "ERROR in answer_probe: error sending probe ack\n");
+}
+
+// Helper function that queues a message read off the socket for its stream, while holding the lock
+//
+// Messages that don't belong to an open stream (and don't open one), such as corrupted messages or stray messages for a
+// stream that was closed, are queued for the control stream and for every stream a thread is waiting on. They're
+// ignored there, just like on a socket without a mux, but a thread waiting on an ack still resends its own message.
+//
+// Keepalive probes are answered right away instead, so a peer waiting on a stream whose thread is busy knows the
+// connection is still alive.
+static void dispatch(RudpMux* mux, RudpDatagram* datagram) {
+    RudpHeader header;
+    RudpStream* stream = NULL;
+    if (deserialize_header(datagram->data, datagram->size, &header) >= 0) {
+        if (header.seq_num == PROBE_SEQ_NUM && is_intact(datagram)) {
+            answer_probe(mux, datagram, header.stream_id);
+            return;
+        }
+        stream = find_stream(mux, header.stream_id);
+        // the peer opens a stream by sending the first message on it, which is checked in full so a corrupted message
+        // can't open a stream
+        if (stream == NULL && mux->accepts && header.seq_num == 1 && is_intact(datagram)) {
+            stream = open_stream(mux, header.stream_id, RUDP_STREAM_BULK);
+            if (stream != NULL)
+                stream->pending = true;
+        }
+    }
+
+    if (stream != NULL) {
+        enqueue(mux, stream, datagram);
+        return;
+    }
+    for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+        RudpStream* other = &mux->streams[i];
+        if (other->open && (other->id == RUDP_CONTROL_STREAM || other->receivers > 0))
+            enqueue(mux, other, datagram);
+    }
+}
+
+
+// Helper function that reads a single message off the socket, waiting up to `timeout` milliseconds (forever if it's
+// negative) for one to arrive
+//
+// Returns the size of the message, 0 if none arrived, and a negative int on failure
+static int read_datagram(RudpMux* mux, RudpDatagram* datagram, int timeout) {
+    struct pollfd poll_fds[1];
+    poll_fds[0] = (struct pollfd) {.fd=mux->sockfd, .events=POLLIN};
+
+    int status = poll(poll_fds, 1, timeout);
+    if (status < 0 && errno != EINTR) {
+        fprintf(stderr, "ERROR in read_datagram: error in poll\n");
+        return status;
+    }
+    else if (status <= 0)
+        return 0;
+
+    datagram->addr_len = sizeof(datagram->addr);
+    datagram->size = recvfrom(mux->sockfd, datagram->data, MAX_PAYLOAD_SIZE, 0, (struct sockaddr*) &datagram->addr,
+                              &datagram->addr_len);
+    if (datagram->size < 0) {
+        fprintf(stderr, "ERROR in read_datagram: error in recvfrom\n");
+        return -1;
+    }
+    return datagram->size;
+}
+
+
+// Helper function that returns the number of milliseconds left until `deadline` (rounded up), or 0 if it has passed
+static int remaining_time(struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    long remaining = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return remaining > 0 ? (int) remaining : 0;
+}
+
+
+// Helper function that waits (while holding the lock) until `ready` holds, reading messages off the socket whenever no
+// other thread is. Gives up at `deadline`, unless it's NULL.
+//
+// Returns 1 once `ready` holds, 0 if the deadline passed first, and a negative int on failure
+static int wait_until(RudpMux* mux, bool (*ready)(RudpMux* mux, void* arg), void* arg, struct timespec* deadline) {
+    while (!ready(mux, arg)) {
+        int timeout = deadline == NULL ? -1 : remaining_time(deadline);
+        if (timeout == 0)
+            return 0;
+
+        if (mux->reading) {
+            // the reader signals once it has queued a message or stopped reading
+            int status = deadline == NULL ? pthread_cond_wait(&mux->changed, &mux->lock)
+                                          : pthread_cond_timedwait(&mux->changed, &mux->lock, deadline);
+            if (status != 0 && status != ETIMEDOUT)
+                return -1;
+            continue;
+        }
+
+        mux->reading = true;
+        pthread_mutex_unlock(&mux->lock);
+        RudpDatagram datagram;
+        int status = read_datagram(mux, &datagram, timeout);
+        pthread_mutex_lock(&mux->lock);
+        mux->reading = false;
+
+        if (status > 0)
+            dispatch(mux, &datagram);
+        pthread_cond_broadcast(&mux->changed);
+        if (status < 0)
+            return status;
+    }
+    return 1;
+}
+
+
+// Helper function that sets `deadline` to `timeout` milliseconds from now
+static void set_deadline(struct timespec* deadline, int timeout) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long) (timeout % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+
+// Helper function that copies the address a message was sent from into `to`
+static void copy_address(RudpDatagram* datagram, SocketInfo* to) {
+    if (to == NULL || to->addr == NULL)
+        return;
+
+    socklen_t addr_len = datagram->addr_len < to->addr_len ? datagram->addr_len : to->addr_len;
+    memcpy(to->addr, &datagram->addr, addr_len);
+    to->addr_len = addr_len;
+}
+
+
+static bool has_pending_stream(RudpMux* mux, void* arg) {
+    for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+        if (mux->streams[i].open && mux->streams[i].pending)
+            return true;
+    }
+    return false;
+}
+
+int rudp_mux_accept(RudpMux* mux, SocketInfo* from) {
+    pthread_mutex_lock(&mux->lock);
+    int status = wait_until(mux, has_pending_stream, NULL, NULL);
+
+    int stream_id = -1;
+    for (int i = 0; status > 0 && i < RUDP_MUX_MAX_STREAMS; i++) {
+        RudpStream* stream = &mux->streams[i];
+        if (stream->open && stream->pending) {
+            // the stream was opened by its first message, which is still queued
+            stream->pending = false;
+            copy_address(&stream->queue[stream->queue_start], from);
+            stream_id = stream->id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mux->lock);
+
+    if (stream_id < 0)
+        fprintf(stderr, "ERROR in rudp_mux_accept: error waiting for a stream\n");
+    return stream_id;
+}
+
+
+// Never holds, so the thread waiting on it keeps reading the socket
+static bool never_ready(RudpMux* mux, void* arg) {
+    return false;
+}
+
+int rudp_mux_serve(RudpMux* mux) {
+    pthread_mutex_lock(&mux->lock);
+    int status = wait_until(mux, never_ready, NULL, NULL);
+    pthread_mutex_unlock(&mux->lock);
+
+    fprintf(stderr, "ERROR in rudp_mux_serve: error reading the socket\n");
+    return status < 0 ? status : -1;
+}
+
+
+// True once the stream `*arg` has a message queued, or has been closed
+static bool has_message(RudpMux* mux, void* arg) {
+    RudpStream* stream = find_stream(mux, *(int*) arg);
+    return stream == NULL || stream->queued > 0;
+}
+
+int rudp_mux_recv(RudpMux* mux, int stream_id, char* buffer, int buffer_size, SocketInfo* from, int timeout) {
+    struct timespec deadline;
+    if (timeout >= 0)
+        set_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    if (stream != NULL)
+        stream->receivers++;
+    int status = wait_until(mux, has_message, &stream_id, timeout >= 0 ? &deadline : NULL);
+
+    stream = find_stream(mux, stream_id);
+    if (stream != NULL)
+        stream->receivers--;
+    if (status > 0 && stream != NULL) {
+        RudpDatagram* datagram = &stream->queue[stream->queue_start];
+        // like recvfrom, a message that doesn't fit in the buffer is cut off
+        status = datagram->size < buffer_size ? datagram->size : buffer_size;
+        memcpy(buffer, datagram->data, status);
+        copy_address(datagram, from);
+        mem_budget_release(mux->budget, datagram->size);
+
+        stream->queue_start = (stream->queue_start + 1) % RUDP_MUX_QUEUE_SIZE;
+        stream->queued--;
+    }
+    else if (status > 0)
+        status = -1;
+    pthread_mutex_unlock(&mux->lock);
+
+    if (status < 0)
+        fprintf(stderr, "ERROR in rudp_mux_recv: could not receive on stream %d\n", stream_id);
+    return status;
+}
+
+
+// how far behind the pass of the last stream that got a slot a stream can start sending from
+#define RUDP_MUX_MAX_LAG ((unsigned long) RUDP_MUX_BULK_SLOTS * MAX_DATA_SIZE * RUDP_MUX_MAX_WEIGHT)
+
+
+int rudp_mux_free_space(RudpMux* mux, int stream_id) {
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    int free_space = stream != NULL ? (RUDP_MUX_QUEUE_SIZE - stream->queued) * MAX_DATA_SIZE : 0;
+    bool budgeted = stream != NULL && stream->class != RUDP_STREAM_CONTROL;
+    pthread_mutex_unlock(&mux->lock);
+
+    size_t available = budgeted ? mem_budget_available(mux->budget) : SIZE_MAX;
+    return available < (size_t) free_space ? (int) available : free_space;
+}
+
+
+static bool is_bulk(RudpStream* stream) {
+    return stream->open && stream->class == RUDP_STREAM_BULK;
+}
+
+
+// Helper function that counts a message a stream was allowed to send, while holding the lock
+static void count_sent(RudpMux* mux, RudpStream* stream, int size) {
+    stream->sent_bytes += size;
+    mux->stats.bytes[stream->class] += size;
+    mux->stats.messages[stream->class]++;
+}
+
+
+// Helper function that hands out the free bulk slots to the waiting streams, while holding the lock
+//
+// Each bulk stream has a pass, which advances by the size of each message it sends divided by its weight. A free slot
+// goes to the waiting stream with the lowest pass, so over time the streams send bytes in proportion to their weights.
+// A stream holding its slot is never waiting at the moment it frees it, so plain round robin over the waiting streams
+// (or deficit round robin, which assumes every stream is always waiting) would hand its share to the others.
+static void schedule(RudpMux* mux) {
+    while (mux->bulk_sending < RUDP_MUX_BULK_SLOTS) {
+        RudpStream* next = NULL;
+        for (int i = 0; i < RUDP_MUX_MAX_STREAMS; i++) {
+            RudpStream* stream = &mux->streams[(mux->next_turn + i) % RUDP_MUX_MAX_STREAMS];
+            if (is_bulk(stream) && stream->waiting && (next == NULL || stream->pass < next->pass))
+                next = stream;
+        }
+        if (next == NULL)
+            return;
+
+        mux->pass = next->pass;
+        next->pass += (unsigned long) next->request * RUDP_MUX_MAX_WEIGHT / next->weight;
+        next->waiting = false;
+        next->sending = true;
+        mux->bulk_sending++;
+        // streams with the same pass take turns
+        mux->next_turn = (int) (next - mux->streams + 1) % RUDP_MUX_MAX_STREAMS;
+        count_sent(mux, next, next->request);
+        pthread_cond_broadcast(&mux->changed);
+    }
+}
+
+int rudp_mux_acquire(RudpMux* mux, int stream_id, int size) {
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    if (stream == NULL || stream->class == RUDP_STREAM_CONTROL) {
+        // control streams have strict priority, so they send right away
+        if (stream != NULL)
+            count_sent(mux, stream, size);
+        pthread_mutex_unlock(&mux->lock);
+        return stream == NULL ? -1 : 0;
+    }
+
+    // a stream that was idle can only catch up on a few messages of the share it didn't use, so it can't then starve the
+    // other streams
+    if (stream->pass + RUDP_MUX_MAX_LAG < mux->pass)
+        stream->pass = mux->pass - RUDP_MUX_MAX_LAG;
+    // other threads hold the slots while they wait for their acks, so they do the reading
+    stream->waiting = true;
+    stream->request = size;
+    schedule(mux);
+    while ((stream = find_stream(mux, stream_id)) != NULL && stream->waiting)
+        pthread_cond_wait(&mux->changed, &mux->lock);
+    pthread_mutex_unlock(&mux->lock);
+
+    return stream == NULL ? -1 : 0;
+}
+
+
+void rudp_mux_release(RudpMux* mux, int stream_id) {
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    if (stream != NULL && stream->sending) {
+        stream->sending = false;
+        mux->bulk_sending--;
+        schedule(mux);
+    }
+    pthread_mutex_unlock(&mux->lock);
+}
+
+
+int rudp_mux_set_weight(RudpMux* mux, int stream_id, int weight) {
+    if (weight < 1 || weight > RUDP_MUX_MAX_WEIGHT) {
+        fprintf(stderr, "ERROR in rudp_mux_set_weight: invalid weight %d\n", weight);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    if (stream != NULL)
+        stream->weight = weight;
+    pthread_mutex_unlock(&mux->lock);
+
+    return stream == NULL ? -1 : 0;
+}
+
+
+void rudp_mux_stats(RudpMux* mux, RudpMuxStats* stats) {
+    pthread_mutex_lock(&mux->lock);
+    *stats = mux->stats;
+    pthread_mutex_unlock(&mux->lock);
+}
+
+
+unsigned long rudp_mux_sent_bytes(RudpMux* mux, int stream_id) {
+    pthread_mutex_lock(&mux->lock);
+    RudpStream* stream = find_stream(mux, stream_id);
+    unsigned long sent_bytes = stream != NULL ? stream->sent_bytes : 0;
+    pthread_mutex_unlock(&mux->lock);
+    return sent_bytes;
+}
@@ -0,0 +1,171 @@
+//
+// RUDP stream multiplexing interface
+//
+// Several independent streams can share a single RUDP connection (one socket talking to one peer). Each stream has its
+// own sequence and ack numbers, so messages on one stream are ordered and retransmitted independently of the others,
+// and a lost or slow message only holds up its own stream. Every RUDP header carries the ID of its stream.
+//
+// Whichever thread is waiting on a message reads the socket on behalf of all the streams, and queues the messages that
+// belong to other streams until their threads pick them up. Keepalive probes are answered by the reader instead of
+// being queued, so a peer probing a stream whose thread is busy still hears back, as long as some thread is waiting
+// (such as one in rudp_mux_accept, or one dedicated to the socket with rudp_mux_serve).
+//
+// A stream's flow-control credit is a single message: its sender only has one message in flight, and that message is
+// only acked once a thread takes it from the stream. A stream that nobody reads therefore only stalls its own sender,
+// and only RUDP_MUX_QUEUE_SIZE messages (the message and any copies of it that were resent) are queued for it. The
+// acks of a stream advertise the free space left in its queue as the receive window, so a sender whose messages would
+// only be dropped holds them back until the receiver catches up.
+//
+// Queued messages can be charged to a memory budget shared with the rest of the program. Once the budget runs low, the
+// windows of bulk streams shrink to what's left of it, and their messages are dropped if it can't cover them. The control
+// stream is exempt, so commands still get through (e.g. to be told the server is out of memory).
+//
+// Sending is scheduled across streams. Control streams (e.g. the one commands are sent on) have strict priority and can
+// always send, so interactive commands are never queued behind bulk transfers, however many of them are running. Bulk
+// streams share RUDP_MUX_BULK_SLOTS messages in flight, which are handed out in proportion to the weights of the streams
+// (stride scheduling): streams with the same weight send the same number of bytes whatever the size of their messages,
+// and a stream with twice the weight sends twice as many. Weights only matter while streams are waiting for slots, since
+// a stream never has more than one message in flight.
+//
+// The peer opens a stream by sending its first message on it. The IDs of recently closed streams are remembered, so a
+// stray message for a stream that has already been closed can't open it again.
+//
+
+#ifndef UDP_RUDP_MUX_H
+#define UDP_RUDP_MUX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "reliable_udp.h"
+#include "../mem_budget.h"
+
+
+// stream that's always open, used for commands and their replies
+#define RUDP_CONTROL_STREAM 0
+
+// most streams open at once on a connection, including the control stream
+#define RUDP_MUX_MAX_STREAMS 32
+// most messages queued for a stream until it's read, any more are dropped (and resent by the peer)
+#define RUDP_MUX_QUEUE_SIZE 4
+// most messages in flight at once on the bulk streams of a connection
+#define RUDP_MUX_BULK_SLOTS 4
+// number of closed streams whose IDs can't be opened again
+#define RUDP_MUX_CLOSED_HISTORY 64
+// largest weight a stream can be given
+#define RUDP_MUX_MAX_WEIGHT 64
+
+// Scheduling classes of streams
+#define RUDP_STREAM_CONTROL 0   // sends without waiting for a turn
+#define RUDP_STREAM_BULK 1      // takes turns with the other bulk streams
+#define RUDP_STREAM_CLASSES 2
+
+
+// A message read off the socket, waiting to be taken by its stream
+typedef struct {
+    char data[MAX_PAYLOAD_SIZE];
+    int size;
+    struct sockaddr_storage addr;   // who sent the message
+    socklen_t addr_len;
+} RudpDatagram;
+
+typedef struct {
+    int id;
+    bool open;
+    int class;                  // RUDP_STREAM_CONTROL or RUDP_STREAM_BULK
+    bool pending;               // opened by the peer, and not handed out by rudp_mux_accept yet
+    bool waiting;               // waiting for its turn to send
+    bool sending;               // holds one of the bulk slots
+    int weight;                 // share of the bulk slots, relative to the other bulk streams
+    unsigned long pass;         // bytes sent divided by the weight (scaled by RUDP_MUX_MAX_WEIGHT), lowest goes next
+    int request;                // size of the message the stream is waiting to send
+    unsigned long sent_bytes;   // bytes the stream was allowed to send
+    int receivers;              // threads waiting on a message in rudp_mux_recv
+
+    RudpDatagram queue[RUDP_MUX_QUEUE_SIZE];   // ring buffer of the messages waiting to be taken
+    int queue_start;
+    int queued;
+} RudpStream;
+
+// Traffic sent on a connection, by scheduling class
+typedef struct {
+    unsigned long bytes[RUDP_STREAM_CLASSES];
+    unsigned long messages[RUDP_STREAM_CLASSES];
+} RudpMuxStats;
+
+struct RudpMux {
+    int sockfd;
+    bool accepts;               // opens the streams the peer starts sending on
+    int closed[RUDP_MUX_CLOSED_HISTORY];    // ring buffer of the IDs of the streams closed most recently
+    int closed_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // signalled when a message is queued, a stream is opened or closed, or a slot is freed
+    bool reading;               // a thread is reading the socket
+
+    RudpStream streams[RUDP_MUX_MAX_STREAMS];
+    int bulk_sending;           // bulk slots in use
+    int next_turn;              // index of the stream that gets the next free bulk slot if passes are tied
+    unsigned long pass;         // pass of the stream that got the last bulk slot
+    RudpMuxStats stats;
+    MemBudget* budget;          // charged for queued messages, unless it's NULL (may be set after rudp_mux_init)
+};
+
+
+// Sets up a mux for the socket `sockfd`, with only the control stream open. If `accepts` is set, the streams the peer
+// sends on are opened (and handed out by rudp_mux_accept).
+void rudp_mux_init(RudpMux* mux, int sockfd, bool accepts);
+
+void rudp_mux_free(RudpMux* mux);
+
+// Opens the stream `stream_id` in scheduling class `class`. The ID of a stream that was closed recently can't be used
+// again.
+//
+// Returns 0 on success, and a negative int if the stream can't be opened.
+int rudp_mux_open(RudpMux* mux, int stream_id, int class);
+
+// Closes a stream, dropping any messages queued for it
+void rudp_mux_close(RudpMux* mux, int stream_id);
+
+// Waits for the peer to open a stream. The peer's address is stored in `from`.
+//
+// Returns the ID of the stream (which is then open in the bulk class), and a negative int on failure.
+int rudp_mux_accept(RudpMux* mux, SocketInfo* from);
+
+// Reads the socket on behalf of every stream until reading fails, so probes are answered and messages are queued even
+// while all the threads using the streams are busy (e.g. on a peer that doesn't accept streams, and so has no thread
+// waiting in rudp_mux_accept). Meant to be run by a thread of its own.
+//
+// Returns a negative int once the socket can't be read anymore.
+int rudp_mux_serve(RudpMux* mux);
+
+// Waits up to `timeout` milliseconds (forever if it's negative) for the next message on the stream `stream_id`, reading
+// messages for the other streams off the socket in the meantime. The sender's address is stored in `from`.
+//
+// Returns the size of the message, 0 if none arrived in time, and a negative int on failure.
+int rudp_mux_recv(RudpMux* mux, int stream_id, char* buffer, int buffer_size, SocketInfo* from, int timeout);
+
+// Returns the bytes of data that can still be queued for the stream `stream_id` before its messages are dropped (which
+// is also limited by the mux's memory budget), and 0 if it isn't open
+int rudp_mux_free_space(RudpMux* mux, int stream_id);
+
+// Waits for the turn of the stream `stream_id` to send a message of `size` bytes. Must be followed by rudp_mux_release
+// once the message has been acked (or given up on).
+//
+// Returns 0 on success, and a negative int if the stream isn't open.
+int rudp_mux_acquire(RudpMux* mux, int stream_id, int size);
+
+void rudp_mux_release(RudpMux* mux, int stream_id);
+
+// Sets the weight of the stream `stream_id`, from 1 (the default) to RUDP_MUX_MAX_WEIGHT
+//
+// Returns 0 on success, and a negative int if the weight is invalid or the stream isn't open.
+int rudp_mux_set_weight(RudpMux* mux, int stream_id, int weight);
+
+// Copies the traffic sent so far on the connection, by scheduling class, into `stats`
+void rudp_mux_stats(RudpMux* mux, RudpMuxStats* stats);
+
+// Returns the bytes the stream `stream_id` was allowed to send so far, and 0 if it isn't open
+unsigned long rudp_mux_sent_bytes(RudpMux* mux, int stream_id);
+
+#endif //UDP_RUDP_MUX_H
@@ -0,0 +1,99 @@
+//
+// RUDP rate limiting implementation
+//
+// Tokens are only added when a message is sent, for all the time since they were last added. A message that finds the
+// bucket short takes its tokens anyway, leaving it negative, and sleeps for as long as the bucket takes to refill that
+// debt. The next message then finds the debt still owed (less whatever was refilled since), so messages sent at the cap
+// queue up one behind another instead of all waking up at once.
+//
+
+// needed for clock_gettime and nanosleep
+#define _POSIX_C_SOURCE 200809L
+
+#include "rudp_rate.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "reliable_udp.h"
+
+
+void rudp_rate_init(RudpRateLimit* limit, long rate) {
+    pthread_mutex_init(&limit->lock, NULL);
+    limit->rate = rate;
+    limit->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &limit->refilled);
+}
+
+
+void rudp_rate_free(RudpRateLimit* limit) {
+    pthread_mutex_destroy(&limit->lock);
+}
+
+
+void rudp_rate_set(RudpRateLimit* limit, long rate) {
+    pthread_mutex_lock(&limit->lock);
+    limit->rate = rate;
+    // a debt owed at the old rate would be paid at the new one, so it's dropped
+    if (limit->tokens < 0)
+        limit->tokens = 0;
+    pthread_mutex_unlock(&limit->lock);
+}
+
+
+long rudp_rate_get(RudpRateLimit* limit) {
+    pthread_mutex_lock(&limit->lock);
+    long rate = limit->rate;
+    pthread_mutex_unlock(&limit->lock);
+    return rate;
+}
+
+
+// Helper function that takes `size` tokens from the limit, returning how long (in seconds) the message has to wait for
+// them to be refilled
+static double take_tokens(RudpRateLimit* limit, int size) {
+    pthread_mutex_lock(&limit->lock);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double) (now.tv_sec - limit->refilled.tv_sec) + (now.tv_nsec - limit->refilled.tv_nsec) / 1e9;
+    limit->refilled = now;
+
+    double delay = 0;
+    if (limit->rate > RUDP_RATE_UNLIMITED) {
+        double burst = (double) limit->rate * RUDP_RATE_BURST_TIME / 1000;
+        if (burst < MAX_PAYLOAD_SIZE)
+            burst = MAX_PAYLOAD_SIZE;
+
+        limit->tokens += elapsed * limit->rate;
+        if (limit->tokens > burst)
+            limit->tokens = burst;
+        limit->tokens -= size;
+        if (limit->tokens < 0)
+            delay = -limit->tokens / limit->rate;
+    }
+    pthread_mutex_unlock(&limit->lock);
+
+    return delay;
+}
+
+int rudp_rate_wait(RudpSender* sender, int size) {
+    double delay = 0;
+    for (int i = 0; i < RUDP_RATE_LEVELS; i++) {
+        if (sender->rate_limits[i] == NULL)
+            continue;
+        double level_delay = take_tokens(sender->rate_limits[i], size);
+        if (level_delay > delay)
+            delay = level_delay;
+    }
+    if (delay <= 0)
+        return 0;
+
+    struct timespec remaining = {.tv_sec=(time_t) delay, .tv_nsec=(long) ((delay - (time_t) delay) * 1e9)};
+    while (nanosleep(&remaining, &remaining) < 0) {
+        if (errno != EINTR) {
+            perror("ERROR in rudp_rate_wait: nanosleep");
+            return -1;
+        }
+    }
+    return 0;
+}
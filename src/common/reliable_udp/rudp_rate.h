@@ -0,0 +1,58 @@
+//
+// RUDP rate limiting interface
+//
+// A rate limit is a token bucket: it fills up at `rate` bytes per second, up to `burst` bytes, and each message takes its
+// size in tokens before it's sent. A sender can be held to several limits at once (e.g. those of the whole server, of
+// the client it's sending to, and of its own transfer), in which case the strictest one sets its pace.
+//
+// Limits pace their senders rather than letting them burst and then stall. The burst is kept to RUDP_RATE_BURST_TIME of
+// traffic (but at least one message), and a message that doesn't have enough tokens reserves them anyway and waits until
+// they've been refilled. Messages sent at the cap are therefore spread out evenly.
+//
+// The rate of a limit can be changed at any time, and the new rate applies to the next message sent under it.
+//
+
+#ifndef UDP_RUDP_RATE_H
+#define UDP_RUDP_RATE_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "types.h"
+
+
+// rate of a limit that doesn't hold back its senders
+#define RUDP_RATE_UNLIMITED 0
+// in milliseconds, traffic that can be sent at once after being idle
+#define RUDP_RATE_BURST_TIME 10
+
+// Levels of the limits a sender can be held to (see RudpSender), any of which can be left unset
+#define RUDP_RATE_GLOBAL 0      // all the traffic of the program
+#define RUDP_RATE_CLIENT 1      // the traffic to a single peer
+#define RUDP_RATE_TRANSFER 2    // the traffic of a single transfer
+
+
+struct RudpRateLimit {
+    pthread_mutex_t lock;
+    long rate;                  // in bytes per second, or RUDP_RATE_UNLIMITED
+    double tokens;              // bytes that can be sent right away, negative if messages are waiting on refills
+    struct timespec refilled;   // when tokens were last added
+};
+
+
+// Sets up a limit of `rate` bytes per second (RUDP_RATE_UNLIMITED for no limit)
+void rudp_rate_init(RudpRateLimit* limit, long rate);
+
+void rudp_rate_free(RudpRateLimit* limit);
+
+// Changes the rate of a limit, to take effect from the next message sent under it
+void rudp_rate_set(RudpRateLimit* limit, long rate);
+
+long rudp_rate_get(RudpRateLimit* limit);
+
+// Waits until a message of `size` bytes can be sent under all the limits of `sender`, taking its tokens
+//
+// Returns 0 on success, and a negative int on failure.
+int rudp_rate_wait(RudpSender* sender, int size);
+
+#endif //UDP_RUDP_RATE_H
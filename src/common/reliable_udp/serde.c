@@ -4,11 +4,26 @@
 
 #include "serde.h"
 
+#include "../crc32c.h"
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
 
+// Helper function that computes the checksum of a serialized message, treating its checksum field as 0
+static unsigned int message_checksum(char* buffer, int message_size) {
+    char empty_checksum[sizeof(int)] = {0,};
+    int checksum_offset = HEADER_SIZE - sizeof(empty_checksum);
+
+    uint32_t checksum = crc32c(0, buffer, checksum_offset);
+    checksum = crc32c(checksum, empty_checksum, sizeof(empty_checksum));
+    checksum = crc32c(checksum, &buffer[HEADER_SIZE], message_size - HEADER_SIZE);
+
+    // a checksum of 0 would be mistaken for a message without a checksum, so (like UDP) it is sent as all ones instead
+    return checksum == NO_CHECKSUM ? 0xFFFFFFFF : checksum;
+}
+
 int serialize(RudpMessage* message, char* buffer, int buffer_len) {
     // We expect the `data_size` field in the header to accurately represent the size of `buffer`
     unsigned int space_needed = sizeof(message->header) + sizeof(*message->data) * message->header.data_size;
@@ -18,7 +33,10 @@ int serialize(RudpMessage* message, char* buffer, int buffer_len) {
     int i = 0;
     int serialized;
 
-    serialized = serialize_header(&message->header, buffer, buffer_len);
+    // the checksum covers the rest of the header as well as the data, so it is only filled in once both are serialized
+    RudpHeader header = message->header;
+    header.checksum = NO_CHECKSUM;
+    serialized = serialize_header(&header, buffer, buffer_len);
     // TODO: error handling
     if (serialized < 0)
         return serialized;
@@ -27,8 +45,13 @@ int serialize(RudpMessage* message, char* buffer, int buffer_len) {
 
     // To serialize the data, we can simply copy it directly to the buffer since they're both char arrays
     memcpy(&buffer[i], message->data, message->header.data_size);
+    i += message->header.data_size;
 
-    return i + message->header.data_size;
+    serialized = serialize_int((int) message_checksum(buffer, i), &buffer[HEADER_SIZE - sizeof(int)], sizeof(int));
+    if (serialized < 0)
+        return serialized;
+
+    return i;
 }
 
 
@@ -46,6 +69,10 @@ int deserialize(char* buffer, int buffer_len, RudpMessage* message) {
     if (buffer_len < expected_size || expected_data_size < 0 || expected_size < 0)
         return -1;
 
+    // corrupted messages are dropped here, before anything acts on their contents
+    if (message->header.checksum != NO_CHECKSUM && message->header.checksum != message_checksum(buffer, expected_size))
+        return CHECKSUM_ERROR;
+
     // TODO: error handling
     // expects message to not have pre-allocated the data buffer
     if (message->data != NULL)
@@ -87,6 +114,24 @@ int serialize_header(RudpHeader* header, char* buffer, int buffer_len) {
     else
         i += serialized;
 
+    serialized = serialize_int(header->stream_id, &buffer[i], buffer_len - i);
+    if (serialized < 0)
+        return serialized;
+    else
+        i += serialized;
+
+    serialized = serialize_int(header->window, &buffer[i], buffer_len - i);
+    if (serialized < 0)
+        return serialized;
+    else
+        i += serialized;
+
+    serialized = serialize_int((int) header->checksum, &buffer[i], buffer_len - i);
+    if (serialized < 0)
+        return serialized;
+    else
+        i += serialized;
+
     return i;
 }
 
@@ -138,6 +183,26 @@ int deserialize_header(char* buffer, int buffer_len, RudpHeader* header) {
         return -1;
     i += deserialized;
 
+    deserialized = deserialize_int(&buffer[i], buffer_len, &header->stream_id);
+    // TODO: error handling
+    if (deserialized < 0)
+        return -1;
+    i += deserialized;
+
+    deserialized = deserialize_int(&buffer[i], buffer_len, &header->window);
+    // TODO: error handling
+    if (deserialized < 0)
+        return -1;
+    i += deserialized;
+
+    int checksum;
+    deserialized = deserialize_int(&buffer[i], buffer_len, &checksum);
+    // TODO: error handling
+    if (deserialized < 0)
+        return -1;
+    header->checksum = (unsigned int) checksum;
+    i += deserialized;
+
     return i;
 }
 
@@ -7,7 +7,7 @@
 
 #include "types.h"
 
-// Serializes (converts into bytes) an RudpMessage
+// Serializes (converts into bytes) an RudpMessage, including a checksum of the serialized message in the header
 //
 // Returns the number of bytes serialized on success, returns a negative int on failure
 int serialize(RudpMessage* message, char* buffer, int buffer_len);
@@ -16,7 +16,8 @@ int serialize(RudpMessage* message, char* buffer, int buffer_len);
 //
 // Dynamically allocates a data buffer that must be freed once it is no longer needed
 //
-// Returns the number of bytes deserialized on success, returns a negative int on failure
+// Returns the number of bytes deserialized on success, CHECKSUM_ERROR if the message was corrupted, and a negative int
+// on other failures. No data buffer is allocated when deserialization fails.
 int deserialize(char* buffer, int buffer_len, RudpMessage* message);
 
 
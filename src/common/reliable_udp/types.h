@@ -5,6 +5,8 @@
 #ifndef UDP_TYPES_H
 #define UDP_TYPES_H
 
+#include <signal.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 
 
@@ -12,22 +14,50 @@
 // TODO: should not clash with other potential return values
 #define PAYLOAD_TOO_LARGE_ERROR (-2)
 #define SENDER_TIMEOUT_ERROR (-3)
+#define CHECKSUM_ERROR (-4)
+// the errors below are kept clear of the KFTP errors, which share the range above them
+#define RECEIVER_TIMEOUT_ERROR (-8)     // no message arrived before the receiver's deadline
+#define PEER_DEAD_ERROR (-9)            // the peer stopped answering, see DEAD_PEER_RTTS
+#define CANCELLED_ERROR (-10)           // the sender or receiver was cancelled, see rudp_cancel
+#define ABORTED_ERROR (-11)             // the peer aborted the exchange, see rudp_abort
 
 // size of RudpHeader in bytes
-#define HEADER_SIZE 12
+#define HEADER_SIZE 24
 
+// value of the checksum field for messages whose sender did not compute a checksum
+#define NO_CHECKSUM 0
+
+
+// Shares a socket between several streams, see rudp_mux.h
+typedef struct RudpMux RudpMux;
+
+// Caps the rate messages are sent at, see rudp_rate.h
+typedef struct RudpRateLimit RudpRateLimit;
+// number of limits a sender can be held to at once (global, per client, and per transfer)
+#define RUDP_RATE_LEVELS 3
+
+// Lets a sender or receiver that's waiting on its peer be stopped from another thread or a signal handler, see
+// rudp_cancel
+typedef struct {
+    volatile sig_atomic_t cancelled;
+} RudpCancel;
 
 // Holds information about the socket to send/receive data to/from
 typedef struct {
     int sockfd;
     struct sockaddr* addr;
     socklen_t addr_len;
+    RudpMux* mux;       // set if the socket is shared between several streams, in which case it's read through the mux
 } SocketInfo;
 
 typedef struct {
     int seq_num;
     int ack_num;
     int data_size; // size of data in bytes
+    int stream_id; // stream the message belongs to, each stream has its own sequence and ack numbers
+    int window;    // bytes of data the message's sender has room to receive next on the stream
+    // CRC32C of the serialized message (computed with this field set to 0), or NO_CHECKSUM. Filled in by serialize().
+    unsigned int checksum;
 } RudpHeader;
 
 typedef struct {
@@ -40,11 +70,27 @@ typedef struct {
     int last_ack;           // last received ack
     int message_timeout;    // in milliseconds, timeout until a message should be resent
     int sender_timeout;     // in milliseconds, timeout until a sender should abort trying to send a message
+    int stream_id;          // stream the messages are sent on
+    RudpRateLimit* rate_limits[RUDP_RATE_LEVELS];   // limits the messages are paced by, unset ones are ignored
+    bool window_known;      // set once the receiver has advertised its window
+    int window;             // bytes the receiver advertised room for in its last ack, no message larger is sent
+    int srtt;               // in microseconds, smoothed round trip time to the receiver, 0 until it has been measured
+    RudpCancel* cancel;     // stops the sender once cancelled, unless it's NULL
+    int aborts;             // exchanges aborted with rudp_abort, which numbers each abort
 } RudpSender;
 
 // Information needed when receiving a RUDP message
 typedef struct {
     int last_received;  // last ack'd seq number
+    int stream_id;      // stream the messages are received on
+    bool window_closed; // set if the last ack told the sender there was no room for another message
+    int receive_timeout;    // in milliseconds, how long to wait for a message before giving up (0 waits forever)
+    bool keepalive;         // probes the sender while waiting on it, and gives up once it stops answering
+    int srtt;               // in microseconds, smoothed round trip time of the probes, 0 until one has been answered
+    RudpCancel* cancel;     // stops the receiver once cancelled, unless it's NULL
+    // set once the peer aborts the exchange, after which sends and receives fail with ABORTED_ERROR until it's cleared
+    bool aborted;
+    int last_abort;         // number of the last abort from the peer, so an abort that was resent is only applied once
 } RudpReceiver;
 
 #endif //UDP_TYPES_H
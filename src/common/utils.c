@@ -4,11 +4,31 @@
 
 #include "utils.h"
 
+#include <string.h>
+
 // returns elapsed time in milliseconds
 int elapsed_time(struct timeval *start, struct timeval *end) {
     return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_usec - start->tv_usec) / 1000;
 }
 
+// returns elapsed time in microseconds
+long elapsed_time_us(struct timeval *start, struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
 int min(int a, int b) {
     return (a < b) ? a : b;
 }
+
+int max(int a, int b) {
+    return (a > b) ? a : b;
+}
+
+bool is_zero(const char* data, int data_size) {
+    if (data_size <= 0)
+        return true;
+
+    // if the first byte is zero and every byte equals the one after it, all bytes are zero. This lets memcmp, which
+    // libc implements with vector instructions, do the scanning.
+    return data[0] == 0 && memcmp(data, data + 1, data_size - 1) == 0;
+}
@@ -5,11 +5,20 @@
 #ifndef UDP_UTILS_H
 #define UDP_UTILS_H
 
+#include <stdbool.h>
 #include <sys/time.h>
 
 // returns elapsed time in milliseconds
 int elapsed_time(struct timeval *start, struct timeval *end);
 
+// returns elapsed time in microseconds
+long elapsed_time_us(struct timeval *start, struct timeval *end);
+
 int min(int a, int b);
 
+int max(int a, int b);
+
+// returns true if all `data_size` bytes of `data` are zero
+bool is_zero(const char* data, int data_size);
+
 #endif //UDP_UTILS_H
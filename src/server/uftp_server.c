@@ -1,14 +1,28 @@
 //
 // Server for simple reliable file transfer over UDP
 //
-// Usage: server <port>
+// Usage: server <port> [-l <limits_file>] [-m <memory_budget>] [<client_address>=<weight>...]
 //
 // This server uses RUDP (Reliable UDP) and KFTP (Kirby's File Transfer Protocol) to provide this functionality. This
 // work was done as a homework assignment for a networking class.
 //
+// Transfers the client runs in the background are sent on RUDP streams of their own, and each one is handled on its own
+// thread. The commands on the control stream keep being handled one at a time in the meantime. Background transfers
+// share the connection in proportion to their weights, which are set per client address on the command line (e.g.
+// `server 9191 10.0.0.2=4`), and default to 1.
+//
+// The server's traffic can be capped with rate limits (globally, per client, and per transfer) set in a limits file,
+// which is re-read whenever it changes so the limits can be adjusted while the server runs (see RateLimits).
+//
+// The memory the server holds on to is kept under a budget (`-m`, in bytes), so a flood of clients can't run it out of
+// memory. The file cache, the messages queued for each stream, and the buffers of running transfers are all charged to
+// it. Once it runs low, the windows the server advertises shrink so clients hold back their messages, and new transfers
+// are refused with an error until running ones finish.
+//
 // Limitations:
-//  - The server is single-threaded
-//  - The server only expects at most one connection (it never resets tracked sequence numbers)
+//  - Commands on the control stream are handled one at a time (only the commands of a pipeline are run concurrently)
+//  - The server only expects at most one connection (it never resets tracked sequence numbers, a command the client
+//    cancels is aborted so both sides' sequence numbers stay in step instead)
 //
 #include <stdio.h>
 #include <unistd.h>
@@ -18,25 +32,60 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <dirent.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
+#include "../common/dir_index.h"
+#include "../common/file_cache.h"
+#include "../common/mem_budget.h"
 #include "../common/reliable_udp/reliable_udp.h"
+#include "../common/reliable_udp/rudp_mux.h"
+#include "../common/reliable_udp/rudp_rate.h"
 #include "../common/kftp/kftp.h"
+#include "../common/kftp/kftp_batch.h"
+#include "../common/kftp/kftp_chunked.h"
+#include "../common/kftp/kftp_command.h"
+#include "../common/kftp/kftp_dedup.h"
+#include "../common/kftp/kftp_delta.h"
+#include "../common/kftp/kftp_fingerprint.h"
+#include "../common/kftp/kftp_listing.h"
+#include "../common/kftp/kftp_merkle.h"
+#include "../common/kftp/kftp_pipeline.h"
+#include "../common/kftp/kftp_striped.h"
+#include "../common/kftp/kftp_tree.h"
 
 #define BUFSIZE 1024
 
-// max number of files that can be listed using the ls command
-// TODO: if we implement ls through KFTP to support an arbitrary response size, do we still need this MAX_FILES limit?
-#define MAX_FILES 100
+// Directory (in the server's current directory) that holds the deduplicated store
+#define DEDUP_STORE_DIR ".kftp_store"
 
-// Delimiters to use when extracting commands and arguments from user-supplied input
-// TODO: should unify client and server command parsing
-#define DELIMITERS " \n\t\r\v\f"
+// Limits for the cache of file contents used to serve `get` commands
+#define FILE_CACHE_CAPACITY (64 * 1024 * 1024)
+#define FILE_CACHE_MAX_FILE_SIZE (8 * 1024 * 1024)
 
 // TODO: standardize error codes between client and server
 #define PARSE_ERROR (-2)
 #define NOT_IMPLEMENTED_ERROR (-3)
+#define NOT_STREAMABLE_ERROR (-4)
+#define OUT_OF_MEMORY_ERROR (-5)
+
+// in bytes, default limit on the memory the server holds on to (file cache, queued messages, and transfer buffers)
+#define SERVER_MEMORY_BUDGET (256 * 1024 * 1024)
+// memory set aside for a transfer while it runs, enough for the buffers of the widest striped transfer
+#define TRANSFER_MEMORY (KFTP_MAX_STRIPES * KFTP_STRIPE_BUFFER_SIZE)
+// memory set aside for a pipeline while it runs, enough for the data of a completion on each of its threads
+#define PIPELINE_MEMORY (KFTP_PIPELINE_THREADS * KFTP_PIPELINE_MAX_DATA_SIZE)
+
+// most clients that can be given a weight on the command line
+#define MAX_CLIENT_WEIGHTS 16
+
+// most clients that can be given a rate limit of their own in the limits file
+#define MAX_CLIENT_LIMITS 16
+// most transfers that can run at once under the limits, including the one on the control stream
+#define MAX_TRANSFER_LIMITS RUDP_MUX_MAX_STREAMS
+// in seconds, how often the limits file is checked for changes
+#define LIMITS_POLL_INTERVAL 1
 
 
 // wrapper around perror for errors that should cause the program to terminate with a negative return code
@@ -46,218 +95,870 @@ void fatal_error(char *msg) {
 }
 
 
-// Collection of filenames, created by the ls_files() function
+// State kept across commands so files don't need to be read again. Only used by the commands on the control stream.
 typedef struct {
-    int count;
-    char **files;
-} Filenames;
+    FileCache files;                        // contents of recently downloaded files
+    KftpFingerprintIndex fingerprints;      // fingerprints of files used in conditional transfers
+    DirIndex listing;                       // sorted names of the files in the current directory, used by ls
+    pthread_mutex_t lock;                   // held by pipelined commands, which are run on several threads at once
+} ServerCaches;
 
 
-// Cleans up the dynamically allocated memory for Filenames.
-//
-// This memory is typically allocated in the ls_files() function.
-void cleanup_filenames(Filenames *filenames) {
-    for (int i = 0; i < filenames->count; i++) {
-        free(filenames->files[i]);
+// TODO: which parameters (for all the functions) should be const?
+// Sends the reply to `request` back to the client, holding the result of the command and a message for the user (which
+// may be empty)
+int do_reply(KftpCommand *request, int status, char *message, SocketInfo *socket_info, RudpSender *sender,
+             RudpReceiver *receiver) {
+    int result = kftp_send_reply(request, status, message, socket_info, sender, receiver);
+    if (result < 0) {
+        perror("ERROR in kftp_send_reply");
+        return result;
     }
-    free(filenames->files);
+
+    return result;
 }
 
 
-// TODO: do we need to only return files?
-// Returns the files in a given directory up to MAX_FILES number of files.
-//
-// This function dynamically allocates the memory required to hold the names of all the files. This memory should be
-// cleaned up using the cleanup_filenames() function.
-Filenames ls_files(char *directory) {
-    char **files = malloc(sizeof(char *) * MAX_FILES);
-    int i = 0;
+// Formats the message telling the client that `request` failed with `error_code`
+void format_error(int error_code, KftpCommand *request, char *err_buff, int buffer_len) {
+    char command[BUFSIZE] = {0,};
+    kftp_command_format(request, command, BUFSIZE);
 
-    DIR *dir = opendir(directory);
+    switch (error_code) {
+        case PARSE_ERROR :
+            snprintf(err_buff, buffer_len, "Invalid command: %s", command);
+            break;
+        case NOT_IMPLEMENTED_ERROR :
+            snprintf(err_buff, buffer_len, "Command not yet implemented: %s", command);
+            break;
+        case NOT_STREAMABLE_ERROR :
+            snprintf(err_buff, buffer_len, "Command can't be run on its own stream: %s", command);
+            break;
+        case OUT_OF_MEMORY_ERROR :
+            snprintf(err_buff, buffer_len, "Server is out of memory, try again later: %s", command);
+            break;
+        default:
+            snprintf(err_buff, buffer_len, "Command failed: %s", command);
+    }
+}
+
+
+// Sends an error message back to the client, in reply to `request`
+void send_error(int error_code, KftpCommand *request, SocketInfo *socket_info, RudpSender *sender,
+                RudpReceiver *receiver) {
+    char err_buff[BUFSIZE] = {0,};
+    format_error(error_code, request, err_buff, BUFSIZE);
+    do_reply(request, error_code, err_buff, socket_info, sender, receiver);
+}
+
+
+// Handles `get` command, that transfers a file from the server to the client
+//
+// For delta transfers, the client first sends signatures of its copy of the file and only the differences are sent
+// back. Compressed transfers send the file as a series of chunks that are compressed when it makes them smaller, and
+// sparse transfers send the same chunks but leave out the file's holes. Striped transfers send ranges of the file in
+// parallel over separate flows. Recursive transfers send a whole directory tree. Conditional transfers are skipped if
+// the client's copy has the same fingerprint as the server's. Deduplicated transfers reassemble the file from the store.
+// Ranged transfers only send part of the file. Merkle-verified transfers resend the blocks that fail the client's check.
+//
+// Files are read through the cache, except for striped and Merkle-verified transfers which need to read the file from
+// several threads, ranged transfers which seek directly to the range instead of reading the whole file, and
+// conditional transfers which may not need to read the file at all. Transfers run on their own stream don't have any
+// `caches`, and always read the file directly.
+//
+// The file is opened before the client is replied to, so the client is told about a missing file instead of waiting
+// for it. Returns a negative int if the command failed before the client was replied to (and should be sent an error
+// instead). Failures after that are noticed by the client as part of the transfer.
+int do_get(KftpCommand *request, KftpTransferFlags *flags, ServerCaches *caches, SocketInfo *socket_info,
+           RudpSender *sender, RudpReceiver *receiver) {
+    char *filename = request->args[0];
+    FileCache *cache = caches != NULL ? &caches->files : NULL;
+    if (flags->recursive) {
+        // a missing tree is reported to the client as part of the transfer, so it doesn't need an error message
+        int result = do_reply(request, 0, "", socket_info, sender, receiver);
+        if (result < 0)
+            return result;
+
+        result = kftp_send_tree(filename, socket_info, sender, receiver);
+        if (result < 0 && result != KFTP_TREE_ROOT_ERROR)
+            fprintf(stderr, "ERROR in do_get: could not send tree\n");
+        return 0;
+    }
 
-    if (dir == NULL) {
-        perror("Could not open directory");
-        free(files);
-        return (Filenames) {.count=0, .files=NULL};
+    FILE *f;
+    if (flags->dedup)
+        f = kftp_dedup_open(filename, DEDUP_STORE_DIR);
+    else if (cache == NULL || flags->striped || flags->merkle || flags->ranged || flags->conditional)
+        f = fopen(filename, "r");
+    else
+        f = file_cache_open(cache, filename);
+    if (f == NULL) {
+        perror("Could not open file for reading");
+        return -1;
     }
 
-    struct dirent *entry;
-    struct stat entry_info;
+    int result = do_reply(request, 0, "", socket_info, sender, receiver);
+    if (result < 0) {
+        fclose(f);
+        return result;
+    }
 
-    while ((entry = readdir(dir)) != NULL) {
-        stat(entry->d_name, &entry_info);
-        // only return files
-        if (S_ISREG(entry_info.st_mode)) {
-            if (i == MAX_FILES) {
-                fprintf(stderr, "ERROR in ls_files: Too many files in directory to return them all\n");
-                break;
-            }
+    if (flags->conditional) {
+        KftpFingerprint fingerprint;
+        KftpFingerprintIndex *index = caches != NULL ? &caches->fingerprints : NULL;
+        bool has_copy = kftp_fingerprint_file(index, filename, &fingerprint) == 0;
+        result = kftp_check_fingerprint(has_copy ? &fingerprint : NULL, socket_info, sender, receiver);
+        if (index != NULL)
+            printf("fingerprint index: %lu hits, %lu misses\n", index->hits, index->misses);
+    }
 
-            size_t filename_size = strlen(entry->d_name) + 1;
-            char *filename = malloc(sizeof(char) * filename_size);
-            strncpy(filename, entry->d_name, filename_size - 1);
-            // makes sure the filename is null terminated
-            filename[filename_size - 1] = 0;
-            files[i] = filename;
-            i++;
-        }
+    if (result != KFTP_MODIFIED) {
+        // the client's copy is up to date, or the fingerprints could not be compared
+    } else if (flags->delta) {
+        result = kftp_send_file_delta(f, socket_info, sender, receiver);
+    } else if (flags->striped) {
+        result = kftp_send_file_striped(f, socket_info, sender, receiver);
+    } else if (flags->merkle) {
+        result = kftp_send_file_merkle(f, socket_info, sender, receiver);
+    } else if (flags->ranged) {
+        result = kftp_send_file_range(f, flags->offset, flags->length, socket_info, sender, receiver);
+    } else if (flags->compress || flags->sparse) {
+        KftpChunkOptions options = {.compress=flags->compress, .sparse=flags->sparse};
+        result = kftp_send_file_chunked(f, &options, socket_info, sender, receiver);
+    } else {
+        result = kftp_send_file(f, socket_info, sender, receiver);
     }
+    fclose(f);
+    if (result < 0)
+        fprintf(stderr, "ERROR in do_get: could not send file\n");
 
-    return (Filenames) {.count=i, .files=files};
+    if (cache != NULL) {
+        FileCacheStats *stats = &cache->stats;
+        printf("file cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %zu bytes cached\n", stats->hits,
+               stats->misses, stats->evictions, stats->invalidations, cache->size);
+    }
+    return 0;
 }
 
-// TODO: which parameters (for all the functions) should be const?
-// Sends a message to the client
+
+// Handles `put -d` command, that updates the server's copy of a file using a delta sent by the client
 //
-// The message is expected to be a string
-int do_send(char *message, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    int status = rudp_send(message, strlen(message), socket_info, sender, receiver);
-    if (status < 0) {
-        perror("ERROR in rudp_send");
-        return status;
+// The file is reconstructed into a temporary file which then replaces the original, since blocks are copied from the
+// original while the new version is written.
+int do_put_delta(char *filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    char temp_filename[BUFSIZE] = {0,};
+    int n = snprintf(temp_filename, BUFSIZE, "%s%s", filename, KFTP_DELTA_TEMP_SUFFIX);
+    if (n >= BUFSIZE || n < 0) {
+        fprintf(stderr, "ERROR in do_put_delta: filename too long\n");
+        return -1;
     }
 
-    return status;
-}
+    FILE *temp = fopen(temp_filename, "w");
+    if (temp == NULL) {
+        perror("Could not open temporary file for writing");
+        return -1;
+    }
 
+    // there may not be an existing copy, in which case the whole file is sent as literal data
+    FILE *basis = fopen(filename, "r");
 
-// Sends an error message back to the client
-void send_error(int errno, char *command, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char err_buff[BUFSIZE] = {0,};
+    int result = kftp_recv_file_delta(basis, temp, socket_info, sender, receiver);
+    fclose(temp);
+    if (basis != NULL)
+        fclose(basis);
 
-    switch (errno) {
-        case PARSE_ERROR :
-            snprintf(err_buff, BUFSIZE, "Invalid command: %s", command);
-            break;
-        case NOT_IMPLEMENTED_ERROR :
-            snprintf(err_buff, BUFSIZE, "Command not yet implemented: %s", command);
-            break;
-        default:
-            snprintf(err_buff, BUFSIZE, "Unrecognized error code: %d", errno);
+    if (result < 0) {
+        remove(temp_filename);
+        return result;
+    }
+
+    if (rename(temp_filename, filename) < 0) {
+        perror("Could not replace file with its updated copy");
+        remove(temp_filename);
+        return -1;
     }
 
-    do_send(err_buff, socket_info, sender, receiver);
+    return result;
 }
 
 
-// Handles `get` command, that transfers a file from the server to the client
-int do_get(char *filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    FILE *f = fopen(filename, "r");
+// Receives the file sent by the client in response to a put command, using the transfer requested by `flags`
+//
+// Conditional transfers are skipped if the server's copy has the same fingerprint as the client's. Deduplicated transfers
+// only receive the chunks that aren't in the store yet, and save the file in the store rather than the current directory.
+// Transfers run on their own stream don't have any `caches` (the file cache notices the file changed on its own).
+int recv_put(char *filename, KftpTransferFlags *flags, ServerCaches *caches, SocketInfo *socket_info,
+             RudpSender *sender, RudpReceiver *receiver) {
+    if (flags->dedup)
+        return kftp_recv_file_dedup(filename, DEDUP_STORE_DIR, socket_info, sender, receiver);
+    if (flags->conditional) {
+        KftpFingerprint fingerprint;
+        bool has_copy = kftp_fingerprint_file(caches != NULL ? &caches->fingerprints : NULL, filename,
+                                              &fingerprint) == 0;
+        int result = kftp_offer_fingerprint(has_copy ? &fingerprint : NULL, socket_info, sender, receiver);
+        if (result != KFTP_MODIFIED)
+            return result == KFTP_NOT_MODIFIED ? 0 : result;
+    }
+
+    // the cache would notice the file changed anyway, but there's no need to hold on to the old contents until then
+    if (caches != NULL)
+        file_cache_invalidate(&caches->files, filename);
+    if (flags->delta)
+        return do_put_delta(filename, socket_info, sender, receiver);
+    if (flags->recursive) {
+        // the client already knows if it couldn't send the tree
+        KftpBatchResult result;
+        int status = kftp_recv_tree(&result, socket_info, receiver);
+        return status == KFTP_TREE_ROOT_ERROR ? 0 : status;
+    }
+
+    FILE *f = fopen(filename, "w");
     if (f == NULL) {
         perror("Could not open file for reading");
         return -1;
     }
 
-    int result = kftp_send_file(f, socket_info, sender, receiver);
+    int result;
+    if (flags->striped)
+        result = kftp_recv_file_striped(f, socket_info, sender, receiver);
+    else if (flags->merkle)
+        result = kftp_recv_file_merkle(f, socket_info, sender, receiver);
+    else if (flags->compress || flags->sparse)
+        result = kftp_recv_file_chunked(f, socket_info, receiver);
+    else
+        result = kftp_recv_file(f, socket_info, receiver);
     fclose(f);
+
+    // don't keep a corrupted (or partly received) copy of the file around
+    if (result == KFTP_INTEGRITY_ERROR) {
+        fprintf(stderr, "ERROR in do_put: received file does not match the client's copy, discarding it\n");
+        remove(filename);
+    } else if (result < 0) {
+        fprintf(stderr, "ERROR in do_put: could not receive the whole file, discarding it\n");
+        remove(filename);
+    }
     return result;
 }
 
 
 // Handles `put` command, that transfers a file from the client to the server
-int do_put(char *filename, SocketInfo *socket_info, RudpReceiver *receiver) {
-    FILE *f = fopen(filename, "w");
+//
+// The client is replied to once the file has been received, so it knows the server kept its copy. Returns a negative int
+// if the file could not be received (and the client should be sent an error instead).
+int do_put(KftpCommand *request, KftpTransferFlags *flags, ServerCaches *caches, SocketInfo *socket_info,
+           RudpSender *sender, RudpReceiver *receiver) {
+    int result = recv_put(request->args[0], flags, caches, socket_info, sender, receiver);
+    if (result < 0)
+        return result;
+
+    return do_reply(request, 0, "", socket_info, sender, receiver);
+}
+
+
+// Handles `mget` command, that sends all the files matching the given patterns to the client as a single batch
+//
+// Returns a negative int if the patterns could not be expanded (and the client should be sent an error instead).
+int do_mget(KftpCommand *request, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpFileList files = {};
+    int result = kftp_find_files(request->args, request->arg_count, &files);
+    if (result == 0)
+        result = do_reply(request, 0, "", socket_info, sender, receiver);
+    if (result < 0) {
+        kftp_free_file_list(&files);
+        return result;
+    }
+
+    bool pack = request->flags & KFTP_FLAG_PACK;
+    result = kftp_send_files(&files, pack ? KFTP_PACK_SIZE : KFTP_NO_PACKING, socket_info, sender, receiver);
+    if (result < 0)
+        fprintf(stderr, "ERROR in do_mget: could not send files\n");
+    kftp_free_file_list(&files);
+    return 0;
+}
+
+
+// Handles `mput` command, that receives a batch of files from the client
+//
+// The client expands its patterns itself, so only the names of the files it found are sent (in the batch).
+int do_mput(KftpCommand *request, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpBatchResult result;
+    int status = kftp_recv_files(&result, socket_info, receiver);
+    if (status < 0)
+        return status;
+
+    printf("Received %d files (%d failed)\n", result.received, result.failed);
+    return do_reply(request, 0, "", socket_info, sender, receiver);
+}
+
+
+// Handles `delete` command, that deletes a file from the server
+int do_delete(KftpCommand *request, ServerCaches *caches, SocketInfo *socket_info, RudpSender *sender,
+              RudpReceiver *receiver) {
+    char *filename = request->args[0];
+    file_cache_invalidate(&caches->files, filename);
+
+    // According to given spec, we should do nothing if the file does not exist (other than telling the client the
+    // command is done)
+    char *message = unlink(filename) == 0 ? "Deleted file\n" : "";
+    return do_reply(request, 0, message, socket_info, sender, receiver);
+}
+
+
+// Sets up the filter selecting the names listed by an ls command: those matching its pattern (if it has one), within the
+// page it requested (if any). At most `max_names` names are listed, unless it's KFTP_LIST_UNLIMITED.
+void init_ls_filter(KftpCommand *request, KftpListFilter *filter, long max_names) {
+    bool paged = request->flags & KFTP_FLAG_PAGED;
+    char *pattern = request->arg_count % 2 == 1 ? request->args[0] : NULL;
+    uint64_t offset = 0;
+    uint64_t limit = 0;
+    if (paged) {
+        kftp_command_arg_uint64(request, request->arg_count - 2, &offset);
+        kftp_command_arg_uint64(request, request->arg_count - 1, &limit);
+    }
+
+    long names = paged ? (long) limit : KFTP_LIST_UNLIMITED;
+    if (max_names != KFTP_LIST_UNLIMITED && (names == KFTP_LIST_UNLIMITED || names > max_names))
+        names = max_names;
+    kftp_list_filter_init(filter, pattern, (long) offset, names);
+}
+
+
+// Handles `ls` command, that lists files in the current directory on the server
+//
+// Streams the names of the files matching the command's pattern (or all the files if it has none) back to the client,
+// after a page of the listing if one was requested. The names come from the index of the directory, which is only read
+// again if the index can't tell what changed since the last ls.
+int do_ls(KftpCommand *request, ServerCaches *caches, SocketInfo *socket_info, RudpSender *sender,
+          RudpReceiver *receiver) {
+    // a directory that can't be read is reported to the client as part of the listing
+    int result = do_reply(request, 0, "", socket_info, sender, receiver);
+    if (result < 0)
+        return result;
+
+    KftpListFilter filter;
+    init_ls_filter(request, &filter, KFTP_LIST_UNLIMITED);
+    result = kftp_send_listing(&caches->listing, &filter, socket_info, sender, receiver);
+    if (result < 0)
+        fprintf(stderr, "ERROR in do_ls: could not send listing\n");
+
+    DirIndexStats *stats = &caches->listing.stats;
+    printf("directory index: %ld files, %lu rebuilds, %lu updates\n", caches->listing.count, stats->rebuilds,
+           stats->updates);
+    return 0;
+}
+
+
+// Handles `exit` command. Does not return.
+void do_exit(KftpCommand *request, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    char *exit_message = "Exiting gracefully";
+    do_reply(request, 0, exit_message, socket_info, sender, receiver);
+
+    close(socket_info->sockfd);
+    exit(0);
+}
+
+
+// Handles a `get` sent in a pipeline, that returns the file (or the requested range of it) in the command's completion
+//
+// The file is read directly rather than through the cache, so gets can run in parallel. Files (or ranges) larger than
+// KFTP_PIPELINE_MAX_DATA_SIZE are refused, and should be downloaded with a get of their own.
+int pipelined_get(KftpCommand *request, KftpCompletion *completion) {
+    KftpTransferFlags flags;
+    kftp_command_transfer_flags(request, &flags);
+    FILE *f = fopen(request->args[0], "r");
     if (f == NULL) {
         perror("Could not open file for reading");
         return -1;
     }
 
-    int result = kftp_recv_file(f, socket_info, receiver);
+    // as with a ranged transfer, the range is cut off at the end of the file
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    long offset = flags.ranged ? flags.offset : 0;
+    long length = size < 0 || offset >= size ? 0 : size - offset;
+    if (flags.ranged && flags.length < length)
+        length = flags.length;
+
+    int result = size < 0 || fseek(f, offset, SEEK_SET) != 0 ? -1 : 0;
+    if (result == 0 && length > KFTP_PIPELINE_MAX_DATA_SIZE) {
+        char message[BUFSIZE] = {0,};
+        snprintf(message, BUFSIZE, "File is too large to get in a pipeline: %s", request->args[0]);
+        kftp_command_init_reply(&completion->reply, request, -1, message);
+    } else if (result == 0 && length > 0) {
+        completion->data = malloc(length);
+        if (completion->data == NULL || fread(completion->data, 1, length, f) != (size_t) length)
+            result = -1;
+        else
+            completion->data_size = (int) length;
+    }
     fclose(f);
+
+    if (result < 0)
+        fprintf(stderr, "ERROR in pipelined_get: could not read file\n");
     return result;
 }
 
 
-// Handles `delete` command, that deletes a file from the server
-int do_delete(char *filename, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    // According to given spec, we should do nothing if the file does not exist
+// Handles a `delete` sent in a pipeline
+int pipelined_delete(KftpCommand *request, ServerCaches *caches, KftpCompletion *completion) {
+    char *filename = request->args[0];
+    pthread_mutex_lock(&caches->lock);
+    file_cache_invalidate(&caches->files, filename);
+    pthread_mutex_unlock(&caches->lock);
+
+    // as with a plain delete, a missing file isn't an error
     if (unlink(filename) == 0)
-        return do_send("Deleted file\n", socket_info, sender, receiver);
+        kftp_command_init_reply(&completion->reply, request, 0, "Deleted file\n");
+    return 0;
+}
+
+
+// Names listed by a pipelined ls, each followed by a newline
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+} ListedNames;
+
+int append_listed_name(char *name, void *context) {
+    ListedNames *names = context;
+    int length = (int) strlen(name);
+    if (names->size + length + 1 > names->capacity) {
+        int capacity = names->capacity == 0 ? BUFSIZE : names->capacity;
+        while (names->size + length + 1 > capacity)
+            capacity *= 2;
+        char *data = realloc(names->data, capacity);
+        if (data == NULL)
+            return -1;
+        names->data = data;
+        names->capacity = capacity;
+    }
 
+    memcpy(&names->data[names->size], name, length);
+    names->data[names->size + length] = '\n';
+    names->size += length + 1;
     return 0;
 }
 
+// Handles an `ls` sent in a pipeline, that returns the names it lists in the command's completion
+//
+// At most KFTP_PIPELINE_MAX_NAMES names are returned, and the command is replied to with a status of KFTP_LIST_MORE if
+// more names match (so the rest can be listed a page at a time).
+int pipelined_ls(KftpCommand *request, ServerCaches *caches, KftpCompletion *completion) {
+    KftpListFilter filter;
+    init_ls_filter(request, &filter, KFTP_PIPELINE_MAX_NAMES);
+
+    ListedNames names = {};
+    pthread_mutex_lock(&caches->lock);
+    int status = kftp_list_names(&caches->listing, &filter, append_listed_name, &names);
+    pthread_mutex_unlock(&caches->lock);
+    if (status < 0) {
+        free(names.data);
+        return status;
+    }
 
-// Handles `ls` command, that lists files in the current directory on the server
+    completion->reply.status = status;
+    completion->data = names.data;
+    completion->data_size = names.size;
+    return 0;
+}
+
+
+// Runs a command sent in a pipeline, filling in its completion. Called from the pipeline's threads, so the caches are
+// only used while holding their lock.
+void run_pipelined(KftpCommand *command, KftpCompletion *completion, void *context) {
+    ServerCaches *caches = context;
+    int status = PARSE_ERROR;
+    if (kftp_command_validate(command) == 0 && kftp_pipeline_allows(command)) {
+        switch (command->opcode) {
+            case KFTP_OP_GET:
+                status = pipelined_get(command, completion);
+                break;
+            case KFTP_OP_DELETE:
+                status = pipelined_delete(command, caches, completion);
+                break;
+            case KFTP_OP_LS:
+                status = pipelined_ls(command, caches, completion);
+                break;
+        }
+    }
+
+    if (status < 0) {
+        char err_buff[BUFSIZE] = {0,};
+        format_error(status, command, err_buff, BUFSIZE);
+        kftp_command_init_reply(&completion->reply, command, status, err_buff);
+    }
+}
+
+
+// Handles a pipeline of commands, sent by the client without waiting for their replies. The commands are run
+// concurrently, and each one is completed (with its reply and any data it returns) as soon as it's done.
+//
+// The start of the pipeline arrives in the same message as the pipeline command, so the `received_size` bytes that
+// followed the command are passed in as `received`. Once the client has started sending the pipeline it can't be
+// replied to with an error, so failures are only logged.
+int do_pipeline(KftpCommand *request, char *received, int received_size, ServerCaches *caches,
+                SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
+    KftpCommand *commands;
+    int count = kftp_recv_pipeline(request, received, received_size, &commands, socket_info, receiver);
+    if (count < 0) {
+        fprintf(stderr, "ERROR in do_pipeline: could not receive pipeline\n");
+        return 0;
+    }
+
+    int result = kftp_run_pipeline(commands, count, run_pipelined, caches, socket_info, sender, receiver);
+    if (result < 0)
+        fprintf(stderr, "ERROR in do_pipeline: could not send completions\n");
+    free(commands);
+
+    printf("ran pipeline of %d commands\n", count);
+    return 0;
+}
+
+
+// Executes the proper processing based on the given command.
 //
-// Sends the list of files in the current directory back to the client, separated by a newline character
-int do_ls(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    Filenames filenames = ls_files(".");
-    char message[BUFSIZE] = {0,};
+// Each command is replied to by its handler. Returns a negative int if the command is invalid or failed before it was
+// replied to, in which case the client should be sent an error in reply instead.
+int process_message(KftpCommand *request, ServerCaches *caches, SocketInfo *socket_info, RudpSender *sender,
+                    RudpReceiver *receiver) {
+    if (kftp_command_validate(request) < 0) return PARSE_ERROR;
+
+    KftpTransferFlags flags;
+    kftp_command_transfer_flags(request, &flags);
+
+    switch (request->opcode) {
+        case KFTP_OP_GET:
+            return do_get(request, &flags, caches, socket_info, sender, receiver);
+        case KFTP_OP_PUT:
+            return do_put(request, &flags, caches, socket_info, sender, receiver);
+        case KFTP_OP_MGET:
+            return do_mget(request, socket_info, sender, receiver);
+        case KFTP_OP_MPUT:
+            return do_mput(request, socket_info, sender, receiver);
+        case KFTP_OP_DELETE:
+            return do_delete(request, caches, socket_info, sender, receiver);
+        case KFTP_OP_LS:
+            return do_ls(request, caches, socket_info, sender, receiver);
+        case KFTP_OP_EXIT:
+            // does not return
+            do_exit(request, socket_info, sender, receiver);
+    }
+
+    // unrecognized command
+    return PARSE_ERROR;
+}
+
+// Returns the memory set aside for `request` while it runs, 0 for commands that don't hold on to any
+size_t command_memory(KftpCommand *request) {
+    if (request->opcode == KFTP_OP_PIPELINE)
+        return PIPELINE_MEMORY;
+    return kftp_command_is_transfer(request) ? TRANSFER_MEMORY : 0;
+}
 
-    if (filenames.files == NULL) {
-        perror("ERROR in ls_files");
+// Rate limit of the traffic sent to a client
+typedef struct {
+    struct in_addr addr;
+    RudpRateLimit limit;
+} ClientLimit;
+
+// Rate limits the server's traffic is held to, read from a limits file that's re-read whenever it changes. Each line of
+// the file sets a limit in bytes per second (0 for no limit), and limits that aren't set are lifted:
+//      global <rate>                   all the traffic of the server
+//      client <address> <rate>         the traffic sent to a client
+//      transfer <rate>                 the traffic of each command or background transfer
+// Lines starting with # are ignored.
+typedef struct {
+    char *path;                     // limits file, or NULL if the server's traffic isn't limited
+    time_t modified;                // modification time and size of the limits file when it was last read
+    off_t size;
+
+    pthread_mutex_t lock;           // guards the tables below, the limits themselves have locks of their own
+    RudpRateLimit global;
+    // a client's limit is kept once it's been set (so senders can hold on to it), and lifted if it's no longer set
+    ClientLimit clients[MAX_CLIENT_LIMITS];
+    int clients_count;
+    long transfer_rate;
+    RudpRateLimit *transfers[MAX_TRANSFER_LIMITS];  // limits of the running transfers, NULL for unused entries
+} RateLimits;
+
+// Reads the limits file and applies its limits, leaving the current ones in place if it's invalid
+//
+// Returns 0 on success, and -1 if the limits file can't be read or is invalid.
+int load_rate_limits(RateLimits *limits) {
+    FILE *fp = fopen(limits->path, "r");
+    if (fp == NULL) {
+        perror("ERROR opening limits file");
         return -1;
     }
 
-    for (int i = 0; i < filenames.count; i++) {
-        char *filename = filenames.files[i];
-        // we check for 2 characters extra to hold a newline character and terminating null character
-        if (strlen(filename) + strlen(message) + 2 < BUFSIZE) {
-            strcat(message, filename);
-            strcat(message, "\n");
+    long global_rate = RUDP_RATE_UNLIMITED, transfer_rate = RUDP_RATE_UNLIMITED;
+    struct in_addr client_addrs[MAX_CLIENT_LIMITS];
+    long client_rates[MAX_CLIENT_LIMITS];
+    int clients_count = 0;
+
+    char line[BUFSIZE];
+    int line_number = 0;
+    bool valid = true;
+    while (valid && fgets(line, BUFSIZE, fp) != NULL) {
+        line_number++;
+        char kind[16], first[INET_ADDRSTRLEN + 1], second[32], extra;
+        int fields = sscanf(line, "%15s %16s %31s %c", kind, first, second, &extra);
+        if (fields <= 0 || kind[0] == '#')
+            continue;
+
+        char *end;
+        if (strcmp(kind, "global") == 0 && fields == 2) {
+            global_rate = strtol(first, &end, 10);
+        } else if (strcmp(kind, "transfer") == 0 && fields == 2) {
+            transfer_rate = strtol(first, &end, 10);
+        } else if (strcmp(kind, "client") == 0 && fields == 3 && clients_count < MAX_CLIENT_LIMITS
+                   && inet_pton(AF_INET, first, &client_addrs[clients_count]) == 1) {
+            client_rates[clients_count] = strtol(second, &end, 10);
+            valid = client_rates[clients_count++] >= 0;
         } else {
-            fprintf(stderr, "ERROR: the filenames from ls are too large to all fit into the buffer\n");
-            return -1;
+            end = first;
         }
+        valid = valid && *end == 0 && end != first && end != second && global_rate >= 0 && transfer_rate >= 0;
+    }
+    fclose(fp);
+
+    if (!valid) {
+        fprintf(stderr, "invalid limits file %s (line %d), keeping the current limits\n", limits->path, line_number);
+        return -1;
+    }
+
+    pthread_mutex_lock(&limits->lock);
+    rudp_rate_set(&limits->global, global_rate);
+    limits->transfer_rate = transfer_rate;
+    for (int i = 0; i < MAX_TRANSFER_LIMITS; i++) {
+        if (limits->transfers[i] != NULL)
+            rudp_rate_set(limits->transfers[i], transfer_rate);
     }
-    int ret_code = do_send(message, socket_info, sender, receiver);
 
-    // ls_files() allocates memory that needs to be freed
-    cleanup_filenames(&filenames);
+    for (int i = 0; i < limits->clients_count; i++)
+        rudp_rate_set(&limits->clients[i].limit, RUDP_RATE_UNLIMITED);
+    for (int i = 0; i < clients_count; i++) {
+        int j = 0;
+        while (j < limits->clients_count && limits->clients[j].addr.s_addr != client_addrs[i].s_addr)
+            j++;
+        if (j == limits->clients_count) {
+            if (j == MAX_CLIENT_LIMITS) {
+                fprintf(stderr, "too many clients have been given limits, ignoring the limit of %s\n",
+                        inet_ntoa(client_addrs[i]));
+                continue;
+            }
+            limits->clients[j].addr = client_addrs[i];
+            rudp_rate_init(&limits->clients[j].limit, RUDP_RATE_UNLIMITED);
+            limits->clients_count++;
+        }
+        rudp_rate_set(&limits->clients[j].limit, client_rates[i]);
+    }
+    pthread_mutex_unlock(&limits->lock);
 
-    return ret_code;
+    printf("limits: %ld bytes/s globally, %ld bytes/s per transfer, %d clients with limits of their own\n",
+           global_rate, transfer_rate, clients_count);
+    return 0;
 }
 
+// Thread that re-reads the limits file whenever its modification time or size changes
+void *watch_rate_limits(void *arg) {
+    RateLimits *limits = arg;
 
-// Handles `exit` command. Does not return.
-void do_exit(SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    char *exit_message = "Exiting gracefully";
-    do_send(exit_message, socket_info, sender, receiver);
+    while (1) {
+        sleep(LIMITS_POLL_INTERVAL);
 
-    close(socket_info->sockfd);
-    exit(0);
+        struct stat file_stat;
+        if (stat(limits->path, &file_stat) < 0 || (file_stat.st_mtime == limits->modified
+                                                   && file_stat.st_size == limits->size))
+            continue;
+        limits->modified = file_stat.st_mtime;
+        limits->size = file_stat.st_size;
+        load_rate_limits(limits);
+    }
 }
 
-
-// Executes the proper processing based on the given command.
+// Sets up `transfer` with the current per-transfer limit, and keeps track of it so it's updated along with the limits
 //
-// This function uses strtok which will mutate the message argument.
-int process_message(char *message, SocketInfo *socket_info, RudpSender *sender, RudpReceiver *receiver) {
-    // TODO: unify command parsing with client implementation
-    char *first_token = strtok(message, DELIMITERS);
-    if (!first_token) return PARSE_ERROR;
+// Returns 0 on success, and -1 if too many transfers are running already.
+int start_transfer_limit(RateLimits *limits, RudpRateLimit *transfer) {
+    pthread_mutex_lock(&limits->lock);
+    int i = 0;
+    while (i < MAX_TRANSFER_LIMITS && limits->transfers[i] != NULL)
+        i++;
+    if (i < MAX_TRANSFER_LIMITS) {
+        rudp_rate_init(transfer, limits->transfer_rate);
+        limits->transfers[i] = transfer;
+    }
+    pthread_mutex_unlock(&limits->lock);
 
-    char *second_token = strtok(NULL, DELIMITERS);
+    if (i == MAX_TRANSFER_LIMITS) {
+        fprintf(stderr, "ERROR in start_transfer_limit: too many transfers\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // single arg commands
-    if (strcmp(first_token, "ls") == 0 || strcmp(first_token, "exit") == 0) {
-        // only one argument allowed
-        if (second_token) return PARSE_ERROR;
+void stop_transfer_limit(RateLimits *limits, RudpRateLimit *transfer) {
+    pthread_mutex_lock(&limits->lock);
+    for (int i = 0; i < MAX_TRANSFER_LIMITS; i++) {
+        if (limits->transfers[i] == transfer)
+            limits->transfers[i] = NULL;
+    }
+    pthread_mutex_unlock(&limits->lock);
+    rudp_rate_free(transfer);
+}
 
-        if (strcmp(first_token, "ls") == 0)
-            return do_ls(socket_info, sender, receiver);
-        else if (strcmp(first_token, "exit") == 0)
-            do_exit(socket_info, sender, receiver);
+// Holds `sender` to the global limit, the limit of the client at `clientaddr`, and the limit of its own `transfer`
+void apply_rate_limits(RateLimits *limits, RudpSender *sender, struct sockaddr_in *clientaddr,
+                       RudpRateLimit *transfer) {
+    sender->rate_limits[RUDP_RATE_GLOBAL] = &limits->global;
+    sender->rate_limits[RUDP_RATE_TRANSFER] = transfer;
+    sender->rate_limits[RUDP_RATE_CLIENT] = NULL;
+
+    pthread_mutex_lock(&limits->lock);
+    for (int i = 0; i < limits->clients_count; i++) {
+        if (limits->clients[i].addr.s_addr == clientaddr->sin_addr.s_addr)
+            sender->rate_limits[RUDP_RATE_CLIENT] = &limits->clients[i].limit;
     }
+    pthread_mutex_unlock(&limits->lock);
+}
 
-    // double arg commands
-    {
-        if (!second_token) return PARSE_ERROR;
+// Weight given to the background transfers of a client
+typedef struct {
+    struct in_addr addr;
+    int weight;
+} ClientWeight;
+
+// What the stream acceptor needs to know
+typedef struct {
+    RudpMux *mux;
+    ClientWeight weights[MAX_CLIENT_WEIGHTS];
+    int weights_count;
+    RateLimits *limits;
+    MemBudget *budget;
+} StreamAcceptor;
+
+// Parses a `<client_address>=<weight>` argument into `weight`, returning 0 on success and -1 if it's invalid
+int parse_client_weight(char *arg, ClientWeight *weight) {
+    char addr[INET_ADDRSTRLEN];
+    char *separator = strchr(arg, '=');
+    if (separator == NULL || separator - arg >= INET_ADDRSTRLEN)
+        return -1;
+    memcpy(addr, arg, separator - arg);
+    addr[separator - arg] = 0;
 
-        // there are no commands that take 3 arguments
-        if (strtok(NULL, DELIMITERS)) return PARSE_ERROR;
+    char *end;
+    long value = strtol(separator + 1, &end, 10);
+    if (inet_pton(AF_INET, addr, &weight->addr) != 1 || *end != 0 || end == separator + 1 || value < 1
+        || value > RUDP_MUX_MAX_WEIGHT)
+        return -1;
+    weight->weight = (int) value;
+    return 0;
+}
 
-        if (strcmp(first_token, "get") == 0)
-            return do_get(second_token, socket_info, sender, receiver);
-        else if (strcmp(first_token, "put") == 0)
-            return do_put(second_token, socket_info, receiver);
-        else if (strcmp(first_token, "delete") == 0)
-            return do_delete(second_token, socket_info, sender, receiver);
+// Returns the weight of the client at `clientaddr`, 1 if it wasn't given one
+int find_client_weight(StreamAcceptor *acceptor, struct sockaddr_in *clientaddr) {
+    for (int i = 0; i < acceptor->weights_count; i++) {
+        if (acceptor->weights[i].addr.s_addr == clientaddr->sin_addr.s_addr)
+            return acceptor->weights[i].weight;
     }
+    return 1;
+}
 
-    // unrecognized command
-    return PARSE_ERROR;
+// A stream opened by the client to run a transfer in the background
+typedef struct {
+    RudpMux *mux;
+    int stream_id;
+    struct sockaddr_in clientaddr;
+    RateLimits *limits;
+    MemBudget *budget;
+} StreamSession;
+
+// Thread that handles the transfer sent on a stream, then closes the stream
+//
+// Only transfers can be run on their own stream, other commands are answered quickly enough on the control stream. The
+// transfer runs alongside the commands on the control stream, so it doesn't use the caches.
+void *serve_stream(void *arg) {
+    StreamSession *session = arg;
+    SocketInfo socket_info = {session->mux->sockfd, (struct sockaddr *) &session->clientaddr,
+                              sizeof(session->clientaddr), session->mux};
+    // a client that goes away mid-transfer is given up on, so the stream's thread and buffers are freed
+    RudpReceiver receiver = {.stream_id=session->stream_id, .keepalive=true};
+    RudpSender sender = {.sender_timeout=SENDER_TIMEOUT, .message_timeout=INITIAL_TIMEOUT,
+                         .stream_id=session->stream_id};
+    RudpRateLimit transfer_limit;
+    bool limited = start_transfer_limit(session->limits, &transfer_limit) == 0;
+    apply_rate_limits(session->limits, &sender, &session->clientaddr, limited ? &transfer_limit : NULL);
+
+    char buf[BUFSIZE];
+    int n = rudp_recv(buf, BUFSIZE, &socket_info, &receiver);
+    if (n < 0) {
+        perror("ERROR in rudp_recv");
+    } else {
+        KftpCommand request;
+        int parsed = deserialize_kftp_command(buf, n, &request);
+        char command[BUFSIZE] = {0,};
+        kftp_command_format(&request, command, BUFSIZE);
+        printf("server received %d bytes on stream %d (request %u): %s\n", n, session->stream_id, request.request_id,
+               command);
+
+        int status;
+        if (parsed < 0)
+            status = PARSE_ERROR;
+        else if (!kftp_command_is_transfer(&request))
+            status = NOT_STREAMABLE_ERROR;
+        else if (mem_budget_reserve(session->budget, TRANSFER_MEMORY) < 0)
+            status = OUT_OF_MEMORY_ERROR;
+        else {
+            status = process_message(&request, NULL, &socket_info, &sender, &receiver);
+            mem_budget_release(session->budget, TRANSFER_MEMORY);
+        }
+        if (status < 0 && status != PEER_DEAD_ERROR)
+            send_error(status, &request, &socket_info, &sender, &receiver);
+    }
+
+    RudpMuxStats stats;
+    rudp_mux_stats(session->mux, &stats);
+    printf("stream %d sent %lu bytes (connection totals: %lu control bytes, %lu bulk bytes)\n", session->stream_id,
+           rudp_mux_sent_bytes(session->mux, session->stream_id), stats.bytes[RUDP_STREAM_CONTROL],
+           stats.bytes[RUDP_STREAM_BULK]);
+    if (limited)
+        stop_transfer_limit(session->limits, &transfer_limit);
+    rudp_mux_close(session->mux, session->stream_id);
+    free(session);
+    return NULL;
+}
+
+// Thread that starts a serve_stream thread for each stream the client opens, giving it the client's weight
+void *accept_streams(void *arg) {
+    StreamAcceptor *acceptor = arg;
+    RudpMux *mux = acceptor->mux;
+
+    while (1) {
+        StreamSession *session = malloc(sizeof(StreamSession));
+        if (session == NULL)
+            fatal_error("ERROR allocating stream");
+        session->mux = mux;
+        session->limits = acceptor->limits;
+        session->budget = acceptor->budget;
+
+        SocketInfo from = {mux->sockfd, (struct sockaddr *) &session->clientaddr, sizeof(session->clientaddr)};
+        session->stream_id = rudp_mux_accept(mux, &from);
+        if (session->stream_id < 0) {
+            free(session);
+            continue;
+        }
+        rudp_mux_set_weight(mux, session->stream_id, find_client_weight(acceptor, &session->clientaddr));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_stream, session) != 0) {
+            perror("ERROR starting stream thread");
+            rudp_mux_close(mux, session->stream_id);
+            free(session);
+            continue;
+        }
+        pthread_detach(thread);
+    }
 }
 
 int main(int argc, char **argv) {
@@ -275,11 +976,51 @@ int main(int argc, char **argv) {
     /*
      * check command line arguments
      */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    RateLimits limits = {.path=NULL};
+    long budget_limit = SERVER_MEMORY_BUDGET;
+    int first_weight = 2;
+    bool valid_options = true;
+    while (valid_options && argc >= first_weight + 2 && argv[first_weight][0] == '-') {
+        if (strcmp(argv[first_weight], "-l") == 0)
+            limits.path = argv[first_weight + 1];
+        else if (strcmp(argv[first_weight], "-m") == 0) {
+            char *end;
+            budget_limit = strtol(argv[first_weight + 1], &end, 10);
+            valid_options = *end == 0 && end != argv[first_weight + 1] && budget_limit > 0;
+        }
+        else
+            valid_options = false;
+        first_weight += 2;
+    }
+    StreamAcceptor acceptor = {.weights_count=argc - first_weight, .limits=&limits};
+    if (argc < 2 || !valid_options || acceptor.weights_count < 0 || acceptor.weights_count > MAX_CLIENT_WEIGHTS) {
+        fprintf(stderr, "usage: %s <port> [-l <limits_file>] [-m <memory_budget>] [<client_address>=<weight>...]\n",
+                argv[0]);
         exit(1);
     }
     portno = atoi(argv[1]);
+    for (int i = 0; i < acceptor.weights_count; i++) {
+        if (parse_client_weight(argv[i + first_weight], &acceptor.weights[i]) < 0) {
+            fprintf(stderr, "invalid client weight (expected <client_address>=<weight>, from 1 to %d): %s\n",
+                    RUDP_MUX_MAX_WEIGHT, argv[i + first_weight]);
+            exit(1);
+        }
+    }
+
+    // the traffic isn't limited until the limits file is read, and the file is then watched for changes
+    pthread_mutex_init(&limits.lock, NULL);
+    rudp_rate_init(&limits.global, RUDP_RATE_UNLIMITED);
+    if (limits.path != NULL) {
+        struct stat limits_stat;
+        if (stat(limits.path, &limits_stat) < 0 || load_rate_limits(&limits) < 0)
+            fatal_error("ERROR reading limits file");
+        limits.modified = limits_stat.st_mtime;
+        limits.size = limits_stat.st_size;
+
+        pthread_t limits_watcher;
+        if (pthread_create(&limits_watcher, NULL, watch_rate_limits, &limits) != 0)
+            fatal_error("ERROR starting limits watcher");
+    }
 
     /*
      * socket: create the parent socket
@@ -312,34 +1053,66 @@ int main(int argc, char **argv) {
              sizeof(serveraddr)) < 0)
         fatal_error("ERROR on binding");
 
+    // the memory held by the caches, the queued messages, and the running transfers is charged to a single budget
+    MemBudget budget;
+    mem_budget_init(&budget, (size_t) budget_limit);
+    acceptor.budget = &budget;
+
+    // commands are received on the control stream, while transfers run in the background get streams of their own
+    RudpMux mux;
+    rudp_mux_init(&mux, sockfd, true);
+    mux.budget = &budget;
+    acceptor.mux = &mux;
+    pthread_t acceptor_thread;
+    if (pthread_create(&acceptor_thread, NULL, accept_streams, &acceptor) != 0)
+        fatal_error("ERROR starting stream acceptor");
+
     clientlen = sizeof(clientaddr);
-    SocketInfo client_socket_info = {sockfd, (struct sockaddr *) &clientaddr, clientlen};
+    SocketInfo client_socket_info = {sockfd, (struct sockaddr *) &clientaddr, clientlen, &mux};
 
     RudpReceiver receiver = {};
     RudpSender sender = {.sender_timeout=SENDER_TIMEOUT, .message_timeout=INITIAL_TIMEOUT};
+    // the commands on the control stream run one at a time, so they share a transfer limit
+    RudpRateLimit command_limit;
+    start_transfer_limit(&limits, &command_limit);
+
+    ServerCaches caches;
+    pthread_mutex_init(&caches.lock, NULL);
+    file_cache_init(&caches.files, FILE_CACHE_CAPACITY, FILE_CACHE_MAX_FILE_SIZE);
+    caches.files.budget = &budget;
+    kftp_fingerprint_index_init(&caches.fingerprints);
+    if (dir_index_init(&caches.listing, ".") < 0)
+        fatal_error("ERROR setting up directory index");
+    // the directory is indexed up front so the first ls doesn't need to wait for it (a failure is retried on each ls)
+    dir_index_refresh(&caches.listing);
 
     /*
-     * main loop: wait for a datagram, then echo it
+     * main loop: wait for a command, then handle it
      */
     while (1) {
 
-        // receive a command from the client
-        memset(buf, 0, BUFSIZE);
-        // we receive BUFSIZE-1 bytes instead of BUFSIZE since we treat the buffer as a string that needs to be
-        // null-terminated
-        n = rudp_recv(buf, BUFSIZE-1, &client_socket_info, &receiver);
+        // receive a command from the client, waiting however long it takes (clients can be idle between commands)
+        // an abort only ends the exchange it was sent in, after which the next command starts in step with the client
+        receiver.keepalive = false;
+        receiver.aborted = false;
+        n = rudp_recv(buf, BUFSIZE, &client_socket_info, &receiver);
 
+        if (n == ABORTED_ERROR) {
+            printf("client aborted its last command\n");
+            continue;
+        }
         if (n < 0) {
             perror("ERROR in rudp_recv");
             continue;
         }
+        // while the command runs, a client that goes away is given up on instead of holding up the others
+        receiver.keepalive = true;
 
+        apply_rate_limits(&limits, &sender, &clientaddr, &command_limit);
 
-        // add zero to end of buffer since we treat it as a string
-        if (n < BUFSIZE && n > 0)
-            buf[n] = 0;
-        else
-            buf[BUFSIZE - 1] = 0;
+        // a malformed command is still replied to (with as much of its request ID as could be read)
+        KftpCommand request;
+        int parsed = deserialize_kftp_command(buf, n, &request);
 
         /*
          * gethostbyaddr: determine who sent the datagram
@@ -357,17 +1130,33 @@ int main(int argc, char **argv) {
         }
         printf("server received datagram from %s (%s)\n",
                hostp->h_name, hostaddrp);
-        printf("server received %lu/%d bytes: %s\n", strlen(buf), n, buf);
-
-        // we keep a copy of the original command since our requirements state "For any other commands, the server
-        // should simply repeat the command back to the client with no modification, stating that the given command was
-        // not understood"
-        char original_command[BUFSIZE] = {0,};
-        strncpy(original_command, buf, BUFSIZE - 1);
-        int status = process_message(buf, &client_socket_info, &sender, &receiver);
-        if (status < 0) {
+        char command[BUFSIZE] = {0,};
+        kftp_command_format(&request, command, BUFSIZE);
+        printf("server received %d bytes (request %u): %s\n", n, request.request_id, command);
+
+        // For any other commands, our requirements state the server "should simply repeat the command back to the
+        // client with no modification, stating that the given command was not understood"
+        // transfers and pipelines are refused once the memory budget can't cover their buffers
+        int status;
+        size_t memory = parsed < 0 ? 0 : command_memory(&request);
+        if (parsed < 0)
+            status = PARSE_ERROR;
+        else if (mem_budget_reserve(&budget, memory) < 0) {
+            memory = 0;
+            status = OUT_OF_MEMORY_ERROR;
+        }
+        else if (request.opcode == KFTP_OP_PIPELINE && kftp_command_validate(&request) == 0)
+            // the rest of the message holds the start of the pipeline
+            status = do_pipeline(&request, &buf[parsed], n - parsed, &caches, &client_socket_info, &sender, &receiver);
+        else
+            status = process_message(&request, &caches, &client_socket_info, &sender, &receiver);
+        mem_budget_release(&budget, memory);
+        // a client that cancelled its command already knows it didn't finish
+        if (receiver.aborted)
+            printf("client aborted request %u\n", request.request_id);
+        else if (status < 0 && status != PEER_DEAD_ERROR) {
             // send error message back to the client
-            send_error(status, original_command, &client_socket_info, &sender, &receiver);
+            send_error(status, &request, &client_socket_info, &sender, &receiver);
         }
     }
 }
@@ -8,7 +8,7 @@ from pathlib import Path
 
 from tests.e2e_utils.socket_utils import Socket, UnreliableSocket
 from tests.e2e_utils.rudp_utils import RudpReceiver, RudpSender
-from tests.e2e_utils.kftp_utils import KftpReceiver, KftpSender
+from tests.e2e_utils.kftp_utils import KftpCommand, KftpReceiver, KftpSender, xxh64
 
 address = "127.0.0.1"
 port = 8080
@@ -23,11 +23,15 @@ class Client:
 
     expected_prompt_lines = [
         b'Please enter one of the following messages: \n',
-        b'\tget <file_name>\n',
-        b'\tput <file_name>\n',
+        b'\tget [-c] [-d|-z|-s|-p|-r|-u|-m] <file_name> [<offset> <length>]\n',
+        b'\tput [-c] [-d|-z|-s|-p|-r|-u|-m] <file_name>\n',
+        b'\tmget [-k] <pattern>...\n',
+        b'\tmput [-k] <pattern>...\n',
         b'\tdelete <file_name>\n',
-        b'\tls\n',
+        b'\tls [<pattern>] [<offset> <count>]\n',
+        b'\tpipeline (followed by delete, ls, and get commands, one per line, and then end)\n',
         b'\texit\n',
+        b'End a get, put, mget, or mput with & to run it in the background.\n',
     ]
     prompt_marker = b"> "
 
@@ -107,6 +111,7 @@ def filepath_to_test_filepath(filepath: Path) -> Path:
 class Server(multiprocessing.Process):
     SOCKET_TIMEOUT = 0.1    # in seconds
 
+    mock_ls_files = [b'.git', b'foo', b'bar']
     mock_ls_response = b'.git\nfoo\nbar\n'
     mock_exit_response = b'Exiting gracefully\n'
     mock_file_contents = b"Hello world!\nGoodbye...\n"
@@ -126,46 +131,83 @@ class Server(multiprocessing.Process):
         self.receiver = RudpReceiver(self.sock)
         self.sender = RudpSender(self.sock, self.receiver)
 
-    def handle_command(self, command: bytes, from_addr: Tuple[str, int]):
-        command_type = command.split()[0]
-        if command_type == b"get":
+    def handle_command(self, message: bytes, from_addr: Tuple[str, int]):
+        command = KftpCommand.deserialize(message)
+        if command.opcode == KftpCommand.GET:
             self.handle_get(command, from_addr)
-        elif command_type == b"put":
-            self.handle_put(command)
-        elif command_type == b"delete":
+        elif command.opcode == KftpCommand.PUT:
+            self.handle_put(command, from_addr)
+        elif command.opcode == KftpCommand.DELETE:
             self.handle_delete(command, from_addr)
-        elif command_type == b"ls":
-            self.handle_ls(from_addr)
-        elif command_type == b"exit":
-            self.handle_exit(from_addr)
-
-    def handle_get(self, command: bytes, from_addr: Tuple[str, int]):
+        elif command.opcode == KftpCommand.LS:
+            self.handle_ls(command, from_addr)
+        elif command.opcode == KftpCommand.EXIT:
+            self.handle_exit(command, from_addr)
+        elif command.opcode == KftpCommand.PIPELINE:
+            self.handle_pipeline(command, message, from_addr)
+
+    def reply(self, command: KftpCommand, from_addr: Tuple[str, int], message: bytes = b""):
+        reply = KftpCommand(KftpCommand.REPLY, command.request_id, args=[message] if message else [])
+        self.send_to(reply.serialize(), from_addr)
+
+    def handle_get(self, command: KftpCommand, from_addr: Tuple[str, int]):
         contents = self.mock_file_contents
-        filename = command.split()[1].decode()
+        filename = command.args[0].decode()
         for file in self.sample_files:
             if filename == str(resources_filepath.joinpath(f"test_{file}")):
                 with open(resources_filepath.joinpath(file), "rb") as f:
                     contents = f.read()
                 break
 
+        self.reply(command, from_addr)
         return KftpSender(self.sender).send_to(contents, from_addr)
 
-    def handle_put(self, command: bytes):
-        filename = command.split()[1].decode()
+    def handle_put(self, command: KftpCommand, from_addr: Tuple[str, int]):
+        filename = command.args[0].decode()
         test_filepath = filepath_to_test_filepath(Path(filename))
         data, _ = KftpReceiver(self.receiver).receive_from()
         with test_filepath.open("wb") as f:
             f.write(data)
-
-    def handle_delete(self, command: bytes, from_addr: Tuple[str, int]):
-        filename = command.split()[1].decode()
-        self.send_to(self.mock_delete_response(filename), from_addr)
-
-    def handle_ls(self, from_addr: Tuple[str, int]):
-        self.send_to(self.mock_ls_response, from_addr)
-
-    def handle_exit(self, from_addr: Tuple[str, int]):
-        self.send_to(self.mock_exit_response, from_addr)
+        self.reply(command, from_addr)
+
+    def handle_delete(self, command: KftpCommand, from_addr: Tuple[str, int]):
+        filename = command.args[0].decode()
+        self.reply(command, from_addr, self.mock_delete_response(filename))
+
+    def handle_ls(self, command: KftpCommand, from_addr: Tuple[str, int]):
+        # the listing is a stream of length-prefixed names, ended by a length of 0 and a status
+        self.reply(command, from_addr)
+        listing = b"".join(len(name).to_bytes(4, "big") + name for name in self.mock_ls_files)
+        self.send_to(listing + (0).to_bytes(4, "big") + (0).to_bytes(4, "big"), from_addr)
+
+    def handle_pipeline(self, pipeline: KftpCommand, message: bytes, from_addr: Tuple[str, int]):
+        # the commands follow the pipeline command on a single stream, each preceded by its size
+        buffer = message[len(pipeline.serialize()):]
+
+        def read(size: int) -> bytes:
+            nonlocal buffer
+            while len(buffer) < size:
+                buffer += self.receive_from()[0]
+            result, buffer = buffer[:size], buffer[size:]
+            return result
+
+        count = int.from_bytes(pipeline.args[0], "big")
+        commands = [KftpCommand.deserialize(read(int.from_bytes(read(4), "big"))) for _ in range(count)]
+
+        # completions can arrive in any order, so they're sent back in reverse
+        completions = b""
+        for command in reversed(commands):
+            data = self.mock_file_contents if command.opcode == KftpCommand.GET else b""
+            message = self.mock_delete_response(command.args[0].decode()) if command.opcode == KftpCommand.DELETE \
+                else b""
+            reply = KftpCommand(KftpCommand.REPLY, command.request_id, args=[message] if message else []).serialize()
+            completions += len(reply).to_bytes(4, "big") + reply + len(data).to_bytes(4, "big")
+            if data:
+                completions += data + xxh64(data).to_bytes(8, "big")
+        self.send_to(completions, from_addr)
+
+    def handle_exit(self, command: KftpCommand, from_addr: Tuple[str, int]):
+        self.reply(command, from_addr, self.mock_exit_response.rstrip(b"\n"))
 
     def send_to(self, message: bytes, addr: Tuple[str, int]):
         self.sender.send_to(message, addr)
@@ -326,6 +368,24 @@ class TestClient:
 
         assert response.rstrip() == expected_response.rstrip()
 
+    @pytest.mark.asyncio
+    async def test_pipeline(self, client: Client, server: None):
+        test_filepath = resources_filepath.joinpath("test_pipeline.txt")
+        command = f"pipeline\ndelete test.txt\nfoo\nget {test_filepath}\nend\n".encode()
+
+        await client.expect_prompt()
+
+        await client.send_input(command)
+        response = await client.read_available_lines()
+        await client.check_errors()
+
+        # commands are reported in the order they complete
+        assert response.rstrip().split(b"\n") == [b"Invalid command: foo", f"Downloaded file: {test_filepath}".encode(),
+                                                   b"Deleted file: test.txt"]
+        assert test_filepath.read_bytes() == Server.mock_file_contents
+
+        test_filepath.unlink()
+
     @pytest.mark.asyncio
     async def test_exit(self, client: Client, server: None):
         command = b"exit\n"
@@ -14,6 +14,7 @@
 #include "../../mocks/mocks.h"
 #include "../../mocks/reliable_udp_mocks.h"
 #include "../../../src/common/utils.h"
+#include "../../../src/common/hash.h"
 #include "../../../src/common/kftp/kftp.h"
 #include "../../../src/common/kftp/kftp_serde.h"
 #include "../../../src/common/reliable_udp/reliable_udp.h"
@@ -21,7 +22,6 @@
 
 #define FSEEK_SUCCESS 0
 #define RUDP_SEND_SUCCESS 0
-#define FEOF_EOF 0
 #define FEOF_NOT_EOF 1
 
 
@@ -39,6 +39,14 @@ void destroy_random_buffer(char* buffer) {
     free(buffer);
 }
 
+// Serializes the trailer for `file_contents` into `buffer`, returning the number of bytes serialized
+int serialize_expected_trailer(char* file_contents, int file_size, char* buffer, int buffer_len) {
+    KftpTrailer trailer = {.hash=xxh64(file_contents, file_size, 0)};
+    int serialized = serialize_kftp_trailer(&trailer, buffer, buffer_len);
+    assert(serialized == KFTP_TRAILER_SIZE);
+    return serialized;
+}
+
 
 static void test_kftp_send_small_file(void** state) {
     SocketInfo socket_info = {};
@@ -51,17 +59,17 @@ static void test_kftp_send_small_file(void** state) {
     // mocks
     will_return_always(fseek, FSEEK_SUCCESS);
     will_return(ftell, dummy_filesize);
-    // should hit EOF on first read
-    will_return(feof, FEOF_EOF);
     set_fread_buffer(dummy_file_contents, dummy_filesize, dummy_filesize);
 
     char expected_data[100] = {};
     int buffer_len = 100;
     KftpHeader header = {.data_size=dummy_filesize};
     int serialized = serialize_kftp_header(&header , expected_data, buffer_len);
-    int expected_data_size = dummy_filesize + serialized;
-    assert(expected_data_size < buffer_len);
     memcpy(&expected_data[serialized], dummy_file_contents, dummy_filesize);
+    // the trailer fits into the same message
+    int expected_data_size = serialized + dummy_filesize;
+    expected_data_size += serialize_expected_trailer(dummy_file_contents, dummy_filesize,
+                                                     &expected_data[expected_data_size], buffer_len - expected_data_size);
     check_rudp_send(expected_data, expected_data_size, RUDP_SEND_SUCCESS);
 
     int result = kftp_send_file(NULL, &socket_info, &sender, &receiver);
@@ -71,6 +79,38 @@ static void test_kftp_send_small_file(void** state) {
     destroy_random_buffer(dummy_file_contents);
 }
 
+// A range that extends past the end of the file is cut off at the end of the file
+static void test_kftp_send_file_range_past_end_of_file(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+
+    int dummy_filesize = 100;
+    int range_size = 10;
+    char* range_contents = create_random_buffer(range_size);
+
+    // mocks
+    will_return_always(fseek, FSEEK_SUCCESS);
+    will_return(ftell, dummy_filesize);
+    set_fread_buffer(range_contents, range_size, range_size);
+
+    char expected_data[100] = {};
+    int buffer_len = 100;
+    KftpHeader header = {.data_size=range_size};
+    int serialized = serialize_kftp_header(&header , expected_data, buffer_len);
+    memcpy(&expected_data[serialized], range_contents, range_size);
+    int expected_data_size = serialized + range_size;
+    expected_data_size += serialize_expected_trailer(range_contents, range_size, &expected_data[expected_data_size],
+                                                     buffer_len - expected_data_size);
+    check_rudp_send(expected_data, expected_data_size, RUDP_SEND_SUCCESS);
+
+    int result = kftp_send_file_range(NULL, dummy_filesize - range_size, 50, &socket_info, &sender, &receiver);
+
+    assert_int_equal(result, 0);
+
+    destroy_random_buffer(range_contents);
+}
+
 static void test_kftp_send_file_over_two_rudp_messages(void** state) {
     SocketInfo socket_info = {};
     RudpSender sender = {};
@@ -97,10 +137,12 @@ static void test_kftp_send_file_over_two_rudp_messages(void** state) {
     memcpy(&expected_data[serialized], dummy_file_contents, first_msg_data_size);
     check_rudp_send(expected_data, MAX_DATA_SIZE, RUDP_SEND_SUCCESS);
 
-    // Check second sent rudp message
-    assert(second_msg_data_size <= MAX_DATA_SIZE);
+    // Check second sent rudp message, which also holds the trailer
+    assert(second_msg_data_size + KFTP_TRAILER_SIZE <= MAX_DATA_SIZE);
     memcpy(expected_data, &dummy_file_contents[first_msg_data_size], second_msg_data_size);
-    check_rudp_send(expected_data, second_msg_data_size, RUDP_SEND_SUCCESS);
+    serialize_expected_trailer(dummy_file_contents, dummy_filesize, &expected_data[second_msg_data_size],
+                               MAX_DATA_SIZE - second_msg_data_size);
+    check_rudp_send(expected_data, second_msg_data_size + KFTP_TRAILER_SIZE, RUDP_SEND_SUCCESS);
 
     int result = kftp_send_file(NULL, &socket_info, &sender, &receiver);
 
@@ -146,8 +188,14 @@ static void test_kftp_send_file_over_several_rudp_messages(void** state) {
         int i = dummy_filesize - remaining_data_size;
         int next_read_size = min(remaining_data_size, MAX_DATA_SIZE);
         memcpy(expected_data, &dummy_file_contents[i], next_read_size);
-        check_rudp_send(expected_data, next_read_size, RUDP_SEND_SUCCESS);
         remaining_data_size -= next_read_size;
+
+        // the last message also holds the trailer
+        int next_send_size = next_read_size;
+        if (remaining_data_size == 0)
+            next_send_size += serialize_expected_trailer(dummy_file_contents, dummy_filesize,
+                                                         &expected_data[next_read_size], MAX_DATA_SIZE - next_read_size);
+        check_rudp_send(expected_data, next_send_size, RUDP_SEND_SUCCESS);
     }
 
     int result = kftp_send_file(NULL, &socket_info, &sender, &receiver);
@@ -157,6 +205,37 @@ static void test_kftp_send_file_over_several_rudp_messages(void** state) {
     destroy_random_buffer(dummy_file_contents);
 }
 
+static void test_kftp_send_trailer_in_separate_message(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+
+    // fills up the first message exactly, leaving no room for the trailer
+    int dummy_filesize = MAX_DATA_SIZE - KFTP_HEADER_SIZE;
+    char* dummy_file_contents = create_random_buffer(dummy_filesize);
+
+    // mocks
+    will_return_always(fseek, FSEEK_SUCCESS);
+    will_return(ftell, dummy_filesize);
+    set_fread_buffer(dummy_file_contents, dummy_filesize, dummy_filesize);
+
+    char expected_data[MAX_DATA_SIZE] = {};
+    KftpHeader header = {.data_size=dummy_filesize};
+    int serialized = serialize_kftp_header(&header , expected_data, MAX_DATA_SIZE);
+    memcpy(&expected_data[serialized], dummy_file_contents, dummy_filesize);
+    check_rudp_send(expected_data, MAX_DATA_SIZE, RUDP_SEND_SUCCESS);
+
+    char expected_trailer[KFTP_TRAILER_SIZE] = {};
+    serialize_expected_trailer(dummy_file_contents, dummy_filesize, expected_trailer, KFTP_TRAILER_SIZE);
+    check_rudp_send(expected_trailer, KFTP_TRAILER_SIZE, RUDP_SEND_SUCCESS);
+
+    int result = kftp_send_file(NULL, &socket_info, &sender, &receiver);
+
+    assert_int_equal(result, 0);
+
+    destroy_random_buffer(dummy_file_contents);
+}
+
 static void test_kftp_recv_small_file(void** state) {
     SocketInfo socket_info = {};
     RudpReceiver receiver = {};
@@ -169,9 +248,10 @@ static void test_kftp_recv_small_file(void** state) {
     int buffer_len = 100;
     KftpHeader header = {.data_size=dummy_filesize};
     int serialized = serialize_kftp_header(&header, received_data, buffer_len);
-    int received_data_size = dummy_filesize + serialized;
-    assert(received_data_size <= buffer_len);
     memcpy(&received_data[serialized], dummy_file_contents, dummy_filesize);
+    int received_data_size = serialized + dummy_filesize;
+    received_data_size += serialize_expected_trailer(dummy_file_contents, dummy_filesize,
+                                                     &received_data[received_data_size], buffer_len - received_data_size);
     set_rudp_recv_buffer(received_data, received_data_size, received_data_size);
 
     check_fwrite(dummy_file_contents, dummy_filesize, dummy_filesize);
@@ -209,10 +289,13 @@ static void test_kftp_recv_file_over_two_messages(void** state) {
 
     check_fwrite(dummy_file_contents, first_msg_data_size, first_msg_data_size);
 
-    // receive and write second chunk
-    assert(second_msg_data_size < MAX_DATA_SIZE);
+    // receive and write second chunk, followed by the trailer
+    assert(second_msg_data_size + KFTP_TRAILER_SIZE < MAX_DATA_SIZE);
     memcpy(received_buffers[1], &dummy_file_contents[first_msg_data_size], second_msg_data_size);
-    set_rudp_recv_buffer(received_buffers[1], second_msg_data_size, second_msg_data_size);
+    serialize_expected_trailer(dummy_file_contents, dummy_filesize, &received_buffers[1][second_msg_data_size],
+                               MAX_DATA_SIZE - second_msg_data_size);
+    set_rudp_recv_buffer(received_buffers[1], second_msg_data_size + KFTP_TRAILER_SIZE,
+                         second_msg_data_size + KFTP_TRAILER_SIZE);
 
     check_fwrite(&dummy_file_contents[first_msg_data_size], second_msg_data_size, second_msg_data_size);
 
@@ -269,8 +352,14 @@ static void test_kftp_recv_file_over_several_rudp_messages(void** state) {
         int offset = dummy_filesize - remaining_data_size;
         int next_recv_size = min(remaining_data_size, MAX_DATA_SIZE);
         memcpy(received_buffers[i], &dummy_file_contents[offset], next_recv_size);
-        set_rudp_recv_buffer(received_buffers[i], next_recv_size, next_recv_size);
         remaining_data_size -= next_recv_size;
+
+        // the last message also holds the trailer
+        if (remaining_data_size == 0)
+            next_recv_size += serialize_expected_trailer(dummy_file_contents, dummy_filesize,
+                                                         &received_buffers[i][next_recv_size],
+                                                         MAX_DATA_SIZE - next_recv_size);
+        set_rudp_recv_buffer(received_buffers[i], next_recv_size, next_recv_size);
         i++;
     }
 
@@ -281,14 +370,76 @@ static void test_kftp_recv_file_over_several_rudp_messages(void** state) {
     destroy_random_buffer(dummy_file_contents);
 }
 
+static void test_kftp_recv_trailer_split_over_messages(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {};
+
+    int dummy_filesize = 10;
+    char* dummy_file_contents = create_random_buffer(dummy_filesize);
+    char trailer[KFTP_TRAILER_SIZE] = {};
+    serialize_expected_trailer(dummy_file_contents, dummy_filesize, trailer, KFTP_TRAILER_SIZE);
+
+    // mocks
+    // the first message holds the data and half of the trailer, the second message the other half
+    char received_data[100] = {};
+    KftpHeader header = {.data_size=dummy_filesize};
+    int serialized = serialize_kftp_header(&header, received_data, sizeof(received_data));
+    memcpy(&received_data[serialized], dummy_file_contents, dummy_filesize);
+    memcpy(&received_data[serialized + dummy_filesize], trailer, KFTP_TRAILER_SIZE / 2);
+    int received_data_size = serialized + dummy_filesize + KFTP_TRAILER_SIZE / 2;
+    set_rudp_recv_buffer(received_data, received_data_size, received_data_size);
+    set_rudp_recv_buffer(&trailer[KFTP_TRAILER_SIZE / 2], KFTP_TRAILER_SIZE / 2, KFTP_TRAILER_SIZE / 2);
+
+    check_fwrite(dummy_file_contents, dummy_filesize, dummy_filesize);
+
+    int result = kftp_recv_file(NULL, &socket_info, &receiver);
+
+    assert_int_equal(result, 0);
+
+    destroy_random_buffer(dummy_file_contents);
+}
+
+static void test_kftp_recv_detects_corrupted_file(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {};
+
+    int dummy_filesize = 10;
+    char* dummy_file_contents = create_random_buffer(dummy_filesize);
+
+    // mocks
+    char received_data[100] = {};
+    int buffer_len = 100;
+    KftpHeader header = {.data_size=dummy_filesize};
+    int serialized = serialize_kftp_header(&header, received_data, buffer_len);
+    memcpy(&received_data[serialized], dummy_file_contents, dummy_filesize);
+    int received_data_size = serialized + dummy_filesize;
+    received_data_size += serialize_expected_trailer(dummy_file_contents, dummy_filesize,
+                                                     &received_data[received_data_size], buffer_len - received_data_size);
+    // flip a bit of the data after the trailer was computed
+    received_data[serialized] ^= 1;
+    set_rudp_recv_buffer(received_data, received_data_size, received_data_size);
+
+    check_fwrite(&received_data[serialized], dummy_filesize, dummy_filesize);
+
+    int result = kftp_recv_file(NULL, &socket_info, &receiver);
+
+    assert_int_equal(result, KFTP_INTEGRITY_ERROR);
+
+    destroy_random_buffer(dummy_file_contents);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
             cmocka_unit_test(test_kftp_send_small_file),
+            cmocka_unit_test(test_kftp_send_file_range_past_end_of_file),
             cmocka_unit_test(test_kftp_send_file_over_two_rudp_messages),
             cmocka_unit_test(test_kftp_send_file_over_several_rudp_messages),
+            cmocka_unit_test(test_kftp_send_trailer_in_separate_message),
             cmocka_unit_test(test_kftp_recv_small_file),
             cmocka_unit_test(test_kftp_recv_file_over_two_messages),
             cmocka_unit_test(test_kftp_recv_file_over_several_rudp_messages),
+            cmocka_unit_test(test_kftp_recv_trailer_split_over_messages),
+            cmocka_unit_test(test_kftp_recv_detects_corrupted_file),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
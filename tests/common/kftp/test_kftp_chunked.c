@@ -0,0 +1,121 @@
+//
+// Tests for KFTP chunked transfers, sent between two threads over a socket pair
+//
+
+// needed for pread and pwrite
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_chunked.h"
+#include "../../../src/common/reliable_udp/reliable_udp.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// larger than an int can hold, so the file's size has to be sent as 64 bits
+#define SPARSE_FILE_SIZE (2560L * 1024 * 1024)
+#define DATA_SIZE 1000
+
+
+typedef struct {
+    FILE* file;
+    KftpChunkOptions options;
+    int sockfd;
+    int status;
+} SendJob;
+
+static void* send_file(void* arg) {
+    SendJob* job = arg;
+    SocketInfo socket_info = {.sockfd=job->sockfd};
+    RudpSender sender = {.message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+    job->status = kftp_send_file_chunked(job->file, &job->options, &socket_info, &sender, &receiver);
+    return NULL;
+}
+
+
+START_TEST(test_large_sparse_file_round_trip) {
+    // a little data at the start, in the middle, and at the end of a file that's otherwise one large hole
+    long offsets[] = {0, SPARSE_FILE_SIZE / 2 + 5, SPARSE_FILE_SIZE - DATA_SIZE};
+    char data[DATA_SIZE];
+    srand(1);
+    for (int i = 0; i < DATA_SIZE; i++)
+        data[i] = (char) rand();
+
+    FILE* source = tmpfile();
+    ck_assert_ptr_nonnull(source);
+    ck_assert_int_eq(ftruncate(fileno(source), SPARSE_FILE_SIZE), 0);
+    for (int i = 0; i < 3; i++)
+        ck_assert_int_eq(pwrite(fileno(source), data, DATA_SIZE, offsets[i]), DATA_SIZE);
+
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    SendJob job = {.file=source, .options={.sparse=true}, .sockfd=fds[0]};
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, send_file, &job), 0);
+
+    FILE* copy = tmpfile();
+    ck_assert_ptr_nonnull(copy);
+    SocketInfo socket_info = {.sockfd=fds[1]};
+    RudpReceiver receiver = {};
+    ck_assert_int_eq(kftp_recv_file_chunked(copy, &socket_info, &receiver), 0);
+    pthread_join(thread, NULL);
+    ck_assert_int_eq(job.status, 0);
+
+    ck_assert_int_eq(fflush(copy), 0);
+    struct stat copy_stat;
+    ck_assert_int_eq(fstat(fileno(copy), &copy_stat), 0);
+    ck_assert_int_eq(copy_stat.st_size, SPARSE_FILE_SIZE);
+    // the holes weren't written out
+    ck_assert_int_lt(copy_stat.st_blocks * 512L, 1024L * 1024);
+
+    char copied[DATA_SIZE];
+    for (int i = 0; i < 3; i++) {
+        ck_assert_int_eq(pread(fileno(copy), copied, DATA_SIZE, offsets[i]), DATA_SIZE);
+        ck_assert_int_eq(memcmp(copied, data, DATA_SIZE), 0);
+    }
+    ck_assert_int_eq(pread(fileno(copy), copied, DATA_SIZE, SPARSE_FILE_SIZE / 4), DATA_SIZE);
+    for (int i = 0; i < DATA_SIZE; i++)
+        ck_assert_int_eq(copied[i], 0);
+
+    fclose(source);
+    fclose(copy);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+
+Suite* kftp_chunked_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpChunked");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_large_sparse_file_round_trip);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_chunked_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
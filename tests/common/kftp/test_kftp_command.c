@@ -0,0 +1,240 @@
+//
+// Tests for the serialization and validation of KFTP control messages
+//
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_command.h"
+
+#include <string.h>
+
+
+START_TEST(test_command_round_trip) {
+    KftpCommand command;
+    kftp_command_init(&command, KFTP_OP_GET, 0x01020304, KFTP_FLAG_RANGED);
+    ck_assert_int_eq(kftp_command_add_string(&command, "foo.txt"), 0);
+    ck_assert_int_eq(kftp_command_add_uint64(&command, 5000000000), 0);
+    ck_assert_int_eq(kftp_command_add_uint64(&command, 10), 0);
+
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int serialized = serialize_kftp_command(&command, buffer, sizeof(buffer));
+    ck_assert_int_eq(serialized, KFTP_COMMAND_HEADER_SIZE + 2 + 7 + 2 * (2 + 8));
+    ck_assert_int_eq(serialized, command.size);
+
+    // the header holds the opcode, the number of arguments, the flags, the request ID, and the status
+    char expected_header[KFTP_COMMAND_HEADER_SIZE] = {KFTP_OP_GET, 3, 0x01, 0x00, 1, 2, 3, 4, 0, 0, 0, 0};
+    ck_assert_mem_eq(buffer, expected_header, KFTP_COMMAND_HEADER_SIZE);
+
+    KftpCommand parsed;
+    ck_assert_int_eq(deserialize_kftp_command(buffer, serialized, &parsed), serialized);
+    ck_assert_int_eq(parsed.opcode, KFTP_OP_GET);
+    ck_assert_uint_eq(parsed.request_id, 0x01020304);
+    ck_assert_int_eq(parsed.flags, KFTP_FLAG_RANGED);
+    ck_assert_int_eq(parsed.arg_count, 3);
+    ck_assert_str_eq(parsed.args[0], "foo.txt");
+
+    uint64_t value;
+    ck_assert_int_eq(kftp_command_arg_uint64(&parsed, 1, &value), 0);
+    ck_assert_uint_eq(value, 5000000000);
+    ck_assert_int_eq(kftp_command_arg_uint64(&parsed, 2, &value), 0);
+    ck_assert_uint_eq(value, 10);
+    // strings aren't numbers
+    ck_assert_int_lt(kftp_command_arg_uint64(&parsed, 0, &value), 0);
+
+    KftpTransferFlags flags;
+    kftp_command_transfer_flags(&parsed, &flags);
+    ck_assert(flags.ranged);
+    ck_assert_int_eq(flags.offset, 5000000000);
+    ck_assert_int_eq(flags.length, 10);
+}
+END_TEST
+
+
+START_TEST(test_command_rejects_malformed_messages) {
+    KftpCommand command;
+    kftp_command_init(&command, KFTP_OP_DELETE, 7, 0);
+    ck_assert_int_eq(kftp_command_add_string(&command, "foo.txt"), 0);
+
+    char buffer[KFTP_COMMAND_MAX_SIZE];
+    int serialized = serialize_kftp_command(&command, buffer, sizeof(buffer));
+
+    // the request ID is still read from a message with a truncated argument, so it can be replied to
+    KftpCommand parsed;
+    ck_assert_int_lt(deserialize_kftp_command(buffer, serialized - 1, &parsed), 0);
+    ck_assert_uint_eq(parsed.request_id, 7);
+    ck_assert_int_lt(deserialize_kftp_command(buffer, KFTP_COMMAND_HEADER_SIZE - 1, &parsed), 0);
+
+    // arguments that don't fit in a single message are rejected
+    char long_arg[KFTP_COMMAND_MAX_SIZE] = {0,};
+    memset(long_arg, 'a', sizeof(long_arg) - 1);
+    kftp_command_init(&command, KFTP_OP_GET, 1, 0);
+    ck_assert_int_lt(kftp_command_add_string(&command, long_arg), 0);
+    ck_assert_int_eq(command.arg_count, 0);
+}
+END_TEST
+
+
+// Builds a command from string arguments, followed by `number_count` numbers
+static void make_command(KftpCommand* command, int opcode, int flags, char** args, int arg_count, int number_count) {
+    kftp_command_init(command, opcode, 1, flags);
+    for (int i = 0; i < arg_count; i++)
+        ck_assert_int_eq(kftp_command_add_string(command, args[i]), 0);
+    for (int i = 0; i < number_count; i++)
+        ck_assert_int_eq(kftp_command_add_uint64(command, i), 0);
+}
+
+START_TEST(test_command_validation) {
+    KftpCommand command;
+    char* one[] = {"foo"};
+    char* two[] = {"foo", "bar"};
+
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_DELTA | KFTP_FLAG_CONDITIONAL, one, 1, 0);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_GET, 0, two, 2, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_GET, 0, NULL, 0, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_RANGED, one, 1, 2);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    // ranges need two numbers, and are sent as plain transfers
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_RANGED, two, 2, 1);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_RANGED | KFTP_FLAG_COMPRESS, one, 1, 2);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    // flags are only allowed on the commands that take them, and only in combinations that make sense
+    make_command(&command, KFTP_OP_PUT, KFTP_FLAG_RANGED, one, 1, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_PUT, KFTP_FLAG_DELTA | KFTP_FLAG_COMPRESS, one, 1, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_PUT, KFTP_FLAG_MERKLE | KFTP_FLAG_CONDITIONAL, one, 1, 0);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_DELETE, KFTP_FLAG_DELTA, one, 1, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_MGET, KFTP_FLAG_PACK, two, 2, 0);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_MGET, 0, NULL, 0, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    // ls takes an optional pattern, followed by an optional page
+    make_command(&command, KFTP_OP_LS, 0, NULL, 0, 0);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_LS, KFTP_FLAG_PAGED, one, 1, 2);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_LS, KFTP_FLAG_PAGED, NULL, 0, 2);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_LS, 0, two, 2, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_LS, KFTP_FLAG_PAGED, two, 2, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    make_command(&command, KFTP_OP_EXIT, 0, NULL, 0, 0);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_EXIT, 0, one, 1, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    // pipelines hold the number of their commands
+    make_command(&command, KFTP_OP_PIPELINE, 0, NULL, 0, 1);
+    ck_assert_int_eq(kftp_command_validate(&command), 0);
+    make_command(&command, KFTP_OP_PIPELINE, 0, NULL, 0, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    // replies and unknown opcodes aren't commands
+    make_command(&command, KFTP_OP_REPLY, 0, NULL, 0, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    make_command(&command, 42, 0, NULL, 0, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+
+    // file names can't be empty or hold 0 bytes
+    char* empty[] = {""};
+    make_command(&command, KFTP_OP_DELETE, 0, empty, 1, 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+    kftp_command_init(&command, KFTP_OP_DELETE, 1, 0);
+    ck_assert_int_eq(kftp_command_add_arg(&command, "foo\0bar", 7), 0);
+    ck_assert_int_lt(kftp_command_validate(&command), 0);
+}
+END_TEST
+
+
+START_TEST(test_command_names_and_format) {
+    ck_assert_int_eq(kftp_command_opcode("get"), KFTP_OP_GET);
+    ck_assert_int_eq(kftp_command_opcode("ls"), KFTP_OP_LS);
+    ck_assert_int_lt(kftp_command_opcode("reply"), 0);
+    ck_assert_int_lt(kftp_command_opcode("foo"), 0);
+    ck_assert_int_eq(kftp_command_flag("-d"), KFTP_FLAG_DELTA);
+    ck_assert_int_eq(kftp_command_flag("-k"), KFTP_FLAG_PACK);
+    ck_assert_int_eq(kftp_command_flag("-x"), 0);
+
+    KftpCommand command;
+    char* one[] = {"foo.txt"};
+    char formatted[64];
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_CONDITIONAL | KFTP_FLAG_DELTA, one, 1, 0);
+    kftp_command_format(&command, formatted, sizeof(formatted));
+    ck_assert_str_eq(formatted, "get -d -c foo.txt");
+
+    make_command(&command, KFTP_OP_LS, KFTP_FLAG_PAGED, NULL, 0, 2);
+    kftp_command_format(&command, formatted, sizeof(formatted));
+    ck_assert_str_eq(formatted, "ls 0 1");
+
+    make_command(&command, KFTP_OP_PIPELINE, 0, NULL, 0, 1);
+    kftp_command_format(&command, formatted, sizeof(formatted));
+    ck_assert_str_eq(formatted, "pipeline 0");
+
+    // output that doesn't fit is cut off
+    make_command(&command, KFTP_OP_DELETE, 0, one, 1, 0);
+    kftp_command_format(&command, formatted, 10);
+    ck_assert_str_eq(formatted, "delete fo");
+}
+END_TEST
+
+
+START_TEST(test_command_is_transfer) {
+    KftpCommand command;
+    char* one[] = {"foo.txt"};
+    make_command(&command, KFTP_OP_GET, KFTP_FLAG_STRIPED, one, 1, 0);
+    ck_assert(kftp_command_is_transfer(&command));
+    make_command(&command, KFTP_OP_MPUT, 0, one, 1, 0);
+    ck_assert(kftp_command_is_transfer(&command));
+
+    // the other commands are answered quickly, so they're only run on the control stream
+    make_command(&command, KFTP_OP_DELETE, 0, one, 1, 0);
+    ck_assert(!kftp_command_is_transfer(&command));
+    make_command(&command, KFTP_OP_LS, 0, NULL, 0, 0);
+    ck_assert(!kftp_command_is_transfer(&command));
+    make_command(&command, KFTP_OP_EXIT, 0, NULL, 0, 0);
+    ck_assert(!kftp_command_is_transfer(&command));
+}
+END_TEST
+
+
+Suite* kftp_command_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpCommand");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_command_round_trip);
+    tcase_add_test(tc_core, test_command_rejects_malformed_messages);
+    tcase_add_test(tc_core, test_command_validation);
+    tcase_add_test(tc_core, test_command_names_and_format);
+    tcase_add_test(tc_core, test_command_is_transfer);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_command_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
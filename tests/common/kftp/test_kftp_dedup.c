@@ -0,0 +1,134 @@
+//
+// Tests for the content-defined chunking used by KFTP deduplicated transfers
+//
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define DATA_SIZE (1024 * 1024)
+
+// Finds the offsets at which `data` is cut into chunks, and returns the number of chunks
+static int find_cuts(const char* data, int data_size, int* cuts) {
+    int count = 0;
+    for (int offset = 0; offset < data_size; count++) {
+        offset += kftp_cdc_chunk(&data[offset], data_size - offset);
+        cuts[count] = offset;
+    }
+    return count;
+}
+
+static char* random_data(int size) {
+    char* data = malloc(size);
+    srand(1);
+    for (int i = 0; i < size; i++)
+        data[i] = (char) rand();
+    return data;
+}
+
+
+START_TEST(test_cdc_chunk_keeps_small_inputs_whole) {
+    char data[KFTP_CDC_MIN_SIZE] = {0,};
+
+    ck_assert_int_eq(kftp_cdc_chunk(data, 0), 0);
+    ck_assert_int_eq(kftp_cdc_chunk(data, 100), 100);
+    ck_assert_int_eq(kftp_cdc_chunk(data, KFTP_CDC_MIN_SIZE), KFTP_CDC_MIN_SIZE);
+}
+END_TEST
+
+
+START_TEST(test_cdc_chunk_sizes_are_bounded) {
+    char* data = random_data(DATA_SIZE);
+    int* cuts = malloc(DATA_SIZE / KFTP_CDC_MIN_SIZE * sizeof(int) + sizeof(int));
+
+    int count = find_cuts(data, DATA_SIZE, cuts);
+    for (int i = 0; i < count - 1; i++) {
+        int size = cuts[i] - (i > 0 ? cuts[i - 1] : 0);
+        ck_assert_int_ge(size, KFTP_CDC_MIN_SIZE);
+        ck_assert_int_le(size, KFTP_CDC_MAX_SIZE);
+    }
+
+    // chunks are normalized around the average size
+    int average = DATA_SIZE / count;
+    ck_assert_int_ge(average, KFTP_CDC_AVG_SIZE / 2);
+    ck_assert_int_le(average, KFTP_CDC_AVG_SIZE * 2);
+
+    // all-zero data never matches the mask, so it is cut at the max size
+    memset(data, 0, DATA_SIZE);
+    ck_assert_int_eq(kftp_cdc_chunk(data, DATA_SIZE), KFTP_CDC_MAX_SIZE);
+
+    free(cuts);
+    free(data);
+}
+END_TEST
+
+
+START_TEST(test_cdc_chunk_boundaries_survive_insertions) {
+    int inserted = 100;
+    char* data = random_data(DATA_SIZE + inserted);
+    char* shifted = malloc(DATA_SIZE + inserted);
+    memcpy(&shifted[inserted], data, DATA_SIZE);
+    memset(shifted, 'x', inserted);
+
+    int max_cuts = DATA_SIZE / KFTP_CDC_MIN_SIZE + 1;
+    int* cuts = malloc(max_cuts * sizeof(int));
+    int* shifted_cuts = malloc(max_cuts * sizeof(int));
+    int count = find_cuts(data, DATA_SIZE, cuts);
+    int shifted_count = find_cuts(shifted, DATA_SIZE + inserted, shifted_cuts);
+
+    // after the first few chunks, the cuts line up again with the original ones (offset by the insertion)
+    int matching = 0;
+    for (int i = 0, j = 0; i < count && j < shifted_count;) {
+        if (cuts[i] + inserted == shifted_cuts[j]) {
+            matching++;
+            i++;
+            j++;
+        } else if (cuts[i] + inserted < shifted_cuts[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    ck_assert_int_ge(matching, count - 3);
+
+    free(shifted_cuts);
+    free(cuts);
+    free(shifted);
+    free(data);
+}
+END_TEST
+
+
+Suite* kftp_dedup_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpDedup");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_cdc_chunk_keeps_small_inputs_whole);
+    tcase_add_test(tc_core, test_cdc_chunk_sizes_are_bounded);
+    tcase_add_test(tc_core, test_cdc_chunk_boundaries_survive_insertions);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_dedup_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
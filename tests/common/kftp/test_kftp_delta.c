@@ -0,0 +1,118 @@
+//
+// Tests for the helpers used by KFTP delta transfers
+//
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_delta.h"
+#include "../../../src/common/reliable_udp/reliable_udp.h"
+#include "../../../src/common/reliable_udp/serde.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+START_TEST(test_rolling_checksum_roll_matches_recomputed_checksum) {
+    char data[64];
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = (char) rand();
+
+    int window = 16;
+    RollingChecksum rolled;
+    rolling_checksum_init(&rolled, data, window);
+
+    for (int i = 1; i + window <= sizeof(data); i++) {
+        rolling_checksum_roll(&rolled, data[i - 1], data[i + window - 1]);
+
+        RollingChecksum expected;
+        rolling_checksum_init(&expected, &data[i], window);
+        ck_assert_uint_eq(rolling_checksum_digest(&rolled), rolling_checksum_digest(&expected));
+    }
+}
+END_TEST
+
+
+START_TEST(test_rolling_checksum_depends_on_byte_order) {
+    char data[] = {1, 2, 3, 4};
+    char swapped[] = {2, 1, 3, 4};
+
+    RollingChecksum checksum, swapped_checksum;
+    rolling_checksum_init(&checksum, data, sizeof(data));
+    rolling_checksum_init(&swapped_checksum, swapped, sizeof(swapped));
+
+    ck_assert_uint_ne(rolling_checksum_digest(&checksum), rolling_checksum_digest(&swapped_checksum));
+}
+END_TEST
+
+
+START_TEST(test_block_size_is_bounded) {
+    ck_assert_int_eq(kftp_delta_block_size(0), KFTP_DELTA_MIN_BLOCK_SIZE);
+    ck_assert_int_eq(kftp_delta_block_size(1000), KFTP_DELTA_MIN_BLOCK_SIZE);
+    ck_assert_int_eq(kftp_delta_block_size(0x7FFFFFFF), KFTP_DELTA_MAX_BLOCK_SIZE);
+}
+END_TEST
+
+
+START_TEST(test_block_size_grows_with_file_size) {
+    // roughly the square root of the file size
+    ck_assert_int_eq(kftp_delta_block_size(4 * 1024 * 1024), 2048);
+}
+END_TEST
+
+
+START_TEST(test_oversized_signature_count_is_rejected) {
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+
+    // the peer claims more blocks than any basis has, which would overflow the size of the signature table
+    char header[8];
+    serialize_int(KFTP_DELTA_MIN_BLOCK_SIZE, header, 4);
+    serialize_int(0x7FFFFFFF, &header[4], 4);
+    RudpMessage message = {.header={.seq_num=1, .data_size=sizeof(header)}, .data=header};
+    char buffer[MAX_PAYLOAD_SIZE];
+    int size = serialize(&message, buffer, MAX_PAYLOAD_SIZE);
+    ck_assert_int_eq(send(fds[1], buffer, size, 0), size);
+
+    SocketInfo socket_info = {.sockfd=fds[0]};
+    RudpSender sender = {.message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+    ck_assert_int_eq(kftp_send_file_delta(NULL, &socket_info, &sender, &receiver), KFTP_DELTA_CORRUPT_ERROR);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+
+Suite* kftp_delta_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpDelta");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_rolling_checksum_roll_matches_recomputed_checksum);
+    tcase_add_test(tc_core, test_rolling_checksum_depends_on_byte_order);
+    tcase_add_test(tc_core, test_block_size_is_bounded);
+    tcase_add_test(tc_core, test_block_size_grows_with_file_size);
+    tcase_add_test(tc_core, test_oversized_signature_count_is_rejected);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_delta_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
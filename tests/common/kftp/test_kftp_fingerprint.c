@@ -0,0 +1,189 @@
+//
+// Tests for the fingerprints used by KFTP conditional transfers, and the index that saves them from being recomputed
+//
+
+// needed for mkdtemp and utimensat
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_fingerprint.h"
+#include "../../../src/common/hash.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static char test_dir[64];
+static char file_path[96];
+static char index_path[96];
+
+static void make_test_dir(void) {
+    strcpy(test_dir, "/tmp/test_kftp_fingerprint_XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(test_dir));
+    snprintf(file_path, sizeof(file_path), "%s/file", test_dir);
+    snprintf(index_path, sizeof(index_path), "%s/index", test_dir);
+}
+
+static void remove_test_dir(void) {
+    remove(file_path);
+    remove(index_path);
+    rmdir(test_dir);
+}
+
+static void write_file(char* path, char* contents) {
+    FILE* f = fopen(path, "w");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_ge(fputs(contents, f), 0);
+    ck_assert_int_eq(fclose(f), 0);
+}
+
+// Sets the modification time of `path`, so a changed file can be made to look unchanged
+static void set_modified(char* path, time_t seconds) {
+    struct timespec times[2] = {{.tv_sec=seconds}, {.tv_sec=seconds}};
+    ck_assert_int_eq(utimensat(AT_FDCWD, path, times, 0), 0);
+}
+
+
+START_TEST(test_unchanged_files_hit_index) {
+    make_test_dir();
+    write_file(file_path, "hello\n");
+    KftpFingerprintIndex index;
+    kftp_fingerprint_index_init(&index);
+
+    KftpFingerprint first, second;
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &first), 0);
+    ck_assert_uint_eq(first.size, 6);
+    ck_assert_uint_eq(first.hash, xxh64("hello\n", 6, 0));
+    ck_assert_uint_eq(index.misses, 1);
+
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &second), 0);
+    ck_assert_uint_eq(index.hits, 1);
+    ck_assert_uint_eq(second.hash, first.hash);
+
+    kftp_fingerprint_index_free(&index);
+    remove_test_dir();
+}
+END_TEST
+
+
+START_TEST(test_changed_files_miss_index) {
+    make_test_dir();
+    write_file(file_path, "hello\n");
+    set_modified(file_path, 1000);
+    KftpFingerprintIndex index;
+    kftp_fingerprint_index_init(&index);
+    KftpFingerprint fingerprint;
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &fingerprint), 0);
+
+    // the same size, but a new modification time
+    write_file(file_path, "world\n");
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &fingerprint), 0);
+    ck_assert_uint_eq(index.misses, 2);
+    ck_assert_uint_eq(fingerprint.hash, xxh64("world\n", 6, 0));
+
+    // a new file (so a new inode) put in its place, even with the same size and modification time
+    char new_path[128];
+    snprintf(new_path, sizeof(new_path), "%s.new", file_path);
+    write_file(new_path, "again\n");
+    set_modified(file_path, 2000);
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &fingerprint), 0);
+    set_modified(new_path, 2000);
+    ck_assert_int_eq(rename(new_path, file_path), 0);
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &fingerprint), 0);
+    ck_assert_uint_eq(index.misses, 4);
+    ck_assert_uint_eq(fingerprint.hash, xxh64("again\n", 6, 0));
+
+    kftp_fingerprint_index_free(&index);
+    remove_test_dir();
+}
+END_TEST
+
+
+START_TEST(test_saved_index_is_loaded) {
+    make_test_dir();
+    write_file(file_path, "hello\n");
+    KftpFingerprintIndex index;
+    kftp_fingerprint_index_init(&index);
+    KftpFingerprint fingerprint;
+    ck_assert_int_eq(kftp_fingerprint_file(&index, file_path, &fingerprint), 0);
+    ck_assert(index.changed);
+    ck_assert_int_eq(kftp_fingerprint_index_save(&index, index_path), 0);
+    ck_assert(!index.changed);
+    kftp_fingerprint_index_free(&index);
+
+    KftpFingerprintIndex loaded;
+    kftp_fingerprint_index_init(&loaded);
+    ck_assert_int_eq(kftp_fingerprint_index_load(&loaded, index_path), 0);
+    ck_assert_int_eq(loaded.count, 1);
+    KftpFingerprint loaded_fingerprint;
+    ck_assert_int_eq(kftp_fingerprint_file(&loaded, file_path, &loaded_fingerprint), 0);
+    ck_assert_uint_eq(loaded.hits, 1);
+    ck_assert_uint_eq(loaded_fingerprint.size, fingerprint.size);
+    ck_assert_uint_eq(loaded_fingerprint.hash, fingerprint.hash);
+
+    // the saved fingerprint has gone stale once the file changes
+    write_file(file_path, "changed\n");
+    ck_assert_int_eq(kftp_fingerprint_file(&loaded, file_path, &loaded_fingerprint), 0);
+    ck_assert_uint_eq(loaded.misses, 1);
+    ck_assert_uint_eq(loaded_fingerprint.hash, xxh64("changed\n", 8, 0));
+
+    kftp_fingerprint_index_free(&loaded);
+    remove_test_dir();
+}
+END_TEST
+
+
+START_TEST(test_invalid_index_is_not_loaded) {
+    make_test_dir();
+    KftpFingerprintIndex index;
+    kftp_fingerprint_index_init(&index);
+
+    // there's nothing to load before the index is first saved
+    ck_assert_int_eq(kftp_fingerprint_index_load(&index, index_path), 0);
+    ck_assert_int_eq(index.count, 0);
+
+    write_file(index_path, "1 2 6 1000 0 abc file\nnot an entry\n");
+    ck_assert_int_lt(kftp_fingerprint_index_load(&index, index_path), 0);
+    ck_assert_int_eq(index.count, 0);
+
+    kftp_fingerprint_index_free(&index);
+    remove_test_dir();
+}
+END_TEST
+
+
+Suite* kftp_fingerprint_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpFingerprint");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_unchanged_files_hit_index);
+    tcase_add_test(tc_core, test_changed_files_miss_index);
+    tcase_add_test(tc_core, test_saved_index_is_loaded);
+    tcase_add_test(tc_core, test_invalid_index_is_not_loaded);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_fingerprint_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
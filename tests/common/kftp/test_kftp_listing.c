@@ -0,0 +1,167 @@
+//
+// Tests for the filters used by KFTP directory listings
+//
+
+// needed for mkdtemp
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp_listing.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+START_TEST(test_list_filter_without_pattern_matches_everything) {
+    KftpListFilter filter;
+    kftp_list_filter_init(&filter, NULL, 10, 20);
+
+    ck_assert_int_eq(filter.offset, 10);
+    ck_assert_int_eq(filter.limit, 20);
+    ck_assert(kftp_list_matches(&filter, "foo"));
+    ck_assert(kftp_list_matches(&filter, ".hidden"));
+}
+END_TEST
+
+
+START_TEST(test_list_filter_detects_prefix_patterns) {
+    KftpListFilter filter;
+
+    kftp_list_filter_init(&filter, "log-*", 0, KFTP_LIST_UNLIMITED);
+    ck_assert_int_eq(filter.prefix_length, 4);
+    ck_assert(kftp_list_matches(&filter, "log-"));
+    ck_assert(kftp_list_matches(&filter, "log-2021.txt"));
+    ck_assert(!kftp_list_matches(&filter, "log"));
+    ck_assert(!kftp_list_matches(&filter, "old-log-2021.txt"));
+
+    kftp_list_filter_init(&filter, "*", 0, KFTP_LIST_UNLIMITED);
+    ck_assert_int_eq(filter.prefix_length, 0);
+    ck_assert(kftp_list_matches(&filter, "anything"));
+
+    // patterns with other wildcards (or no trailing '*') need full glob matching
+    kftp_list_filter_init(&filter, "log-?*", 0, KFTP_LIST_UNLIMITED);
+    ck_assert_int_eq(filter.prefix_length, -1);
+    kftp_list_filter_init(&filter, "log-\\*", 0, KFTP_LIST_UNLIMITED);
+    ck_assert_int_eq(filter.prefix_length, -1);
+    kftp_list_filter_init(&filter, "log", 0, KFTP_LIST_UNLIMITED);
+    ck_assert_int_eq(filter.prefix_length, -1);
+}
+END_TEST
+
+
+START_TEST(test_list_filter_matches_globs) {
+    KftpListFilter filter;
+
+    kftp_list_filter_init(&filter, "*.txt", 0, KFTP_LIST_UNLIMITED);
+    ck_assert(kftp_list_matches(&filter, "notes.txt"));
+    ck_assert(!kftp_list_matches(&filter, "notes.txt.gz"));
+
+    kftp_list_filter_init(&filter, "part-[0-9]?", 0, KFTP_LIST_UNLIMITED);
+    ck_assert(kftp_list_matches(&filter, "part-1a"));
+    ck_assert(!kftp_list_matches(&filter, "part-a1"));
+
+    // an exact name only matches itself
+    kftp_list_filter_init(&filter, "log", 0, KFTP_LIST_UNLIMITED);
+    ck_assert(kftp_list_matches(&filter, "log"));
+    ck_assert(!kftp_list_matches(&filter, "log-1"));
+}
+END_TEST
+
+
+// Names collected by a listing visitor
+typedef struct {
+    char names[8][16];
+    int count;
+} VisitedNames;
+
+static int visit_name(char* name, void* context) {
+    VisitedNames* visited = context;
+    if (visited->count == 8)
+        return -1;
+    strcpy(visited->names[visited->count++], name);
+    return 0;
+}
+
+static int list_names(DirIndex* index, char* pattern, long offset, long limit, VisitedNames* visited) {
+    KftpListFilter filter;
+    kftp_list_filter_init(&filter, pattern, offset, limit);
+    *visited = (VisitedNames) {};
+    return kftp_list_names(index, &filter, visit_name, visited);
+}
+
+START_TEST(test_list_names_selects_pages_in_order) {
+    char test_dir[] = "/tmp/test_kftp_listing_XXXXXX";
+    ck_assert_ptr_nonnull(mkdtemp(test_dir));
+    char* files[] = {"b.txt", "a.txt", "c.log", "d.txt"};
+    for (int i = 0; i < 4; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", test_dir, files[i]);
+        FILE* f = fopen(path, "w");
+        ck_assert_ptr_nonnull(f);
+        fclose(f);
+    }
+
+    DirIndex index;
+    ck_assert_int_eq(dir_index_init(&index, test_dir), 0);
+    VisitedNames visited;
+
+    ck_assert_int_eq(list_names(&index, NULL, 0, KFTP_LIST_UNLIMITED, &visited), KFTP_LIST_DONE);
+    ck_assert_int_eq(visited.count, 4);
+    ck_assert_str_eq(visited.names[0], "a.txt");
+    ck_assert_str_eq(visited.names[3], "d.txt");
+
+    // the listing stops at the limit, and says whether more names match
+    ck_assert_int_eq(list_names(&index, "*.txt", 1, 1, &visited), KFTP_LIST_MORE);
+    ck_assert_int_eq(visited.count, 1);
+    ck_assert_str_eq(visited.names[0], "b.txt");
+    ck_assert_int_eq(list_names(&index, "*.txt", 1, 2, &visited), KFTP_LIST_DONE);
+    ck_assert_int_eq(visited.count, 2);
+    ck_assert_str_eq(visited.names[1], "d.txt");
+
+    ck_assert_int_eq(list_names(&index, "c*", 0, KFTP_LIST_UNLIMITED, &visited), KFTP_LIST_DONE);
+    ck_assert_int_eq(visited.count, 1);
+    ck_assert_str_eq(visited.names[0], "c.log");
+
+    dir_index_free(&index);
+    for (int i = 0; i < 4; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", test_dir, files[i]);
+        remove(path);
+    }
+    rmdir(test_dir);
+}
+END_TEST
+
+
+Suite* kftp_listing_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpListing");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_list_filter_without_pattern_matches_everything);
+    tcase_add_test(tc_core, test_list_filter_detects_prefix_patterns);
+    tcase_add_test(tc_core, test_list_filter_matches_globs);
+    tcase_add_test(tc_core, test_list_names_selects_pages_in_order);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_listing_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
@@ -0,0 +1,206 @@
+//
+// Tests for the Merkle trees used by KFTP Merkle-verified transfers
+//
+
+// needed for pwrite and clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../../src/common/kftp/kftp.h"
+#include "../../../src/common/kftp/kftp_merkle.h"
+#include "../../../src/common/hash.h"
+#include "../../../src/common/reliable_udp/reliable_udp.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// a few full blocks and a partial one, so the tree has a node without a sibling
+#define DATA_SIZE (5 * KFTP_MERKLE_BLOCK_SIZE + 100)
+#define BLOCK_COUNT 6
+
+static char* random_data(int size) {
+    char* data = malloc(size);
+    srand(1);
+    for (int i = 0; i < size; i++)
+        data[i] = (char) rand();
+    return data;
+}
+
+// Returns a temporary file holding `data`, which is removed once it is closed
+static FILE* temp_file(char* data, int size) {
+    FILE* f = tmpfile();
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fwrite(data, 1, size, f), size);
+    ck_assert_int_eq(fflush(f), 0);
+    return f;
+}
+
+typedef struct {
+    FILE* file;
+    int sockfd;
+    int status;
+} SendJob;
+
+static void* send_file(void* arg) {
+    SendJob* job = arg;
+    SocketInfo socket_info = {.sockfd=job->sockfd};
+    RudpSender sender = {.message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+    job->status = kftp_send_file_merkle(job->file, &socket_info, &sender, &receiver);
+    return NULL;
+}
+
+
+START_TEST(test_merkle_block_size_bounds_block_count) {
+    ck_assert_int_eq(kftp_merkle_block_size(0), KFTP_MERKLE_BLOCK_SIZE);
+    ck_assert_int_eq(kftp_merkle_block_size(DATA_SIZE), KFTP_MERKLE_BLOCK_SIZE);
+
+    uint64_t max_size = (uint64_t) KFTP_MERKLE_BLOCK_SIZE * KFTP_MERKLE_MAX_BLOCKS;
+    ck_assert_int_eq(kftp_merkle_block_size(max_size), KFTP_MERKLE_BLOCK_SIZE);
+    ck_assert_int_eq(kftp_merkle_block_size(max_size + 1), 2 * KFTP_MERKLE_BLOCK_SIZE);
+
+    // a 500 GB file
+    uint64_t large_size = 500ULL * 1000 * 1000 * 1000;
+    int block_size = kftp_merkle_block_size(large_size);
+    ck_assert_uint_le((large_size + block_size - 1) / block_size, KFTP_MERKLE_MAX_BLOCKS);
+}
+END_TEST
+
+
+START_TEST(test_merkle_root_combines_leaves) {
+    uint64_t leaves[3] = {1, 2, 3};
+
+    ck_assert_uint_eq(kftp_merkle_root(leaves, 1), 1);
+
+    uint64_t pair = xxh64((char*) leaves, 2 * sizeof(uint64_t), 1);
+    ck_assert_uint_eq(kftp_merkle_root(leaves, 2), pair);
+
+    // the third leaf has no sibling, so it's combined with the root of the first two
+    uint64_t top[2] = {pair, 3};
+    ck_assert_uint_eq(kftp_merkle_root(leaves, 3), xxh64((char*) top, sizeof(top), 1));
+
+    // any change to a leaf changes the root
+    leaves[2] = 4;
+    ck_assert_uint_ne(kftp_merkle_root(leaves, 3), xxh64((char*) top, sizeof(top), 1));
+}
+END_TEST
+
+
+START_TEST(test_merkle_hash_blocks_hashes_each_block) {
+    char* data = random_data(DATA_SIZE);
+    FILE* f = temp_file(data, DATA_SIZE);
+
+    uint64_t leaves[BLOCK_COUNT];
+    ck_assert_int_eq(kftp_merkle_hash_blocks(fileno(f), DATA_SIZE, KFTP_MERKLE_BLOCK_SIZE, leaves), 0);
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        int offset = i * KFTP_MERKLE_BLOCK_SIZE;
+        int length = DATA_SIZE - offset < KFTP_MERKLE_BLOCK_SIZE ? DATA_SIZE - offset : KFTP_MERKLE_BLOCK_SIZE;
+        ck_assert_uint_eq(leaves[i], xxh64(&data[offset], length, 0));
+    }
+
+    // the file is shorter than claimed
+    ck_assert_int_lt(kftp_merkle_hash_blocks(fileno(f), DATA_SIZE + KFTP_MERKLE_BLOCK_SIZE, KFTP_MERKLE_BLOCK_SIZE,
+                                             leaves), 0);
+
+    fclose(f);
+    free(data);
+}
+END_TEST
+
+
+START_TEST(test_merkle_verify_detects_changed_byte) {
+    char* data = random_data(DATA_SIZE);
+    FILE* f = temp_file(data, DATA_SIZE);
+
+    uint64_t leaves[BLOCK_COUNT];
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        int offset = i * KFTP_MERKLE_BLOCK_SIZE;
+        int length = DATA_SIZE - offset < KFTP_MERKLE_BLOCK_SIZE ? DATA_SIZE - offset : KFTP_MERKLE_BLOCK_SIZE;
+        leaves[i] = xxh64(&data[offset], length, 0);
+    }
+    uint64_t root = kftp_merkle_root(leaves, BLOCK_COUNT);
+    ck_assert_int_eq(kftp_merkle_verify(fileno(f), root), 0);
+
+    char flipped = (char) ~data[3 * KFTP_MERKLE_BLOCK_SIZE + 7];
+    ck_assert_int_eq(pwrite(fileno(f), &flipped, 1, 3 * KFTP_MERKLE_BLOCK_SIZE + 7), 1);
+    ck_assert_int_eq(kftp_merkle_verify(fileno(f), root), KFTP_INTEGRITY_ERROR);
+
+    fclose(f);
+    free(data);
+}
+END_TEST
+
+
+START_TEST(test_merkle_write_error_is_reported_to_sender) {
+    char* data = random_data(DATA_SIZE);
+    FILE* source = temp_file(data, DATA_SIZE);
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SendJob job = {.file=source, .sockfd=fds[0]};
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, send_file, &job), 0);
+
+    // blocks can't be written to a file that's only open for reading
+    FILE* copy = fopen("/dev/null", "r");
+    ck_assert_ptr_nonnull(copy);
+    SocketInfo socket_info = {.sockfd=fds[1]};
+    RudpSender sender = {.message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+    ck_assert_int_lt(kftp_recv_file_merkle(copy, &socket_info, &sender, &receiver), 0);
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // the sender is told the file was refused, rather than giving up on the receiver once it stops answering
+    ck_assert_int_lt(job.status, 0);
+    long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    ck_assert_int_lt(elapsed, DEAD_PEER_MIN_TIMEOUT);
+
+    fclose(source);
+    fclose(copy);
+    close(fds[0]);
+    close(fds[1]);
+    free(data);
+}
+END_TEST
+
+
+Suite* kftp_merkle_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("KftpMerkle");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_merkle_block_size_bounds_block_count);
+    tcase_add_test(tc_core, test_merkle_root_combines_leaves);
+    tcase_add_test(tc_core, test_merkle_hash_blocks_hashes_each_block);
+    tcase_add_test(tc_core, test_merkle_verify_detects_changed_byte);
+    tcase_add_test(tc_core, test_merkle_write_error_is_reported_to_sender);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = kftp_merkle_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
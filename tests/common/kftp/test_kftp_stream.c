@@ -0,0 +1,108 @@
+//
+// Tests for the KFTP stream, which packs data written to it into full RUDP messages
+//
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <string.h>
+
+#include "../../mocks/reliable_udp_mocks.h"
+#include "../../../src/common/kftp/kftp_stream.h"
+#include "../../../src/common/reliable_udp/reliable_udp.h"
+
+
+#define RUDP_SEND_SUCCESS 0
+
+
+static void test_kftp_stream_packs_small_writes_into_one_message(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .sender=&sender, .receiver=&receiver};
+
+    char expected_data[] = {0, 0, 0, 1, 'a', 'b', 'c', 0, 0, 1, 0};
+    check_rudp_send(expected_data, sizeof(expected_data), RUDP_SEND_SUCCESS);
+
+    assert_int_equal(kftp_stream_write_int(&stream, 1), 0);
+    assert_int_equal(kftp_stream_write(&stream, "abc", 3), 0);
+    assert_int_equal(kftp_stream_write_int(&stream, 256), 0);
+    assert_int_equal(kftp_stream_flush(&stream), 0);
+}
+
+static void test_kftp_stream_sends_full_messages(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .sender=&sender, .receiver=&receiver};
+
+    char data[MAX_DATA_SIZE + 10];
+    memset(data, 0x41, MAX_DATA_SIZE);
+    memset(&data[MAX_DATA_SIZE], 0x42, 10);
+
+    check_rudp_send(data, MAX_DATA_SIZE, RUDP_SEND_SUCCESS);
+    check_rudp_send(&data[MAX_DATA_SIZE], 10, RUDP_SEND_SUCCESS);
+
+    assert_int_equal(kftp_stream_write(&stream, data, sizeof(data)), 0);
+    assert_int_equal(kftp_stream_flush(&stream), 0);
+}
+
+static void test_kftp_stream_flush_without_data_sends_nothing(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .sender=&sender, .receiver=&receiver};
+
+    assert_int_equal(kftp_stream_flush(&stream), 0);
+}
+
+static void test_kftp_stream_reads_across_messages(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {};
+    KftpStream stream = {.socket_info=&socket_info, .receiver=&receiver};
+
+    char first_message[] = {0, 0, 1};
+    char second_message[] = {2, 'x', 'y'};
+    set_rudp_recv_buffer(first_message, sizeof(first_message), sizeof(first_message));
+    set_rudp_recv_buffer(second_message, sizeof(second_message), sizeof(second_message));
+
+    int value = 0;
+    char rest[2] = {};
+    assert_int_equal(kftp_stream_read_int(&stream, &value), 0);
+    assert_int_equal(value, 258);
+    assert_int_equal(kftp_stream_read(&stream, rest, sizeof(rest)), 0);
+    assert_memory_equal(rest, "xy", 2);
+}
+
+static void test_kftp_stream_uint64_round_trips(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {};
+    RudpReceiver receiver = {};
+    KftpStream write_stream = {.socket_info=&socket_info, .sender=&sender, .receiver=&receiver};
+    KftpStream read_stream = {.socket_info=&socket_info, .receiver=&receiver};
+
+    // values larger than an int, such as offsets into large files, are sent as two big-endian ints
+    char expected_data[] = {0, 0, 0, 1, 0x80, 0, 0, 2};
+    check_rudp_send(expected_data, sizeof(expected_data), RUDP_SEND_SUCCESS);
+    assert_int_equal(kftp_stream_write_uint64(&write_stream, 0x180000002), 0);
+    assert_int_equal(kftp_stream_flush(&write_stream), 0);
+
+    set_rudp_recv_buffer(expected_data, sizeof(expected_data), sizeof(expected_data));
+    uint64_t value = 0;
+    assert_int_equal(kftp_stream_read_uint64(&read_stream, &value), 0);
+    assert_true(value == 0x180000002);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test(test_kftp_stream_packs_small_writes_into_one_message),
+            cmocka_unit_test(test_kftp_stream_sends_full_messages),
+            cmocka_unit_test(test_kftp_stream_flush_without_data_sends_nothing),
+            cmocka_unit_test(test_kftp_stream_reads_across_messages),
+            cmocka_unit_test(test_kftp_stream_uint64_round_trips),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -13,7 +13,9 @@
 
 #include "../../mocks/mocks.h"
 #include "../../../src/common/reliable_udp/reliable_udp.h"
+#include "../../../src/common/reliable_udp/rudp_mux.h"
 #include "../../../src/common/reliable_udp/serde.h"
+#include "../../../src/common/utils.h"
 
 
 #define SENDTO_SUCCESS 1
@@ -43,6 +45,8 @@ static void test_rudp_send_succeeds_with_ack(void** state) {
     int result = rudp_send(buffer, buffer_len, &socket_info, &sender, &receiver);
     assert_int_equal(result, 0);
     assert_int_equal(sender.last_ack, 1);
+    // the message was acked on its first attempt, so it was timed
+    assert_true(sender.srtt > 0);
 }
 
 static void test_rudp_send_succeeds_despite_message_loss(void** state) {
@@ -86,8 +90,8 @@ static void test_rudp_send_large_message(void** state) {
 
     // mocked recvfrom response
     RudpHeader received_headers[2] = {
-            {.ack_num=1},
-            {.ack_num=2},
+            {.ack_num=1, .window=SOCKET_RECEIVE_WINDOW},
+            {.ack_num=2, .window=SOCKET_RECEIVE_WINDOW},
     };
     char* received_buffers[2] = {
             (char[MAX_PAYLOAD_SIZE]) {0,},
@@ -184,9 +188,9 @@ static void test_rudp_acks_previous_messages(void** state) {
     serialize_header(&old_msg_header, old_msg_buffer, buffer_len);
     set_recvfrom_buffer(old_msg_buffer, buffer_len, RECVFROM_SUCCESS);
 
-    RudpHeader old_msg_ack_header = {.ack_num=5};
+    RudpHeader old_msg_ack_header = {.ack_num=5, .window=SOCKET_RECEIVE_WINDOW};
     char old_msg_ack_buffer[100] = {0,};
-    serialize_header(&old_msg_ack_header, old_msg_ack_buffer, buffer_len);
+    serialize(&(RudpMessage) {.header=old_msg_ack_header}, old_msg_ack_buffer, buffer_len);
     check_sendto(old_msg_ack_buffer, buffer_len, SENDTO_SUCCESS);
 
     // mocked resend and ack
@@ -216,9 +220,9 @@ static void test_rudp_recv_acks_on_receipt(void** state) {
     serialize_header(&recvfrom_header, recvfrom_buffer, buffer_len);
     set_recvfrom_buffer(recvfrom_buffer, buffer_len, RECVFROM_SUCCESS);
 
-    RudpHeader expected_sent_header = {.seq_num=0, .ack_num=1, .data_size=0};
+    RudpHeader expected_sent_header = {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW};
     char expected_sent_buffer[100] = {0,};
-    int serialized = serialize_header(&expected_sent_header, expected_sent_buffer, buffer_len);
+    int serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, buffer_len);
     // mocks sendto, but also checks that the buffer sendto received is equal to expected_sent_buffer
     check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
 
@@ -253,15 +257,15 @@ static void test_rudp_recv_acks_previous_requests(void** state) {
     }
 
     RudpHeader expected_sent_headers[2] = {
-            {.seq_num=0, .ack_num=1, .data_size=0},
-            {.seq_num=0, .ack_num=2, .data_size=0},
+            {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+            {.seq_num=0, .ack_num=2, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
     };
     char* expected_sent_buffers[2] = {
             (char[100]) {0,},
             (char[100]) {0,},
     };
     for (int i = 0; i < 2; i++) {
-        int serialized = serialize_header(&expected_sent_headers[i], expected_sent_buffers[i], buffer_len);
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i], buffer_len);
         check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
     }
 
@@ -295,9 +299,9 @@ static void test_rudp_recv_does_not_ack_future_requests(void** state) {
         set_recvfrom_buffer(received_buffers[i], serialized, RECVFROM_SUCCESS);
     }
 
-    RudpHeader expected_sent_header ={.seq_num=0, .ack_num=1, .data_size=0};
+    RudpHeader expected_sent_header ={.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW};
     char expected_sent_buffer[100] = {0,};
-    int serialized = serialize_header(&expected_sent_header, expected_sent_buffer, buffer_len);
+    int serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, buffer_len);
     check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
 
     int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
@@ -320,9 +324,9 @@ static void test_rudp_recv_puts_data_in_buffer(void** state) {
     strcpy(&recvfrom_buffer[serialized], test_string);
     set_recvfrom_buffer(recvfrom_buffer, buffer_len, RECVFROM_SUCCESS);
 
-    RudpHeader expected_sent_header = {.seq_num=0, .ack_num=1, .data_size=0};
+    RudpHeader expected_sent_header = {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW};
     char expected_sent_buffer[100] = {};
-    serialized = serialize_header(&expected_sent_header, expected_sent_buffer, buffer_len);
+    serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, buffer_len);
     // mocks sendto, but also checks that the buffer sendto received is equal to expected_sent_buffer
     check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
 
@@ -333,6 +337,543 @@ static void test_rudp_recv_puts_data_in_buffer(void** state) {
     assert_string_equal(buffer, test_string);
 }
 
+static void test_rudp_recv_drops_corrupted_messages(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=0};
+    char* test_string = "hello world!";
+
+    // mocked recvfrom messages
+    //
+    // the first copy of the message is corrupted in transit, so it should be neither acked nor returned. The
+    // retransmitted copy arrives intact.
+    char data[100] = {};
+    strcpy(data, test_string);
+    RudpMessage message = {.header={.seq_num=1, .data_size=strlen(test_string)+1}, .data=data};
+    char* received_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++)
+        serialize(&message, received_buffers[i], buffer_len);
+    received_buffers[0][HEADER_SIZE] ^= 0x01;
+    for (int i = 0; i < 2; i++)
+        set_recvfrom_buffer(received_buffers[i], buffer_len, RECVFROM_SUCCESS);
+
+    RudpHeader expected_sent_header = {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW};
+    char expected_sent_buffer[100] = {};
+    int serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, buffer_len);
+    check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+
+    assert_int_equal(result, strlen(test_string)+1);
+    assert_int_equal(receiver.last_received, 1);
+    assert_string_equal(buffer, test_string);
+}
+
+static void test_rudp_recv_answers_fin(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=3};
+
+    // mocked recvfrom messages
+    //
+    // the sender finishes the previous exchange before starting the next one
+    RudpHeader received_headers[2] = {
+            {.seq_num=FIN_SEQ_NUM, .ack_num=3},
+            {.seq_num=4},
+    };
+    char* received_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize_header(&received_headers[i], received_buffers[i], buffer_len);
+        set_recvfrom_buffer(received_buffers[i], serialized, RECVFROM_SUCCESS);
+    }
+
+    RudpHeader expected_sent_headers[2] = {
+            {.seq_num=FIN_ACK_SEQ_NUM, .ack_num=0, .data_size=0},
+            {.seq_num=0, .ack_num=4, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i], buffer_len);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+
+    assert_int_equal(result, 0);
+    assert_int_equal(receiver.last_received, 4);
+}
+
+static void test_rudp_send_treats_fin_as_ack(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpSender sender = {.last_ack=0, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+
+    set_poll_rc(POLL_READY);
+
+    // the ack for the message was lost, but the FIN that followed it arrived
+    RudpHeader recvfrom_header = {.seq_num=FIN_SEQ_NUM, .ack_num=1};
+    char recvfrom_buffer[100] = {0,};
+    int serialized = serialize_header(&recvfrom_header, recvfrom_buffer, buffer_len);
+    set_recvfrom_buffer(recvfrom_buffer, serialized, RECVFROM_SUCCESS);
+
+    RudpMessage expected_sent_messages[2] = {
+            {.header=(RudpHeader) {.seq_num=1, .ack_num=0, .data_size=buffer_len}, .data=buffer},
+            {.header=(RudpHeader) {.seq_num=FIN_ACK_SEQ_NUM, .ack_num=0, .data_size=0}},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        serialized = serialize(&expected_sent_messages[i], expected_sent_buffers[i], MAX_PAYLOAD_SIZE);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_send(buffer, buffer_len, &socket_info, &sender, &receiver);
+    assert_int_equal(result, 0);
+    assert_int_equal(sender.last_ack, 1);
+}
+
+static void test_rudp_finish_returns_on_fin_ack(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=5};
+
+    set_poll_rc(POLL_READY);
+
+    RudpHeader recvfrom_header = {.seq_num=FIN_ACK_SEQ_NUM};
+    char recvfrom_buffer[100] = {0,};
+    int serialized = serialize_header(&recvfrom_header, recvfrom_buffer, sizeof(recvfrom_buffer));
+    set_recvfrom_buffer(recvfrom_buffer, serialized, RECVFROM_SUCCESS);
+
+    // the FIN acks the last message received
+    RudpHeader expected_sent_header = {.seq_num=FIN_SEQ_NUM, .ack_num=5, .data_size=0, .window=SOCKET_RECEIVE_WINDOW};
+    char expected_sent_buffer[100] = {0,};
+    serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, sizeof(expected_sent_buffer));
+    check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
+
+    int result = rudp_finish(&socket_info, &receiver);
+    assert_int_equal(result, 0);
+}
+
+static void test_rudp_finish_acks_resent_messages(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=5};
+
+    // the first FIN is lost, so the peer resends its last message before the second FIN is answered
+    will_return_count(poll, POLL_READY, 2);
+    RudpHeader received_headers[2] = {
+            {.seq_num=5},
+            {.seq_num=FIN_ACK_SEQ_NUM},
+    };
+    char* received_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize_header(&received_headers[i], received_buffers[i], 100);
+        set_recvfrom_buffer(received_buffers[i], serialized, RECVFROM_SUCCESS);
+    }
+
+    RudpHeader expected_sent_headers[3] = {
+            {.seq_num=FIN_SEQ_NUM, .ack_num=5, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+            {.seq_num=0, .ack_num=5, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+            {.seq_num=FIN_SEQ_NUM, .ack_num=5, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* expected_sent_buffers[3] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 3; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i], 100);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_finish(&socket_info, &receiver);
+    assert_int_equal(result, 0);
+}
+
+static void test_rudp_finish_gives_up_on_silent_peers(void** state) {
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=5};
+
+    set_sendto_rc(SENDTO_SUCCESS);
+    set_poll_rc(POLL_NOT_READY);
+
+    int result = rudp_finish(&socket_info, &receiver);
+    assert_int_equal(result, 0);
+}
+
+static void test_rudp_recv_keeps_messages_for_other_streams(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    RudpMux mux;
+    rudp_mux_init(&mux, 999, true);
+    SocketInfo socket_info = {.sockfd=999, .mux=&mux};
+    RudpReceiver control_receiver = {};
+    RudpReceiver stream_receiver = {.stream_id=5};
+
+    // mocked recvfrom messages
+    //
+    // the peer opens stream 5, then sends a stray message for a stream that isn't open, and then sends on the control
+    // stream
+    RudpHeader received_headers[3] = {
+            {.seq_num=1, .data_size=1, .stream_id=5},
+            {.seq_num=2, .stream_id=9},
+            {.seq_num=1, .stream_id=RUDP_CONTROL_STREAM},
+    };
+    char* received_buffers[3] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    will_return_count(poll, POLL_READY, 3);
+    for (int i = 0; i < 3; i++) {
+        char data[1] = {'x'};
+        int serialized = serialize(&(RudpMessage) {.header=received_headers[i], .data=data}, received_buffers[i],
+                                   buffer_len);
+        set_recvfrom_buffer(received_buffers[i], serialized, serialized);
+    }
+
+    // only the messages on open streams are acked, each on its own stream, once they've been taken off its queue
+    RudpHeader expected_sent_headers[2] = {
+            {.seq_num=0, .ack_num=1, .data_size=0, .stream_id=RUDP_CONTROL_STREAM,
+                    .window=RUDP_MUX_QUEUE_SIZE * MAX_DATA_SIZE},
+            {.seq_num=0, .ack_num=1, .data_size=0, .stream_id=5, .window=RUDP_MUX_QUEUE_SIZE * MAX_DATA_SIZE},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i],
+                                   buffer_len);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    assert_int_equal(rudp_recv(buffer, buffer_len, &socket_info, &control_receiver), 0);
+    assert_int_equal(control_receiver.last_received, 1);
+
+    // the message on stream 5 was kept for it, so it's received without reading the socket again
+    assert_int_equal(rudp_mux_accept(&mux, NULL), 5);
+    assert_int_equal(rudp_recv(buffer, buffer_len, &socket_info, &stream_receiver), 1);
+    assert_int_equal(stream_receiver.last_received, 1);
+    assert_int_equal(buffer[0], 'x');
+
+    rudp_mux_free(&mux);
+}
+
+static void test_rudp_send_waits_for_window_update(void** state) {
+    char buffer[MAX_DATA_SIZE+1] = {0,};
+    int buffer_len = MAX_DATA_SIZE+1;
+    struct sockaddr_in addr = {.sin_port=8080, .sin_addr=0x7F000001, .sin_family=AF_INET};
+    SocketInfo socket_info = {.addr=(struct sockaddr*) &addr, .addr_len=sizeof(addr), .sockfd=999};
+    RudpSender sender = {.last_ack=0, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {};
+
+    will_return_count(poll, POLL_READY, 3);
+
+    // mocked recvfrom responses
+    //
+    // the first chunk is acked with a closed window, so the second chunk is only sent once the receiver re-sends the
+    // ack with room in its window
+    RudpHeader received_headers[3] = {
+            {.ack_num=1, .window=0},
+            {.ack_num=1, .window=SOCKET_RECEIVE_WINDOW},
+            {.ack_num=2, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* received_buffers[3] = {
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+    };
+    for (int i = 0; i < 3; i++) {
+        int serialized = serialize_header(&received_headers[i], received_buffers[i], MAX_PAYLOAD_SIZE);
+        set_recvfrom_buffer(received_buffers[i], serialized, RECVFROM_SUCCESS);
+    }
+
+    // each chunk is only sent once
+    set_sendto_rc_count(SENDTO_SUCCESS, 2);
+
+    int result = rudp_send(buffer, buffer_len, &socket_info, &sender, &receiver);
+    assert_int_equal(result, 0);
+    assert_int_equal(sender.last_ack, 2);
+    assert_int_equal(sender.window, SOCKET_RECEIVE_WINDOW);
+}
+
+static void test_rudp_recv_sends_window_update(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    struct sockaddr_in addr = {.sin_port=8080, .sin_addr=0x7F000001, .sin_family=AF_INET};
+    SocketInfo socket_info = {.addr=(struct sockaddr*) &addr, .addr_len=sizeof(addr), .sockfd=999};
+    // the last ack closed the window
+    RudpReceiver receiver = {.last_received=1, .window_closed=true};
+
+    // mocked recvfrom message
+    RudpHeader recvfrom_header = {.seq_num=2};
+    char recvfrom_buffer[100] = {0,};
+    serialize_header(&recvfrom_header, recvfrom_buffer, buffer_len);
+    set_recvfrom_buffer(recvfrom_buffer, buffer_len, RECVFROM_SUCCESS);
+
+    // the last ack is sent again with the reopened window before the next message is received and acked
+    RudpHeader expected_sent_headers[2] = {
+            {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+            {.seq_num=0, .ack_num=2, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i],
+                                   buffer_len);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+    assert_int_equal(result, 0);
+    assert_int_equal(receiver.last_received, 2);
+    assert_false(receiver.window_closed);
+}
+
+static void test_rudp_send_gives_up_on_dead_peer(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    // the round trip time is known from earlier messages
+    RudpSender sender = {.last_ack=0, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT, .srtt=1000};
+    RudpReceiver receiver = {};
+
+    // the message (and the probes sent along with it) are never answered
+    will_return_always(sendto, 0);
+    will_return_always(poll, POLL_NOT_READY);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    int result = rudp_send(buffer, buffer_len, &socket_info, &sender, &receiver);
+    gettimeofday(&end, NULL);
+    assert_int_equal(result, PEER_DEAD_ERROR);
+    assert_true(elapsed_time(&start, &end) < SENDER_TIMEOUT);
+}
+
+static void test_rudp_recv_times_out(void** state) {
+    char buffer[100] = {0,};
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.receive_timeout=50};
+
+    will_return_always(poll, POLL_NOT_READY);
+
+    int result = rudp_recv(buffer, sizeof(buffer), &socket_info, &receiver);
+    assert_int_equal(result, RECEIVER_TIMEOUT_ERROR);
+}
+
+static void test_rudp_recv_gives_up_on_dead_peer(void** state) {
+    char buffer[100] = {0,};
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.keepalive=true};
+
+    // the probes are never answered
+    will_return_always(sendto, 0);
+    will_return_always(poll, POLL_NOT_READY);
+
+    int result = rudp_recv(buffer, sizeof(buffer), &socket_info, &receiver);
+    assert_int_equal(result, PEER_DEAD_ERROR);
+}
+
+static void test_rudp_recv_answers_probes(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {};
+
+    // the sender probes us before sending its message
+    RudpHeader received_headers[2] = {
+            {.seq_num=PROBE_SEQ_NUM},
+            {.seq_num=1},
+    };
+    char* received_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=received_headers[i]}, received_buffers[i], buffer_len);
+        set_recvfrom_buffer(received_buffers[i], serialized, serialized);
+    }
+
+    RudpHeader expected_sent_headers[2] = {
+            {.seq_num=PROBE_ACK_SEQ_NUM, .ack_num=0, .data_size=0},
+            {.seq_num=0, .ack_num=1, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        int serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i],
+                                   buffer_len);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+    assert_int_equal(result, 0);
+    assert_int_equal(receiver.last_received, 1);
+}
+
+static void test_cancelled_transfers_stop(void** state) {
+    char buffer[100] = {0,};
+    SocketInfo socket_info = {};
+    RudpCancel cancel = {};
+    RudpSender sender = {.last_ack=0, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT,
+                         .cancel=&cancel};
+    RudpReceiver receiver = {.cancel=&cancel};
+
+    assert_false(rudp_is_cancelled(&cancel));
+    assert_false(rudp_is_cancelled(NULL));
+    rudp_cancel(&cancel);
+    assert_true(rudp_is_cancelled(&cancel));
+
+    // nothing is sent or received once cancelled
+    assert_int_equal(rudp_send(buffer, sizeof(buffer), &socket_info, &sender, &receiver), CANCELLED_ERROR);
+    assert_int_equal(rudp_recv(buffer, sizeof(buffer), &socket_info, &receiver), CANCELLED_ERROR);
+}
+
+// Helper function that serializes an abort of the exchange into `buffer`, returning its size
+static int serialize_abort(int seq_num, int number, int last_ack, int last_received, char* buffer, int buffer_len) {
+    char data[12];
+    serialize_int(number, data, 12);
+    serialize_int(last_ack, &data[4], 8);
+    serialize_int(last_received, &data[8], 4);
+    RudpMessage message = {.header=(RudpHeader) {.seq_num=seq_num, .ack_num=EMPTY_ACK_NUM, .data_size=12},
+                           .data=data};
+    return serialize(&message, buffer, buffer_len);
+}
+
+static void test_rudp_recv_stops_on_abort(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=4};
+
+    // the ack of message 4 was lost, so the sender gave up on it
+    char recvfrom_buffer[100] = {0,};
+    int serialized = serialize_abort(ABORT_SEQ_NUM, 1, 3, 7, recvfrom_buffer, buffer_len);
+    set_recvfrom_buffer(recvfrom_buffer, serialized, serialized);
+
+    RudpHeader expected_sent_header = {.seq_num=ABORT_ACK_SEQ_NUM, .ack_num=1, .data_size=0};
+    char expected_sent_buffer[100] = {0,};
+    serialized = serialize(&(RudpMessage) {.header=expected_sent_header}, expected_sent_buffer, buffer_len);
+    check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+    assert_int_equal(result, ABORTED_ERROR);
+    assert_true(receiver.aborted);
+    assert_int_equal(receiver.last_abort, 1);
+    assert_int_equal(receiver.last_received, 3);
+
+    // nothing else is received until the abort is cleared
+    assert_int_equal(rudp_recv(buffer, buffer_len, &socket_info, &receiver), ABORTED_ERROR);
+}
+
+static void test_rudp_recv_only_answers_resent_aborts(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpReceiver receiver = {.last_received=3, .last_abort=1};
+
+    // the first ABORT-ACK was lost, so the sender resent its abort before starting the next exchange
+    char* received_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    int serialized = serialize_abort(ABORT_SEQ_NUM, 1, 3, 7, received_buffers[0], buffer_len);
+    set_recvfrom_buffer(received_buffers[0], serialized, serialized);
+    serialized = serialize(&(RudpMessage) {.header={.seq_num=4}}, received_buffers[1], buffer_len);
+    set_recvfrom_buffer(received_buffers[1], serialized, serialized);
+
+    RudpHeader expected_sent_headers[2] = {
+            {.seq_num=ABORT_ACK_SEQ_NUM, .ack_num=1, .data_size=0},
+            {.seq_num=0, .ack_num=4, .data_size=0, .window=SOCKET_RECEIVE_WINDOW},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[100]) {0,},
+            (char[100]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        serialized = serialize(&(RudpMessage) {.header=expected_sent_headers[i]}, expected_sent_buffers[i], buffer_len);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_recv(buffer, buffer_len, &socket_info, &receiver);
+    assert_int_equal(result, 0);
+    assert_false(receiver.aborted);
+    assert_int_equal(receiver.last_received, 4);
+}
+
+static void test_rudp_send_stops_on_abort(void** state) {
+    char buffer[100] = {0,};
+    int buffer_len = 100;
+    SocketInfo socket_info = {};
+    RudpSender sender = {.last_ack=0, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {.last_received=2};
+
+    // the receiver gave up on the exchange before message 1 arrived
+    set_poll_rc(POLL_READY);
+    char recvfrom_buffer[100] = {0,};
+    int serialized = serialize_abort(ABORT_SEQ_NUM, 1, 2, 0, recvfrom_buffer, buffer_len);
+    set_recvfrom_buffer(recvfrom_buffer, serialized, RECVFROM_SUCCESS);
+
+    RudpMessage expected_sent_messages[2] = {
+            {.header=(RudpHeader) {.seq_num=1, .ack_num=0, .data_size=buffer_len}, .data=buffer},
+            {.header=(RudpHeader) {.seq_num=ABORT_ACK_SEQ_NUM, .ack_num=1, .data_size=0}},
+    };
+    char* expected_sent_buffers[2] = {
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+            (char[MAX_PAYLOAD_SIZE]) {0,},
+    };
+    for (int i = 0; i < 2; i++) {
+        serialized = serialize(&expected_sent_messages[i], expected_sent_buffers[i], MAX_PAYLOAD_SIZE);
+        check_sendto(expected_sent_buffers[i], serialized, SENDTO_SUCCESS);
+    }
+
+    int result = rudp_send(buffer, buffer_len, &socket_info, &sender, &receiver);
+    assert_int_equal(result, ABORTED_ERROR);
+    assert_int_equal(sender.last_ack, 0);
+    assert_int_equal(receiver.last_received, 2);
+}
+
+static void test_rudp_abort_returns_on_abort_ack(void** state) {
+    SocketInfo socket_info = {};
+    RudpSender sender = {.last_ack=2, .message_timeout=INITIAL_TIMEOUT, .sender_timeout=SENDER_TIMEOUT};
+    RudpReceiver receiver = {.last_received=5};
+
+    set_poll_rc(POLL_READY);
+    RudpHeader recvfrom_header = {.seq_num=ABORT_ACK_SEQ_NUM, .ack_num=1};
+    char recvfrom_buffer[100] = {0,};
+    int serialized = serialize(&(RudpMessage) {.header=recvfrom_header}, recvfrom_buffer, sizeof(recvfrom_buffer));
+    set_recvfrom_buffer(recvfrom_buffer, serialized, RECVFROM_SUCCESS);
+
+    // the abort tells the peer where we are in the exchange
+    char expected_sent_buffer[100] = {0,};
+    serialized = serialize_abort(ABORT_SEQ_NUM, 1, 2, 5, expected_sent_buffer, sizeof(expected_sent_buffer));
+    check_sendto(expected_sent_buffer, serialized, SENDTO_SUCCESS);
+
+    int result = rudp_abort(&socket_info, &sender, &receiver);
+    assert_int_equal(result, 0);
+    assert_int_equal(sender.aborts, 1);
+}
 
 int main(void) {
     const struct CMUnitTest tests[] = {
@@ -346,6 +887,24 @@ int main(void) {
             cmocka_unit_test(test_rudp_recv_acks_previous_requests),
             cmocka_unit_test(test_rudp_recv_does_not_ack_future_requests),
             cmocka_unit_test(test_rudp_recv_puts_data_in_buffer),
+            cmocka_unit_test(test_rudp_recv_drops_corrupted_messages),
+            cmocka_unit_test(test_rudp_recv_answers_fin),
+            cmocka_unit_test(test_rudp_send_treats_fin_as_ack),
+            cmocka_unit_test(test_rudp_finish_returns_on_fin_ack),
+            cmocka_unit_test(test_rudp_finish_acks_resent_messages),
+            cmocka_unit_test(test_rudp_finish_gives_up_on_silent_peers),
+            cmocka_unit_test(test_rudp_recv_keeps_messages_for_other_streams),
+            cmocka_unit_test(test_rudp_send_waits_for_window_update),
+            cmocka_unit_test(test_rudp_recv_sends_window_update),
+            cmocka_unit_test(test_rudp_send_gives_up_on_dead_peer),
+            cmocka_unit_test(test_rudp_recv_times_out),
+            cmocka_unit_test(test_rudp_recv_gives_up_on_dead_peer),
+            cmocka_unit_test(test_rudp_recv_answers_probes),
+            cmocka_unit_test(test_cancelled_transfers_stop),
+            cmocka_unit_test(test_rudp_recv_stops_on_abort),
+            cmocka_unit_test(test_rudp_recv_only_answers_resent_aborts),
+            cmocka_unit_test(test_rudp_send_stops_on_abort),
+            cmocka_unit_test(test_rudp_abort_returns_on_abort_ack),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,315 @@
+//
+// Tests for the scheduling of messages across the streams of an RUDP connection
+//
+
+// needed for usleep
+#define _DEFAULT_SOURCE
+
+#include <check.h>
+
+#include "../../../src/common/reliable_udp/rudp_mux.h"
+#include "../../../src/common/reliable_udp/serde.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+// how long the senders keep sending for, in microseconds
+#define SEND_DURATION 300000
+// how long a sender holds its slot for each message, standing in for the round trip of the message and its ack
+#define HOLD_TIME 200
+// size of the data of the messages the peer sends in the memory budget tests
+#define PEER_DATA_SIZE 500
+
+
+// A thread sending messages of `size` bytes on a stream until the test is over
+typedef struct {
+    RudpMux* mux;
+    int stream_id;
+    int size;
+    volatile bool* done;
+} Sender;
+
+static void* send_messages(void* arg) {
+    Sender* sender = arg;
+    while (!*sender->done) {
+        if (rudp_mux_acquire(sender->mux, sender->stream_id, sender->size) < 0)
+            break;
+        usleep(HOLD_TIME);
+        rudp_mux_release(sender->mux, sender->stream_id);
+    }
+    return NULL;
+}
+
+// Sends on the streams of `senders` at once for SEND_DURATION
+static void run_senders(Sender* senders, int count) {
+    pthread_t threads[RUDP_MUX_MAX_STREAMS];
+    volatile bool done = false;
+    for (int i = 0; i < count; i++) {
+        senders[i].done = &done;
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, send_messages, &senders[i]), 0);
+    }
+
+    usleep(SEND_DURATION);
+    done = true;
+    for (int i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+
+START_TEST(test_weighted_streams_send_in_proportion) {
+    RudpMux mux;
+    rudp_mux_init(&mux, -1, false);
+
+    // more streams than bulk slots, so they have to wait for their turns
+    Sender senders[2 * RUDP_MUX_BULK_SLOTS];
+    for (int i = 0; i < 2 * RUDP_MUX_BULK_SLOTS; i++) {
+        ck_assert_int_eq(rudp_mux_open(&mux, i + 1, RUDP_STREAM_BULK), 0);
+        senders[i] = (Sender) {.mux=&mux, .stream_id=i + 1, .size=MAX_DATA_SIZE};
+    }
+    for (int i = 0; i < RUDP_MUX_BULK_SLOTS; i++)
+        ck_assert_int_eq(rudp_mux_set_weight(&mux, i + 1, 3), 0);
+
+    run_senders(senders, 2 * RUDP_MUX_BULK_SLOTS);
+
+    unsigned long heavy = 0, light = 0;
+    for (int i = 0; i < RUDP_MUX_BULK_SLOTS; i++) {
+        heavy += rudp_mux_sent_bytes(&mux, i + 1);
+        light += rudp_mux_sent_bytes(&mux, RUDP_MUX_BULK_SLOTS + i + 1);
+    }
+    // the heavy streams should get three times the share, with some slack for the timing of the threads
+    ck_assert_uint_gt(light, 0);
+    ck_assert_uint_ge(heavy, 2 * light);
+
+    rudp_mux_free(&mux);
+}
+END_TEST
+
+
+START_TEST(test_streams_share_bytes_rather_than_messages) {
+    RudpMux mux;
+    rudp_mux_init(&mux, -1, false);
+
+    // half the streams send messages a quarter of the size of the others'
+    Sender senders[2 * RUDP_MUX_BULK_SLOTS];
+    for (int i = 0; i < 2 * RUDP_MUX_BULK_SLOTS; i++) {
+        ck_assert_int_eq(rudp_mux_open(&mux, i + 1, RUDP_STREAM_BULK), 0);
+        int size = i < RUDP_MUX_BULK_SLOTS ? MAX_DATA_SIZE / 4 : MAX_DATA_SIZE;
+        senders[i] = (Sender) {.mux=&mux, .stream_id=i + 1, .size=size};
+    }
+
+    run_senders(senders, 2 * RUDP_MUX_BULK_SLOTS);
+
+    unsigned long small_messages = 0, large_messages = 0;
+    for (int i = 0; i < RUDP_MUX_BULK_SLOTS; i++) {
+        small_messages += rudp_mux_sent_bytes(&mux, i + 1) / (MAX_DATA_SIZE / 4);
+        large_messages += rudp_mux_sent_bytes(&mux, RUDP_MUX_BULK_SLOTS + i + 1) / MAX_DATA_SIZE;
+    }
+    // the streams sending small messages take their turns more often, though each turn takes as long as the others' so
+    // they can't make up the whole difference
+    ck_assert_uint_gt(large_messages, 0);
+    ck_assert_uint_ge(small_messages, 2 * large_messages);
+
+    rudp_mux_free(&mux);
+}
+END_TEST
+
+
+START_TEST(test_control_stream_never_waits) {
+    RudpMux mux;
+    rudp_mux_init(&mux, -1, false);
+
+    for (int i = 0; i < RUDP_MUX_BULK_SLOTS; i++) {
+        ck_assert_int_eq(rudp_mux_open(&mux, i + 1, RUDP_STREAM_BULK), 0);
+        ck_assert_int_eq(rudp_mux_acquire(&mux, i + 1, MAX_DATA_SIZE), 0);
+    }
+
+    // every bulk slot is taken, but the control stream sends right away
+    ck_assert_int_eq(rudp_mux_acquire(&mux, RUDP_CONTROL_STREAM, 10), 0);
+    rudp_mux_release(&mux, RUDP_CONTROL_STREAM);
+
+    RudpMuxStats stats;
+    rudp_mux_stats(&mux, &stats);
+    ck_assert_uint_eq(stats.bytes[RUDP_STREAM_CONTROL], 10);
+    ck_assert_uint_eq(stats.messages[RUDP_STREAM_CONTROL], 1);
+    ck_assert_uint_eq(stats.bytes[RUDP_STREAM_BULK], RUDP_MUX_BULK_SLOTS * MAX_DATA_SIZE);
+    ck_assert_uint_eq(stats.messages[RUDP_STREAM_BULK], RUDP_MUX_BULK_SLOTS);
+
+    rudp_mux_free(&mux);
+}
+END_TEST
+
+
+START_TEST(test_set_weight_rejects_invalid_weights) {
+    RudpMux mux;
+    rudp_mux_init(&mux, -1, false);
+    ck_assert_int_eq(rudp_mux_open(&mux, 1, RUDP_STREAM_BULK), 0);
+
+    ck_assert_int_eq(rudp_mux_set_weight(&mux, 1, RUDP_MUX_MAX_WEIGHT), 0);
+    ck_assert_int_lt(rudp_mux_set_weight(&mux, 1, 0), 0);
+    ck_assert_int_lt(rudp_mux_set_weight(&mux, 1, RUDP_MUX_MAX_WEIGHT + 1), 0);
+    ck_assert_int_lt(rudp_mux_set_weight(&mux, 2, 1), 0);
+
+    rudp_mux_free(&mux);
+}
+END_TEST
+
+
+// Helper function that sends a message with PEER_DATA_SIZE bytes of data on `stream_id` from the peer's end of a
+// socket pair, returning the size of the serialized message
+static int send_from_peer(int peer_fd, int stream_id, int seq_num) {
+    char data[PEER_DATA_SIZE] = {0,};
+    char buffer[MAX_PAYLOAD_SIZE];
+    RudpMessage message = {.header={.seq_num=seq_num, .data_size=PEER_DATA_SIZE, .stream_id=stream_id}, .data=data};
+    int size = serialize(&message, buffer, MAX_PAYLOAD_SIZE);
+    ck_assert_int_eq(send(peer_fd, buffer, size, 0), size);
+    return size;
+}
+
+START_TEST(test_queued_messages_are_charged_to_budget) {
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    RudpMux mux;
+    rudp_mux_init(&mux, fds[0], false);
+    ck_assert_int_eq(rudp_mux_open(&mux, 1, RUDP_STREAM_BULK), 0);
+
+    // room for two of the messages the peer sends
+    int message_size = PEER_DATA_SIZE + HEADER_SIZE;
+    MemBudget budget;
+    mem_budget_init(&budget, 2 * message_size + message_size / 2);
+    mux.budget = &budget;
+    ck_assert_int_eq(rudp_mux_free_space(&mux, 1), 2 * message_size + message_size / 2);
+
+    for (int i = 0; i < 3; i++)
+        send_from_peer(fds[1], 1, i + 1);
+    send_from_peer(fds[1], RUDP_CONTROL_STREAM, 1);
+
+    // the third message on stream 1 doesn't fit in the budget and is dropped, but the control stream isn't held back
+    char buffer[MAX_PAYLOAD_SIZE];
+    ck_assert_int_eq(rudp_mux_recv(&mux, RUDP_CONTROL_STREAM, buffer, MAX_PAYLOAD_SIZE, NULL, 100), message_size);
+    ck_assert_uint_eq(budget.used, 2 * message_size);
+    ck_assert_int_eq(rudp_mux_free_space(&mux, 1), message_size / 2);
+    ck_assert_int_eq(rudp_mux_free_space(&mux, RUDP_CONTROL_STREAM), RUDP_MUX_QUEUE_SIZE * MAX_DATA_SIZE);
+
+    ck_assert_int_eq(rudp_mux_recv(&mux, 1, buffer, MAX_PAYLOAD_SIZE, NULL, 0), message_size);
+    ck_assert_int_eq(rudp_mux_recv(&mux, 1, buffer, MAX_PAYLOAD_SIZE, NULL, 0), message_size);
+    ck_assert_int_eq(rudp_mux_recv(&mux, 1, buffer, MAX_PAYLOAD_SIZE, NULL, 50), 0);
+    ck_assert_uint_eq(budget.used, 0);
+
+    // messages still queued when their stream is closed are given back to the budget
+    send_from_peer(fds[1], 1, 3);
+    ck_assert_int_eq(rudp_mux_recv(&mux, RUDP_CONTROL_STREAM, buffer, MAX_PAYLOAD_SIZE, NULL, 50), 0);
+    ck_assert_uint_eq(budget.used, message_size);
+    rudp_mux_close(&mux, 1);
+    ck_assert_uint_eq(budget.used, 0);
+
+    rudp_mux_free(&mux);
+    mem_budget_free(&budget);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+
+START_TEST(test_probes_are_answered_without_being_queued) {
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    RudpMux mux;
+    rudp_mux_init(&mux, fds[0], false);
+
+    // the probe is answered by whichever thread reads it, even though nobody is waiting on its stream
+    char buffer[MAX_PAYLOAD_SIZE];
+    RudpMessage probe = {.header={.seq_num=PROBE_SEQ_NUM, .stream_id=7}};
+    int size = serialize(&probe, buffer, MAX_PAYLOAD_SIZE);
+    ck_assert_int_eq(send(fds[1], buffer, size, 0), size);
+    ck_assert_int_eq(rudp_mux_recv(&mux, RUDP_CONTROL_STREAM, buffer, MAX_PAYLOAD_SIZE, NULL, 50), 0);
+
+    size = recv(fds[1], buffer, MAX_PAYLOAD_SIZE, MSG_DONTWAIT);
+    RudpMessage answer = {};
+    ck_assert_int_ge(deserialize(buffer, size, &answer), 0);
+    ck_assert_int_eq(answer.header.seq_num, PROBE_ACK_SEQ_NUM);
+    ck_assert_int_eq(answer.header.stream_id, 7);
+    free(answer.data);
+
+    rudp_mux_free(&mux);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+
+static void* serve(void* arg) {
+    rudp_mux_serve(arg);
+    return NULL;
+}
+
+START_TEST(test_serve_answers_probes_while_threads_are_busy) {
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    RudpMux mux;
+    rudp_mux_init(&mux, fds[0], false);
+    pthread_t reader;
+    ck_assert_int_eq(pthread_create(&reader, NULL, serve, &mux), 0);
+
+    // no thread is waiting on a stream, but the probe is still answered, and messages are still queued
+    char buffer[MAX_PAYLOAD_SIZE];
+    RudpMessage probe = {.header={.seq_num=PROBE_SEQ_NUM}};
+    int size = serialize(&probe, buffer, MAX_PAYLOAD_SIZE);
+    ck_assert_int_eq(send(fds[1], buffer, size, 0), size);
+    int message_size = send_from_peer(fds[1], RUDP_CONTROL_STREAM, 1);
+
+    struct pollfd poll_fd = {.fd=fds[1], .events=POLLIN};
+    ck_assert_int_eq(poll(&poll_fd, 1, 1000), 1);
+    size = recv(fds[1], buffer, MAX_PAYLOAD_SIZE, 0);
+    RudpMessage answer = {};
+    ck_assert_int_ge(deserialize(buffer, size, &answer), 0);
+    ck_assert_int_eq(answer.header.seq_num, PROBE_ACK_SEQ_NUM);
+    free(answer.data);
+    ck_assert_int_eq(rudp_mux_recv(&mux, RUDP_CONTROL_STREAM, buffer, MAX_PAYLOAD_SIZE, NULL, 1000), message_size);
+
+    // the reader only stops once it's cancelled (while it waits on the socket, without holding the lock)
+    pthread_cancel(reader);
+    pthread_join(reader, NULL);
+    rudp_mux_free(&mux);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+Suite* rudp_mux_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("RUDP mux");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_weighted_streams_send_in_proportion);
+    tcase_add_test(tc_core, test_streams_share_bytes_rather_than_messages);
+    tcase_add_test(tc_core, test_control_stream_never_waits);
+    tcase_add_test(tc_core, test_set_weight_rejects_invalid_weights);
+    tcase_add_test(tc_core, test_queued_messages_are_charged_to_budget);
+    tcase_add_test(tc_core, test_probes_are_answered_without_being_queued);
+    tcase_add_test(tc_core, test_serve_answers_probes_while_threads_are_busy);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = rudp_mux_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
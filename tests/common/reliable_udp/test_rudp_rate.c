@@ -0,0 +1,123 @@
+//
+// Tests for the token buckets that pace RUDP senders
+//
+
+// needed for clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../../src/common/reliable_udp/rudp_rate.h"
+#include "../../../src/common/reliable_udp/reliable_udp.h"
+
+#include <time.h>
+
+
+// Helper function that returns how long (in milliseconds) it takes to send `count` messages of `size` bytes
+static long time_messages(RudpSender* sender, int count, int size) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++)
+        ck_assert_int_eq(rudp_rate_wait(sender, size), 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+
+START_TEST(test_unlimited_sender_never_waits) {
+    RudpRateLimit limit;
+    rudp_rate_init(&limit, RUDP_RATE_UNLIMITED);
+    RudpSender sender = {.rate_limits={[RUDP_RATE_GLOBAL]=&limit}};
+    RudpSender no_limits = {};
+
+    ck_assert_int_lt(time_messages(&sender, 1000, MAX_PAYLOAD_SIZE), 50);
+    ck_assert_int_lt(time_messages(&no_limits, 1000, MAX_PAYLOAD_SIZE), 50);
+
+    rudp_rate_free(&limit);
+}
+END_TEST
+
+
+START_TEST(test_sender_is_paced_at_rate) {
+    RudpRateLimit limit;
+    rudp_rate_init(&limit, 100 * 1000);
+    RudpSender sender = {.rate_limits={[RUDP_RATE_TRANSFER]=&limit}};
+
+    // 20 KB at 100 KB/s takes 200 ms
+    long elapsed = time_messages(&sender, 20, 1000);
+    ck_assert_int_ge(elapsed, 180);
+    ck_assert_int_lt(elapsed, 400);
+
+    rudp_rate_free(&limit);
+}
+END_TEST
+
+
+START_TEST(test_strictest_limit_sets_pace) {
+    RudpRateLimit global, client, transfer;
+    rudp_rate_init(&global, 1000 * 1000);
+    rudp_rate_init(&client, 50 * 1000);
+    rudp_rate_init(&transfer, RUDP_RATE_UNLIMITED);
+    RudpSender sender = {.rate_limits={&global, &client, &transfer}};
+
+    // 10 KB at 50 KB/s takes 200 ms
+    long elapsed = time_messages(&sender, 10, 1000);
+    ck_assert_int_ge(elapsed, 170);
+    ck_assert_int_lt(elapsed, 400);
+
+    rudp_rate_free(&global);
+    rudp_rate_free(&client);
+    rudp_rate_free(&transfer);
+}
+END_TEST
+
+
+START_TEST(test_rate_can_be_changed) {
+    RudpRateLimit limit;
+    rudp_rate_init(&limit, 10 * 1000);
+    RudpSender sender = {.rate_limits={[RUDP_RATE_CLIENT]=&limit}};
+
+    // the debt of a message sent at the old rate doesn't hold up the messages sent at the new one
+    ck_assert_int_eq(rudp_rate_wait(&sender, 1000), 0);
+    rudp_rate_set(&limit, 1000 * 1000);
+    ck_assert_int_eq(rudp_rate_get(&limit), 1000 * 1000);
+    ck_assert_int_lt(time_messages(&sender, 50, 1000), 100);
+
+    rudp_rate_set(&limit, RUDP_RATE_UNLIMITED);
+    ck_assert_int_lt(time_messages(&sender, 1000, 1000), 50);
+
+    rudp_rate_free(&limit);
+}
+END_TEST
+
+
+Suite* rudp_rate_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("RUDP rate limits");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_unlimited_sender_never_waits);
+    tcase_add_test(tc_core, test_sender_is_paced_at_rate);
+    tcase_add_test(tc_core, test_strictest_limit_sets_pace);
+    tcase_add_test(tc_core, test_rate_can_be_changed);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = rudp_rate_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
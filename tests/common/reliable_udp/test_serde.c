@@ -28,17 +28,19 @@ START_TEST(test_serialize_int) {
 END_TEST
 
 START_TEST(test_serialize_header) {
-    int buffer_length = 12;
+    int buffer_length = 24;
     RudpHeader header = {.seq_num=0, .ack_num=0, .data_size=0};
-    char expected[12] = {0,};
-    char result[12] = {0,};
+    char expected[24] = {0,};
+    char result[24] = {0,};
 
     int serialized = serialize_header(&header, result, buffer_length);
     ck_assert_int_eq(serialized, buffer_length);
     ck_assert_mem_eq(result, expected, buffer_length);
 
-    header = (RudpHeader) {.seq_num=123, .ack_num=456, .data_size=789};
-    memcpy(expected, (char[]) {0, 0, 0, 123, 0, 0, 1, 200, 0, 0, 3, 21}, sizeof(*expected) * buffer_length);
+    header = (RudpHeader) {.seq_num=123, .ack_num=456, .data_size=789, .stream_id=7, .window=4096,
+                           .checksum=0xDEADBEEF};
+    memcpy(expected, (char[]) {0, 0, 0, 123, 0, 0, 1, 200, 0, 0, 3, 21, 0, 0, 0, 7, 0, 0, 16, 0, 0xDE, 0xAD, 0xBE, 0xEF},
+           sizeof(*expected) * buffer_length);
 
     serialized = serialize_header(&header, result, buffer_length);
     ck_assert_int_eq(serialized, buffer_length);
@@ -48,13 +50,15 @@ END_TEST
 
 START_TEST(test_serialize_message) {
     int buffer_length = 1024;
-    int header_size = 12;
+    int header_size = 24;
     char data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
     int data_size = 9;
     RudpHeader header = {.seq_num=0, .ack_num=0, .data_size=data_size};
     RudpMessage message = {.header=header, .data=data};
-    // the data comes after the header, and the header should be 12 bytes long
-    char expected[1024] = {[11]=9, [12]=1, [13]=2, [14]=3, [15]=4, [16]=5, [17]=6, [18]=7, [19]=8, [20]=9, 0,};
+    // the data comes after the header, and the header should be 24 bytes long. The header ends with the CRC32C of the
+    // message.
+    char expected[1024] = {[11]=9, [20]=0xCD, [21]=0xCD, [22]=0xF8, [23]=0x55,
+                           [24]=1, [25]=2, [26]=3, [27]=4, [28]=5, [29]=6, [30]=7, [31]=8, [32]=9, 0,};
     char result[1024] = {0,};
 
     int serialized = serialize(&message, result, buffer_length);
@@ -65,12 +69,12 @@ END_TEST
 
 START_TEST(test_serialize_message_with_empty_data) {
     int buffer_length = 1024;
-    int header_size = 12;
+    int header_size = 24;
     RudpHeader header = {.seq_num=0, .ack_num=0, .data_size=0};
     char* data = NULL;
     int data_size = 0;
     RudpMessage message = {.header=header, .data=data};
-    char expected[1024] = {0,};
+    char expected[1024] = {[20]=0x84, [21]=0xFB, [22]=0xEC, [23]=0xEE, 0,};
     char result[1024] = {0,};
 
     int serialized = serialize(&message, result, buffer_length);
@@ -101,9 +105,10 @@ START_TEST(test_deserialize_int) {
 END_TEST
 
 START_TEST(test_deserialize_header) {
-    int expected_deserialized_bytes = 12;
-    char buffer[12] = {0, 0, 0, 123, 0, 0, 1, 200, 0, 0, 3, 21};
-    RudpHeader expected_header = {.seq_num=123, .ack_num=456, .data_size=789};
+    int expected_deserialized_bytes = 24;
+    char buffer[24] = {0, 0, 0, 123, 0, 0, 1, 200, 0, 0, 3, 21, 0, 0, 0, 7, 0, 0, 16, 0, 0xDE, 0xAD, 0xBE, 0xEF};
+    RudpHeader expected_header = {.seq_num=123, .ack_num=456, .data_size=789, .stream_id=7, .window=4096,
+                                  .checksum=0xDEADBEEF};
 
     RudpHeader result = {};
     int deserialized = deserialize_header(buffer, expected_deserialized_bytes, &result);
@@ -112,15 +117,19 @@ START_TEST(test_deserialize_header) {
     ck_assert(result.seq_num == expected_header.seq_num
                 && result.ack_num == expected_header.ack_num
                 && result.data_size == expected_header.data_size
+                && result.stream_id == expected_header.stream_id
+                && result.window == expected_header.window
+                && result.checksum == expected_header.checksum
     );
 
 }
 END_TEST
 
 START_TEST(test_deserialize_message) {
-    int expected_deserialized_bytes = 21;
+    int expected_deserialized_bytes = 33;
     // deserialization relies on the length field to accurately represent the size of data
-    char buffer[21] = {[11]=9, [12]=1, [13]=2, [14]=3, [15]=4, [16]=5, [17]=6, [18]=7, [19]=8, [20]=9};
+    char buffer[33] = {[11]=9, [20]=0xCD, [21]=0xCD, [22]=0xF8, [23]=0x55,
+                       [24]=1, [25]=2, [26]=3, [27]=4, [28]=5, [29]=6, [30]=7, [31]=8, [32]=9};
     int expected_data_size = 9;
     RudpHeader  expected_header = {.seq_num=0, .ack_num=0, .data_size=expected_data_size};
 
@@ -133,13 +142,45 @@ START_TEST(test_deserialize_message) {
               && result.header.data_size == expected_header.data_size
     );
     ck_assert_int_eq(result.header.data_size, expected_data_size);
-    ck_assert_mem_eq(&buffer[12], result.data, result.header.data_size);
+    ck_assert_mem_eq(&buffer[24], result.data, result.header.data_size);
 
     // TODO: should avoid needing to manually free allocated data buffers
     free(result.data);
 }
 END_TEST
 
+START_TEST(test_deserialize_message_without_checksum) {
+    int expected_deserialized_bytes = 33;
+    // a checksum of 0 means the sender did not compute one, so the message is accepted as is
+    char buffer[33] = {[11]=9, [24]=1, [25]=2, [26]=3, [27]=4, [28]=5, [29]=6, [30]=7, [31]=8, [32]=9};
+
+    RudpMessage result = {};
+    int deserialized = deserialize(buffer, expected_deserialized_bytes, &result);
+
+    ck_assert_int_eq(deserialized, expected_deserialized_bytes);
+    ck_assert_int_eq(result.header.data_size, 9);
+    ck_assert_mem_eq(&buffer[24], result.data, result.header.data_size);
+
+    // TODO: should avoid needing to manually free allocated data buffers
+    free(result.data);
+}
+END_TEST
+
+START_TEST(test_deserialize_rejects_corrupted_message) {
+    char buffer[33] = {[11]=9, [20]=0xCD, [21]=0xCD, [22]=0xF8, [23]=0x55,
+                       [24]=1, [25]=2, [26]=3, [27]=4, [28]=5, [29]=6, [30]=7, [31]=8, [32]=9};
+
+    // flip a single bit of the data
+    buffer[28] ^= 0x10;
+
+    RudpMessage result = {};
+    int deserialized = deserialize(buffer, sizeof(buffer), &result);
+
+    ck_assert_int_eq(deserialized, CHECKSUM_ERROR);
+    ck_assert_ptr_eq(result.data, NULL);
+}
+END_TEST
+
 START_TEST(test_serialize_then_deserialize_message) {
     int buffer_length = 1024;
     char data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
@@ -167,7 +208,8 @@ END_TEST
 
 START_TEST(test_deserialize_then_serialize_message) {
     int buffer_length = 1024;
-    char buffer[1024] = {[11]=9, [12]=1, [13]=2, [14]=3, [15]=4, [16]=5, [17]=6, [18]=7, [19]=8, [20]=9};
+    char buffer[1024] = {[11]=9, [20]=0xCD, [21]=0xCD, [22]=0xF8, [23]=0x55,
+                         [24]=1, [25]=2, [26]=3, [27]=4, [28]=5, [29]=6, [30]=7, [31]=8, [32]=9};
 
     RudpMessage result_message = {};
     char result_buffer[1024] = {0,};
@@ -198,6 +240,8 @@ Suite* serde_suite(void) {
     tcase_add_test(tc_core, test_deserialize_int);
     tcase_add_test(tc_core, test_deserialize_header);
     tcase_add_test(tc_core, test_deserialize_message);
+    tcase_add_test(tc_core, test_deserialize_message_without_checksum);
+    tcase_add_test(tc_core, test_deserialize_rejects_corrupted_message);
 
     tcase_add_test(tc_core, test_serialize_then_deserialize_message);
     tcase_add_test(tc_core, test_deserialize_then_serialize_message);
@@ -0,0 +1,79 @@
+//
+// Tests for the CRC32C checksums used to detect corrupted datagrams
+//
+
+#include <check.h>
+
+#include "../../src/common/crc32c.h"
+
+#include <string.h>
+
+
+START_TEST(test_crc32c_matches_reference_values) {
+    char zeros[32] = {0,};
+    char ones[32];
+    memset(ones, 0xFF, sizeof(ones));
+    char incrementing[32];
+    for (int i = 0; i < sizeof(incrementing); i++)
+        incrementing[i] = (char) i;
+
+    // check value of the CRC32C specification, and test vectors from RFC 3720 (iSCSI)
+    ck_assert_uint_eq(crc32c(0, "123456789", 9), 0xE3069283);
+    ck_assert_uint_eq(crc32c(0, zeros, sizeof(zeros)), 0x8A9136AA);
+    ck_assert_uint_eq(crc32c(0, ones, sizeof(ones)), 0x62A8AB43);
+    ck_assert_uint_eq(crc32c(0, incrementing, sizeof(incrementing)), 0x46DD794E);
+}
+END_TEST
+
+
+START_TEST(test_crc32c_software_matches_crc32c) {
+    char data[1000];
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 31 + 7);
+
+    // sizes that aren't a multiple of 8 also exercise the byte at a time tail of both implementations
+    for (int size = 0; size <= sizeof(data); size += 37)
+        ck_assert_uint_eq(crc32c_software(0, data, size), crc32c(0, data, size));
+}
+END_TEST
+
+
+START_TEST(test_crc32c_can_be_extended) {
+    char* data = "The quick brown fox jumps over the lazy dog";
+    int size = strlen(data);
+
+    ck_assert_uint_eq(crc32c(crc32c(0, data, 10), &data[10], size - 10), crc32c(0, data, size));
+    ck_assert_uint_eq(crc32c_software(crc32c_software(0, data, 3), &data[3], size - 3), crc32c(0, data, size));
+}
+END_TEST
+
+
+Suite* crc32c_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("CRC32C");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_crc32c_matches_reference_values);
+    tcase_add_test(tc_core, test_crc32c_software_matches_crc32c);
+    tcase_add_test(tc_core, test_crc32c_can_be_extended);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = crc32c_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
@@ -0,0 +1,201 @@
+//
+// Tests for the sorted index of the files in a directory
+//
+
+// needed for mkdtemp
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../src/common/dir_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static char test_dir[64];
+
+static void make_test_dir(void) {
+    strcpy(test_dir, "/tmp/test_dir_index_XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(test_dir));
+}
+
+static char* test_path(char* name) {
+    static char path[128];
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    return path;
+}
+
+static void create_file(char* name) {
+    FILE* f = fopen(test_path(name), "w");
+    ck_assert_ptr_nonnull(f);
+    fclose(f);
+}
+
+static void assert_names(DirIndex* index, char** names, int count) {
+    ck_assert_int_eq(index->count, count);
+    for (int i = 0; i < count; i++)
+        ck_assert_str_eq(index->names[i], names[i]);
+}
+
+
+START_TEST(test_dir_index_sorts_regular_files) {
+    make_test_dir();
+    create_file("c");
+    create_file("a");
+    create_file("b");
+    ck_assert_int_eq(mkdir(test_path("subdir"), 0755), 0);
+
+    DirIndex index;
+    ck_assert_int_eq(dir_index_init(&index, test_dir), 0);
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+
+    char* expected[] = {"a", "b", "c"};
+    assert_names(&index, expected, 3);
+    ck_assert_int_eq(index.stats.rebuilds, 1);
+
+    ck_assert_int_eq(dir_index_lower_bound(&index, ""), 0);
+    ck_assert_int_eq(dir_index_lower_bound(&index, "b"), 1);
+    ck_assert_int_eq(dir_index_lower_bound(&index, "bb"), 2);
+    ck_assert_int_eq(dir_index_lower_bound(&index, "d"), 3);
+
+    dir_index_free(&index);
+    remove(test_path("a"));
+    remove(test_path("b"));
+    remove(test_path("c"));
+    rmdir(test_path("subdir"));
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_dir_index_follows_changes) {
+    make_test_dir();
+    create_file("b");
+    create_file("d");
+
+    DirIndex index;
+    ck_assert_int_eq(dir_index_init(&index, test_dir), 0);
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+
+    create_file("a");
+    create_file("e");
+    remove(test_path("d"));
+    char renamed[128];
+    strcpy(renamed, test_path("c"));
+    ck_assert_int_eq(rename(test_path("b"), renamed), 0);
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+
+    char* expected[] = {"a", "c", "e"};
+    assert_names(&index, expected, 3);
+
+    // a file that's created and removed again between refreshes never shows up
+    create_file("f");
+    remove(test_path("f"));
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+    assert_names(&index, expected, 3);
+
+    dir_index_free(&index);
+    remove(test_path("a"));
+    remove(test_path("c"));
+    remove(test_path("e"));
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_dir_index_applies_many_changes_in_place) {
+    make_test_dir();
+    char name[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "f%03d", i);
+        create_file(name);
+    }
+
+    DirIndex index;
+    ck_assert_int_eq(dir_index_init(&index, test_dir), 0);
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+
+    // removals and insertions spread all over the index, including at both ends
+    for (int i = 0; i < 200; i += 3) {
+        snprintf(name, sizeof(name), "f%03d", i);
+        remove(test_path(name));
+    }
+    for (int i = 0; i < 200; i += 7) {
+        snprintf(name, sizeof(name), "f%03d_new", i);
+        create_file(name);
+    }
+    create_file("a_first");
+    create_file("z_last");
+    ck_assert_int_eq(dir_index_refresh(&index), 0);
+    ck_assert_int_eq(index.stats.rebuilds, 1);
+
+    // the index matches one read from scratch
+    DirIndex rebuilt;
+    ck_assert_int_eq(dir_index_init(&rebuilt, test_dir), 0);
+    ck_assert_int_eq(dir_index_refresh(&rebuilt), 0);
+    assert_names(&index, rebuilt.names, (int) rebuilt.count);
+    ck_assert_int_eq(index.count, 200 - 67 + 29 + 2);
+
+    dir_index_free(&rebuilt);
+    dir_index_free(&index);
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "f%03d", i);
+        remove(test_path(name));
+        snprintf(name, sizeof(name), "f%03d_new", i);
+        remove(test_path(name));
+    }
+    remove(test_path("a_first"));
+    remove(test_path("z_last"));
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_dir_index_reports_missing_directory) {
+    make_test_dir();
+
+    DirIndex index;
+    ck_assert_int_eq(dir_index_init(&index, test_dir), 0);
+    rmdir(test_dir);
+    ck_assert_int_lt(dir_index_refresh(&index), 0);
+    ck_assert_int_eq(index.count, 0);
+
+    dir_index_free(&index);
+}
+END_TEST
+
+
+Suite* dir_index_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("DirIndex");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_dir_index_sorts_regular_files);
+    tcase_add_test(tc_core, test_dir_index_follows_changes);
+    tcase_add_test(tc_core, test_dir_index_applies_many_changes_in_place);
+    tcase_add_test(tc_core, test_dir_index_reports_missing_directory);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = dir_index_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
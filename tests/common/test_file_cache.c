@@ -0,0 +1,242 @@
+//
+// Tests for the in-memory LRU cache of file contents
+//
+
+// needed for mkdtemp
+#define _POSIX_C_SOURCE 200809L
+
+#include <check.h>
+
+#include "../../src/common/file_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static char test_dir[64];
+
+static void make_test_dir(void) {
+    strcpy(test_dir, "/tmp/test_file_cache_XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(test_dir));
+}
+
+static void write_file(char* path, char* contents) {
+    FILE* f = fopen(path, "w");
+    ck_assert_ptr_nonnull(f);
+    fputs(contents, f);
+    fclose(f);
+}
+
+// reads the whole stream into `buffer` and closes it
+static void read_and_close(FILE* f, char* buffer, int buffer_size) {
+    ck_assert_ptr_nonnull(f);
+    memset(buffer, 0, buffer_size);
+    fread(buffer, 1, buffer_size - 1, f);
+    fclose(f);
+}
+
+static char* test_path(char* name) {
+    static char path[128];
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    return path;
+}
+
+
+START_TEST(test_file_cache_hits_after_first_read) {
+    make_test_dir();
+    char path[128];
+    strcpy(path, test_path("hot"));
+    write_file(path, "hello, world");
+
+    FileCache cache;
+    file_cache_init(&cache, 1024, 1024);
+    char buffer[64];
+
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "hello, world");
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "hello, world");
+
+    ck_assert_int_eq(cache.stats.misses, 1);
+    ck_assert_int_eq(cache.stats.hits, 1);
+    ck_assert_int_eq(cache.size, strlen("hello, world"));
+
+    file_cache_free(&cache);
+    ck_assert_int_eq(cache.size, 0);
+    remove(path);
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_file_cache_rereads_changed_files) {
+    make_test_dir();
+    char path[128];
+    strcpy(path, test_path("changed"));
+    write_file(path, "old contents");
+
+    FileCache cache;
+    file_cache_init(&cache, 1024, 1024);
+    char buffer[64];
+
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    write_file(path, "new contents, longer");
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "new contents, longer");
+    ck_assert_int_eq(cache.stats.invalidations, 1);
+    ck_assert_int_eq(cache.stats.hits, 0);
+
+    // removed files are no longer served from the cache
+    remove(path);
+    ck_assert_ptr_null(file_cache_open(&cache, path));
+    ck_assert_int_eq(cache.size, 0);
+
+    file_cache_free(&cache);
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_file_cache_evicts_least_recently_used) {
+    make_test_dir();
+    char a[128], b[128], c[128];
+    strcpy(a, test_path("a"));
+    strcpy(b, test_path("b"));
+    strcpy(c, test_path("c"));
+    write_file(a, "0123456789");
+    write_file(b, "0123456789");
+    write_file(c, "0123456789");
+
+    // room for two of the files
+    FileCache cache;
+    file_cache_init(&cache, 25, 25);
+    char buffer[64];
+
+    read_and_close(file_cache_open(&cache, a), buffer, sizeof(buffer));
+    read_and_close(file_cache_open(&cache, b), buffer, sizeof(buffer));
+    // makes b the least recently used file
+    read_and_close(file_cache_open(&cache, a), buffer, sizeof(buffer));
+    read_and_close(file_cache_open(&cache, c), buffer, sizeof(buffer));
+
+    ck_assert_int_eq(cache.stats.evictions, 1);
+    ck_assert_int_eq(cache.size, 20);
+
+    read_and_close(file_cache_open(&cache, a), buffer, sizeof(buffer));
+    read_and_close(file_cache_open(&cache, c), buffer, sizeof(buffer));
+    ck_assert_int_eq(cache.stats.hits, 3);
+    read_and_close(file_cache_open(&cache, b), buffer, sizeof(buffer));
+    ck_assert_int_eq(cache.stats.misses, 4);
+
+    file_cache_free(&cache);
+    remove(a);
+    remove(b);
+    remove(c);
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_file_cache_skips_large_files) {
+    make_test_dir();
+    char path[128];
+    strcpy(path, test_path("large"));
+    write_file(path, "more than eight bytes");
+
+    FileCache cache;
+    file_cache_init(&cache, 1024, 8);
+    char buffer[64];
+
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "more than eight bytes");
+    read_and_close(file_cache_open(&cache, path), buffer, sizeof(buffer));
+    ck_assert_int_eq(cache.stats.misses, 2);
+    ck_assert_int_eq(cache.size, 0);
+
+    file_cache_free(&cache);
+    remove(path);
+    rmdir(test_dir);
+}
+END_TEST
+
+
+START_TEST(test_file_cache_stays_within_budget) {
+    make_test_dir();
+    char a[128], b[128], c[128];
+    strcpy(a, test_path("a"));
+    strcpy(b, test_path("b"));
+    strcpy(c, test_path("c"));
+    write_file(a, "0123456789");
+    write_file(b, "0123456789");
+    write_file(c, "0123456789");
+
+    // the cache itself has plenty of room, but shares a budget of 25 bytes
+    MemBudget budget;
+    mem_budget_init(&budget, 25);
+    FileCache cache;
+    file_cache_init(&cache, 1024, 1024);
+    cache.budget = &budget;
+    char buffer[64];
+
+    read_and_close(file_cache_open(&cache, a), buffer, sizeof(buffer));
+    read_and_close(file_cache_open(&cache, b), buffer, sizeof(buffer));
+    ck_assert_uint_eq(budget.used, 20);
+
+    // once something else takes part of the budget, both files have to be evicted to make room for another one
+    mem_budget_charge(&budget, 10);
+    read_and_close(file_cache_open(&cache, c), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "0123456789");
+    ck_assert_int_eq(cache.stats.evictions, 2);
+    ck_assert_int_eq(cache.size, 10);
+    ck_assert_uint_eq(budget.used, 20);
+
+    // with the budget spent, files are read from disk instead of being cached
+    mem_budget_charge(&budget, 10);
+    read_and_close(file_cache_open(&cache, a), buffer, sizeof(buffer));
+    ck_assert_str_eq(buffer, "0123456789");
+    ck_assert_int_eq(cache.size, 0);
+    ck_assert_uint_eq(budget.used, 20);
+
+    file_cache_free(&cache);
+    mem_budget_release(&budget, 20);
+    ck_assert_uint_eq(budget.used, 0);
+    mem_budget_free(&budget);
+    remove(a);
+    remove(b);
+    remove(c);
+    rmdir(test_dir);
+}
+END_TEST
+
+
+Suite* file_cache_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("FileCache");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_file_cache_hits_after_first_read);
+    tcase_add_test(tc_core, test_file_cache_rereads_changed_files);
+    tcase_add_test(tc_core, test_file_cache_evicts_least_recently_used);
+    tcase_add_test(tc_core, test_file_cache_skips_large_files);
+    tcase_add_test(tc_core, test_file_cache_stays_within_budget);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = file_cache_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
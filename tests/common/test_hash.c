@@ -0,0 +1,99 @@
+//
+// Tests for the hash functions used to identify and verify transferred data
+//
+
+#include <check.h>
+
+#include "../../src/common/hash.h"
+
+#include <string.h>
+
+
+START_TEST(test_xxh64_matches_reference_values) {
+    // reference values from the xxHash reference implementation
+    ck_assert(xxh64("", 0, 0) == 0xEF46DB3751D8E999ULL);
+    ck_assert(xxh64("a", 1, 0) == 0xD24EC4F1A98C6E5BULL);
+    ck_assert(xxh64("abc", 3, 0) == 0x44BC2CF5AD770999ULL);
+}
+END_TEST
+
+
+START_TEST(test_xxh64_handles_inputs_longer_than_a_stripe) {
+    char* data = "Nobody inspects the spammish repetition, and more text to exceed 32 bytes!!";
+
+    ck_assert(xxh64(data, strlen(data), 0) == 0x6EEC08268AD90742ULL);
+}
+END_TEST
+
+
+START_TEST(test_xxh64_depends_on_seed) {
+    char data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+    ck_assert(xxh64(data, sizeof(data), 0) != xxh64(data, sizeof(data), 1));
+}
+END_TEST
+
+
+START_TEST(test_xxh64_incremental_matches_one_shot) {
+    char data[200];
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 7);
+
+    // split the data into pieces of every size, so that pieces straddle the 32 byte stripes in different ways
+    for (int piece_size = 1; piece_size <= sizeof(data); piece_size++) {
+        Xxh64State state;
+        xxh64_init(&state, 0);
+        for (int i = 0; i < sizeof(data); i += piece_size)
+            xxh64_update(&state, &data[i], i + piece_size <= sizeof(data) ? piece_size : sizeof(data) - i);
+
+        ck_assert(xxh64_digest(&state) == xxh64(data, sizeof(data), 0));
+    }
+}
+END_TEST
+
+
+START_TEST(test_xxh64_digest_can_be_taken_midway) {
+    char* data = "Nobody inspects the spammish repetition, and more text to exceed 32 bytes!!";
+    Xxh64State state;
+    xxh64_init(&state, 0);
+
+    xxh64_update(&state, data, 40);
+    ck_assert(xxh64_digest(&state) == xxh64(data, 40, 0));
+
+    xxh64_update(&state, &data[40], strlen(data) - 40);
+    ck_assert(xxh64_digest(&state) == 0x6EEC08268AD90742ULL);
+}
+END_TEST
+
+
+Suite* hash_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("Hash");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_xxh64_matches_reference_values);
+    tcase_add_test(tc_core, test_xxh64_handles_inputs_longer_than_a_stripe);
+    tcase_add_test(tc_core, test_xxh64_depends_on_seed);
+    tcase_add_test(tc_core, test_xxh64_incremental_matches_one_shot);
+    tcase_add_test(tc_core, test_xxh64_digest_can_be_taken_midway);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = hash_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
@@ -0,0 +1,98 @@
+//
+// Tests for the LZ4 block codec used to compress transferred chunks
+//
+
+#include <check.h>
+
+#include "../../src/common/lz4.h"
+
+#include <string.h>
+
+
+START_TEST(test_lz4_round_trips_compressible_data) {
+    char data[4096];
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = "abcdefgh"[i % 8];
+    char compressed[sizeof(data)];
+    char decompressed[sizeof(data)];
+
+    int compressed_size = lz4_compress(data, sizeof(data), compressed, sizeof(compressed));
+    ck_assert_int_gt(compressed_size, 0);
+    ck_assert_int_lt(compressed_size, sizeof(data) / 10);
+
+    int decompressed_size = lz4_decompress(compressed, compressed_size, decompressed, sizeof(decompressed));
+    ck_assert_int_eq(decompressed_size, sizeof(data));
+    ck_assert(memcmp(data, decompressed, sizeof(data)) == 0);
+}
+END_TEST
+
+
+START_TEST(test_lz4_decodes_reference_block) {
+    // 100 'a's as compressed by the reference implementation: 1 literal, a 94 byte match at offset 1, then 5 literals
+    char compressed[] = {0x1F, 'a', 0x01, 0x00, 0x4B, 0x50, 'a', 'a', 'a', 'a', 'a'};
+    char expected[100];
+    memset(expected, 'a', sizeof(expected));
+    char decompressed[100];
+
+    int decompressed_size = lz4_decompress(compressed, sizeof(compressed), decompressed, sizeof(decompressed));
+    ck_assert_int_eq(decompressed_size, sizeof(expected));
+    ck_assert(memcmp(expected, decompressed, sizeof(expected)) == 0);
+}
+END_TEST
+
+
+START_TEST(test_lz4_reports_data_that_does_not_shrink) {
+    // a simple LCG gives data with no repeated 4 byte sequences to match
+    char data[1024];
+    unsigned int state = 1;
+    for (int i = 0; i < sizeof(data); i++) {
+        state = state * 1103515245 + 12345;
+        data[i] = (char) (state >> 16);
+    }
+    char compressed[sizeof(data)];
+
+    ck_assert_int_eq(lz4_compress(data, sizeof(data), compressed, sizeof(data) - 1), 0);
+}
+END_TEST
+
+
+START_TEST(test_lz4_rejects_malformed_data) {
+    // match offset points before the start of the output
+    char compressed[] = {0x10, 'a', 0x05, 0x00};
+    char decompressed[64];
+
+    ck_assert_int_lt(lz4_decompress(compressed, sizeof(compressed), decompressed, sizeof(decompressed)), 0);
+}
+END_TEST
+
+
+Suite* lz4_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("LZ4");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_lz4_round_trips_compressible_data);
+    tcase_add_test(tc_core, test_lz4_decodes_reference_block);
+    tcase_add_test(tc_core, test_lz4_reports_data_that_does_not_shrink);
+    tcase_add_test(tc_core, test_lz4_rejects_malformed_data);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = lz4_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
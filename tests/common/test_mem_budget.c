@@ -0,0 +1,97 @@
+//
+// Tests for the memory budget shared by the buffers and caches of a program
+//
+
+#include <check.h>
+
+#include "../../src/common/mem_budget.h"
+
+#include <stdint.h>
+
+
+START_TEST(test_reservations_stay_within_limit) {
+    MemBudget budget;
+    mem_budget_init(&budget, 100);
+
+    ck_assert_int_eq(mem_budget_reserve(&budget, 60), 0);
+    ck_assert_int_eq(mem_budget_reserve(&budget, 40), 0);
+    ck_assert_uint_eq(mem_budget_available(&budget), 0);
+    ck_assert_int_lt(mem_budget_reserve(&budget, 1), 0);
+    ck_assert_uint_eq(budget.refused, 1);
+
+    mem_budget_release(&budget, 60);
+    ck_assert_uint_eq(mem_budget_available(&budget), 60);
+    ck_assert_int_lt(mem_budget_reserve(&budget, 61), 0);
+    ck_assert_int_eq(mem_budget_reserve(&budget, 60), 0);
+    ck_assert_uint_eq(budget.peak, 100);
+
+    mem_budget_free(&budget);
+}
+END_TEST
+
+
+START_TEST(test_charges_can_overrun_limit) {
+    MemBudget budget;
+    mem_budget_init(&budget, 100);
+
+    // memory that's needed regardless is counted, and leaves nothing for reservations until it's released
+    mem_budget_charge(&budget, 150);
+    ck_assert_uint_eq(budget.used, 150);
+    ck_assert_uint_eq(mem_budget_available(&budget), 0);
+    ck_assert_int_lt(mem_budget_reserve(&budget, 1), 0);
+
+    mem_budget_release(&budget, 100);
+    ck_assert_uint_eq(mem_budget_available(&budget), 50);
+    ck_assert_int_eq(mem_budget_reserve(&budget, 50), 0);
+
+    mem_budget_free(&budget);
+}
+END_TEST
+
+
+START_TEST(test_unlimited_budgets_never_refuse) {
+    MemBudget budget;
+    mem_budget_init(&budget, MEM_BUDGET_UNLIMITED);
+
+    ck_assert_int_eq(mem_budget_reserve(&budget, SIZE_MAX / 2), 0);
+    ck_assert_uint_eq(mem_budget_available(&budget), SIZE_MAX);
+    mem_budget_release(&budget, SIZE_MAX / 2);
+
+    // a missing budget doesn't limit anything either
+    ck_assert_int_eq(mem_budget_reserve(NULL, SIZE_MAX), 0);
+    ck_assert_uint_eq(mem_budget_available(NULL), SIZE_MAX);
+
+    mem_budget_free(&budget);
+}
+END_TEST
+
+
+Suite* mem_budget_suite(void) {
+    Suite *s;
+    TCase *tc_core;
+    s = suite_create("MemBudget");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_reservations_stay_within_limit);
+    tcase_add_test(tc_core, test_charges_can_overrun_limit);
+    tcase_add_test(tc_core, test_unlimited_budgets_never_refuse);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int num_failed = 0;
+    Suite *s;
+    SRunner *sr;
+
+    s = mem_budget_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    num_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return num_failed;
+}
@@ -59,6 +59,33 @@ START_TEST(test_elapsed_time_can_be_negative) {
 END_TEST
 
 
+START_TEST(test_elapsed_time_us_is_in_microseconds) {
+    struct timeval start = {.tv_sec = 1, .tv_usec = 999999};
+    struct timeval end = {.tv_sec = 5, .tv_usec = 32};
+
+    ck_assert_int_eq(elapsed_time_us(&start, &end), 3000033);
+    ck_assert_int_eq(elapsed_time_us(&end, &start), -3000033);
+}
+END_TEST
+
+
+START_TEST(test_is_zero) {
+    char data[1000] = {0,};
+
+    ck_assert(is_zero(data, sizeof(data)));
+    ck_assert(is_zero(data, 0));
+
+    // a single non-zero byte anywhere should be found
+    data[0] = 1;
+    ck_assert(!is_zero(data, sizeof(data)));
+    data[0] = 0;
+    data[999] = 1;
+    ck_assert(!is_zero(data, sizeof(data)));
+    ck_assert(is_zero(data, 999));
+}
+END_TEST
+
+
 Suite* utils_suite(void) {
     Suite *s;
     TCase *tc_core;
@@ -68,6 +95,8 @@ Suite* utils_suite(void) {
     tcase_add_test(tc_core, test_elapsed_time_no_diff_is_zero);
     tcase_add_test(tc_core, test_elapsed_time_is_in_milliseconds);
     tcase_add_test(tc_core, test_elapsed_time_can_be_negative);
+    tcase_add_test(tc_core, test_elapsed_time_us_is_in_microseconds);
+    tcase_add_test(tc_core, test_is_zero);
 
     suite_add_tcase(s, tc_core);
 
@@ -1,4 +1,4 @@
-from typing import Tuple
+from typing import List, Tuple
 
 from tests.e2e_utils.rudp_utils import RudpMessage, RudpReceiver, RudpSender
 
@@ -18,6 +18,77 @@ class KftpHeader:
         return KftpHeader(int.from_bytes(data[0:4], "big", signed=True))
 
 
+_MASK64 = (1 << 64) - 1
+_PRIME64_1 = 0x9E3779B185EBCA87
+_PRIME64_2 = 0xC2B2AE3D27D4EB4F
+_PRIME64_3 = 0x165667B19E3779F9
+_PRIME64_4 = 0x85EBCA77C2B2AE63
+_PRIME64_5 = 0x27D4EB2F165667C5
+
+
+def _rotl64(value: int, bits: int) -> int:
+    return ((value << bits) | (value >> (64 - bits))) & _MASK64
+
+
+def _xxh64_round(acc: int, lane: int) -> int:
+    acc = (acc + lane * _PRIME64_2) & _MASK64
+    return (_rotl64(acc, 31) * _PRIME64_1) & _MASK64
+
+
+def xxh64(data: bytes, seed: int = 0) -> int:
+    """Pure python XXH64, matching the hash used in the KFTP trailer"""
+    i = 0
+    if len(data) >= 32:
+        v = [(seed + _PRIME64_1 + _PRIME64_2) & _MASK64, (seed + _PRIME64_2) & _MASK64, seed,
+             (seed - _PRIME64_1) & _MASK64]
+        while i + 32 <= len(data):
+            for lane in range(4):
+                v[lane] = _xxh64_round(v[lane], int.from_bytes(data[i + lane * 8:i + lane * 8 + 8], "little"))
+            i += 32
+        h = (_rotl64(v[0], 1) + _rotl64(v[1], 7) + _rotl64(v[2], 12) + _rotl64(v[3], 18)) & _MASK64
+        for lane in v:
+            h ^= _xxh64_round(0, lane)
+            h = (h * _PRIME64_1 + _PRIME64_4) & _MASK64
+    else:
+        h = (seed + _PRIME64_5) & _MASK64
+
+    h = (h + len(data)) & _MASK64
+    while i + 8 <= len(data):
+        h ^= _xxh64_round(0, int.from_bytes(data[i:i + 8], "little"))
+        h = (_rotl64(h, 27) * _PRIME64_1 + _PRIME64_4) & _MASK64
+        i += 8
+    if i + 4 <= len(data):
+        h ^= (int.from_bytes(data[i:i + 4], "little") * _PRIME64_1) & _MASK64
+        h = (_rotl64(h, 23) * _PRIME64_2 + _PRIME64_3) & _MASK64
+        i += 4
+    while i < len(data):
+        h ^= (data[i] * _PRIME64_5) & _MASK64
+        h = (_rotl64(h, 11) * _PRIME64_1) & _MASK64
+        i += 1
+
+    h ^= h >> 33
+    h = (h * _PRIME64_2) & _MASK64
+    h ^= h >> 29
+    h = (h * _PRIME64_3) & _MASK64
+    h ^= h >> 32
+    return h
+
+
+class KftpTrailer:
+    SIZE = 8
+
+    def __init__(self, hash: int):
+        self.hash = hash
+
+    def serialize(self) -> bytes:
+        return self.hash.to_bytes(8, "big")
+
+    @staticmethod
+    def deserialize(data: bytes) -> "KftpTrailer":
+        assert len(data) >= 8
+        return KftpTrailer(int.from_bytes(data[0:8], "big"))
+
+
 class KftpSender:
     def __init__(self, sender: RudpSender):
         self.sender = sender
@@ -25,20 +96,27 @@ class KftpSender:
     def send_to(self, file_data: bytes, addr: Tuple[str, int]):
         header = KftpHeader(len(file_data))
         serialized_header = header.serialize()
+        serialized_trailer = KftpTrailer(xxh64(file_data)).serialize()
 
+        # the trailer is appended to the last data message if it fits, otherwise it is sent in a message of its own
         if len(file_data) + len(serialized_header) > RudpMessage.DATASIZE:
             offset = RudpMessage.DATASIZE - len(serialized_header)
-            first_message = serialized_header + file_data[:offset]
-            self.sender.send_to(first_message, addr)
+            last_message = serialized_header + file_data[:offset]
 
             while offset < len(file_data):
+                self.sender.send_to(last_message, addr)
                 next_message_size = min(len(file_data) - offset, RudpMessage.DATASIZE)
-                next_message = file_data[offset:offset+next_message_size]
-                self.sender.send_to(next_message, addr)
+                last_message = file_data[offset:offset+next_message_size]
                 offset += next_message_size
 
         else:
-            self.sender.send_to(serialized_header + file_data, addr)
+            last_message = serialized_header + file_data
+
+        if len(last_message) + len(serialized_trailer) <= RudpMessage.DATASIZE:
+            self.sender.send_to(last_message + serialized_trailer, addr)
+        else:
+            self.sender.send_to(last_message, addr)
+            self.sender.send_to(serialized_trailer, addr)
 
 
 class KftpReceiver:
@@ -48,11 +126,80 @@ class KftpReceiver:
     def receive_from(self) -> Tuple[bytes, Tuple[str, int]]:
         first_message, first_addr = self.receiver.receive_from()
         header = KftpHeader.deserialize(first_message)
-        file_data = first_message[4:]
+        received = first_message[KftpHeader.SIZE:]
 
-        while len(file_data) < header.data_size:
+        while len(received) < header.data_size + KftpTrailer.SIZE:
             next_message, next_addr = self.receiver.receive_from()
             if first_addr == next_addr:
-                file_data += next_message
+                received += next_message
+
+        file_data = received[:header.data_size]
+        trailer = KftpTrailer.deserialize(received[header.data_size:])
+        assert trailer.hash == xxh64(file_data), "KFTP trailer hash does not match the received data"
 
         return file_data, first_addr
+
+
+class KftpCommand:
+    """Binary control message used for commands and the server's replies to them"""
+    HEADER_SIZE = 12
+
+    # opcodes
+    GET = 1
+    PUT = 2
+    MGET = 3
+    MPUT = 4
+    DELETE = 5
+    LS = 6
+    EXIT = 7
+    REPLY = 8
+    PIPELINE = 9
+
+    # flags
+    DELTA = 1 << 0
+    COMPRESS = 1 << 1
+    SPARSE = 1 << 2
+    STRIPED = 1 << 3
+    RECURSIVE = 1 << 4
+    CONDITIONAL = 1 << 5
+    DEDUP = 1 << 6
+    MERKLE = 1 << 7
+    RANGED = 1 << 8
+    PAGED = 1 << 9
+    PACK = 1 << 10
+
+    def __init__(self, opcode: int, request_id: int = 0, flags: int = 0, status: int = 0, args: List[bytes] = None):
+        self.opcode = opcode
+        self.request_id = request_id
+        self.flags = flags
+        self.status = status
+        self.args = args if args is not None else []
+
+    @staticmethod
+    def number(value: int) -> bytes:
+        """Serializes a number argument (e.g. the offset of a ranged get)"""
+        return value.to_bytes(8, "big")
+
+    def serialize(self) -> bytes:
+        data = bytes([self.opcode, len(self.args)]) + self.flags.to_bytes(2, "big")
+        data += self.request_id.to_bytes(4, "big") + self.status.to_bytes(4, "big", signed=True)
+        for arg in self.args:
+            data += len(arg).to_bytes(2, "big") + arg
+        return data
+
+    @staticmethod
+    def deserialize(data: bytes) -> "KftpCommand":
+        assert len(data) >= KftpCommand.HEADER_SIZE
+        command = KftpCommand(data[0], int.from_bytes(data[4:8], "big"), int.from_bytes(data[2:4], "big"),
+                              int.from_bytes(data[8:12], "big", signed=True))
+        offset = KftpCommand.HEADER_SIZE
+        for _ in range(data[1]):
+            length = int.from_bytes(data[offset:offset + 2], "big")
+            command.args.append(data[offset + 2:offset + 2 + length])
+            offset += 2 + length
+        return command
+
+    @property
+    def message(self) -> bytes:
+        """Message held in a reply, or b"" if it has none"""
+        return self.args[0] if self.args else b""
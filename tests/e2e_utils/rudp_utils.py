@@ -4,26 +4,67 @@ from typing import Tuple
 from tests.e2e_utils.socket_utils import Socket
 
 
-class RudpHeader:
-    SIZE = 12
+def _make_crc32c_table():
+    table = []
+    for byte in range(256):
+        crc = byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x82F63B78 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+
+_CRC32C_TABLE = _make_crc32c_table()
+
 
-    def __init__(self, seq_num: int, ack_num: int, data_size: int):
+def crc32c(data: bytes) -> int:
+    crc = 0xFFFFFFFF
+    for byte in data:
+        crc = (crc >> 8) ^ _CRC32C_TABLE[(crc ^ byte) & 0xFF]
+    return crc ^ 0xFFFFFFFF
+
+
+class RudpHeader:
+    SIZE = 24
+    NO_CHECKSUM = 0
+    # sequence numbers of the messages that finish an exchange
+    FIN_SEQ_NUM = -1
+    FIN_ACK_SEQ_NUM = -2
+    # sequence numbers of keepalive probes, and of their answers
+    PROBE_SEQ_NUM = -3
+    PROBE_ACK_SEQ_NUM = -4
+    # sequence numbers of the messages that abort an exchange, and of their answers
+    ABORT_SEQ_NUM = -5
+    ABORT_ACK_SEQ_NUM = -6
+
+    def __init__(self, seq_num: int, ack_num: int, data_size: int, checksum: int = NO_CHECKSUM, stream_id: int = 0,
+                 window: int = 0):
         self.seq_num = seq_num
         self.ack_num = ack_num
         self.data_size = data_size
+        self.stream_id = stream_id
+        # bytes the sender of an ack has room for
+        self.window = window
+        self.checksum = checksum
 
     def serialize(self) -> bytes:
         return (self.seq_num.to_bytes(4, "big", signed=True)
                 + self.ack_num.to_bytes(4, "big", signed=True)
                 + self.data_size.to_bytes(4, "big", signed=True)
+                + self.stream_id.to_bytes(4, "big", signed=True)
+                + self.window.to_bytes(4, "big", signed=True)
+                + self.checksum.to_bytes(4, "big")
                 )
 
     @staticmethod
     def deserialize(data: bytes) -> "RudpHeader":
-        assert len(data) >= 12
+        assert len(data) >= RudpHeader.SIZE
         return RudpHeader(int.from_bytes(data[0:4], "big", signed=True),
                           int.from_bytes(data[4:8], "big", signed=True),
-                          int.from_bytes(data[8:12], "big", signed=True))
+                          int.from_bytes(data[8:12], "big", signed=True),
+                          int.from_bytes(data[20:24], "big"),
+                          int.from_bytes(data[12:16], "big", signed=True),
+                          int.from_bytes(data[16:20], "big", signed=True))
 
 
 class RudpMessage:
@@ -35,20 +76,36 @@ class RudpMessage:
         self.data = data
         assert header.data_size == len(data)
 
+    @staticmethod
+    def checksum(header: RudpHeader, data: bytes) -> int:
+        """CRC32C of the message with the checksum field set to 0, where 0 is sent as all ones"""
+        unchecked_header = RudpHeader(header.seq_num, header.ack_num, header.data_size, stream_id=header.stream_id,
+                                      window=header.window)
+        checksum = crc32c(unchecked_header.serialize() + data)
+        return checksum if checksum != RudpHeader.NO_CHECKSUM else 0xFFFFFFFF
+
     def serialize(self) -> bytes:
+        self.header.checksum = RudpMessage.checksum(self.header, self.data)
         return self.header.serialize() + self.data
 
     @staticmethod
     def deserialize(data: bytes) -> "RudpMessage":
         header = RudpHeader.deserialize(data)
-        assert header.data_size == len(data[12:])
-        return RudpMessage(header, data[12:])
+        assert header.data_size == len(data[RudpHeader.SIZE:])
+        message = RudpMessage(header, data[RudpHeader.SIZE:])
+        assert (header.checksum == RudpHeader.NO_CHECKSUM
+                or header.checksum == RudpMessage.checksum(header, message.data)), "corrupted RUDP message"
+        return message
 
 
 class RudpReceiver:
-    def __init__(self, sock: Socket, last_received: int = 0):
+    # only one message is received at a time, so acks advertise room for the next one
+    WINDOW = RudpMessage.DATASIZE
+
+    def __init__(self, sock: Socket, last_received: int = 0, stream_id: int = 0):
         self.sock = sock
         self.last_received = last_received
+        self.stream_id = stream_id
 
     def receive_from(self) -> Tuple[bytes, Tuple[str, int]]:
         while True:
@@ -59,6 +116,13 @@ class RudpReceiver:
 
             recv_message = RudpMessage.deserialize(data)
             print(f"Received message with seq header: {recv_message.header.seq_num}, looking for: {self.last_received+1}")
+            # probes are answered on any stream, like a peer whose socket is shared between streams would
+            if recv_message.header.seq_num == RudpHeader.PROBE_SEQ_NUM:
+                self.send_probe_ack(recv_message.header.stream_id, addr)
+                continue
+            # messages on other streams are dropped, and resent by their sender later on
+            if recv_message.header.stream_id != self.stream_id:
+                continue
             if recv_message.header.seq_num == self.last_received + 1:
                 self.last_received += 1
                 self.send_ack(recv_message.header.seq_num, addr)
@@ -66,9 +130,21 @@ class RudpReceiver:
             # ack previously received messages in case the ack hasn't yet been received by the sender
             elif recv_message.header.seq_num == self.last_received:
                 self.send_ack(recv_message.header.seq_num, addr)
+            elif recv_message.header.seq_num == RudpHeader.FIN_SEQ_NUM:
+                self.send_fin_ack(addr)
+
+    def send_probe_ack(self, stream_id: int, addr: Tuple[str, int]):
+        message = RudpMessage(RudpHeader(RudpHeader.PROBE_ACK_SEQ_NUM, 0, 0, stream_id=stream_id), b'')
+        print(f"Answering probe from: {addr}")
+        self.sock.sendto(message.serialize(), addr)
+
+    def send_fin_ack(self, addr: Tuple[str, int]):
+        message = RudpMessage(RudpHeader(RudpHeader.FIN_ACK_SEQ_NUM, 0, 0, stream_id=self.stream_id), b'')
+        print(f"Sending FIN-ACK to: {addr}")
+        self.sock.sendto(message.serialize(), addr)
 
     def send_ack(self, ack_num: int, addr: Tuple[str, int]):
-        message = RudpMessage(RudpHeader(0, ack_num, 0), b'')
+        message = RudpMessage(RudpHeader(0, ack_num, 0, stream_id=self.stream_id, window=RudpReceiver.WINDOW), b'')
         print(f"Sending ack: {ack_num} to: {addr}")
         self.sock.sendto(message.serialize(), addr)
 
@@ -82,7 +158,7 @@ class RudpSender:
         self.last_ack = last_ack
 
     def send_to(self, data: bytes, to_addr: Tuple[str, int]):
-        message = RudpMessage(RudpHeader(self.last_ack + 1, 0, len(data)), data)
+        message = RudpMessage(RudpHeader(self.last_ack + 1, 0, len(data), stream_id=self.receiver.stream_id), data)
 
         counter = 0
         acked = False
@@ -100,10 +176,18 @@ class RudpSender:
             print(f"Checked for ack: {recv_data}")
             if addr == to_addr:
                 recv_message = RudpMessage.deserialize(recv_data)
+                if recv_message.header.seq_num == RudpHeader.PROBE_SEQ_NUM:
+                    self.receiver.send_probe_ack(recv_message.header.stream_id, addr)
+                    continue
+                if recv_message.header.stream_id != self.receiver.stream_id:
+                    continue
                 if recv_message.header.ack_num == self.last_ack + 1:
                     print(f"Acked: {recv_message.header.ack_num}")
                     self.last_ack += 1
                     acked = True
+                    # a FIN acks the message too, and waits to hear back
+                    if recv_message.header.seq_num == RudpHeader.FIN_SEQ_NUM:
+                        self.receiver.send_fin_ack(addr)
                 # ack previously received messages in case the ack hasn't yet been received
                 elif recv_message.header.seq_num == self.receiver.last_received:
                     self.receiver.send_ack(recv_message.header.seq_num, addr)
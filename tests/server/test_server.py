@@ -1,13 +1,15 @@
+import os
 import pytest
+import signal
 import subprocess
 import socket
 import time
-from typing import Generator
+from typing import Generator, List, Tuple
 from pathlib import Path
 
 from tests.e2e_utils.socket_utils import Socket, UnreliableSocket
-from tests.e2e_utils.rudp_utils import RudpReceiver, RudpSender
-from tests.e2e_utils.kftp_utils import KftpReceiver, KftpSender
+from tests.e2e_utils.rudp_utils import RudpHeader, RudpMessage, RudpReceiver, RudpSender
+from tests.e2e_utils.kftp_utils import KftpCommand, KftpReceiver, KftpSender, xxh64
 
 address = "127.0.0.1"
 port = 8080
@@ -17,29 +19,131 @@ resources_filepath = Path("tests/resources/")
 class Client:
     SOCKET_TIMEOUT = 0.5    # in seconds
 
-    def __init__(self, sock: Socket):
+    def __init__(self, sock: Socket, stream_id: int = 0):
         sock.sock.settimeout(self.SOCKET_TIMEOUT)
         self.sock = sock
-        self.receiver = RudpReceiver(self.sock)
+        self.receiver = RudpReceiver(self.sock, stream_id=stream_id)
         self.sender = RudpSender(self.sock, self.receiver)
+        self.last_request_id = 0
+
+    def stream(self, stream_id: int) -> "Client":
+        """Returns a client that sends its commands on its own stream, over the same socket"""
+        return Client(self.sock, stream_id)
+
+    def command(self, opcode: int, *args: bytes, flags: int = 0) -> KftpCommand:
+        """Builds a command with a new request ID"""
+        self.last_request_id += 1
+        return KftpCommand(opcode, self.last_request_id, flags, args=list(args))
 
     def get(self, filename: str) -> bytes:
-        self.send(f"get {filename}".encode())
+        reply = self.send_command(self.command(KftpCommand.GET, str(filename).encode()))
+        assert reply.status == 0
         data, _ = KftpReceiver(self.receiver).receive_from()
         return data
 
-    def put(self, filename: str, data: bytes):
-        self.send(f"put {filename}".encode())
-        return KftpSender(self.sender).send_to(data, (address, port))
-
-    def delete(self, filename: str) -> bytes:
-        return self.send_and_receive(f"delete {filename}".encode())
-
-    def ls(self) -> bytes:
-        return self.send_and_receive(b"ls")
-
-    def exit(self) -> bytes:
-        return self.send_and_receive(b"exit")
+    def put(self, filename: str, data: bytes) -> KftpCommand:
+        command = self.command(KftpCommand.PUT, str(filename).encode())
+        self.send(command.serialize())
+        KftpSender(self.sender).send_to(data, (address, port))
+        return self.receive_reply(command)
+
+    def delete(self, filename: str) -> KftpCommand:
+        return self.send_command(self.command(KftpCommand.DELETE, str(filename).encode()))
+
+    def ls(self, pattern: bytes = None, page: Tuple[int, int] = None) -> Tuple[List[bytes], int]:
+        """Returns the names in a listing, and the status sent at its end"""
+        args = [pattern] if pattern is not None else []
+        flags = 0
+        if page is not None:
+            args += [KftpCommand.number(page[0]), KftpCommand.number(page[1])]
+            flags = KftpCommand.PAGED
+        reply = self.send_command(self.command(KftpCommand.LS, *args, flags=flags))
+        assert reply.status == 0
+        return self.receive_listing()
+
+    def receive_listing(self) -> Tuple[List[bytes], int]:
+        # the listing is a stream of length-prefixed names, ended by a length of 0 and a status
+        data = b""
+        names = []
+        offset = 0
+        while True:
+            while len(data) < offset + 4:
+                data += self.receive()
+            length = int.from_bytes(data[offset:offset + 4], "big", signed=True)
+            offset += 4
+            while len(data) < offset + (length if length > 0 else 4):
+                data += self.receive()
+            if length == 0:
+                return names, int.from_bytes(data[offset:offset + 4], "big", signed=True)
+            names.append(data[offset:offset + length])
+            offset += length
+
+    def pipeline(self, commands: List[KftpCommand]) -> List[Tuple[KftpCommand, bytes]]:
+        """Sends commands as a pipeline, and returns each reply (and the data returned with it) in the order they
+        arrive"""
+        # the commands follow the pipeline command on a single stream, each preceded by its size
+        data = self.command(KftpCommand.PIPELINE, KftpCommand.number(len(commands))).serialize()
+        for command in commands:
+            serialized = command.serialize()
+            data += len(serialized).to_bytes(4, "big") + serialized
+        for offset in range(0, len(data), RudpMessage.DATASIZE):
+            self.send(data[offset:offset + RudpMessage.DATASIZE])
+
+        buffer = b""
+
+        def read(size: int) -> bytes:
+            nonlocal buffer
+            while len(buffer) < size:
+                buffer += self.receive()
+            result, buffer = buffer[:size], buffer[size:]
+            return result
+
+        completions = []
+        for _ in commands:
+            reply = KftpCommand.deserialize(read(int.from_bytes(read(4), "big")))
+            assert reply.opcode == KftpCommand.REPLY
+            data_size = int.from_bytes(read(4), "big")
+            returned = read(data_size) if data_size > 0 else b""
+            if data_size > 0:
+                assert int.from_bytes(read(8), "big") == xxh64(returned)
+            completions.append((reply, returned))
+        return completions
+
+    def exit(self) -> KftpCommand:
+        return self.send_command(self.command(KftpCommand.EXIT))
+
+    def finish(self) -> bool:
+        """Sends a FIN (resending it until it's answered), and returns True once it's answered with a FIN-ACK"""
+        fin = RudpMessage(RudpHeader(RudpHeader.FIN_SEQ_NUM, self.receiver.last_received, 0,
+                                     stream_id=self.receiver.stream_id), b"")
+        for _ in range(RudpSender.timeout_retries):
+            self.sock.sendto(fin.serialize(), (address, port))
+            try:
+                # a reply whose ack was lost may be resent first, which the FIN acks
+                while True:
+                    data, _ = self.sock.recvfrom(RudpMessage.BUFSIZE)
+                    if RudpMessage.deserialize(data).header.seq_num == RudpHeader.FIN_ACK_SEQ_NUM:
+                        return True
+            except socket.timeout:
+                continue
+        return False
+
+    def abort(self, number: int = 1) -> bool:
+        """Aborts the current exchange (resending the abort until it's answered), and returns True once it's answered
+        with an ABORT-ACK"""
+        data = b"".join(n.to_bytes(4, "big", signed=True)
+                        for n in (number, self.sender.last_ack, self.receiver.last_received))
+        abort = RudpMessage(RudpHeader(RudpHeader.ABORT_SEQ_NUM, 0, len(data), stream_id=self.receiver.stream_id), data)
+        for _ in range(RudpSender.timeout_retries):
+            self.sock.sendto(abort.serialize(), (address, port))
+            try:
+                while True:
+                    header = RudpMessage.deserialize(self.sock.recvfrom(RudpMessage.BUFSIZE)[0]).header
+                    if header.seq_num == RudpHeader.ABORT_ACK_SEQ_NUM and header.ack_num == number:
+                        return True
+            except socket.timeout:
+                continue
+        return False
 
     def send(self, data: bytes):
         self.sender.send_to(data, (address, port))
@@ -48,9 +152,15 @@ class Client:
         data, _ = self.receiver.receive_from()
         return data
 
-    def send_and_receive(self, data: bytes) -> bytes:
-        self.send(data)
-        return self.receive()
+    def send_command(self, command: KftpCommand) -> KftpCommand:
+        self.send(command.serialize())
+        return self.receive_reply(command)
+
+    def receive_reply(self, command: KftpCommand) -> KftpCommand:
+        reply = KftpCommand.deserialize(self.receive())
+        assert reply.opcode == KftpCommand.REPLY
+        assert reply.request_id == command.request_id
+        return reply
 
 
 @pytest.fixture(params=["reliable", "unreliable"])
@@ -92,7 +202,11 @@ def run_server() -> Generator[subprocess.Popen, None, None]:
 class TestResponses:
     not_implemented_message_format = "Command not yet implemented: {command}"
     invalid_command_message_format = "Invalid command: {command}"
+    failed_command_message_format = "Command failed: {command}"
     delete_message = b"Deleted file\n"
+    parse_error = -2
+    not_streamable_error = -4
+    not_streamable_message_format = "Command can't be run on its own stream: {command}"
 
 
 @pytest.mark.usefixtures("killable_server")
@@ -106,6 +220,14 @@ class TestServerNonExiting(TestResponses):
         expected_response = file_contents
         assert response == expected_response
 
+    def test_get_missing_file_replies_with_error(self, client: Client):
+        filepath = resources_filepath.joinpath("test.txt")
+        assert not Path(filepath).is_file()
+
+        reply = client.send_command(client.command(KftpCommand.GET, str(filepath).encode()))
+        assert reply.status < 0
+        assert reply.message == self.failed_command_message_format.format(command=f"get {filepath}").encode()
+
     def test_get_sample_files(self, client: Client):
         """Tests the sample files provided for this homework assignment"""
         sample_files = ["foo1", "foo2", "foo3"]
@@ -121,7 +243,8 @@ class TestServerNonExiting(TestResponses):
     def test_put(self, client: Client):
         test_contents = b"Hello world!\nGoodbye...\n"
         filepath = resources_filepath.joinpath("test.txt")
-        client.put(filepath, test_contents)
+        reply = client.put(filepath, test_contents)
+        assert reply.status == 0
 
         with open(filepath, "rb") as f:
             file_contents = f.read()
@@ -154,9 +277,9 @@ class TestServerNonExiting(TestResponses):
             f.write("Test case, soon to be deleted\n")
         assert Path(filepath).is_file()
 
-        response = client.delete(filepath)
-        expected_response = self.delete_message
-        assert response == expected_response
+        reply = client.delete(filepath)
+        assert reply.status == 0
+        assert reply.message == self.delete_message
         assert not Path(filepath).is_file()
 
     def test_delete_nonexistent_file_does_nothing(self, client: Client):
@@ -164,56 +287,421 @@ class TestServerNonExiting(TestResponses):
         # test file should not exist
         assert not Path(filepath).is_file()
 
-        response = client.delete(filepath)
-        expected_response = b""
-        assert response == expected_response
+        # the server still replies, so the client knows the command is done
+        reply = client.delete(filepath)
+        assert reply.status == 0
+        assert reply.message == b""
 
     def test_ls(self, client: Client):
-        response = client.ls()
-        response_files = response.strip().split(b"\n")
+        response_files, status = client.ls()
         local_files = [f.name.encode() for f in Path('.').iterdir() if f.is_file()]
         assert sorted(response_files) == sorted(local_files)
+        assert status == 0
+
+    def test_ls_filters_by_pattern(self, client: Client):
+        response_files, status = client.ls(b"*.md")
+        local_files = [f.name.encode() for f in Path('.').glob("*.md") if f.is_file()]
+        assert sorted(response_files) == sorted(local_files)
+        assert status == 0
+
+    def test_ls_pages_through_files(self, client: Client):
+        all_files, _ = client.ls()
+        first_page, first_status = client.ls(page=(0, 1))
+        rest, rest_status = client.ls(page=(1, len(all_files)))
+        assert first_page == all_files[:1]
+        assert first_status == (1 if len(all_files) > 1 else 0)
+        assert rest == all_files[1:]
+        assert rest_status == 0
 
     def test_invalid_commands_sent_back(self, client: Client):
-        command = "foo bar"
-        response = client.send_and_receive(command.encode())
-        expected_response = self.invalid_command_message_format.format(command=command).encode()
-        assert response == expected_response
+        reply = client.send_command(client.command(42, b"bar"))
+        assert reply.status == self.parse_error
+        assert reply.message == self.invalid_command_message_format.format(command="unknown command 42 bar").encode()
+
+    @pytest.mark.parametrize("command,opcode", [("get", KftpCommand.GET), ("put", KftpCommand.PUT),
+                                                ("delete", KftpCommand.DELETE)])
+    def test_must_pass_one_argument(self, command: str, opcode: int, client: Client):
+        multi_reply = client.send_command(client.command(opcode, b"test.txt", b"foo.bar"))
+        expected_multi_response = self.invalid_command_message_format.format(command=f"{command} test.txt foo.bar")
+        assert multi_reply.status == self.parse_error
+        assert multi_reply.message == expected_multi_response.encode()
+
+        no_arg_reply = client.send_command(client.command(opcode))
+        no_arg_expected_response = self.invalid_command_message_format.format(command=command)
+        assert no_arg_reply.status == self.parse_error
+        assert no_arg_reply.message == no_arg_expected_response.encode()
+
+    @pytest.mark.parametrize("args,flags", [
+        ([b"foo", b"bar"], 0),
+        ([b"foo", KftpCommand.number(1)], KftpCommand.PAGED),
+        ([b"foo", b"1", b"2"], KftpCommand.PAGED),
+        ([KftpCommand.number(1 << 63), KftpCommand.number(2)], KftpCommand.PAGED),
+        ([b"foo"], KftpCommand.DELTA),
+    ])
+    def test_ls_rejects_invalid_arguments(self, args: List[bytes], flags: int, client: Client):
+        reply = client.send_command(client.command(KftpCommand.LS, *args, flags=flags))
+        assert reply.status == self.parse_error
+        assert reply.message.startswith(self.invalid_command_message_format.format(command="ls").encode())
+
+    def test_must_pass_no_arguments(self, client: Client):
+        reply = client.send_command(client.command(KftpCommand.EXIT, b"foo"))
+        expected_response = self.invalid_command_message_format.format(command="exit foo").encode()
+        assert reply.status == self.parse_error
+        assert reply.message == expected_response
+
+    def test_text_commands_rejected(self, client: Client):
+        client.send(b"ls\n")
+        reply = KftpCommand.deserialize(client.receive())
+        assert reply.opcode == KftpCommand.REPLY
+        assert reply.status == self.parse_error
+
+    def test_pipeline_completes_every_command(self, client: Client):
+        # enough deletes that the pipeline spans several messages
+        filepaths = [resources_filepath.joinpath(f"test_pipeline_{i}") for i in range(50)]
+        for filepath in filepaths:
+            filepath.write_bytes(b"soon to be deleted\n")
+        foo1 = resources_filepath.joinpath("foo1")
+        missing = resources_filepath.joinpath("test.txt")
+
+        deletes = [client.command(KftpCommand.DELETE, str(filepath).encode()) for filepath in filepaths]
+        get = client.command(KftpCommand.GET, str(foo1).encode())
+        ranged_get = client.command(KftpCommand.GET, str(foo1).encode(), KftpCommand.number(5),
+                                    KftpCommand.number(10), flags=KftpCommand.RANGED)
+        missing_get = client.command(KftpCommand.GET, str(missing).encode())
+        missing_delete = client.command(KftpCommand.DELETE, str(missing).encode())
+        ls = client.command(KftpCommand.LS, b"*.md")
+        commands = deletes + [get, ranged_get, missing_get, missing_delete, ls]
+
+        completions = {reply.request_id: (reply, data) for reply, data in client.pipeline(commands)}
+        assert sorted(completions) == sorted(command.request_id for command in commands)
+
+        for command in deletes:
+            reply, _ = completions[command.request_id]
+            assert reply.status == 0
+            assert reply.message == self.delete_message
+        assert not any(filepath.is_file() for filepath in filepaths)
+
+        contents = foo1.read_bytes()
+        assert completions[get.request_id][1] == contents
+        assert completions[ranged_get.request_id][1] == contents[5:15]
+        assert completions[missing_get.request_id][0].status < 0
+        assert completions[missing_delete.request_id][0].message == b""
+        local_files = [f.name.encode() for f in Path('.').glob("*.md") if f.is_file()]
+        assert sorted(completions[ls.request_id][1].split(b"\n")[:-1]) == sorted(local_files)
+
+    def test_pipeline_rejects_commands_that_cant_be_pipelined(self, client: Client):
+        put = client.command(KftpCommand.PUT, b"test.txt")
+        delta_get = client.command(KftpCommand.GET, b"test.txt", flags=KftpCommand.DELTA)
+        delete = client.command(KftpCommand.DELETE, b"test.txt")
+
+        completions = {reply.request_id: reply for reply, _ in client.pipeline([put, delta_get, delete])}
+        assert completions[put.request_id].status == self.parse_error
+        assert completions[put.request_id].message == \
+            self.invalid_command_message_format.format(command="put test.txt").encode()
+        assert completions[delta_get.request_id].status == self.parse_error
+        assert completions[delete.request_id].status == 0
+
+    def test_finish_is_answered(self, client: Client):
+        client.delete("test.txt")
+        assert client.finish()
+
+        # the server is still waiting for the next command
+        assert client.delete("test.txt").status == 0
+
+    def test_get_on_own_stream(self, client: Client):
+        filepath = resources_filepath.joinpath("foo1")
+        with open(filepath, "rb") as f:
+            assert client.stream(100).get(filepath) == f.read()
 
-    @pytest.mark.parametrize("command", ["get", "put", "delete"])
-    def test_must_pass_one_argument(self, command: str, client: Client):
-        files = "test.txt foo.bar"
-        multiple_args_command = f"{command} {files}"
-        multi_response = client.send_and_receive(multiple_args_command.encode())
-        expected_multi_response = self.invalid_command_message_format.format(command=multiple_args_command).encode()
-        assert multi_response == expected_multi_response
-
-        no_arg_response = client.send_and_receive(command.encode())
-        no_arg_expected_response = self.invalid_command_message_format.format(command=command).encode()
-        assert no_arg_response == no_arg_expected_response
-
-    @pytest.mark.parametrize("command", ["ls", "exit"])
-    def test_must_pass_no_arguments(self, command: str, client: Client):
-        arg = "foo"
-        full_command = f"{command} {arg}"
-        response = client.send_and_receive(full_command.encode())
-        expected_response = self.invalid_command_message_format.format(command=full_command).encode()
-        assert response == expected_response
+        # the control stream is still waiting for commands
+        assert client.delete("test.txt").status == 0
 
-    def test_messages_ignore_newlines(self, client: Client):
-        command = "ls\n"
-        response = client.send_and_receive(command.encode())
-        response_files = response.strip().split(b"\n")
-        local_files = [f.name.encode() for f in Path('.').iterdir() if f.is_file()]
-        assert sorted(response_files) == sorted(local_files)
+    def test_stream_only_runs_transfers(self, client: Client):
+        stream = client.stream(100)
+        reply = stream.send_command(stream.command(KftpCommand.DELETE, b"test.txt"))
+        assert reply.status == self.not_streamable_error
+        assert reply.message == self.not_streamable_message_format.format(command="delete test.txt").encode()
+
+    def test_transfers_dont_block_control_stream(self, client: Client):
+        # the transfer stalls after its reply, since nothing reads the rest of its stream until the end of the test
+        stream = client.stream(100)
+        filepath = resources_filepath.joinpath("foo1")
+        assert stream.send_command(stream.command(KftpCommand.GET, str(filepath).encode())).status == 0
+
+        assert client.delete("test.txt").status == 0
+        assert client.ls(b"Makefile") == ([b"Makefile"], 0)
+
+        data, _ = KftpReceiver(stream.receiver).receive_from()
+        with open(filepath, "rb") as f:
+            assert data == f.read()
+
+    def test_silent_client_is_given_up_on(self, client: Client):
+        # the client starts a put, then goes silent without sending the file (or answering the server's probes)
+        filepath = resources_filepath.joinpath("test.txt")
+        client.send(client.command(KftpCommand.PUT, str(filepath).encode()).serialize())
+        time.sleep(3)
+
+        # the server gave up on the put within a few seconds rather than waiting on it forever, so the client's next
+        # command is answered as a command
+        assert client.delete(str(filepath)).status == 0
+        assert not filepath.is_file()
+
+    def test_aborted_put_is_discarded(self, client: Client):
+        # the client starts a put, then aborts it before sending the file
+        filepath = resources_filepath.joinpath("test.txt")
+        client.send(client.command(KftpCommand.PUT, str(filepath).encode()).serialize())
+        assert client.abort()
+
+        # the server stopped waiting on the file right away, and its sequence numbers are in step with the client's
+        assert client.delete(str(filepath)).status == 0
+        assert not filepath.is_file()
+
+    def test_replies_match_request_ids(self, client: Client):
+        command = KftpCommand(KftpCommand.DELETE, 0xDEADBEEF, args=[b"test.txt"])
+        reply = client.send_command(command)
+        assert reply.request_id == 0xDEADBEEF
 
 
 class TestServerExiting(TestResponses):
     def test_exit(self, client: Client, killable_server: subprocess.Popen):
-        response = client.exit()
+        reply = client.exit()
         expected_response = b"Exiting gracefully"
-        assert response == expected_response
+        assert reply.status == 0
+        assert reply.message == expected_response
 
         # server should exit gracefully
         killable_server.wait(1)
         assert killable_server.returncode == 0
+
+
+class TestServerArguments:
+    @pytest.mark.parametrize("weight", ["127.0.0.1=0", "127.0.0.1=65", "127.0.0.1", "localhost=2", "127.0.0.1=2x"])
+    def test_rejects_invalid_client_weights(self, weight: str):
+        result = subprocess.run(["./out/server/server", str(port), weight], capture_output=True, timeout=5)
+        assert result.returncode == 1
+        assert b"invalid client weight" in result.stderr
+
+    def test_rejects_invalid_limits_file(self, tmp_path: Path):
+        limits_file = tmp_path.joinpath("limits")
+        limits_file.write_text("transfer fast\n")
+        result = subprocess.run(["./out/server/server", str(port), "-l", str(limits_file)], capture_output=True,
+                                timeout=5)
+        assert result.returncode != 0
+        assert b"invalid limits file" in result.stderr
+
+    @pytest.mark.parametrize("budget", ["0", "-1", "1M", ""])
+    def test_rejects_invalid_memory_budgets(self, budget: str):
+        result = subprocess.run(["./out/server/server", str(port), "-m", budget], capture_output=True, timeout=5)
+        assert result.returncode == 1
+        assert b"usage" in result.stderr
+
+
+@pytest.fixture
+def limits_file(tmp_path: Path) -> Generator[Path, None, None]:
+    limits_file = tmp_path.joinpath("limits")
+    # foo1 (22 KB) takes over a second to send at 20 KB/s
+    limits_file.write_text("# capped for the tests\nglobal 1000000\ntransfer 20000\nclient 10.0.0.2 5000\n")
+    with subprocess.Popen(["./out/server/server", str(port), "-l", str(limits_file)]) as proc:
+        time.sleep(1)
+        yield limits_file
+        proc.kill()
+
+
+class TestRateLimits:
+    def get_timed(self, filepath: Path) -> float:
+        with socket.socket(type=socket.SOCK_DGRAM) as sock:
+            start = time.monotonic()
+            data = Client(Socket(sock)).get(filepath)
+            elapsed = time.monotonic() - start
+
+        with open(filepath, "rb") as f:
+            assert data == f.read()
+        return elapsed
+
+    def test_transfer_is_paced_at_limit(self, limits_file: Path):
+        assert self.get_timed(resources_filepath.joinpath("foo1")) > 0.9
+
+    def test_limits_are_reloaded_when_changed(self, limits_file: Path):
+        limits_file.write_text("transfer 0\n")
+        # the limits file is checked for changes every second
+        time.sleep(1.5)
+        assert self.get_timed(resources_filepath.joinpath("foo1")) < 0.5
+
+
+@pytest.fixture
+def small_budget_server() -> Generator[subprocess.Popen, None, None]:
+    # not enough memory for the buffers of a single transfer
+    with subprocess.Popen(["./out/server/server", str(port), "-m", "100000"]) as proc:
+        time.sleep(1)
+        yield proc
+        proc.kill()
+
+
+@pytest.mark.usefixtures("small_budget_server")
+class TestMemoryBudget(TestResponses):
+    out_of_memory_error = -5
+    out_of_memory_message_format = "Server is out of memory, try again later: {command}"
+
+    def test_transfers_are_refused_over_budget(self, client: Client):
+        filepath = resources_filepath.joinpath("foo1")
+        reply = client.send_command(client.command(KftpCommand.GET, str(filepath).encode()))
+        assert reply.status == self.out_of_memory_error
+        assert reply.message == self.out_of_memory_message_format.format(command=f"get {filepath}").encode()
+
+        stream = client.stream(100)
+        reply = stream.send_command(stream.command(KftpCommand.GET, str(filepath).encode()))
+        assert reply.status == self.out_of_memory_error
+
+        # commands that don't hold on to memory still run
+        assert client.ls(b"Makefile") == ([b"Makefile"], 0)
+
+
+@pytest.fixture
+def server_dir(tmp_path: Path) -> Generator[Path, None, None]:
+    """Runs the server in a directory of its own, so the client's copies of the files aren't the server's"""
+    server_dir = tmp_path.joinpath("server")
+    server_dir.mkdir()
+    with subprocess.Popen([Path("out/server/server").resolve(), str(port)], cwd=server_dir) as proc:
+        time.sleep(1)
+        yield server_dir
+        proc.kill()
+
+
+@pytest.fixture
+def client_dir(tmp_path: Path) -> Path:
+    client_dir = tmp_path.joinpath("client")
+    client_dir.mkdir()
+    return client_dir
+
+
+def run_client(client_dir: Path, *commands: str) -> bytes:
+    """Runs the real client in `client_dir`, types `commands` into it, and returns what it printed"""
+    commands_input = "".join(f"{command}\n" for command in commands) + "exit\n"
+    result = subprocess.run([Path("out/client/client").resolve(), address, str(port)], cwd=client_dir,
+                            input=commands_input.encode(), capture_output=True, timeout=30)
+    assert result.returncode == 0
+    return result.stdout
+
+
+@pytest.mark.usefixtures("server_dir")
+class TestClientServerRoundTrips:
+    def test_striped_transfers(self, server_dir: Path, client_dir: Path):
+        # large enough to be split over every stripe
+        contents = os.urandom(300000)
+        client_dir.joinpath("upload.bin").write_bytes(contents)
+        server_dir.joinpath("download.bin").write_bytes(contents[::-1])
+
+        output = run_client(client_dir, "put -p upload.bin", "get -p download.bin")
+        assert b"Sent file: upload.bin" in output
+        assert b"Downloaded file: download.bin" in output
+        assert server_dir.joinpath("upload.bin").read_bytes() == contents
+        assert client_dir.joinpath("download.bin").read_bytes() == contents[::-1]
+
+    def test_batch_transfers(self, server_dir: Path, client_dir: Path):
+        for name in ["a.txt", "b.txt", "c.log"]:
+            client_dir.joinpath(name).write_bytes(f"local {name}\n".encode())
+        for name in ["x1.dat", "x2.dat", "y.dat", "z.dat"]:
+            server_dir.joinpath(name).write_bytes(f"remote {name}\n".encode() * 1000)
+
+        output = run_client(client_dir, "mput *.txt", "mget x*.dat y.dat")
+        assert b"Sent 2 files" in output
+        assert b"Downloaded 3 files" in output
+        for name in ["a.txt", "b.txt"]:
+            assert server_dir.joinpath(name).read_bytes() == f"local {name}\n".encode()
+        assert not server_dir.joinpath("c.log").exists()
+        for name in ["x1.dat", "x2.dat", "y.dat"]:
+            assert client_dir.joinpath(name).read_bytes() == f"remote {name}\n".encode() * 1000
+        assert not client_dir.joinpath("z.dat").exists()
+
+    def test_packed_batch_transfers(self, server_dir: Path, client_dir: Path):
+        # many files that share packs, and one larger than a pack
+        uploads = {f"up{i}.txt": f"upload {i}\n".encode() * i for i in range(50)}
+        uploads["up_large.txt"] = os.urandom(100000)
+        downloads = {f"down{i}.txt": f"download {i}\n".encode() * i for i in range(50)}
+        downloads["down_large.txt"] = os.urandom(100000)
+        for name, contents in uploads.items():
+            client_dir.joinpath(name).write_bytes(contents)
+        for name, contents in downloads.items():
+            server_dir.joinpath(name).write_bytes(contents)
+
+        output = run_client(client_dir, "mput -k up*.txt", "mget -k down*.txt")
+        assert b"Sent 51 files" in output
+        assert b"Downloaded 51 files" in output
+        for name, contents in uploads.items():
+            assert server_dir.joinpath(name).read_bytes() == contents
+        for name, contents in downloads.items():
+            assert client_dir.joinpath(name).read_bytes() == contents
+
+    @staticmethod
+    def make_tree(root: Path) -> dict:
+        """Creates a small tree under `root`, and returns the contents of each of its files by relative path"""
+        files = {"top.txt": b"top\n", "sub/inner.bin": os.urandom(50000), "sub/deeper/leaf.txt": b"leaf\n"}
+        for path, contents in files.items():
+            root.joinpath(path).parent.mkdir(parents=True, exist_ok=True)
+            root.joinpath(path).write_bytes(contents)
+        root.joinpath("empty").mkdir()
+        root.joinpath("top.txt").chmod(0o755)
+        os.utime(root.joinpath("sub/deeper/leaf.txt"), (1000000000, 1000000000))
+        return files
+
+    def test_tree_transfers(self, server_dir: Path, client_dir: Path):
+        uploads = self.make_tree(client_dir.joinpath("up_tree"))
+        downloads = self.make_tree(server_dir.joinpath("down_tree"))
+
+        output = run_client(client_dir, "put -r up_tree", "get -r down_tree")
+        assert b"Sent file: up_tree" in output
+        assert b"Downloaded file: down_tree" in output
+        for root, files in [(server_dir.joinpath("up_tree"), uploads), (client_dir.joinpath("down_tree"), downloads)]:
+            for path, contents in files.items():
+                assert root.joinpath(path).read_bytes() == contents
+            assert root.joinpath("empty").is_dir()
+            assert root.joinpath("top.txt").stat().st_mode & 0o777 == 0o755
+            assert root.joinpath("sub/deeper/leaf.txt").stat().st_mtime == 1000000000
+
+    def test_conditional_transfers(self, server_dir: Path, client_dir: Path):
+        for name in ["same_down.txt", "same_up.txt"]:
+            client_dir.joinpath(name).write_bytes(b"unchanged\n" * 1000)
+            server_dir.joinpath(name).write_bytes(b"unchanged\n" * 1000)
+        client_dir.joinpath("changed.txt").write_bytes(b"old\n")
+        server_dir.joinpath("changed.txt").write_bytes(b"new\n")
+
+        output = run_client(client_dir, "get -c same_down.txt", "put -c same_up.txt", "get -c changed.txt")
+        assert b"File not modified: same_down.txt" in output
+        assert b"File not modified: same_up.txt" in output
+        assert b"Downloaded file: changed.txt" in output
+        assert client_dir.joinpath("changed.txt").read_bytes() == b"new\n"
+        # the client saved the fingerprints of its files, so an unchanged file isn't hashed again by the next client
+        index = client_dir.joinpath(".kftp-fingerprints").read_text()
+        assert "same_down.txt" in index
+        assert "same_up.txt" in index
+
+    def test_ranged_get(self, server_dir: Path, client_dir: Path):
+        contents = os.urandom(5000)
+        server_dir.joinpath("ranged.bin").write_bytes(contents)
+        client_dir.joinpath("ranged.bin").write_bytes(b"whole local copy\n")
+
+        output = run_client(client_dir, "get ranged.bin 1000 10", "pipeline", "get ranged.bin 4990 100", "end")
+        assert b"Downloaded file: ranged.bin.1000-10" in output
+        assert b"Downloaded file: ranged.bin.4990-100" in output
+        assert client_dir.joinpath("ranged.bin.1000-10").read_bytes() == contents[1000:1010]
+        # the range is cut off at the end of the file
+        assert client_dir.joinpath("ranged.bin.4990-100").read_bytes() == contents[4990:]
+        assert client_dir.joinpath("ranged.bin").read_bytes() == b"whole local copy\n"
+
+    def test_cancelled_get(self, server_dir: Path, client_dir: Path):
+        server_dir.joinpath("big.bin").write_bytes(os.urandom(50 * 1024 * 1024))
+        client_dir.joinpath("after.txt").write_bytes(b"sent after the cancelled get\n")
+
+        # Ctrl-C while the download runs cancels it, and the next command starts in step with the server
+        with subprocess.Popen([Path("out/client/client").resolve(), address, str(port)], cwd=client_dir,
+                              stdin=subprocess.PIPE, stdout=subprocess.PIPE) as client:
+            client.stdin.write(b"get big.bin\n")
+            client.stdin.flush()
+            time.sleep(1)
+            client.send_signal(signal.SIGINT)
+            output, _ = client.communicate(b"put after.txt\nexit\n", timeout=30)
+            assert client.returncode == 0
+
+        assert b"Cancelled: get big.bin" in output
+        assert b"Sent file: after.txt" in output
+        assert server_dir.joinpath("after.txt").read_bytes() == b"sent after the cancelled get\n"